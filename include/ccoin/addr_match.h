@@ -27,5 +27,7 @@ extern void bbm_free(struct bp_block_match *match);
 
 extern GPtrArray *bp_block_match(const struct bp_block *block,
 			  const struct bp_keyset *ks);
+extern GPtrArray *bp_block_match_raw(const void *data, size_t data_len,
+				     const struct bp_keyset *ks);
 
 #endif /* __LIBCCOIN_ADDR_MATCH_H__ */
@@ -0,0 +1,41 @@
+#ifndef __LIBCCOIN_BLKTMPL_H__
+#define __LIBCCOIN_BLKTMPL_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <glib.h>
+#include <ccoin/core.h>
+#include <ccoin/buint.h>
+#include <ccoin/mempool.h>
+
+/* candidate block, assembled from the mempool */
+struct blktmpl {
+	struct mempool	*mp;		/* not owned */
+
+	struct bp_block	block;		/* vtx[0] is the coinbase */
+	uint32_t	height;
+	GString		*cb_script;	/* coinbase payout scriptPubKey */
+
+	int64_t		fees;
+	unsigned int	size;		/* serialized block size, upper bound */
+	unsigned int	max_size;
+
+	GHashTable	*map_tx;	/* txid -> bp_tx, in block.vtx */
+	GHashTable	*deferred;	/* txids awaiting unconfirmed parents */
+	GPtrArray	*mlevels;	/* merkle tree; of GArray of bu256_t */
+	bool		building;	/* full rebuild in progress */
+};
+
+extern bool blktmpl_init(struct blktmpl *t, struct mempool *mp,
+			 const bu256_t *hashPrevBlock, uint32_t height,
+			 uint32_t nBits, const GString *cb_script);
+extern void blktmpl_free(struct blktmpl *t);
+extern bool blktmpl_build(struct blktmpl *t);
+extern bool blktmpl_tx_added(struct blktmpl *t, const bu256_t *hash);
+extern bool blktmpl_tx_removed(struct blktmpl *t, const bu256_t *hash);
+
+#endif /* __LIBCCOIN_BLKTMPL_H__ */
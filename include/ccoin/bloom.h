@@ -4,6 +4,7 @@
 #ifndef LIBCCOIN_BLOOM_H
 #define LIBCCOIN_BLOOM_H
 
+#include <stdint.h>
 #include <stdbool.h>
 #include <glib.h>
 #include <ccoin/buffer.h>
@@ -15,8 +16,15 @@ enum {
 };
 
 struct bloom {
-	GString		*vData;
+	GString		*vData;		// bit array; fixed size
 	unsigned int	nHashFuncs;
+
+	// hashing parameters, derived from the above by bloom_init()
+	// and deser_bloom()
+	unsigned int	n_hash;		// nHashFuncs, limited
+	uint32_t	seed_step;
+	uint32_t	nbits;
+	uint64_t	nbits_inv;	// reciprocal, for mod nbits
 };
 
 extern bool bloom_init(struct bloom *bf, unsigned int nElements,double nFPRate);
@@ -27,7 +35,15 @@ extern bool deser_bloom(struct bloom *bf, struct const_buffer *buf);
 extern void ser_bloom(GString *s, const struct bloom *bf);
 
 extern void bloom_insert(struct bloom *bf, const void *data, size_t data_len);
-extern bool bloom_contains(struct bloom *bf, const void *data, size_t data_len);
+extern bool bloom_contains(const struct bloom *bf, const void *data, size_t data_len);
+extern void bloom_clear(struct bloom *bf);
+extern unsigned int bloom_contains_batch(const struct bloom *bf,
+					 const struct const_buffer *keys,
+					 unsigned int n_keys, bool *match);
+
+// MurmurHash3 (x86_32) of one key, for each of n_seeds seeds
+extern void murmur3_multi(uint32_t *out, const uint32_t *seeds,
+			  unsigned int n_seeds, const void *data, size_t len);
 
 extern bool bloom_size_ok(const struct bloom *bf);
 
@@ -41,6 +41,11 @@ extern bool deser_bp_addr(unsigned int protover,
 extern void ser_bp_addr(GString *s, unsigned int protover, const struct bp_address *addr);
 static inline void bp_addr_free(struct bp_address *addr) {}
 
+enum inv_type {
+	MSG_TX		= 1,
+	MSG_BLOCK	= 2,
+};
+
 struct bp_inv {
 	uint32_t	type;
 	bu256_t		hash;
@@ -133,6 +138,8 @@ extern void ser_bp_tx(GString *s, const struct bp_tx *tx);
 extern void bp_tx_free_vout(struct bp_tx *tx);
 extern void bp_tx_free(struct bp_tx *tx);
 extern bool bp_tx_valid(const struct bp_tx *tx);
+extern bool bp_tx_final(const struct bp_tx *tx, unsigned int height,
+			int64_t block_time);
 extern void bp_tx_calc_sha256(struct bp_tx *tx);
 extern unsigned int bp_tx_ser_size(const struct bp_tx *tx);
 extern void bp_tx_copy(struct bp_tx *dest, const struct bp_tx *src);
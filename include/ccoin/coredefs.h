@@ -7,10 +7,14 @@
 
 enum {
 	CADDR_TIME_VERSION	= 31402,
+	BIP0031_VERSION		= 60000,	/* ping nonce, pong */
 
 	MAX_BLOCK_SIZE		= 1000000,
 
 	COINBASE_MATURITY	= 100,
+
+	/* nLockTime below this is a block height, else a unix time */
+	LOCKTIME_THRESHOLD	= 500000000,
 };
 
 enum {
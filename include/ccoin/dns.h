@@ -0,0 +1,42 @@
+#ifndef __LIBCCOIN_DNS_H__
+#define __LIBCCOIN_DNS_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <glib.h>
+
+enum {
+	DNS_SEED_TIMEOUT_MS	= 10 * 1000,
+};
+
+extern const char *dns_seeds_default[];		/* NULL-terminated */
+
+/*
+ * Resolve a seed name to a GList of malloc'd struct bp_address, or NULL.
+ * Called from seeder threads, concurrently.
+ */
+typedef GList *(*dns_resolve_fn)(const char *name, void *priv);
+
+extern GList *dns_resolve_getaddrinfo(const char *name, void *priv);
+
+/*
+ * Concurrent DNS seeding: each seed is queried from its own thread, and
+ * results are collected as they arrive.  dns_seeder_fd() becomes
+ * readable whenever new results are ready, or the last query finishes,
+ * for use with poll(2) or an event loop.
+ */
+struct dns_seeder;
+
+extern struct dns_seeder *dns_seeder_new(const char **seeds,
+					 unsigned int timeout_ms,
+					 dns_resolve_fn resolve, void *priv);
+extern void dns_seeder_free(struct dns_seeder *ds);
+extern int dns_seeder_fd(const struct dns_seeder *ds);
+extern GList *dns_seeder_take(struct dns_seeder *ds);
+extern bool dns_seeder_done(struct dns_seeder *ds);
+extern bool dns_seeder_wait(struct dns_seeder *ds);
+
+#endif /* __LIBCCOIN_DNS_H__ */
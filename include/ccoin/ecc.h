@@ -0,0 +1,82 @@
+#ifndef __LIBCCOIN_ECC_H__
+#define __LIBCCOIN_ECC_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * secp256k1 ECDSA, without OpenSSL.  Available when the compiler
+ * provides 128-bit integers (__SIZEOF_INT128__); lib/key.c falls back
+ * to OpenSSL otherwise.
+ */
+
+enum {
+	ECC_PUBKEY_COMPRESSED	= 33,
+	ECC_PUBKEY_UNCOMPRESSED	= 65,
+	ECC_SIG_MAX		= 72,		/* DER-encoded */
+};
+
+/* affine public key, as normalized field elements */
+struct ecc_pubkey {
+	uint64_t	x[5];
+	uint64_t	y[5];
+};
+
+extern bool ecc_pubkey_parse(struct ecc_pubkey *pub, const void *data,
+			     size_t len);
+extern size_t ecc_pubkey_serialize(unsigned char *out,
+				   const struct ecc_pubkey *pub,
+				   bool compressed);
+extern bool ecc_pubkey_create(struct ecc_pubkey *pub,
+			      const unsigned char *seckey);
+
+/*
+ * Public keys for n 32-byte secrets at seckeys, sharing the final
+ * field inversion.  Returns true if all secrets are in range;
+ * results[i], if given, is each secret's own outcome.
+ */
+extern bool ecc_pubkey_create_batch(struct ecc_pubkey *pubs,
+				    const unsigned char *seckeys, size_t n,
+				    bool *results);
+
+/* Verify a DER signature, parsed as laxly as OpenSSL historically did */
+extern bool ecc_verify(const struct ecc_pubkey *pub,
+		       const void *data, size_t data_len,
+		       const void *sig, size_t sig_len);
+
+/*
+ * Sign with a caller-supplied 32-byte nonce; fails if the key or
+ * nonce is out of range, or (with negligible probability) the nonce
+ * yields a zero r or s: retry with another.
+ */
+extern bool ecc_sign(unsigned char *sig, size_t *sig_len,
+		     const unsigned char *seckey,
+		     const void *data, size_t data_len,
+		     const unsigned char *nonce);
+
+/* the message as signed: leftmost 256 bits, mod n (RFC 6979 bits2octets) */
+extern void ecc_msg_get_b32(unsigned char *out, const void *data,
+			    size_t data_len);
+
+/*
+ * Verify many signatures, sharing work between them.  Returns true if
+ * all are valid; results[i], if given, is each item's own outcome.
+ * Items with the same key should point at the same ecc_pubkey.
+ */
+struct ecc_verify_item {
+	const struct ecc_pubkey	*pub;
+	const void		*data;
+	size_t			data_len;
+	const void		*sig;
+	size_t			sig_len;
+};
+
+extern bool ecc_verify_batch(const struct ecc_verify_item *items, size_t n,
+			     bool *results);
+
+#endif /* __LIBCCOIN_ECC_H__ */
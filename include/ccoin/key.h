@@ -6,6 +6,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <glib.h>
 #include <openssl/ec.h>
 #include <ccoin/buint.h>
@@ -17,6 +18,13 @@ struct bp_key {
 extern bool bp_key_init(struct bp_key *key);
 extern void bp_key_free(struct bp_key *key);
 extern bool bp_key_generate(struct bp_key *key);
+
+/*
+ * generate n keys, each already bp_key_init()'d; public keys are
+ * computed together, from the generator tables built once per process
+ */
+extern bool bp_key_generate_batch(struct bp_key *keys, unsigned int n);
+
 extern bool bp_privkey_set(struct bp_key *key, const void *privkey, size_t pk_len);
 extern bool bp_pubkey_set(struct bp_key *key, const void *pubkey, size_t pk_len);
 extern bool bp_key_secret_set(struct bp_key *key, const void *privkey_, size_t pk_len);
@@ -28,9 +36,71 @@ extern bool bp_sign(struct bp_key *key, const void *data, size_t data_len,
 extern bool bp_verify(struct bp_key *key, const void *data, size_t data_len,
 	       const void *sig, size_t sig_len);
 
+/*
+ * sign repeatedly with one key: the secret is extracted once, and
+ * signing allocates nothing.  Nonces are deterministic (RFC 6979),
+ * as they are for bp_sign(), where the compiler has 128-bit integers;
+ * otherwise they are OpenSSL's, and random.  sig must hold BP_SIG_MAX
+ * bytes.
+ */
+enum {
+	BP_SIG_MAX		= 72,		/* DER-encoded */
+};
+
+struct bp_signer {
+	const struct bp_key	*key;
+	unsigned char		seckey[32];
+	unsigned char		pub[65];
+	size_t			pub_len;	/* 0 until bp_signer_pubkey() */
+};
+
+extern bool bp_signer_init(struct bp_signer *signer, const struct bp_key *key);
+extern bool bp_signer_sign(struct bp_signer *signer, const void *data,
+			   size_t data_len, unsigned char *sig,
+			   size_t *sig_len);
+extern bool bp_signer_pubkey(struct bp_signer *signer, const void **pubkey,
+			     size_t *pk_len);
+extern void bp_signer_free(struct bp_signer *signer);
+
+/* verify, with the public key decoded via a shared LRU cache */
+enum {
+	BP_PUBKEY_CACHE_MAX	= 4096,
+};
+
+extern bool bp_pubkey_verify(const void *pubkey, size_t pk_len,
+			     const void *data, size_t data_len,
+			     const void *sig, size_t sig_len);
+extern void bp_pubkey_cache_clear(void);
+
+/*
+ * verify many signatures together; true if all are valid, with each
+ * item's outcome in results[], if given
+ */
+struct bp_verify_item {
+	const void	*pubkey;
+	size_t		pk_len;
+	const void	*data;
+	size_t		data_len;
+	const void	*sig;
+	size_t		sig_len;
+};
+
+extern bool bp_pubkey_verify_batch(const struct bp_verify_item *items,
+				   unsigned int n, bool *results);
+
+/*
+ * keys and key hashes, for matching outputs.  A blocked bloom filter
+ * over both answers most misses with one 64-bit probe; the hash tables
+ * are consulted on filter hits only.
+ */
 struct bp_keyset {
 	GHashTable	*pub;
 	GHashTable	*pubhash;
+
+	uint64_t	*filter;	/* prefilter blocks; NULL if empty */
+	unsigned int	filter_blocks;	/* a power of two */
+	unsigned int	filter_shift;	/* 64 - log2(filter_blocks) */
+	unsigned int	filter_n;	/* items added */
 };
 
 extern void bpks_init(struct bp_keyset *ks);
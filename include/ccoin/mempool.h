@@ -0,0 +1,68 @@
+#ifndef __LIBCCOIN_MEMPOOL_H__
+#define __LIBCCOIN_MEMPOOL_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <glib.h>
+#include <ccoin/core.h>
+#include <ccoin/buint.h>
+
+/* validated, unconfirmed transaction */
+struct mempool_ent {
+	struct bp_tx	tx;		/* tx.sha256 is valid */
+
+	unsigned int	size;		/* serialized bytes */
+	int64_t		fee;		/* inputs minus outputs */
+	uint64_t	fee_rate;	/* fee per 1000 bytes */
+	time_t		nTime;		/* arrival time */
+
+	size_t		mem;		/* bytes charged to the pool */
+	unsigned int	heap_idx;	/* position in fee-rate index */
+};
+
+struct mempool {
+	struct bp_utxo_set *uset;	/* confirmed coins; not owned */
+	unsigned int	flags;		/* SCRIPT_VERIFY_* */
+	unsigned int	height;		/* of the best chain tip */
+
+	GHashTable	*map_tx;	/* txid -> mempool_ent */
+	GHashTable	*map_spent;	/* bp_outpt -> spending mempool_ent */
+	GPtrArray	*by_fee;	/* min-heap of mempool_ent, by fee rate */
+
+	size_t		mem_bytes;
+	size_t		max_bytes;
+};
+
+extern void mempool_init(struct mempool *mp, struct bp_utxo_set *uset,
+			 unsigned int height, size_t max_bytes);
+extern void mempool_free(struct mempool *mp);
+extern bool mempool_add(struct mempool *mp, const struct bp_tx *tx);
+extern void mempool_remove(struct mempool *mp, const bu256_t *hash,
+			   bool descendants);
+extern void mempool_block_connected(struct mempool *mp,
+				    const struct bp_block *block,
+				    unsigned int height);
+
+static inline struct mempool_ent *mempool_lookup(struct mempool *mp,
+						 const bu256_t *hash)
+{
+	return g_hash_table_lookup(mp->map_tx, hash);
+}
+
+static inline struct mempool_ent *mempool_spender(struct mempool *mp,
+						  const struct bp_outpt *outpt)
+{
+	return g_hash_table_lookup(mp->map_spent, outpt);
+}
+
+static inline unsigned int mempool_count(const struct mempool *mp)
+{
+	return g_hash_table_size(mp->map_tx);
+}
+
+#endif /* __LIBCCOIN_MEMPOOL_H__ */
@@ -26,8 +26,38 @@ struct p2p_message {
 	void			*data;
 };
 
+/* P2P commands known to this library, as compact integer ids */
+enum msg_cmd {
+	MSG_CMD_UNKNOWN,
+
+	MSG_CMD_VERSION,
+	MSG_CMD_VERACK,
+	MSG_CMD_ADDR,
+	MSG_CMD_GETADDR,
+	MSG_CMD_INV,
+	MSG_CMD_GETDATA,
+	MSG_CMD_NOTFOUND,
+	MSG_CMD_GETBLOCKS,
+	MSG_CMD_GETHEADERS,
+	MSG_CMD_HEADERS,
+	MSG_CMD_BLOCK,
+	MSG_CMD_TX,
+	MSG_CMD_MEMPOOL,
+	MSG_CMD_PING,
+	MSG_CMD_PONG,
+	MSG_CMD_ALERT,
+
+	MSG_CMD_COUNT
+};
+
+extern enum msg_cmd message_cmd_id(const char *command);
+extern const char *message_cmd_str(enum msg_cmd id);
+
 extern void parse_message_hdr(struct p2p_message_hdr *hdr, const unsigned char *data);
 extern bool message_valid(const struct p2p_message *msg);
+extern GString *message_new(size_t data_len_hint);
+extern void message_finish(GString *s, const unsigned char netmagic[4],
+		    const char *command_);
 extern GString *message_str(const unsigned char netmagic[4],
 		     const char *command_,
 		     const void *data, uint32_t data_len);
@@ -49,9 +79,25 @@ static inline void msg_version_init(struct msg_version *mv)
 }
 
 extern bool deser_msg_version(struct msg_version *mv, struct const_buffer *buf);
-extern GString *ser_msg_version(const struct msg_version *mv);
+extern void ser_msg_version(GString *s, const struct msg_version *mv);
 static inline void msg_version_free(struct msg_version *mv) {}
 
+/* "ping" and "pong" share one layout */
+struct msg_ping {
+	uint64_t	nonce;
+};
+
+static inline void msg_ping_init(struct msg_ping *mp)
+{
+	memset(mp, 0, sizeof(*mp));
+}
+
+extern bool deser_msg_ping(unsigned int protover, struct msg_ping *mp,
+			   struct const_buffer *buf);
+extern void ser_msg_ping(unsigned int protover, GString *s,
+			 const struct msg_ping *mp);
+static inline void msg_ping_free(struct msg_ping *mp) {}
+
 struct msg_addr {
 	GPtrArray	*addrs;
 };
@@ -66,4 +112,24 @@ extern bool deser_msg_addr(unsigned int protover, struct msg_addr *ma,
 extern GString *ser_msg_addr(unsigned int protover, const struct msg_addr *ma);
 extern void msg_addr_free(struct msg_addr *ma);
 
+enum {
+	MAX_INV_SZ	= 50000,	/* max entries per inv/getdata message */
+};
+
+/* "inv", "getdata" and "notfound" share one layout */
+struct msg_vinv {
+	GPtrArray	*invs;		/* of bp_inv */
+};
+
+static inline void msg_vinv_init(struct msg_vinv *mv)
+{
+	memset(mv, 0, sizeof(*mv));
+}
+
+extern void msg_vinv_push(struct msg_vinv *mv, uint32_t type,
+			  const bu256_t *hash);
+extern bool deser_msg_vinv(struct msg_vinv *mv, struct const_buffer *buf);
+extern void ser_msg_vinv(GString *s, const struct msg_vinv *mv);
+extern void msg_vinv_free(struct msg_vinv *mv);
+
 #endif /* __LIBCCOIN_MESSAGE_H__ */
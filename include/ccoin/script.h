@@ -205,6 +205,19 @@ struct bscript_addr {
 	GList			*pubhash;	/* of struct buffer */
 };
 
+enum {
+	BSP_MAX_MULTISIG_KEYS	= 16,
+};
+
+/* standard template match; buffers point into the matched script */
+struct bscript_tmpl {
+	enum txnouttype		txtype;
+	unsigned int		n_req;		/* multisig: sigs required */
+	unsigned int		n_keys;
+	struct const_buffer	keys[BSP_MAX_MULTISIG_KEYS];
+	struct const_buffer	hash;		/* P2PKH, P2SH */
+};
+
 extern const char *GetOpName(enum opcodetype opcode);
 extern enum opcodetype GetOpType(const char *opname);
 
@@ -215,6 +228,8 @@ extern enum opcodetype GetOpType(const char *opname);
 extern bool bsp_getop(struct bscript_op *op, struct bscript_parser *bp);
 extern GPtrArray *bsp_parse_all(const void *data_, size_t data_len);
 extern enum txnouttype bsp_classify(GPtrArray *ops);
+extern enum txnouttype bsp_classify_script(struct bscript_tmpl *tmpl,
+				    const void *data, size_t data_len);
 extern bool bsp_addr_parse(struct bscript_addr *addr,
 		    const void *data, size_t data_len);
 extern void bsp_addr_free(struct bscript_addr *addr);
@@ -251,9 +266,31 @@ static inline void bsp_start(struct bscript_parser *bp,
  * script validation and signing
  */
 
+/* OP_CODESEPARATORs in scriptCode are left out of the signature hash */
 extern void bp_tx_sighash(bu256_t *hash, const GString *scriptCode,
 		   const struct bp_tx *txTo, unsigned int nIn,
 		   int nHashType);
+
+/*
+ * signature hashes for many inputs of one transaction: the blanked
+ * inputs and the outputs are serialized once, at init, and each
+ * SIGHASH_ALL hash is then streamed without copying the transaction.
+ * Other hash types fall back to bp_tx_sighash().
+ */
+struct bp_sighash_ctx {
+	const struct bp_tx	*tx;
+	GString			*head;		/* nVersion, vin count */
+	GString			*vin;		/* inputs, scriptSig blanked */
+	GString			*tail;		/* vout, nLockTime */
+};
+
+extern void bp_sighash_ctx_init(struct bp_sighash_ctx *ctx,
+				const struct bp_tx *tx);
+extern void bp_sighash_ctx_free(struct bp_sighash_ctx *ctx);
+extern void bp_sighash_ctx_hash(bu256_t *hash,
+				const struct bp_sighash_ctx *ctx,
+				const GString *scriptCode, unsigned int nIn,
+				int nHashType);
 extern bool bp_script_verify(const GString *scriptSig, const GString *scriptPubKey,
 		      const struct bp_tx *txTo, unsigned int nIn,
 		      unsigned int flags, int nHashType);
@@ -267,6 +304,11 @@ extern bool bp_sign_sig(struct bp_keystore *ks, const struct bp_utxo *txFrom,
 		 struct bp_tx *txTo, unsigned int nIn,
 		 unsigned int flags, int nHashType);
 
+/* sign every input i against fromPubKeys[i]; true if all were signed */
+extern bool bp_script_sign_all(struct bp_keystore *ks,
+			       GString * const *fromPubKeys,
+			       struct bp_tx *txTo, int nHashType);
+
 /*
  * script building
  */
@@ -275,6 +317,18 @@ extern void bsp_push_data(GString *s, const void *data, size_t data_len);
 extern void bsp_push_int64(GString *s, int64_t v);
 extern void bsp_push_uint64(GString *s, uint64_t v);
 
+/*
+ * script number encoding, without BIGNUM: at most BSP_SCRIPTNUM_MAX
+ * bytes are written; decoding fails if the input exceeds max_len bytes
+ */
+enum {
+	BSP_SCRIPTNUM_MAX	= 9,
+};
+
+extern unsigned int bsp_scriptnum_enc(unsigned char *out, int64_t v);
+extern bool bsp_scriptnum_dec(int64_t *vo, const void *data, size_t data_len,
+			      size_t max_len);
+
 static inline void bsp_push_op(GString *s, enum opcodetype op)
 {
 	uint8_t c = (uint8_t) op;
@@ -7,50 +7,74 @@
 #include <ccoin/core.h>
 #include <ccoin/script.h>
 #include <ccoin/key.h>
+#include <ccoin/serialize.h>
 #include <ccoin/addr_match.h>
 #include <ccoin/compat.h>		/* for g_ptr_array_new_full */
 
-bool bp_txout_match(const struct bp_txout *txout,
-		    const struct bp_keyset *ks)
+/*
+ * The key, or key hash, a standard output pays to, as a slice of its
+ * script: the usual encodings by position, anything else via the
+ * template classifier.
+ */
+static bool script_key_slice(struct const_buffer *slice, bool *is_pubkeyhash,
+			     const unsigned char *s, size_t len)
 {
-	if (!txout || !txout->scriptPubKey || !ks)
-		return false;
+	/* OP_DUP OP_HASH160 <20 bytes> OP_EQUALVERIFY OP_CHECKSIG */
+	if (len == 25 && s[0] == OP_DUP && s[1] == OP_HASH160 &&
+	    s[2] == 20 && s[23] == OP_EQUALVERIFY && s[24] == OP_CHECKSIG) {
+		slice->p = s + 3;
+		slice->len = 20;
+		*is_pubkeyhash = true;
+		return true;
+	}
 
-	bool rc = false;
-	
-	struct bscript_addr addrs;
-	if (!bsp_addr_parse(&addrs, txout->scriptPubKey->str,
-			    txout->scriptPubKey->len))
-		return false;
+	/* <33 or 65 bytes> OP_CHECKSIG */
+	if (((len == 35 && s[0] == 33) || (len == 67 && s[0] == 65)) &&
+	    s[len - 1] == OP_CHECKSIG) {
+		slice->p = s + 1;
+		slice->len = len - 2;
+		*is_pubkeyhash = false;
+		return true;
+	}
 
-	struct const_buffer *buf;
-	GList *tmp = addrs.pub;
-	while (tmp) {
-		buf = tmp->data;
-		tmp = tmp->next;
+	struct bscript_tmpl tmpl;
+	switch (bsp_classify_script(&tmpl, s, len)) {
 
-		if (bpks_lookup(ks, buf->p, buf->len, false)) {
-			rc = true;
-			goto out;
-		}
-	}
+	case TX_PUBKEY:
+		*slice = tmpl.keys[0];
+		*is_pubkeyhash = false;
+		return true;
 
-	tmp = addrs.pubhash;
-	while (tmp) {
-		buf = tmp->data;
-		tmp = tmp->next;
+	case TX_PUBKEYHASH:
+		*slice = tmpl.hash;
+		*is_pubkeyhash = true;
+		return true;
 
-		if (bpks_lookup(ks, buf->p, buf->len, true)) {
-			rc = true;
-			goto out;
-		}
+	default:
+		return false;
 	}
+}
 
-out:
-	g_list_free_full(addrs.pub, (GDestroyNotify) buffer_free);
-	g_list_free_full(addrs.pubhash, (GDestroyNotify) buffer_free);
+static bool script_match(const void *script, size_t script_len,
+			 const struct bp_keyset *ks)
+{
+	struct const_buffer slice;
+	bool is_pubkeyhash;
+
+	if (!script_key_slice(&slice, &is_pubkeyhash, script, script_len))
+		return false;
+
+	return bpks_lookup(ks, slice.p, slice.len, is_pubkeyhash);
+}
+
+bool bp_txout_match(const struct bp_txout *txout,
+		    const struct bp_keyset *ks)
+{
+	if (!txout || !txout->scriptPubKey || !ks)
+		return false;
 
-	return rc;
+	return script_match(txout->scriptPubKey->str,
+			    txout->scriptPubKey->len, ks);
 }
 
 bool bp_tx_match(const struct bp_tx *tx, const struct bp_keyset *ks)
@@ -120,6 +144,21 @@ void bbm_free(struct bp_block_match *match)
 		free(match);
 }
 
+/* add txout i of vtx[n] to the matches, the first match creating it */
+static bool block_match_add(GPtrArray *arr, struct bp_block_match **match,
+			    unsigned int n, unsigned int i)
+{
+	if (!*match) {
+		*match = bbm_new();
+		if (!*match)
+			return false;
+		(*match)->n = n;
+		g_ptr_array_add(arr, *match);
+	}
+
+	return BN_set_bit(&(*match)->mask, i) == 1;
+}
+
 GPtrArray *bp_block_match(const struct bp_block *block,
 			  const struct bp_keyset *ks)
 {
@@ -130,35 +169,90 @@ GPtrArray *bp_block_match(const struct bp_block *block,
 				(GDestroyNotify) bbm_free);
 	if (!arr)
 		return NULL;
-	
-	BIGNUM tmp_mask;
-	BN_init(&tmp_mask);
 
-	unsigned int n;
+	/* no mask work for transactions that do not match */
+	unsigned int n, i;
 	for (n = 0; n < block->vtx->len; n++) {
-		struct bp_tx *tx;
+		struct bp_tx *tx = g_ptr_array_index(block->vtx, n);
+		struct bp_block_match *match = NULL;
 
-		tx = g_ptr_array_index(block->vtx, n);
-		if (!bp_tx_match_mask(&tmp_mask, tx, ks))
-			goto err_out;
+		if (!tx->vout)
+			continue;
+
+		for (i = 0; i < tx->vout->len; i++)
+			if (bp_txout_match(g_ptr_array_index(tx->vout, i), ks) &&
+			    !block_match_add(arr, &match, n, i))
+				goto err_out;
+	}
+
+	return arr;
+
+err_out:
+	g_ptr_array_free(arr, TRUE);
+	return NULL;
+}
+
+/*
+ * As bp_block_match(), over a serialized block: output scripts are
+ * matched in place, and nothing is deserialized.  NULL if the block
+ * is malformed.
+ */
+GPtrArray *bp_block_match_raw(const void *data, size_t data_len,
+			      const struct bp_keyset *ks)
+{
+	struct const_buffer buf = { data, data_len };
+	uint32_t n_tx, n_in, n_out, len;
+	unsigned int n, i;
+
+	if (!data || !ks)
+		return NULL;
+
+	GPtrArray *arr = g_ptr_array_new_full(16, (GDestroyNotify) bbm_free);
+	if (!arr)
+		return NULL;
 
-		if (!BN_is_zero(&tmp_mask)) {
-			struct bp_block_match *match;
+	if (!deser_skip(&buf, 80))			/* header */
+		goto err_out;
+	if (buf.len == 0)				/* header only */
+		return arr;
+	if (!deser_varlen(&n_tx, &buf))
+		goto err_out;
 
-			match = bbm_new();
-			match->n = n;
-			BN_copy(&match->mask, &tmp_mask);
+	for (n = 0; n < n_tx; n++) {
+		struct bp_block_match *match = NULL;
 
-			g_ptr_array_add(arr, match);
+		if (!deser_skip(&buf, 4) ||		/* nVersion */
+		    !deser_varlen(&n_in, &buf))
+			goto err_out;
+		for (i = 0; i < n_in; i++)
+			if (!deser_skip(&buf, 36) ||	/* prevout */
+			    !deser_varlen(&len, &buf) ||
+			    !deser_skip(&buf, len) ||	/* scriptSig */
+			    !deser_skip(&buf, 4))	/* nSequence */
+				goto err_out;
+
+		if (!deser_varlen(&n_out, &buf))
+			goto err_out;
+		for (i = 0; i < n_out; i++) {
+			if (!deser_skip(&buf, 8) ||	/* nValue */
+			    !deser_varlen(&len, &buf) ||
+			    buf.len < len)
+				goto err_out;
+
+			if (script_match(buf.p, len, ks) &&
+			    !block_match_add(arr, &match, n, i))
+				goto err_out;
+
+			deser_skip(&buf, len);
 		}
+
+		if (!deser_skip(&buf, 4))		/* nLockTime */
+			goto err_out;
 	}
 
-	BN_clear_free(&tmp_mask);
 	return arr;
 
 err_out:
-	BN_clear_free(&tmp_mask);
 	g_ptr_array_free(arr, TRUE);
 	return NULL;
 }
-
@@ -0,0 +1,376 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <ccoin/blktmpl.h>
+#include <ccoin/script.h>
+#include <ccoin/util.h>
+#include <ccoin/compat.h>		/* for g_ptr_array_new_full */
+
+enum {
+	BLKTMPL_HDR_SZ		= 80 + 3,	/* header, and tx count < 64k */
+};
+
+/*
+ * merkle tree, kept level by level so that appending a leaf, or
+ * replacing the coinbase, rehashes only the path from leaf to root
+ */
+
+static void mlevels_free(GPtrArray *mlevels)
+{
+	unsigned int i;
+	for (i = 0; i < mlevels->len; i++)
+		g_array_free(g_ptr_array_index(mlevels, i), TRUE);
+	g_ptr_array_set_size(mlevels, 0);
+}
+
+static GArray *mlevel_get(GPtrArray *mlevels, unsigned int level)
+{
+	while (mlevels->len <= level)
+		g_ptr_array_add(mlevels,
+				g_array_new(FALSE, TRUE, sizeof(bu256_t)));
+
+	return g_ptr_array_index(mlevels, level);
+}
+
+static void mlevel_put(GArray *lv, unsigned int idx, const bu256_t *hash)
+{
+	if (idx == lv->len)
+		g_array_append_vals(lv, hash, 1);
+	else
+		g_array_index(lv, bu256_t, idx) = *hash;
+}
+
+static void merkle_update(struct blktmpl *t, unsigned int idx,
+			  const bu256_t *leaf)
+{
+	GArray *lv = mlevel_get(t->mlevels, 0);
+	unsigned int level = 0;
+
+	mlevel_put(lv, idx, leaf);
+
+	while (lv->len > 1) {
+		unsigned int i1 = idx & ~1U;
+		unsigned int i2 = MIN(i1 + 1, lv->len - 1);
+		bu256_t hash;
+
+		bu_Hash_((unsigned char *) &hash,
+			 &g_array_index(lv, bu256_t, i1), sizeof(bu256_t),
+			 &g_array_index(lv, bu256_t, i2), sizeof(bu256_t));
+
+		idx /= 2;
+		lv = mlevel_get(t->mlevels, ++level);
+		mlevel_put(lv, idx, &hash);
+	}
+
+	bu256_copy(&t->block.hashMerkleRoot, &g_array_index(lv, bu256_t, 0));
+}
+
+/* full recompute, splitting bp_block_merkle_tree() output into levels */
+static void merkle_build(struct blktmpl *t)
+{
+	mlevels_free(t->mlevels);
+
+	GArray *arr = bp_block_merkle_tree(&t->block);
+	unsigned int j = 0, level = 0, nSize = t->block.vtx->len;
+
+	while (true) {
+		GArray *lv = mlevel_get(t->mlevels, level++);
+		g_array_append_vals(lv, &g_array_index(arr, bu256_t, j), nSize);
+		j += nSize;
+
+		if (nSize == 1)
+			break;
+		nSize = (nSize + 1) / 2;
+	}
+
+	bu256_copy(&t->block.hashMerkleRoot,
+		   &g_array_index(arr, bu256_t, arr->len - 1));
+	g_array_free(arr, TRUE);
+}
+
+static struct bp_tx *coinbase_new(const struct blktmpl *t)
+{
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	bp_tx_init(tx);
+	tx->nVersion = 1;
+	tx->vin = g_ptr_array_new_full(1, g_free);
+	tx->vout = g_ptr_array_new_full(1, g_free);
+
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	bp_outpt_init(&txin->prevout);
+	txin->prevout.n = 0xffffffffU;
+	txin->nSequence = 0xffffffffU;
+
+	/* block height, then room for a miner's extra nonce */
+	const unsigned char extranonce[4] = {};
+	txin->scriptSig = g_string_new(NULL);
+	bsp_push_int64(txin->scriptSig, t->height);
+	bsp_push_data(txin->scriptSig, extranonce, sizeof(extranonce));
+	g_ptr_array_add(tx->vin, txin);
+
+	struct bp_txout *txout = calloc(1, sizeof(*txout));
+	bp_txout_init(txout);
+	txout->nValue = bp_block_value(t->height, 0);
+	txout->scriptPubKey = g_string_new_len(t->cb_script->str,
+					       t->cb_script->len);
+	g_ptr_array_add(tx->vout, txout);
+
+	bp_tx_calc_sha256(tx);
+	return tx;
+}
+
+static void coinbase_update(struct blktmpl *t)
+{
+	struct bp_tx *cb = g_ptr_array_index(t->block.vtx, 0);
+	struct bp_txout *txout = g_ptr_array_index(cb->vout, 0);
+
+	txout->nValue = bp_block_value(t->height, t->fees);
+
+	cb->sha256_valid = false;
+	bp_tx_calc_sha256(cb);
+}
+
+static void blktmpl_reset(struct blktmpl *t)
+{
+	if (t->block.vtx) {
+		unsigned int i;
+		for (i = 0; i < t->block.vtx->len; i++) {
+			struct bp_tx *tx = g_ptr_array_index(t->block.vtx, i);
+			bp_tx_free(tx);
+			free(tx);
+		}
+		g_ptr_array_set_size(t->block.vtx, 0);
+	} else
+		t->block.vtx = g_ptr_array_new();
+
+	g_hash_table_remove_all(t->map_tx);
+	g_hash_table_remove_all(t->deferred);
+	mlevels_free(t->mlevels);
+
+	t->fees = 0;
+
+	struct bp_tx *cb = coinbase_new(t);
+	g_ptr_array_add(t->block.vtx, cb);
+	t->size = BLKTMPL_HDR_SZ + bp_tx_ser_size(cb);
+
+	merkle_update(t, 0, &cb->sha256);
+}
+
+bool blktmpl_init(struct blktmpl *t, struct mempool *mp,
+		  const bu256_t *hashPrevBlock, uint32_t height,
+		  uint32_t nBits, const GString *cb_script)
+{
+	memset(t, 0, sizeof(*t));
+
+	t->mp = mp;
+	t->height = height;
+	t->max_size = MAX_BLOCK_SIZE;
+	t->cb_script = g_string_new_len(cb_script->str, cb_script->len);
+
+	bp_block_init(&t->block);
+	t->block.nVersion = 2;
+	bu256_copy(&t->block.hashPrevBlock, hashPrevBlock);
+	t->block.nTime = (uint32_t) time(NULL);
+	t->block.nBits = nBits;
+
+	t->map_tx = g_hash_table_new(g_bu256_hash, g_bu256_equal);
+	t->deferred = g_hash_table_new_full(g_bu256_hash, g_bu256_equal,
+					    g_free, NULL);
+	t->mlevels = g_ptr_array_new();
+
+	blktmpl_reset(t);
+
+	return true;
+}
+
+void blktmpl_free(struct blktmpl *t)
+{
+	if (!t)
+		return;
+
+	if (t->block.vtx) {
+		unsigned int i;
+		for (i = 0; i < t->block.vtx->len; i++) {
+			struct bp_tx *tx = g_ptr_array_index(t->block.vtx, i);
+			bp_tx_free(tx);
+			free(tx);
+		}
+		g_ptr_array_free(t->block.vtx, TRUE);
+		t->block.vtx = NULL;
+	}
+	bp_block_free(&t->block);
+
+	if (t->mlevels) {
+		mlevels_free(t->mlevels);
+		g_ptr_array_free(t->mlevels, TRUE);
+		t->mlevels = NULL;
+	}
+	if (t->deferred) {
+		g_hash_table_unref(t->deferred);
+		t->deferred = NULL;
+	}
+	if (t->map_tx) {
+		g_hash_table_unref(t->map_tx);
+		t->map_tx = NULL;
+	}
+	if (t->cb_script) {
+		g_string_free(t->cb_script, TRUE);
+		t->cb_script = NULL;
+	}
+}
+
+/* are all of this transaction's unconfirmed parents in the block? */
+static bool blktmpl_parents_in(const struct blktmpl *t,
+			       const struct mempool_ent *ent)
+{
+	unsigned int i;
+	for (i = 0; i < ent->tx.vin->len; i++) {
+		struct bp_txin *txin = g_ptr_array_index(ent->tx.vin, i);
+
+		if (mempool_lookup(t->mp, &txin->prevout.hash) &&
+		    !g_hash_table_lookup(t->map_tx, &txin->prevout.hash))
+			return false;
+	}
+
+	return true;
+}
+
+static void blktmpl_append(struct blktmpl *t, const struct mempool_ent *ent)
+{
+	struct bp_tx *tx = calloc(1, sizeof(*tx));
+	bp_tx_init(tx);
+	bp_tx_copy(tx, &ent->tx);
+	bu256_copy(&tx->sha256, &ent->tx.sha256);
+	tx->sha256_valid = true;
+
+	g_ptr_array_add(t->block.vtx, tx);
+	g_hash_table_insert(t->map_tx, &tx->sha256, tx);
+
+	t->fees += ent->fee;
+	t->size += ent->size;
+
+	if (!t->building)
+		merkle_update(t, t->block.vtx->len - 1, &tx->sha256);
+}
+
+/*
+ * Add a transaction once every unconfirmed parent is in the block;
+ * until then, it is deferred.  Adding a transaction pulls in any of its
+ * deferred children that became ready.
+ */
+static bool blktmpl_try_add(struct blktmpl *t, struct mempool_ent *ent)
+{
+	const bu256_t *hash = &ent->tx.sha256;
+
+	if (g_hash_table_lookup(t->map_tx, hash))
+		return true;
+
+	if (!blktmpl_parents_in(t, ent)) {
+		if (!g_hash_table_lookup_extended(t->deferred, hash,
+						  NULL, NULL))
+			g_hash_table_insert(t->deferred,
+					    g_memdup(hash, sizeof(bu256_t)),
+					    NULL);
+		return false;
+	}
+
+	if (t->size + ent->size > t->max_size)
+		return false;
+
+	g_hash_table_remove(t->deferred, hash);
+	blktmpl_append(t, ent);
+
+	unsigned int i;
+	for (i = 0; i < ent->tx.vout->len; i++) {
+		struct bp_outpt outpt = { .n = i };
+		bu256_copy(&outpt.hash, hash);
+
+		struct mempool_ent *child = mempool_spender(t->mp, &outpt);
+		if (child &&
+		    g_hash_table_lookup_extended(t->deferred, &child->tx.sha256,
+						 NULL, NULL))
+			blktmpl_try_add(t, child);
+	}
+
+	return true;
+}
+
+static int ent_fee_rate_cmp(const void *a_, const void *b_)
+{
+	const struct mempool_ent *a = *(const struct mempool_ent **) a_;
+	const struct mempool_ent *b = *(const struct mempool_ent **) b_;
+
+	if (a->fee_rate != b->fee_rate)
+		return (a->fee_rate > b->fee_rate) ? -1 : 1;
+	if (a->nTime != b->nTime)
+		return (a->nTime < b->nTime) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Rebuild from scratch: greedy selection by fee rate, highest first,
+ * with children deferred until their parents are selected.
+ */
+bool blktmpl_build(struct blktmpl *t)
+{
+	blktmpl_reset(t);
+
+	GPtrArray *by_fee = t->mp->by_fee;
+	unsigned int i, n = by_fee->len;
+
+	struct mempool_ent **cand = g_memdup(by_fee->pdata,
+					     n * sizeof(*cand));
+	qsort(cand, n, sizeof(*cand), ent_fee_rate_cmp);
+
+	t->building = true;
+	for (i = 0; i < n; i++)
+		blktmpl_try_add(t, cand[i]);
+	t->building = false;
+
+	g_free(cand);
+
+	coinbase_update(t);
+	merkle_build(t);
+
+	return true;
+}
+
+/*
+ * Incremental update, for a transaction newly accepted into the mempool:
+ * append it, if it fits, and rehash only the changed merkle paths.
+ */
+bool blktmpl_tx_added(struct blktmpl *t, const bu256_t *hash)
+{
+	struct mempool_ent *ent = mempool_lookup(t->mp, hash);
+	if (!ent)
+		return false;
+
+	if (!blktmpl_try_add(t, ent))
+		return false;
+
+	/* fees changed the coinbase, and thus leaf 0 */
+	coinbase_update(t);
+	struct bp_tx *cb = g_ptr_array_index(t->block.vtx, 0);
+	merkle_update(t, 0, &cb->sha256);
+
+	return true;
+}
+
+/* a transaction left the mempool; rebuild if it was in the block */
+bool blktmpl_tx_removed(struct blktmpl *t, const bu256_t *hash)
+{
+	g_hash_table_remove(t->deferred, hash);
+
+	if (!g_hash_table_lookup(t->map_tx, hash))
+		return true;
+
+	return blktmpl_build(t);
+}
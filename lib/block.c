@@ -83,6 +83,33 @@ bool bp_tx_valid(const struct bp_tx *tx)
 	return true;
 }
 
+/*
+ * Could tx be included in a block at the given height and time?  Its
+ * nLockTime must have passed, or every input must have opted out of
+ * replacement with a final nSequence.
+ */
+bool bp_tx_final(const struct bp_tx *tx, unsigned int height,
+		 int64_t block_time)
+{
+	if (tx->nLockTime == 0)
+		return true;
+
+	int64_t lock_limit = (tx->nLockTime < LOCKTIME_THRESHOLD) ?
+			     (int64_t) height : block_time;
+	if ((int64_t) tx->nLockTime < lock_limit)
+		return true;
+
+	unsigned int i;
+	for (i = 0; i < tx->vin->len; i++) {
+		struct bp_txin *txin = g_ptr_array_index(tx->vin, i);
+
+		if (txin->nSequence != 0xffffffffU)
+			return false;
+	}
+
+	return true;
+}
+
 GArray *bp_block_merkle_tree(const struct bp_block *block)
 {
 	if (!block->vtx || !block->vtx->len)
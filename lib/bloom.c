@@ -13,107 +13,242 @@
 #define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455L
 #define LN2 0.6931471805599453094172321214581765680755001343602552L
 
-static const unsigned char bit_mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+/*
+ * MurmurHash3 (x86_32), see
+ * http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
+ *
+ * computed for several seeds in one pass over the data.  The per-block
+ * key mixing does not depend on the seed, so it is done once per block;
+ * the seed-dependent state is processed one SIMD register of seeds at a
+ * time, using GCC vector extensions: 16 lanes with AVX-512, 8 with AVX2,
+ * 4 otherwise (SSE2, NEON, ...), as the build targets.  Without vector
+ * extension support, one lane: plain scalar code.
+ */
+
+#if defined(__GNUC__) && \
+    ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 7)))
+#if defined(__AVX512F__)
+#define BLOOM_LANES 16
+#define BLOOM_LANE_IDX { 0, 1, 2, 3, 4, 5, 6, 7, \
+			 8, 9, 10, 11, 12, 13, 14, 15 }
+#elif defined(__AVX2__)
+#define BLOOM_LANES 8
+#define BLOOM_LANE_IDX { 0, 1, 2, 3, 4, 5, 6, 7 }
+#else
+#define BLOOM_LANES 4
+#define BLOOM_LANE_IDX { 0, 1, 2, 3 }
+#endif
+typedef uint32_t bloom_vec __attribute__((vector_size(BLOOM_LANES * 4)));
+#else
+#define BLOOM_LANES 1
+#define BLOOM_LANE_IDX 0
+typedef uint32_t bloom_vec;
+#endif
+
+static const uint32_t c1 = 0xcc9e2d51;
+static const uint32_t c2 = 0x1b873593;
 
 static inline uint32_t ROTL32 ( uint32_t x, int8_t r )
 {
   return (x << r) | (x >> (32 - r));
 }
 
-static unsigned int bloom_hash(struct bloom *bf, unsigned int nHashNum,
-				   struct const_buffer *vDataToHash_)
+static inline uint32_t murmur3_mix_k1(uint32_t k1)
 {
-	// The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
-	uint32_t h1 = nHashNum * (0xffffffffU / (bf->nHashFuncs-1));
-	const uint32_t c1 = 0xcc9e2d51;
-	const uint32_t c2 = 0x1b873593;
-	const unsigned char *vDataToHash = vDataToHash_->p;
+	k1 *= c1;
+	k1 = ROTL32(k1,15);
+	k1 *= c2;
+	return k1;
+}
 
-	const int nblocks = vDataToHash_->len / 4;
+static inline void murmur3_vec(bloom_vec *h_io, const unsigned char *data,
+			       size_t len)
+{
+	const size_t nblocks = len / 4;
+	bloom_vec h1 = *h_io;
+	size_t i;
 
 	//----------
 	// body
-	const uint32_t * blocks = (const uint32_t *)(&vDataToHash[0] + nblocks*4);
+	for (i = 0; i < nblocks; i++) {
+		uint32_t k1;
+		memcpy(&k1, data + (i * 4), 4);
 
-	int i;
-	for(i = -nblocks; i; i++)
-	{
-		uint32_t k1 = blocks[i];
-
-		k1 *= c1;
-		k1 = ROTL32(k1,15);
-		k1 *= c2;
-
-		h1 ^= k1;
-		h1 = ROTL32(h1,13); 
-		h1 = h1*5+0xe6546b64;
+		h1 ^= murmur3_mix_k1(k1);
+		h1 = (h1 << 13) | (h1 >> 19);
+		h1 = h1 * 5 + 0xe6546b64;
 	}
 
 	//----------
 	// tail
-	const uint8_t * tail = (const uint8_t*)(&vDataToHash[0] + nblocks*4);
-
+	const uint8_t *tail = data + (nblocks * 4);
 	uint32_t k1 = 0;
 
-	switch(vDataToHash_->len & 3)
-	{
+	switch (len & 3) {
 	case 3: k1 ^= tail[2] << 16;
 	case 2: k1 ^= tail[1] << 8;
 	case 1: k1 ^= tail[0];
-			k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
+		h1 ^= murmur3_mix_k1(k1);
 	};
 
 	//----------
 	// finalization
-	h1 ^= vDataToHash_->len;
+	h1 ^= (uint32_t) len;
 	h1 ^= h1 >> 16;
 	h1 *= 0x85ebca6b;
 	h1 ^= h1 >> 13;
 	h1 *= 0xc2b2ae35;
 	h1 ^= h1 >> 16;
 
-	return h1 % (bf->vData->len * 8);
+	*h_io = h1;
 }
 
-static void string_resize(GString *s, unsigned int new_index)
+void murmur3_multi(uint32_t *out, const uint32_t *seeds, unsigned int n_seeds,
+		   const void *data, size_t len)
 {
-	unsigned int new_size = new_index + 1;
-	unsigned int cur_size = s->len;
-	if (cur_size >= new_size)
-		return;
-	
-	g_string_set_size(s, new_size);
+	unsigned int i;
+
+	for (i = 0; i < n_seeds; i += BLOOM_LANES) {
+		unsigned int n = MIN(n_seeds - i, BLOOM_LANES);
+		bloom_vec h;
+
+		// lanes past n_seeds are computed, and ignored
+		memset(&h, 0, sizeof(h));
+		memcpy(&h, &seeds[i], n * sizeof(uint32_t));
 
-	unsigned int pad = new_size - cur_size;
-	memset(s->str + cur_size, 0, pad);
+		murmur3_vec(&h, data, len);
+
+		memcpy(&out[i], &h, n * sizeof(uint32_t));
+	}
 }
 
-void bloom_insert(struct bloom *bf, const void *data, size_t data_len)
+/*
+ * Hash functions of a filter: MurmurHash3, seeded by hash number, and
+ * reduced modulo the filter's bit count.  The reduction is a multiply
+ * by a reciprocal, computed once when the filter is sized, rather than
+ * a division, where available; the result is identical.
+ */
+static void bloom_hash_setup(struct bloom *bf)
 {
-	struct const_buffer vKey = { data, data_len };
+	bf->seed_step = (bf->nHashFuncs > 1) ?
+		(0xffffffffU / (bf->nHashFuncs-1)) : 0;
+	bf->nbits = bf->vData ? bf->vData->len * 8 : 0;
+
+	// oversized (invalid, per bloom_size_ok) filters are limited
+	bf->n_hash = MIN(bf->nHashFuncs, MAX_HASH_FUNCS);
+
+	bf->nbits_inv = bf->nbits ?
+		(UINT64_C(0xffffffffffffffff) / bf->nbits) + 1 : 0;
+}
+
+static inline uint32_t bloom_reduce(const struct bloom *bf, uint32_t h)
+{
+#ifdef __SIZEOF_INT128__
+	uint64_t lowbits = bf->nbits_inv * h;
+	return (uint32_t) (((unsigned __int128) lowbits * bf->nbits) >> 64);
+#else
+	return h % bf->nbits;
+#endif
+}
+
+// bit indexes for hash functions [first, first + BLOOM_LANES)
+static inline void bloom_hash_lanes(const struct bloom *bf,
+				    unsigned int first, uint32_t *idx,
+				    const void *data, size_t data_len)
+{
+	const bloom_vec lane_idx = BLOOM_LANE_IDX;
+	bloom_vec h = (lane_idx + first) * bf->seed_step;
 	unsigned int i;
-	for (i = 0; i < bf->nHashFuncs; i++)
-	{
-		unsigned int nIndex = bloom_hash(bf, i, &vKey);
-		string_resize(bf->vData, nIndex >> 3);
-		bf->vData->str[nIndex >> 3] |= bit_mask[7 & nIndex];
+
+	murmur3_vec(&h, data, data_len);
+	memcpy(idx, &h, sizeof(h));
+
+	for (i = 0; i < BLOOM_LANES; i++)
+		idx[i] = bloom_reduce(bf, idx[i]);
+}
+
+// The bit array is sized once, at init or deserialization; hash
+// indexes are always within it, so neither path below allocates.
+
+void bloom_insert(struct bloom *bf, const void *data, size_t data_len)
+{
+	if (!bf->vData || !bf->vData->len)
+		return;
+
+	unsigned char *v = (unsigned char *) bf->vData->str;
+	uint32_t idx[BLOOM_LANES];
+	unsigned int i, j;
+
+	for (i = 0; i < bf->n_hash; i += BLOOM_LANES) {
+		bloom_hash_lanes(bf, i, idx, data, data_len);
+
+		for (j = 0; j < MIN(bf->n_hash - i, BLOOM_LANES); j++)
+			v[idx[j] >> 3] |= 1U << (7 & idx[j]);
 	}
 }
 
-bool bloom_contains(struct bloom *bf, const void *data, size_t data_len)
+/*
+ * Hash functions are evaluated a vector at a time; most absent keys are
+ * rejected by the first vector, before the rest are computed.
+ */
+static inline bool bloom_test(const struct bloom *bf, const unsigned char *v,
+			      const void *data, size_t data_len)
 {
-	struct const_buffer vKey = { data, data_len };
-	unsigned int i;
-	for (i = 0; i < bf->nHashFuncs; i++)
-	{
-		unsigned int nIndex = bloom_hash(bf, i, &vKey);
-		string_resize(bf->vData, nIndex >> 3);
-		if (!(bf->vData->str[nIndex >> 3] & bit_mask[7 & nIndex]))
+	uint32_t idx[BLOOM_LANES];
+	unsigned int i, j, hit = 1;
+
+	for (i = 0; i < bf->n_hash; i += BLOOM_LANES) {
+		bloom_hash_lanes(bf, i, idx, data, data_len);
+
+		for (j = 0; j < MIN(bf->n_hash - i, BLOOM_LANES); j++)
+			hit &= v[idx[j] >> 3] >> (7 & idx[j]);
+		if (!(hit & 1))
 			return false;
 	}
+
 	return true;
 }
 
+bool bloom_contains(const struct bloom *bf, const void *data, size_t data_len)
+{
+	if (!bf->vData || !bf->vData->len)
+		return false;
+
+	return bloom_test(bf, (const unsigned char *) bf->vData->str,
+			  data, data_len);
+}
+
+/*
+ * Test many keys against one filter, e.g. every output script in a
+ * block.  Sets match[i] for each key; returns the number matched.
+ */
+unsigned int bloom_contains_batch(const struct bloom *bf,
+				  const struct const_buffer *keys,
+				  unsigned int n_keys, bool *match)
+{
+	unsigned int i, n_match = 0;
+
+	if (!bf->vData || !bf->vData->len) {
+		memset(match, 0, n_keys * sizeof(*match));
+		return 0;
+	}
+
+	const unsigned char *v = (const unsigned char *) bf->vData->str;
+
+	for (i = 0; i < n_keys; i++) {
+		match[i] = bloom_test(bf, v, keys[i].p, keys[i].len);
+		n_match += match[i];
+	}
+
+	return n_match;
+}
+
+void bloom_clear(struct bloom *bf)
+{
+	if (bf->vData)
+		memset(bf->vData->str, 0, bf->vData->len);
+}
+
 bool bloom_size_ok(const struct bloom *bf)
 {
 	return bf->vData->len <= MAX_BLOOM_FILTER_SIZE &&
@@ -124,6 +259,8 @@ bool deser_bloom(struct bloom *bf, struct const_buffer *buf)
 {
 	if (!deser_varstr(&bf->vData, buf)) return false;
 	if (!deser_u32(&bf->nHashFuncs, buf)) return false;
+
+	bloom_hash_setup(bf);
 	return true;
 }
 
@@ -137,15 +274,22 @@ bool bloom_init(struct bloom *bf, unsigned int nElements, double nFPRate)
 {
 	memset(bf, 0, sizeof(*bf));
 
+	if (!nElements)
+		nElements = 1;
+
 	unsigned int filter_size =
 	MIN((unsigned int)(-1 / LN2SQUARED * nElements * log(nFPRate)), MAX_BLOOM_FILTER_SIZE * 8) / 8;
+	filter_size = MAX(filter_size, 1);
 
 	bf->vData = g_string_sized_new(filter_size);
-	string_resize(bf->vData, filter_size - 1);
+	g_string_set_size(bf->vData, filter_size);
+	memset(bf->vData->str, 0, filter_size);
 
 	bf->nHashFuncs =
 	MIN((unsigned int)(bf->vData->len * 8 / nElements * LN2), MAX_HASH_FUNCS);
+	bf->nHashFuncs = MAX(bf->nHashFuncs, 1);
 
+	bloom_hash_setup(bf);
 	return true;
 }
 
@@ -15,15 +15,46 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <glib.h>
 #include <ccoin/util.h>
 #include <ccoin/core.h>
+#include <ccoin/dns.h>
 
-static const char *dns_seeds[] = {
+const char *dns_seeds_default[] = {
 	"seed.bitcoin.sipa.be",
 	"dnsseed.bluematt.me",
 	"dnsseed.bitcoin.dashjr.org",
 	"bitseed.xf2.org",
+	NULL
+};
+
+/*
+ * Shared between the owner and its query threads, each holding a
+ * reference.  A resolver cannot be cancelled, so threads may outlive
+ * the owner; whoever drops the last reference frees the seeder.
+ */
+struct dns_seeder {
+	pthread_mutex_t	lock;
+	unsigned int	refs;
+	bool		closed;		/* owner gone; discard results */
+
+	int		pipefd[2];	/* "results ready" notification */
+	GList		*results;	/* of bp_address, not yet taken */
+	unsigned int	n_pending;	/* queries outstanding */
+	int64_t		deadline;	/* ms, monotonic */
+
+	dns_resolve_fn	resolve;
+	void		*priv;
+};
+
+struct dns_query {
+	struct dns_seeder *ds;
+	char		*name;
 };
 
 static GList *add_seed_addr(GList *l, const struct addrinfo *ai)
@@ -57,9 +88,10 @@ err_out:
 	return l;
 }
 
-static GList *query_seed(GList *l, const char *seedname)
+GList *dns_resolve_getaddrinfo(const char *seedname, void *priv)
 {
 	struct addrinfo hints, *res;
+	GList *l = NULL;
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_UNSPEC;
@@ -77,13 +109,192 @@ static GList *query_seed(GList *l, const char *seedname)
 	return l;
 }
 
-GList *bu_dns_seed_addrs(void)
+static int64_t dns_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static void dns_seeder_unref(struct dns_seeder *ds)
+{
+	pthread_mutex_lock(&ds->lock);
+	bool last = (--ds->refs == 0);
+	pthread_mutex_unlock(&ds->lock);
+
+	if (!last)
+		return;
+
+	g_list_free_full(ds->results, g_free);
+	if (ds->pipefd[0] >= 0)
+		close(ds->pipefd[0]);
+	close(ds->pipefd[1]);
+	pthread_mutex_destroy(&ds->lock);
+	free(ds);
+}
+
+static void *dns_query_thread(void *arg)
 {
+	struct dns_query *q = arg;
+	struct dns_seeder *ds = q->ds;
+
+	GList *l = ds->resolve(q->name, ds->priv);
+
+	pthread_mutex_lock(&ds->lock);
+
+	ds->n_pending--;
+	if (!ds->closed) {
+		ds->results = g_list_concat(ds->results, l);
+		l = NULL;
+
+		/* if the pipe is full, a wakeup is already pending */
+		char c = 0;
+		ssize_t wrc = write(ds->pipefd[1], &c, 1);
+		(void) wrc;
+	}
+
+	pthread_mutex_unlock(&ds->lock);
+
+	g_list_free_full(l, g_free);
+	free(q->name);
+	free(q);
+
+	dns_seeder_unref(ds);
+	return NULL;
+}
+
+struct dns_seeder *dns_seeder_new(const char **seeds,
+				  unsigned int timeout_ms,
+				  dns_resolve_fn resolve, void *priv)
+{
+	struct dns_seeder *ds = calloc(1, sizeof(*ds));
+	if (!ds)
+		return NULL;
+
+	if (pipe(ds->pipefd) < 0) {
+		free(ds);
+		return NULL;
+	}
+	fcntl(ds->pipefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(ds->pipefd[1], F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_init(&ds->lock, NULL);
+	ds->refs = 1;
+	ds->deadline = dns_now_ms() + timeout_ms;
+	ds->resolve = resolve ? resolve : dns_resolve_getaddrinfo;
+	ds->priv = priv;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
 	unsigned int i;
+	for (i = 0; seeds && seeds[i]; i++) {
+		struct dns_query *q = calloc(1, sizeof(*q));
+		q->ds = ds;
+		q->name = strdup(seeds[i]);
+
+		pthread_mutex_lock(&ds->lock);
+		ds->refs++;
+		ds->n_pending++;
+		pthread_mutex_unlock(&ds->lock);
+
+		pthread_t thr;
+		if (pthread_create(&thr, &attr, dns_query_thread, q) != 0) {
+			pthread_mutex_lock(&ds->lock);
+			ds->refs--;
+			ds->n_pending--;
+			pthread_mutex_unlock(&ds->lock);
+
+			free(q->name);
+			free(q);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return ds;
+}
+
+void dns_seeder_free(struct dns_seeder *ds)
+{
+	if (!ds)
+		return;
+
+	/* stragglers will find no one listening */
+	pthread_mutex_lock(&ds->lock);
+	ds->closed = true;
+	close(ds->pipefd[0]);
+	ds->pipefd[0] = -1;
+	pthread_mutex_unlock(&ds->lock);
+
+	dns_seeder_unref(ds);
+}
+
+int dns_seeder_fd(const struct dns_seeder *ds)
+{
+	return ds->pipefd[0];
+}
+
+/* results that arrived since the last call; caller owns the list */
+GList *dns_seeder_take(struct dns_seeder *ds)
+{
+	char buf[64];
+
+	pthread_mutex_lock(&ds->lock);
+
+	while (read(ds->pipefd[0], buf, sizeof(buf)) > 0)
+		;			/* drain notifications */
+
+	GList *l = ds->results;
+	ds->results = NULL;
+
+	pthread_mutex_unlock(&ds->lock);
+
+	return l;
+}
+
+/* true once every query answered, or the timeout passed */
+bool dns_seeder_done(struct dns_seeder *ds)
+{
+	pthread_mutex_lock(&ds->lock);
+	bool done = (ds->n_pending == 0) || (dns_now_ms() >= ds->deadline);
+	pthread_mutex_unlock(&ds->lock);
+
+	return done;
+}
+
+/* block until new results, completion, or timeout; false on timeout */
+bool dns_seeder_wait(struct dns_seeder *ds)
+{
+	int64_t remain = ds->deadline - dns_now_ms();
+	if (remain <= 0)
+		return false;
+
+	struct pollfd pfd = { ds->pipefd[0], POLLIN };
+
+	return poll(&pfd, 1, (int) remain) > 0;
+}
+
+GList *bu_dns_seed_addrs(void)
+{
+	struct dns_seeder *ds;
 	GList *l = NULL;
 
-	for (i = 0; i < ARRAY_SIZE(dns_seeds); i++)
-		l = query_seed(l, dns_seeds[i]);
+	ds = dns_seeder_new(dns_seeds_default, DNS_SEED_TIMEOUT_MS,
+			    dns_resolve_getaddrinfo, NULL);
+	if (!ds)
+		return NULL;
+
+	while (true) {
+		l = g_list_concat(l, dns_seeder_take(ds));
+		if (dns_seeder_done(ds))
+			break;
+		dns_seeder_wait(ds);
+	}
+
+	dns_seeder_free(ds);
 
 	return l;
 }
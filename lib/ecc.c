@@ -0,0 +1,1792 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ccoin/ecc.h>
+
+#ifdef __SIZEOF_INT128__
+
+typedef unsigned __int128 uint128_t;
+
+/*
+ * Field elements, mod p = 2^256 - 2^32 - 977: five limbs of 52 bits
+ * (48 for the top one) in 64-bit words, so that sums need no carry
+ * propagation.  An element of "magnitude" m has limbs of at most 2*m
+ * times their normalized maximum.  fe_mul and fe_sqr accept magnitude
+ * up to 8, and return magnitude 1; fe_negate(r, a, m) wants a of
+ * magnitude at most m, and returns m + 1.
+ */
+struct fe {
+	uint64_t	n[5];
+};
+
+#define M52		0xFFFFFFFFFFFFFULL
+#define M48		0xFFFFFFFFFFFFULL
+#define P0		0xFFFFEFFFFFC2FULL	/* low limb of p */
+#define R256		0x1000003D1ULL		/* 2^256 mod p */
+#define R260		0x1000003D10ULL		/* 2^260 mod p */
+
+#define FE_CONST(d7, d6, d5, d4, d3, d2, d1, d0) {{ \
+	(d0) | (((uint64_t) (d1) & 0xFFFFFULL) << 32), \
+	((uint64_t) (d1) >> 20) | ((uint64_t) (d2) << 12) | \
+		(((uint64_t) (d3) & 0xFFULL) << 44), \
+	((uint64_t) (d3) >> 8) | (((uint64_t) (d4) & 0xFFFFFFFULL) << 24), \
+	((uint64_t) (d4) >> 28) | ((uint64_t) (d5) << 4) | \
+		(((uint64_t) (d6) & 0xFFFFULL) << 36), \
+	((uint64_t) (d6) >> 16) | ((uint64_t) (d7) << 16) }}
+
+static const struct fe fe_beta = FE_CONST(
+	0x7ae96a2bUL, 0x657c0710UL, 0x6e64479eUL, 0xac3434e9UL,
+	0x9cf04975UL, 0x12f58995UL, 0xc1396c28UL, 0x719501eeUL);
+
+static void fe_set_int(struct fe *r, uint64_t a)
+{
+	r->n[0] = a;
+	r->n[1] = r->n[2] = r->n[3] = r->n[4] = 0;
+}
+
+/* to magnitude 1, not necessarily the canonical representative */
+static void fe_normalize_weak(struct fe *r)
+{
+	uint64_t t0 = r->n[0], t1 = r->n[1], t2 = r->n[2],
+		 t3 = r->n[3], t4 = r->n[4];
+
+	uint64_t x = t4 >> 48;
+	t4 &= M48;
+
+	t0 += x * R256;
+	t1 += t0 >> 52; t0 &= M52;
+	t2 += t1 >> 52; t1 &= M52;
+	t3 += t2 >> 52; t2 &= M52;
+	t4 += t3 >> 52; t3 &= M52;
+
+	r->n[0] = t0; r->n[1] = t1; r->n[2] = t2; r->n[3] = t3; r->n[4] = t4;
+}
+
+/* to the canonical representative, in [0, p) */
+static void fe_normalize(struct fe *r)
+{
+	uint64_t t0 = r->n[0], t1 = r->n[1], t2 = r->n[2],
+		 t3 = r->n[3], t4 = r->n[4];
+
+	uint64_t x = t4 >> 48;
+	t4 &= M48;
+
+	t0 += x * R256;
+	t1 += t0 >> 52; t0 &= M52;
+	t2 += t1 >> 52; t1 &= M52;
+	t3 += t2 >> 52; t2 &= M52;
+	t4 += t3 >> 52; t3 &= M52;
+
+	/* now below 2^256 + small; subtract p once if at least p */
+	uint64_t m = t1 & t2 & t3;
+	x = (t4 >> 48) | ((t4 == M48) & (m == M52) & (t0 >= P0));
+
+	t0 += x * R256;
+	t1 += t0 >> 52; t0 &= M52;
+	t2 += t1 >> 52; t1 &= M52;
+	t3 += t2 >> 52; t2 &= M52;
+	t4 += t3 >> 52; t3 &= M52;
+	t4 &= M48;
+
+	r->n[0] = t0; r->n[1] = t1; r->n[2] = t2; r->n[3] = t3; r->n[4] = t4;
+}
+
+static bool fe_normalizes_to_zero(const struct fe *a)
+{
+	struct fe t = *a;
+	fe_normalize(&t);
+	return (t.n[0] | t.n[1] | t.n[2] | t.n[3] | t.n[4]) == 0;
+}
+
+/* input normalized */
+static bool fe_is_odd(const struct fe *a)
+{
+	return a->n[0] & 1;
+}
+
+static bool fe_equal(const struct fe *a, const struct fe *b)
+{
+	return memcmp(a->n, b->n, sizeof(a->n)) == 0;
+}
+
+static bool fe_set_b32(struct fe *r, const unsigned char *a)
+{
+	uint64_t w[4];
+	unsigned int i, j;
+
+	for (i = 0; i < 4; i++) {
+		w[i] = 0;
+		for (j = 0; j < 8; j++)
+			w[i] = (w[i] << 8) | a[(3 - i) * 8 + j];
+	}
+
+	r->n[0] = w[0] & M52;
+	r->n[1] = ((w[0] >> 52) | (w[1] << 12)) & M52;
+	r->n[2] = ((w[1] >> 40) | (w[2] << 24)) & M52;
+	r->n[3] = ((w[2] >> 28) | (w[3] << 36)) & M52;
+	r->n[4] = w[3] >> 16;
+
+	/* reject encodings of values >= p */
+	return !((r->n[4] == M48) &&
+		 ((r->n[3] & r->n[2] & r->n[1]) == M52) &&
+		 (r->n[0] >= P0));
+}
+
+/* input normalized */
+static void fe_get_b32(unsigned char *r, const struct fe *a)
+{
+	uint64_t w[4];
+	unsigned int i, j;
+
+	w[0] = a->n[0] | (a->n[1] << 52);
+	w[1] = (a->n[1] >> 12) | (a->n[2] << 40);
+	w[2] = (a->n[2] >> 24) | (a->n[3] << 28);
+	w[3] = (a->n[3] >> 36) | (a->n[4] << 16);
+
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 8; j++)
+			r[(3 - i) * 8 + j] = w[i] >> (56 - (8 * j));
+}
+
+static void fe_negate(struct fe *r, const struct fe *a, unsigned int m)
+{
+	uint64_t k = 2 * (m + 1);
+
+	r->n[0] = (P0 * k) - a->n[0];
+	r->n[1] = (M52 * k) - a->n[1];
+	r->n[2] = (M52 * k) - a->n[2];
+	r->n[3] = (M52 * k) - a->n[3];
+	r->n[4] = (M48 * k) - a->n[4];
+}
+
+static void fe_add(struct fe *r, const struct fe *a)
+{
+	unsigned int i;
+	for (i = 0; i < 5; i++)
+		r->n[i] += a->n[i];
+}
+
+static void fe_mul_int(struct fe *r, unsigned int k)
+{
+	unsigned int i;
+	for (i = 0; i < 5; i++)
+		r->n[i] *= k;
+}
+
+/*
+ * Reduce a 9-column product (each column below 2^116) to magnitude 1:
+ * carry it into ten 52-bit limbs, fold those at 2^260 and up back in
+ * as multiples of 2^260 mod p, then fold the excess over 2^256.
+ */
+static void fe_reduce_wide(struct fe *r, const uint128_t *d)
+{
+	uint64_t t[10];
+	uint128_t c = 0;
+	unsigned int i;
+
+	for (i = 0; i < 9; i++) {
+		c += d[i];
+		t[i] = (uint64_t) c & M52;
+		c >>= 52;
+	}
+	t[9] = (uint64_t) c;
+
+	c = 0;
+	for (i = 0; i < 4; i++) {
+		c += t[i] + ((uint128_t) t[i + 5] * R260);
+		t[i] = (uint64_t) c & M52;
+		c >>= 52;
+	}
+	c += t[4] + ((uint128_t) t[9] * R260);
+	t[4] = (uint64_t) c & M48;
+	c >>= 48;
+
+	c = ((uint128_t) (uint64_t) c * R256) + t[0];
+	t[0] = (uint64_t) c & M52;
+	c >>= 52;
+	for (i = 1; i < 4; i++) {
+		c += t[i];
+		t[i] = (uint64_t) c & M52;
+		c >>= 52;
+	}
+	c += t[4];
+	t[4] = (uint64_t) c & M48;
+	c >>= 48;
+
+	r->n[0] = t[0] + ((uint64_t) c * R256);
+	r->n[1] = t[1];
+	r->n[2] = t[2];
+	r->n[3] = t[3];
+	r->n[4] = t[4];
+}
+
+static void fe_mul(struct fe *r, const struct fe *a, const struct fe *b)
+{
+	const uint64_t *x = a->n, *y = b->n;
+	uint128_t d[9];
+
+	d[0] = (uint128_t) x[0] * y[0];
+	d[1] = (uint128_t) x[0] * y[1] + (uint128_t) x[1] * y[0];
+	d[2] = (uint128_t) x[0] * y[2] + (uint128_t) x[1] * y[1] +
+	       (uint128_t) x[2] * y[0];
+	d[3] = (uint128_t) x[0] * y[3] + (uint128_t) x[1] * y[2] +
+	       (uint128_t) x[2] * y[1] + (uint128_t) x[3] * y[0];
+	d[4] = (uint128_t) x[0] * y[4] + (uint128_t) x[1] * y[3] +
+	       (uint128_t) x[2] * y[2] + (uint128_t) x[3] * y[1] +
+	       (uint128_t) x[4] * y[0];
+	d[5] = (uint128_t) x[1] * y[4] + (uint128_t) x[2] * y[3] +
+	       (uint128_t) x[3] * y[2] + (uint128_t) x[4] * y[1];
+	d[6] = (uint128_t) x[2] * y[4] + (uint128_t) x[3] * y[3] +
+	       (uint128_t) x[4] * y[2];
+	d[7] = (uint128_t) x[3] * y[4] + (uint128_t) x[4] * y[3];
+	d[8] = (uint128_t) x[4] * y[4];
+
+	fe_reduce_wide(r, d);
+}
+
+static void fe_sqr(struct fe *r, const struct fe *a)
+{
+	const uint64_t *x = a->n;
+	uint64_t x0_2 = x[0] * 2, x1_2 = x[1] * 2, x2_2 = x[2] * 2,
+		 x3_2 = x[3] * 2;
+	uint128_t d[9];
+
+	d[0] = (uint128_t) x[0] * x[0];
+	d[1] = (uint128_t) x0_2 * x[1];
+	d[2] = (uint128_t) x0_2 * x[2] + (uint128_t) x[1] * x[1];
+	d[3] = (uint128_t) x0_2 * x[3] + (uint128_t) x1_2 * x[2];
+	d[4] = (uint128_t) x0_2 * x[4] + (uint128_t) x1_2 * x[3] +
+	       (uint128_t) x[2] * x[2];
+	d[5] = (uint128_t) x1_2 * x[4] + (uint128_t) x2_2 * x[3];
+	d[6] = (uint128_t) x2_2 * x[4] + (uint128_t) x[3] * x[3];
+	d[7] = (uint128_t) x3_2 * x[4];
+	d[8] = (uint128_t) x[4] * x[4];
+
+	fe_reduce_wide(r, d);
+}
+
+static void fe_sqr_n(struct fe *r, const struct fe *a, unsigned int n)
+{
+	*r = *a;
+	while (n-- > 0)
+		fe_sqr(r, r);
+}
+
+/*
+ * a^(2^k - 1) for the runs of ones in p - 2 and (p + 1) / 4, shared by
+ * fe_inv and fe_sqrt: x223 = a^(2^223 - 1), x22, x2
+ */
+static void fe_pow_x223(struct fe *x223, struct fe *x22, struct fe *x2,
+			const struct fe *a)
+{
+	struct fe x3, x6, x9, x11, x44, x88, x176, x220, t;
+
+	fe_sqr(x2, a);
+	fe_mul(x2, x2, a);
+	fe_sqr(&x3, x2);
+	fe_mul(&x3, &x3, a);
+	fe_sqr_n(&x6, &x3, 3);
+	fe_mul(&x6, &x6, &x3);
+	fe_sqr_n(&x9, &x6, 3);
+	fe_mul(&x9, &x9, &x3);
+	fe_sqr_n(&x11, &x9, 2);
+	fe_mul(&x11, &x11, x2);
+	fe_sqr_n(x22, &x11, 11);
+	fe_mul(x22, x22, &x11);
+	fe_sqr_n(&x44, x22, 22);
+	fe_mul(&x44, &x44, x22);
+	fe_sqr_n(&x88, &x44, 44);
+	fe_mul(&x88, &x88, &x44);
+	fe_sqr_n(&x176, &x88, 88);
+	fe_mul(&x176, &x176, &x88);
+	fe_sqr_n(&x220, &x176, 44);
+	fe_mul(&x220, &x220, &x44);
+	fe_sqr_n(&t, &x220, 3);
+	fe_mul(x223, &t, &x3);
+}
+
+/* a^(p-2); constant time */
+static void fe_inv(struct fe *r, const struct fe *a)
+{
+	struct fe x223, x22, x2, t;
+
+	fe_pow_x223(&x223, &x22, &x2, a);
+
+	fe_sqr_n(&t, &x223, 23);
+	fe_mul(&t, &t, &x22);
+	fe_sqr_n(&t, &t, 5);
+	fe_mul(&t, &t, a);
+	fe_sqr_n(&t, &t, 3);
+	fe_mul(&t, &t, &x2);
+	fe_sqr_n(&t, &t, 2);
+	fe_mul(r, &t, a);
+}
+
+/* a^((p+1)/4), if a is a square; r normalized */
+static bool fe_sqrt(struct fe *r, const struct fe *a)
+{
+	struct fe x223, x22, x2, t, chk, aa;
+
+	fe_pow_x223(&x223, &x22, &x2, a);
+
+	fe_sqr_n(&t, &x223, 23);
+	fe_mul(&t, &t, &x22);
+	fe_sqr_n(&t, &t, 6);
+	fe_mul(&t, &t, &x2);
+	fe_sqr_n(r, &t, 2);
+	fe_normalize(r);
+
+	fe_sqr(&chk, r);
+	fe_normalize(&chk);
+	aa = *a;
+	fe_normalize(&aa);
+	return fe_equal(&chk, &aa);
+}
+
+/*
+ * Scalars, mod the group order n: four 64-bit limbs, always reduced.
+ */
+struct scalar {
+	uint64_t	d[4];
+};
+
+#define N0		0xBFD25E8CD0364141ULL
+#define N1		0xBAAEDCE6AF48A03BULL
+#define N2		0xFFFFFFFFFFFFFFFEULL
+#define N3		0xFFFFFFFFFFFFFFFFULL
+
+/* 2^256 - n */
+static const uint64_t scalar_nc[3] = {
+	0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 1,
+};
+
+/* n - 2, for inversion */
+static const struct scalar scalar_n_2 = {{
+	0xBFD25E8CD036413FULL, N1, N2, N3,
+}};
+
+/* GLV endomorphism: lambda, and the lattice basis for splitting */
+static const struct scalar scalar_minus_lambda = {{
+	0xE0CFC810B51283CFULL, 0xA880B9FC8EC739C2ULL,
+	0x5AD9E3FD77ED9BA4ULL, 0xAC9C52B33FA3CF1FULL,
+}};
+static const struct scalar scalar_minus_b1 = {{
+	0x6F547FA90ABFE4C3ULL, 0xE4437ED6010E8828ULL, 0, 0,
+}};
+static const struct scalar scalar_minus_b2 = {{
+	0xD765CDA83DB1562CULL, 0x8A280AC50774346DULL,
+	0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL,
+}};
+static const struct scalar scalar_g1 = {{
+	0xE893209A45DBB031ULL, 0x3DAA8A1471E8CA7FULL,
+	0xE86C90E49284EB15ULL, 0x3086D221A7D46BCDULL,
+}};
+static const struct scalar scalar_g2 = {{
+	0x1571B4AE8AC47F71ULL, 0x221208AC9DF506C6ULL,
+	0x6F547FA90ABFE4C4ULL, 0xE4437ED6010E8828ULL,
+}};
+
+static int scalar_check_overflow(const struct scalar *a)
+{
+	int yes = 0, no = 0;
+
+	no |= (a->d[3] < N3);
+	no |= (a->d[2] < N2);
+	yes |= (a->d[2] > N2) & ~no;
+	no |= (a->d[1] < N1);
+	yes |= (a->d[1] > N1) & ~no;
+	yes |= (a->d[0] >= N0) & ~no;
+	return yes;
+}
+
+/* subtract n, if overflow (0 or 1) */
+static void scalar_reduce(struct scalar *r, unsigned int overflow)
+{
+	uint128_t t;
+
+	t = (uint128_t) r->d[0] + ((uint64_t) overflow * scalar_nc[0]);
+	r->d[0] = (uint64_t) t; t >>= 64;
+	t += (uint128_t) r->d[1] + ((uint64_t) overflow * scalar_nc[1]);
+	r->d[1] = (uint64_t) t; t >>= 64;
+	t += (uint128_t) r->d[2] + ((uint64_t) overflow * scalar_nc[2]);
+	r->d[2] = (uint64_t) t; t >>= 64;
+	t += r->d[3];
+	r->d[3] = (uint64_t) t;
+}
+
+/* big-endian; reduced mod n, with *overflow set if it was not below n */
+static void scalar_set_b32(struct scalar *r, const unsigned char *b,
+			   int *overflow)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 4; i++) {
+		r->d[i] = 0;
+		for (j = 0; j < 8; j++)
+			r->d[i] = (r->d[i] << 8) | b[(3 - i) * 8 + j];
+	}
+
+	int over = scalar_check_overflow(r);
+	scalar_reduce(r, over);
+	if (overflow)
+		*overflow = over;
+}
+
+static void scalar_get_b32(unsigned char *b, const struct scalar *a)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 8; j++)
+			b[(3 - i) * 8 + j] = a->d[i] >> (56 - (8 * j));
+}
+
+static bool scalar_is_zero(const struct scalar *a)
+{
+	return (a->d[0] | a->d[1] | a->d[2] | a->d[3]) == 0;
+}
+
+static void scalar_add(struct scalar *r, const struct scalar *a,
+		       const struct scalar *b)
+{
+	uint128_t t = 0;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		t += (uint128_t) a->d[i] + b->d[i];
+		r->d[i] = (uint64_t) t;
+		t >>= 64;
+	}
+
+	scalar_reduce(r, (unsigned int) t + scalar_check_overflow(r));
+}
+
+static void scalar_negate(struct scalar *r, const struct scalar *a)
+{
+	uint64_t nonzero = 0xFFFFFFFFFFFFFFFFULL *
+			   (uint64_t) !scalar_is_zero(a);
+	uint128_t t = (uint128_t) (~a->d[0]) + N0 + 1;
+
+	r->d[0] = (uint64_t) t & nonzero; t >>= 64;
+	t += (uint128_t) (~a->d[1]) + N1;
+	r->d[1] = (uint64_t) t & nonzero; t >>= 64;
+	t += (uint128_t) (~a->d[2]) + N2;
+	r->d[2] = (uint64_t) t & nonzero; t >>= 64;
+	t += (uint128_t) (~a->d[3]) + N3;
+	r->d[3] = (uint64_t) t & nonzero;
+}
+
+/* a > n/2 */
+static bool scalar_is_high(const struct scalar *a)
+{
+	static const uint64_t h[4] = {
+		0xDFE92F46681B20A0ULL, 0x5D576E7357A4501DULL,
+		0xFFFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL,
+	};
+	int i;
+
+	for (i = 3; i >= 0; i--) {
+		if (a->d[i] != h[i])
+			return a->d[i] > h[i];
+	}
+	return false;
+}
+
+static void scalar_mul_512(uint64_t l[8], const struct scalar *a,
+			   const struct scalar *b)
+{
+	unsigned int i, j;
+
+	memset(l, 0, 8 * sizeof(uint64_t));
+	for (i = 0; i < 4; i++) {
+		uint128_t c = 0;
+		for (j = 0; j < 4; j++) {
+			c += ((uint128_t) a->d[i] * b->d[j]) + l[i + j];
+			l[i + j] = (uint64_t) c;
+			c >>= 64;
+		}
+		l[i + 4] = (uint64_t) c;
+	}
+}
+
+/* 192-bit accumulator, for column-wise multiplication */
+struct acc192 {
+	uint128_t	lo;
+	uint64_t	hi;
+};
+
+static inline void acc_add(struct acc192 *c, uint128_t v)
+{
+	c->lo += v;
+	c->hi += (c->lo < v);
+}
+
+static inline uint64_t acc_extract(struct acc192 *c)
+{
+	uint64_t v = (uint64_t) c->lo;
+
+	c->lo = (c->lo >> 64) | ((uint128_t) c->hi << 64);
+	c->hi = 0;
+	return v;
+}
+
+/*
+ * o = lo + hi * (2^256 - n), column by column: lo has four limbs, hi
+ * hlen; o gets hlen + 3, and the carry out of those is returned.
+ */
+static uint64_t scalar_fold(uint64_t *o, const uint64_t *lo,
+			    const uint64_t *hi, unsigned int hlen)
+{
+	struct acc192 c = { 0, 0 };
+	unsigned int k;
+
+	for (k = 0; k < hlen + 3; k++) {
+		if (k < 4)
+			acc_add(&c, lo[k]);
+		if (k < hlen)
+			acc_add(&c, (uint128_t) hi[k] * scalar_nc[0]);
+		if (k >= 1 && k <= hlen)
+			acc_add(&c, (uint128_t) hi[k - 1] * scalar_nc[1]);
+		if (k >= 2 && k <= hlen + 1)
+			acc_add(&c, hi[k - 2]);
+		o[k] = acc_extract(&c);
+	}
+
+	return (uint64_t) c.lo;
+}
+
+/*
+ * Reduce a 512-bit value: 2^256 == 2^256 - n (mod n), a 129-bit
+ * number, so folding the high part back in three times leaves
+ * 385, 258, then 256 bits plus a carry; a final conditional
+ * subtraction covers that.  Constant time.
+ */
+static void scalar_reduce_512(struct scalar *r, const uint64_t l[8])
+{
+	uint64_t m[7], p[6];
+
+	scalar_fold(m, l, l + 4, 4);
+	scalar_fold(p, m, m + 4, 3);
+	uint64_t c = scalar_fold(r->d, p, p + 4, 1);
+
+	scalar_reduce(r, (unsigned int) c + scalar_check_overflow(r));
+}
+
+static void scalar_mul(struct scalar *r, const struct scalar *a,
+		       const struct scalar *b)
+{
+	uint64_t l[8];
+
+	scalar_mul_512(l, a, b);
+	scalar_reduce_512(r, l);
+}
+
+/* a^(n-2), by 4-bit windows of the (public) exponent; constant time */
+static void scalar_inverse(struct scalar *r, const struct scalar *a)
+{
+	struct scalar pw[16], acc;
+	int i;
+
+	memset(&pw[0], 0, sizeof(pw[0]));
+	pw[0].d[0] = 1;
+	for (i = 1; i < 16; i++)
+		scalar_mul(&pw[i], &pw[i - 1], a);
+
+	acc = pw[0];
+	for (i = 63; i >= 0; i--) {
+		unsigned int nib = (scalar_n_2.d[i / 16] >> ((i % 16) * 4)) & 0xf;
+		unsigned int j;
+
+		for (j = 0; j < 4; j++)
+			scalar_mul(&acc, &acc, &acc);
+		if (nib)
+			scalar_mul(&acc, &acc, &pw[nib]);
+	}
+
+	*r = acc;
+}
+
+static uint64_t u256_add(uint64_t *r, const uint64_t *a, const uint64_t *b)
+{
+	uint128_t c = 0;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		c += (uint128_t) a[i] + b[i];
+		r[i] = (uint64_t) c;
+		c >>= 64;
+	}
+	return (uint64_t) c;
+}
+
+static uint64_t u256_sub(uint64_t *r, const uint64_t *a, const uint64_t *b)
+{
+	uint64_t borrow = 0;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		uint64_t t = a[i] - b[i] - borrow;
+		borrow = (a[i] < b[i]) || (a[i] == b[i] && borrow);
+		r[i] = t;
+	}
+	return borrow;
+}
+
+static void u256_shr1(uint64_t *r, uint64_t top)
+{
+	r[0] = (r[0] >> 1) | (r[1] << 63);
+	r[1] = (r[1] >> 1) | (r[2] << 63);
+	r[2] = (r[2] >> 1) | (r[3] << 63);
+	r[3] = (r[3] >> 1) | (top << 63);
+}
+
+static bool u256_is_one(const uint64_t *a)
+{
+	return a[0] == 1 && (a[1] | a[2] | a[3]) == 0;
+}
+
+/* x / 2 (mod n) */
+static void scalar_half_var(uint64_t *x)
+{
+	static const uint64_t n[4] = { N0, N1, N2, N3 };
+
+	if (x[0] & 1)
+		u256_shr1(x, u256_add(x, x, n));
+	else
+		u256_shr1(x, 0);
+}
+
+/*
+ * Inverse by the binary extended Euclidean algorithm: variable time,
+ * for public values (signature verification) only.  a != 0.
+ */
+static void scalar_inverse_var(struct scalar *r, const struct scalar *a)
+{
+	static const uint64_t n[4] = { N0, N1, N2, N3 };
+	uint64_t u[4], v[4], x1[4] = { 1, 0, 0, 0 }, x2[4] = { 0, 0, 0, 0 };
+
+	memcpy(u, a->d, sizeof(u));
+	memcpy(v, n, sizeof(v));
+
+	while (!u256_is_one(u) && !u256_is_one(v)) {
+		while (!(u[0] & 1)) {
+			u256_shr1(u, 0);
+			scalar_half_var(x1);
+		}
+		while (!(v[0] & 1)) {
+			u256_shr1(v, 0);
+			scalar_half_var(x2);
+		}
+
+		uint64_t t[4];
+		if (!u256_sub(t, u, v)) {
+			memcpy(u, t, sizeof(u));
+			if (u256_sub(x1, x1, x2))
+				u256_add(x1, x1, n);
+		} else {
+			u256_sub(v, v, u);
+			if (u256_sub(x2, x2, x1))
+				u256_add(x2, x2, n);
+		}
+	}
+
+	memcpy(r->d, u256_is_one(u) ? x1 : x2, sizeof(r->d));
+}
+
+static unsigned int scalar_get_bits(const struct scalar *a, unsigned int off,
+				    unsigned int count)
+{
+	unsigned int i = off / 64, sh = off % 64;
+	uint64_t v = a->d[i] >> sh;
+
+	if ((sh + count > 64) && (i < 3))
+		v |= a->d[i + 1] << (64 - sh);
+
+	return (unsigned int) (v & ((1ULL << count) - 1));
+}
+
+/* round(a * b / 2^384) */
+static void scalar_mul_shift_384(struct scalar *r, const struct scalar *a,
+				 const struct scalar *b)
+{
+	uint64_t l[8];
+
+	scalar_mul_512(l, a, b);
+
+	uint128_t c = (uint128_t) l[6] + (l[5] >> 63);
+	r->d[0] = (uint64_t) c;
+	c >>= 64;
+	r->d[1] = l[7] + (uint64_t) c;
+	r->d[2] = r->d[3] = 0;
+}
+
+/*
+ * Split k into r1 + r2 * lambda (mod n), with r1 and r2 each at most
+ * 128 bits in absolute value (either may be "negative", near n).
+ */
+static void scalar_split_lambda(struct scalar *r1, struct scalar *r2,
+				const struct scalar *k)
+{
+	struct scalar c1, c2;
+
+	scalar_mul_shift_384(&c1, k, &scalar_g1);
+	scalar_mul_shift_384(&c2, k, &scalar_g2);
+	scalar_mul(&c1, &c1, &scalar_minus_b1);
+	scalar_mul(&c2, &c2, &scalar_minus_b2);
+	scalar_add(r2, &c1, &c2);
+	scalar_mul(r1, r2, &scalar_minus_lambda);
+	scalar_add(r1, r1, k);
+}
+
+/*
+ * Points, in affine and Jacobian (x = X/Z^2, y = Y/Z^3) coordinates,
+ * on y^2 = x^3 + 7.  Jacobian coordinates are kept at magnitude <= 2.
+ */
+struct ge {
+	struct fe	x, y;
+	bool		infinity;
+};
+
+struct gej {
+	struct fe	x, y, z;
+	bool		infinity;
+};
+
+static const struct ge ge_g = {
+	FE_CONST(0x79BE667EUL, 0xF9DCBBACUL, 0x55A06295UL, 0xCE870B07UL,
+		 0x029BFCDBUL, 0x2DCE28D9UL, 0x59F2815BUL, 0x16F81798UL),
+	FE_CONST(0x483ADA77UL, 0x26A3C465UL, 0x5DA4FBFCUL, 0x0E1108A8UL,
+		 0xFD17B448UL, 0xA6855419UL, 0x9C47D08FUL, 0xFB10D4B8UL),
+	false
+};
+
+static void gej_set_ge(struct gej *r, const struct ge *a)
+{
+	r->infinity = a->infinity;
+	r->x = a->x;
+	r->y = a->y;
+	fe_set_int(&r->z, 1);
+}
+
+/* to affine; r normalized */
+static void ge_set_gej(struct ge *r, const struct gej *a)
+{
+	struct fe zi, zi2, zi3;
+
+	r->infinity = a->infinity;
+	if (a->infinity)
+		return;
+
+	fe_inv(&zi, &a->z);
+	fe_sqr(&zi2, &zi);
+	fe_mul(&zi3, &zi2, &zi);
+	fe_mul(&r->x, &a->x, &zi2);
+	fe_mul(&r->y, &a->y, &zi3);
+	fe_normalize(&r->x);
+	fe_normalize(&r->y);
+}
+
+/* many to affine, with a single inversion; none may be infinity */
+static void ge_set_all_gej(struct ge *r, const struct gej *a, size_t len)
+{
+	struct fe *acc = malloc(len * sizeof(*acc));
+	struct fe inv, zi, zi2, zi3;
+	size_t i;
+
+	acc[0] = a[0].z;
+	for (i = 1; i < len; i++)
+		fe_mul(&acc[i], &acc[i - 1], &a[i].z);
+
+	fe_inv(&inv, &acc[len - 1]);
+
+	for (i = len; i-- > 0; ) {
+		if (i > 0) {
+			fe_mul(&zi, &inv, &acc[i - 1]);
+			fe_mul(&inv, &inv, &a[i].z);
+		} else
+			zi = inv;
+
+		fe_sqr(&zi2, &zi);
+		fe_mul(&zi3, &zi2, &zi);
+		fe_mul(&r[i].x, &a[i].x, &zi2);
+		fe_mul(&r[i].y, &a[i].y, &zi3);
+		fe_normalize(&r[i].x);
+		fe_normalize(&r[i].y);
+		r[i].infinity = false;
+	}
+
+	free(acc);
+}
+
+static bool ge_is_valid(const struct ge *a)
+{
+	struct fe y2, x3;
+
+	fe_sqr(&y2, &a->y);
+	fe_sqr(&x3, &a->x);
+	fe_mul(&x3, &x3, &a->x);
+	x3.n[0] += 7;
+	fe_normalize(&y2);
+	fe_normalize(&x3);
+	return fe_equal(&y2, &x3);
+}
+
+/* the point with x coordinate x (normalized), and y of the given parity */
+static bool ge_set_xo(struct ge *r, const struct fe *x, bool odd)
+{
+	struct fe x3;
+
+	r->x = *x;
+	r->infinity = false;
+
+	fe_sqr(&x3, x);
+	fe_mul(&x3, &x3, x);
+	x3.n[0] += 7;
+	if (!fe_sqrt(&r->y, &x3))
+		return false;
+
+	if (fe_is_odd(&r->y) != odd) {
+		fe_negate(&r->y, &r->y, 1);
+		fe_normalize(&r->y);
+	}
+	return true;
+}
+
+static void gej_double(struct gej *r, const struct gej *a)
+{
+	struct fe y2, s, m, y4, x, y, z, t;
+
+	/* no point of order two on this curve: y != 0 */
+	if (a->infinity) {
+		r->infinity = true;
+		return;
+	}
+
+	fe_sqr(&y2, &a->y);
+	fe_mul(&s, &a->x, &y2);
+	fe_mul_int(&s, 4);			/* S = 4XY^2, magnitude 4 */
+	fe_sqr(&m, &a->x);
+	fe_mul_int(&m, 3);			/* M = 3X^2, 3 */
+	fe_sqr(&y4, &y2);
+	fe_mul_int(&y4, 8);			/* 8Y^4, 8 */
+	fe_mul(&z, &a->y, &a->z);
+	fe_mul_int(&z, 2);			/* Z' = 2YZ, 2 */
+
+	fe_sqr(&x, &m);
+	fe_negate(&t, &s, 4);
+	fe_add(&x, &t);
+	fe_add(&x, &t);
+	fe_normalize_weak(&x);			/* X' = M^2 - 2S */
+
+	fe_negate(&t, &x, 1);
+	fe_add(&t, &s);
+	fe_mul(&y, &t, &m);
+	fe_negate(&t, &y4, 8);
+	fe_add(&y, &t);
+	fe_normalize_weak(&y);			/* Y' = M(S - X') - 8Y^4 */
+
+	r->x = x;
+	r->y = y;
+	r->z = z;
+	r->infinity = false;
+}
+
+/*
+ * r = a + b, for h = U2 - U1 and i = S2 - S1 already computed: the
+ * common tail of the addition formulas.  u1 and s1 are magnitude 1.
+ */
+static void gej_add_tail(struct gej *r, const struct fe *u1,
+			 const struct fe *s1, const struct fe *h,
+			 const struct fe *i, const struct fe *z)
+{
+	struct fe h2, h3, t, x, y, n;
+
+	fe_sqr(&h2, h);
+	fe_mul(&h3, h, &h2);
+	fe_mul(&t, u1, &h2);
+
+	fe_sqr(&x, i);
+	fe_negate(&n, &h3, 1);
+	fe_add(&x, &n);
+	fe_negate(&n, &t, 1);
+	fe_add(&x, &n);
+	fe_add(&x, &n);
+	fe_normalize_weak(&x);			/* X3 = I^2 - H^3 - 2 U1 H^2 */
+
+	fe_negate(&y, &x, 1);
+	fe_add(&y, &t);
+	fe_mul(&y, &y, i);
+	fe_mul(&h3, &h3, s1);
+	fe_negate(&n, &h3, 1);
+	fe_add(&y, &n);
+	fe_normalize_weak(&y);			/* Y3 = I(U1 H^2 - X3) - S1 H^3 */
+
+	r->x = x;
+	r->y = y;
+	r->z = *z;
+	r->infinity = false;
+}
+
+/* r = a + b, variable time */
+static void gej_add_var(struct gej *r, const struct gej *a, const struct gej *b)
+{
+	struct fe z12, z22, u1, u2, s1, s2, h, i, z;
+
+	if (a->infinity) {
+		*r = *b;
+		return;
+	}
+	if (b->infinity) {
+		*r = *a;
+		return;
+	}
+
+	fe_sqr(&z12, &a->z);
+	fe_sqr(&z22, &b->z);
+	fe_mul(&u1, &a->x, &z22);
+	fe_mul(&u2, &b->x, &z12);
+	fe_mul(&s1, &a->y, &z22);
+	fe_mul(&s1, &s1, &b->z);
+	fe_mul(&s2, &b->y, &z12);
+	fe_mul(&s2, &s2, &a->z);
+
+	fe_negate(&h, &u1, 1);
+	fe_add(&h, &u2);
+	fe_negate(&i, &s1, 1);
+	fe_add(&i, &s2);
+
+	if (fe_normalizes_to_zero(&h)) {
+		if (fe_normalizes_to_zero(&i))
+			gej_double(r, a);
+		else
+			r->infinity = true;
+		return;
+	}
+
+	fe_mul(&z, &a->z, &b->z);
+	fe_mul(&z, &z, &h);
+	gej_add_tail(r, &u1, &s1, &h, &i, &z);
+}
+
+/*
+ * r = a + b, b affine.  Without the special cases, this is constant
+ * time (gej_add_ge); those are only for callers that rule out a == b,
+ * a == -b and infinities.
+ */
+static void gej_add_ge_common(const struct gej *a, const struct ge *b,
+			      struct fe *h, struct fe *i,
+			      struct fe *u1, struct fe *s1)
+{
+	struct fe z12, u2, s2;
+
+	fe_sqr(&z12, &a->z);
+	fe_mul(&u2, &b->x, &z12);
+	fe_mul(&s2, &b->y, &z12);
+	fe_mul(&s2, &s2, &a->z);
+
+	*u1 = a->x;
+	fe_normalize_weak(u1);
+	*s1 = a->y;
+	fe_normalize_weak(s1);
+
+	fe_negate(h, u1, 1);
+	fe_add(h, &u2);
+	fe_negate(i, s1, 1);
+	fe_add(i, &s2);
+}
+
+static void gej_add_ge_var(struct gej *r, const struct gej *a,
+			   const struct ge *b)
+{
+	struct fe h, i, u1, s1, z;
+
+	if (a->infinity) {
+		gej_set_ge(r, b);
+		return;
+	}
+	if (b->infinity) {
+		*r = *a;
+		return;
+	}
+
+	gej_add_ge_common(a, b, &h, &i, &u1, &s1);
+
+	if (fe_normalizes_to_zero(&h)) {
+		if (fe_normalizes_to_zero(&i))
+			gej_double(r, a);
+		else
+			r->infinity = true;
+		return;
+	}
+
+	fe_mul(&z, &a->z, &h);
+	gej_add_tail(r, &u1, &s1, &h, &i, &z);
+}
+
+static void gej_add_ge(struct gej *r, const struct gej *a, const struct ge *b)
+{
+	struct fe h, i, u1, s1, z;
+
+	gej_add_ge_common(a, b, &h, &i, &u1, &s1);
+	fe_mul(&z, &a->z, &h);
+	gej_add_tail(r, &u1, &s1, &h, &i, &z);
+}
+
+static void gej_neg(struct gej *r, const struct gej *a)
+{
+	*r = *a;
+	fe_normalize_weak(&r->y);
+	fe_negate(&r->y, &r->y, 1);
+}
+
+/*
+ * Verification: a*Q + b*G by Strauss' method over width-w NAFs, with
+ * both scalars split by the endomorphism (lambda*(x,y) = (beta*x, y))
+ * into halves of about 128 bits.  Odd multiples of Q are computed per
+ * call; those of G come from a table built once.
+ */
+enum {
+	WINDOW_A		= 5,
+	WINDOW_G		= 12,
+	TABLE_A			= 1 << (WINDOW_A - 2),
+	TABLE_G			= 1 << (WINDOW_G - 2),
+	WNAF_BITS		= 256,
+
+	/* fixed-base comb, for signing: 4-bit digits */
+	GEN_TEETH		= 4,
+	GEN_DIGITS		= 256 / GEN_TEETH,
+	GEN_VALUES		= 1 << GEN_TEETH,
+
+	/* batch key creation: points per shared inversion */
+	CREATE_BATCH		= 128,
+};
+
+static struct ge ecmult_g_table[TABLE_G];		/* (2i+1)G */
+static struct ge ecmult_gen_table[GEN_DIGITS][GEN_VALUES];
+static pthread_once_t ecc_once = PTHREAD_ONCE_INIT;
+
+/*
+ * wNAF digits of a, least significant first; returns the count.  A
+ * "negative" (high) scalar is negated, and its digits with it.
+ */
+static int ecmult_wnaf(int *wnaf, const struct scalar *a, int w)
+{
+	struct scalar s = *a;
+	int last_set_bit = -1, bit = 0, sign = 1, carry = 0;
+
+	memset(wnaf, 0, WNAF_BITS * sizeof(wnaf[0]));
+
+	if (scalar_is_high(&s)) {
+		scalar_negate(&s, &s);
+		sign = -1;
+	}
+
+	while (bit < WNAF_BITS) {
+		if (scalar_get_bits(&s, bit, 1) == (unsigned int) carry) {
+			bit++;
+			continue;
+		}
+
+		int now = w;
+		if (now > WNAF_BITS - bit)
+			now = WNAF_BITS - bit;
+
+		int word = scalar_get_bits(&s, bit, now) + carry;
+		carry = (word >> (w - 1)) & 1;
+		word -= carry << w;
+
+		wnaf[bit] = sign * word;
+		last_set_bit = bit;
+		bit += now;
+	}
+
+	return last_set_bit + 1;
+}
+
+static void ecmult_odd_multiples(struct gej *pre, const struct gej *a,
+				 unsigned int n)
+{
+	struct gej d;
+	unsigned int i;
+
+	gej_double(&d, a);
+	pre[0] = *a;
+	for (i = 1; i < n; i++)
+		gej_add_var(&pre[i], &pre[i - 1], &d);
+}
+
+static void gej_table_get(struct gej *r, const struct gej *pre, int n)
+{
+	if (n > 0)
+		*r = pre[(n - 1) / 2];
+	else
+		gej_neg(r, &pre[(-n - 1) / 2]);
+}
+
+static void ge_table_get(struct ge *r, const struct ge *pre, int n,
+			 bool lambda)
+{
+	*r = pre[((n > 0 ? n : -n) - 1) / 2];
+	if (lambda)
+		fe_mul(&r->x, &r->x, &fe_beta);
+	if (n < 0)
+		fe_negate(&r->y, &r->y, 1);
+}
+
+/* odd multiples of a point, and of its image under the endomorphism */
+struct ecmult_pre {
+	struct gej	a[TABLE_A];
+	struct gej	a_lam[TABLE_A];
+};
+
+static void ecmult_pre_init(struct ecmult_pre *pre, const struct ge *q)
+{
+	struct gej qj;
+	unsigned int i;
+
+	gej_set_ge(&qj, q);
+	ecmult_odd_multiples(pre->a, &qj, TABLE_A);
+	for (i = 0; i < TABLE_A; i++) {
+		pre->a_lam[i] = pre->a[i];
+		fe_mul(&pre->a_lam[i].x, &pre->a[i].x, &fe_beta);
+	}
+}
+
+static void ecmult(struct gej *r, const struct ecmult_pre *pre,
+		   const struct scalar *na, const struct scalar *ng)
+{
+	struct scalar na1, na2, ng1, ng2;
+	int wnaf_na1[WNAF_BITS], wnaf_na2[WNAF_BITS];
+	int wnaf_ng1[WNAF_BITS], wnaf_ng2[WNAF_BITS];
+	struct gej t;
+	struct ge g;
+	int i, bits;
+
+	scalar_split_lambda(&na1, &na2, na);
+	scalar_split_lambda(&ng1, &ng2, ng);
+
+	int bits_na1 = ecmult_wnaf(wnaf_na1, &na1, WINDOW_A);
+	int bits_na2 = ecmult_wnaf(wnaf_na2, &na2, WINDOW_A);
+	int bits_ng1 = ecmult_wnaf(wnaf_ng1, &ng1, WINDOW_G);
+	int bits_ng2 = ecmult_wnaf(wnaf_ng2, &ng2, WINDOW_G);
+
+	bits = bits_na1;
+	if (bits_na2 > bits)
+		bits = bits_na2;
+	if (bits_ng1 > bits)
+		bits = bits_ng1;
+	if (bits_ng2 > bits)
+		bits = bits_ng2;
+
+	r->infinity = true;
+	for (i = bits - 1; i >= 0; i--) {
+		gej_double(r, r);
+
+		if (wnaf_na1[i]) {
+			gej_table_get(&t, pre->a, wnaf_na1[i]);
+			gej_add_var(r, r, &t);
+		}
+		if (wnaf_na2[i]) {
+			gej_table_get(&t, pre->a_lam, wnaf_na2[i]);
+			gej_add_var(r, r, &t);
+		}
+		if (wnaf_ng1[i]) {
+			ge_table_get(&g, ecmult_g_table, wnaf_ng1[i], false);
+			gej_add_ge_var(r, r, &g);
+		}
+		if (wnaf_ng2[i]) {
+			ge_table_get(&g, ecmult_g_table, wnaf_ng2[i], true);
+			gej_add_ge_var(r, r, &g);
+		}
+	}
+}
+
+/*
+ * Signing: k*G as the sum of one table entry per 4-bit digit of k,
+ * T[i][d] = d*16^i*G + U_i, each picked by a scan of the whole row.
+ * The U_i sum to zero, and keep entries (and partial sums) away from
+ * infinity and from each other, so the constant-time addition formula
+ * applies throughout.  U is a point of unknown discrete log: the x
+ * coordinate is SHA256 of the uncompressed encoding of G.
+ */
+static const unsigned char ecmult_gen_nums_x[32] = {
+	0x50, 0x92, 0x9b, 0x74, 0xc1, 0xa0, 0x49, 0x54,
+	0xb7, 0x8b, 0x4b, 0x60, 0x35, 0xe9, 0x7a, 0x5e,
+	0x07, 0x8a, 0x5a, 0x0f, 0x28, 0xec, 0x96, 0xd5,
+	0x47, 0xbf, 0xee, 0x9a, 0xce, 0x80, 0x3a, 0xc0,
+};
+
+static void ecmult_gen_table_init(void)
+{
+	struct gej *pts = malloc(GEN_DIGITS * GEN_VALUES * sizeof(*pts));
+	struct gej base, u, usum;
+	struct ge nums;
+	struct fe x;
+	unsigned int i, j;
+
+	fe_set_b32(&x, ecmult_gen_nums_x);
+	ge_set_xo(&nums, &x, false);
+
+	gej_set_ge(&base, &ge_g);
+	gej_set_ge(&u, &nums);
+	usum.infinity = true;
+
+	for (i = 0; i < GEN_DIGITS; i++) {
+		struct gej *row = &pts[i * GEN_VALUES];
+
+		if (i == GEN_DIGITS - 1)
+			gej_neg(&row[0], &usum);
+		else
+			row[0] = u;
+		for (j = 1; j < GEN_VALUES; j++)
+			gej_add_var(&row[j], &row[j - 1], &base);
+
+		gej_add_var(&usum, &usum, &u);
+		gej_double(&u, &u);
+		for (j = 0; j < GEN_TEETH; j++)
+			gej_double(&base, &base);
+	}
+
+	ge_set_all_gej(&ecmult_gen_table[0][0], pts, GEN_DIGITS * GEN_VALUES);
+	free(pts);
+}
+
+static void ecc_init(void)
+{
+	struct gej *pts = malloc(TABLE_G * sizeof(*pts));
+	struct gej g;
+
+	gej_set_ge(&g, &ge_g);
+	ecmult_odd_multiples(pts, &g, TABLE_G);
+	ge_set_all_gej(ecmult_g_table, pts, TABLE_G);
+	free(pts);
+
+	ecmult_gen_table_init();
+}
+
+static void ecmult_gen(struct gej *r, const struct scalar *k)
+{
+	struct ge add;
+	unsigned int i, j, l;
+
+	for (i = 0; i < GEN_DIGITS; i++) {
+		unsigned int d = scalar_get_bits(k, i * GEN_TEETH, GEN_TEETH);
+
+		memset(&add, 0, sizeof(add));
+		for (j = 0; j < GEN_VALUES; j++) {
+			const struct ge *e = &ecmult_gen_table[i][j];
+			uint64_t mask = -(uint64_t) (j == d);
+
+			for (l = 0; l < 5; l++) {
+				add.x.n[l] |= e->x.n[l] & mask;
+				add.y.n[l] |= e->y.n[l] & mask;
+			}
+		}
+
+		if (i == 0)
+			gej_set_ge(r, &add);
+		else
+			gej_add_ge(r, r, &add);
+	}
+}
+
+/* message hash to scalar, as OpenSSL: leftmost 256 bits, mod n */
+static void scalar_set_msg(struct scalar *r, const void *data, size_t len)
+{
+	unsigned char buf[32];
+
+	memset(buf, 0, sizeof(buf));
+	if (len > 32)
+		len = 32;
+	memcpy(buf + (32 - len), data, len);
+	scalar_set_b32(r, buf, NULL);
+}
+
+/*
+ * Lax DER, accepting what OpenSSL did before it insisted on strict
+ * encodings: long-form or bogus lengths, leading zeros, and trailing
+ * garbage.  Out of range values parse, as a signature that fails.
+ */
+static bool sig_parse_der_lax(struct scalar *r, struct scalar *s,
+			      const unsigned char *in, size_t len)
+{
+	size_t pos = 0, lenbyte, vpos[2], vlen[2];
+	unsigned int v;
+
+	if (pos == len || in[pos] != 0x30)
+		return false;
+	pos++;
+
+	if (pos == len)
+		return false;
+	lenbyte = in[pos++];
+	if (lenbyte & 0x80) {
+		lenbyte -= 0x80;
+		if (lenbyte > len - pos)
+			return false;
+		pos += lenbyte;
+	}
+
+	for (v = 0; v < 2; v++) {
+		if (pos == len || in[pos] != 0x02)
+			return false;
+		pos++;
+
+		if (pos == len)
+			return false;
+		lenbyte = in[pos++];
+		if (lenbyte & 0x80) {
+			lenbyte -= 0x80;
+			if (lenbyte > len - pos)
+				return false;
+			while (lenbyte > 0 && in[pos] == 0) {
+				pos++;
+				lenbyte--;
+			}
+			if (lenbyte >= sizeof(uint32_t))
+				return false;
+			vlen[v] = 0;
+			while (lenbyte > 0) {
+				vlen[v] = (vlen[v] << 8) + in[pos];
+				pos++;
+				lenbyte--;
+			}
+		} else
+			vlen[v] = lenbyte;
+
+		if (vlen[v] > len - pos)
+			return false;
+		vpos[v] = pos;
+		pos += vlen[v];
+	}
+
+	bool overflow = false;
+	unsigned char buf[2][32];
+	memset(buf, 0, sizeof(buf));
+
+	for (v = 0; v < 2; v++) {
+		while (vlen[v] > 0 && in[vpos[v]] == 0) {
+			vlen[v]--;
+			vpos[v]++;
+		}
+		if (vlen[v] > 32)
+			overflow = true;
+		else
+			memcpy(buf[v] + (32 - vlen[v]), in + vpos[v], vlen[v]);
+	}
+
+	int over_r = 0, over_s = 0;
+	scalar_set_b32(r, buf[0], &over_r);
+	scalar_set_b32(s, buf[1], &over_s);
+	if (overflow || over_r || over_s) {
+		memset(r, 0, sizeof(*r));
+		memset(s, 0, sizeof(*s));
+	}
+
+	return true;
+}
+
+static size_t der_put_int(unsigned char *out, const unsigned char *b32)
+{
+	unsigned int skip = 0;
+
+	while (skip < 31 && b32[skip] == 0)
+		skip++;
+
+	size_t n = 32 - skip, pad = (b32[skip] & 0x80) ? 1 : 0;
+
+	out[0] = 0x02;
+	out[1] = n + pad;
+	out[2] = 0;
+	memcpy(out + 2 + pad, b32 + skip, n);
+	return 2 + pad + n;
+}
+
+static void pubkey_load(struct ge *r, const struct ecc_pubkey *pub)
+{
+	memcpy(r->x.n, pub->x, sizeof(r->x.n));
+	memcpy(r->y.n, pub->y, sizeof(r->y.n));
+	r->infinity = false;
+}
+
+static void pubkey_save(struct ecc_pubkey *pub, const struct ge *a)
+{
+	memcpy(pub->x, a->x.n, sizeof(pub->x));
+	memcpy(pub->y, a->y.n, sizeof(pub->y));
+}
+
+bool ecc_pubkey_parse(struct ecc_pubkey *pub, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	struct ge q;
+	struct fe x, y;
+
+	if (len == ECC_PUBKEY_COMPRESSED && (p[0] == 0x02 || p[0] == 0x03)) {
+		if (!fe_set_b32(&x, p + 1) ||
+		    !ge_set_xo(&q, &x, p[0] == 0x03))
+			return false;
+	}
+
+	/* uncompressed, or hybrid (parity in the prefix, too) */
+	else if (len == ECC_PUBKEY_UNCOMPRESSED &&
+		 (p[0] == 0x04 || p[0] == 0x06 || p[0] == 0x07)) {
+		if (!fe_set_b32(&x, p + 1) || !fe_set_b32(&y, p + 33))
+			return false;
+		if (p[0] != 0x04 && fe_is_odd(&y) != (p[0] == 0x07))
+			return false;
+
+		q.x = x;
+		q.y = y;
+		q.infinity = false;
+		if (!ge_is_valid(&q))
+			return false;
+	}
+
+	else
+		return false;
+
+	pubkey_save(pub, &q);
+	return true;
+}
+
+size_t ecc_pubkey_serialize(unsigned char *out, const struct ecc_pubkey *pub,
+			    bool compressed)
+{
+	struct ge q;
+
+	pubkey_load(&q, pub);
+
+	fe_get_b32(out + 1, &q.x);
+	if (compressed) {
+		out[0] = fe_is_odd(&q.y) ? 0x03 : 0x02;
+		return ECC_PUBKEY_COMPRESSED;
+	}
+
+	out[0] = 0x04;
+	fe_get_b32(out + 33, &q.y);
+	return ECC_PUBKEY_UNCOMPRESSED;
+}
+
+bool ecc_pubkey_create(struct ecc_pubkey *pub, const unsigned char *seckey)
+{
+	struct scalar sec;
+	struct gej rj;
+	struct ge r;
+	int overflow;
+
+	pthread_once(&ecc_once, ecc_init);
+
+	scalar_set_b32(&sec, seckey, &overflow);
+	if (overflow || scalar_is_zero(&sec))
+		return false;
+
+	ecmult_gen(&rj, &sec);
+	ge_set_gej(&r, &rj);
+	pubkey_save(pub, &r);
+
+	memset(&sec, 0, sizeof(sec));
+	return true;
+}
+
+void ecc_msg_get_b32(unsigned char *out, const void *data, size_t data_len)
+{
+	struct scalar e;
+
+	scalar_set_msg(&e, data, data_len);
+	scalar_get_b32(out, &e);
+}
+
+bool ecc_pubkey_create_batch(struct ecc_pubkey *pubs,
+			     const unsigned char *seckeys, size_t n,
+			     bool *results)
+{
+	struct gej rj[CREATE_BATCH];
+	struct ge r[CREATE_BATCH];
+	size_t idx[CREATE_BATCH];
+	size_t i, j, n_ok = 0;
+
+	pthread_once(&ecc_once, ecc_init);
+
+	for (i = 0; i < n; ) {
+		size_t n_pts = 0;
+
+		/* a chunk at a time, with one inversion per chunk */
+		for (; i < n && n_pts < CREATE_BATCH; i++) {
+			struct scalar sec;
+			int overflow;
+
+			scalar_set_b32(&sec, seckeys + i * 32, &overflow);
+			if (results)
+				results[i] = false;
+			if (overflow || scalar_is_zero(&sec))
+				continue;
+
+			ecmult_gen(&rj[n_pts], &sec);
+			idx[n_pts++] = i;
+			memset(&sec, 0, sizeof(sec));
+		}
+
+		if (n_pts == 0)
+			continue;
+
+		ge_set_all_gej(r, rj, n_pts);
+		for (j = 0; j < n_pts; j++) {
+			pubkey_save(&pubs[idx[j]], &r[j]);
+			if (results)
+				results[idx[j]] = true;
+		}
+		n_ok += n_pts;
+	}
+
+	return n_ok == n;
+}
+
+/*
+ * The ECDSA equation, given the public key's tables and 1/s:
+ * x(R) mod n == r, for R = (e/s)G + (r/s)Q
+ */
+static bool ecdsa_check(const struct ecmult_pre *pre, const struct scalar *r,
+			const struct scalar *sn, const struct scalar *e)
+{
+	struct scalar u1, u2;
+	struct gej rj;
+	struct fe xr, rz2;
+	unsigned char buf[32];
+
+	scalar_mul(&u1, e, sn);
+	scalar_mul(&u2, r, sn);
+
+	ecmult(&rj, pre, &u2, &u1);
+	if (rj.infinity)
+		return false;
+
+	/*
+	 * without leaving Jacobian coordinates: compare r * Z^2 with X,
+	 * and also r + n, if that is still below p
+	 */
+	scalar_get_b32(buf, r);
+	fe_set_b32(&xr, buf);
+	fe_sqr(&rz2, &rj.z);
+
+	struct fe t, x = rj.x;
+	fe_normalize(&x);
+
+	fe_mul(&t, &xr, &rz2);
+	fe_normalize(&t);
+	if (fe_equal(&t, &x))
+		return true;
+
+	/* p - n, less one */
+	static const unsigned char p_minus_n[32] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01,
+		0x45, 0x51, 0x23, 0x19, 0x50, 0xb7, 0x5f, 0xc4,
+		0x40, 0x2d, 0xa1, 0x72, 0x2f, 0xc9, 0xba, 0xed,
+	};
+	if (memcmp(buf, p_minus_n, 32) > 0)
+		return false;
+
+	static const struct fe fe_n = FE_CONST(
+		0xFFFFFFFFUL, 0xFFFFFFFFUL, 0xFFFFFFFFUL, 0xFFFFFFFEUL,
+		0xBAAEDCE6UL, 0xAF48A03BUL, 0xBFD25E8CUL, 0xD0364141UL);
+	fe_add(&xr, &fe_n);
+	fe_mul(&t, &xr, &rz2);
+	fe_normalize(&t);
+	return fe_equal(&t, &x);
+}
+
+bool ecc_verify(const struct ecc_pubkey *pub, const void *data,
+		size_t data_len, const void *sig, size_t sig_len)
+{
+	struct scalar r, s, e, sn;
+	struct ecmult_pre pre;
+	struct ge q;
+
+	if (!sig_parse_der_lax(&r, &s, sig, sig_len))
+		return false;
+	if (scalar_is_zero(&r) || scalar_is_zero(&s))
+		return false;
+
+	pthread_once(&ecc_once, ecc_init);
+
+	scalar_set_msg(&e, data, data_len);
+	scalar_inverse_var(&sn, &s);
+
+	pubkey_load(&q, pub);
+	ecmult_pre_init(&pre, &q);
+
+	return ecdsa_check(&pre, &r, &sn, &e);
+}
+
+/*
+ * Batches: the s values are inverted together, by Montgomery's trick
+ * (one inversion, three multiplications each), and items are grouped
+ * by public key, so each key's tables are built once.  ECDSA gives no
+ * y coordinate for R, so the equations themselves cannot be merged
+ * into a single multi-scalar multiplication; each is still checked.
+ */
+struct batch_ent {
+	const struct ecc_verify_item	*item;
+	size_t				idx;
+	struct scalar			r, s, sn;
+};
+
+static int batch_ent_cmp(const void *a_, const void *b_)
+{
+	const struct batch_ent *a = a_, *b = b_;
+
+	if (a->item->pub != b->item->pub)
+		return (a->item->pub < b->item->pub) ? -1 : 1;
+	return (a->idx < b->idx) ? -1 : (a->idx > b->idx);
+}
+
+bool ecc_verify_batch(const struct ecc_verify_item *items, size_t n,
+		      bool *results)
+{
+	struct batch_ent *ents = NULL;
+	struct scalar *acc = NULL;
+	size_t i, n_ents = 0, n_ok = 0;
+
+	if (n == 0)
+		return true;
+
+	ents = malloc(n * sizeof(*ents));
+	acc = malloc(n * sizeof(*acc));
+	if (!ents || !acc) {
+		/* one at a time, then */
+		for (i = 0; i < n; i++) {
+			bool ok = ecc_verify(items[i].pub, items[i].data,
+					     items[i].data_len, items[i].sig,
+					     items[i].sig_len);
+			if (results)
+				results[i] = ok;
+			n_ok += ok;
+		}
+		goto out;
+	}
+
+	pthread_once(&ecc_once, ecc_init);
+
+	for (i = 0; i < n; i++) {
+		struct batch_ent *ent = &ents[n_ents];
+
+		if (results)
+			results[i] = false;
+
+		ent->item = &items[i];
+		ent->idx = i;
+		if (!sig_parse_der_lax(&ent->r, &ent->s, items[i].sig,
+				       items[i].sig_len) ||
+		    scalar_is_zero(&ent->r) || scalar_is_zero(&ent->s))
+			continue;
+
+		if (n_ents == 0)
+			acc[0] = ent->s;
+		else
+			scalar_mul(&acc[n_ents], &acc[n_ents - 1], &ent->s);
+		n_ents++;
+	}
+
+	if (n_ents == 0)
+		goto out;
+
+	struct scalar inv;
+	scalar_inverse_var(&inv, &acc[n_ents - 1]);
+	for (i = n_ents; i-- > 1; ) {
+		scalar_mul(&ents[i].sn, &inv, &acc[i - 1]);
+		scalar_mul(&inv, &inv, &ents[i].s);
+	}
+	ents[0].sn = inv;
+
+	qsort(ents, n_ents, sizeof(*ents), batch_ent_cmp);
+
+	struct ecmult_pre pre;
+	const struct ecc_pubkey *pre_pub = NULL;
+
+	for (i = 0; i < n_ents; i++) {
+		const struct ecc_verify_item *item = ents[i].item;
+		struct scalar e;
+
+		if (item->pub != pre_pub) {
+			struct ge q;
+
+			pubkey_load(&q, item->pub);
+			ecmult_pre_init(&pre, &q);
+			pre_pub = item->pub;
+		}
+
+		scalar_set_msg(&e, item->data, item->data_len);
+		bool ok = ecdsa_check(&pre, &ents[i].r, &ents[i].sn, &e);
+		if (results)
+			results[ents[i].idx] = ok;
+		n_ok += ok;
+	}
+
+out:
+	free(ents);
+	free(acc);
+	return n_ok == n;
+}
+
+bool ecc_sign(unsigned char *sig, size_t *sig_len,
+	      const unsigned char *seckey, const void *data, size_t data_len,
+	      const unsigned char *nonce)
+{
+	struct scalar sec, k, r, s, e, ki;
+	struct gej rj;
+	struct ge rp;
+	unsigned char rb[32], sb[32];
+	int overflow;
+	bool ok = false;
+
+	pthread_once(&ecc_once, ecc_init);
+
+	scalar_set_b32(&sec, seckey, &overflow);
+	if (overflow || scalar_is_zero(&sec))
+		goto out;
+	scalar_set_b32(&k, nonce, &overflow);
+	if (overflow || scalar_is_zero(&k))
+		goto out;
+
+	ecmult_gen(&rj, &k);
+	ge_set_gej(&rp, &rj);
+	fe_get_b32(rb, &rp.x);
+	scalar_set_b32(&r, rb, NULL);
+	if (scalar_is_zero(&r))
+		goto out;
+
+	/* s = (e + r * sec) / k */
+	scalar_set_msg(&e, data, data_len);
+	scalar_mul(&s, &r, &sec);
+	scalar_add(&s, &s, &e);
+	scalar_inverse(&ki, &k);
+	scalar_mul(&s, &s, &ki);
+	if (scalar_is_zero(&s))
+		goto out;
+
+	scalar_get_b32(rb, &r);
+	scalar_get_b32(sb, &s);
+
+	size_t n = 2;
+	n += der_put_int(sig + n, rb);
+	n += der_put_int(sig + n, sb);
+	sig[0] = 0x30;
+	sig[1] = n - 2;
+	*sig_len = n;
+
+	ok = true;
+
+out:
+	memset(&sec, 0, sizeof(sec));
+	memset(&k, 0, sizeof(k));
+	memset(&ki, 0, sizeof(ki));
+	return ok;
+}
+
+#endif /* __SIZEOF_INT128__ */
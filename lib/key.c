@@ -6,11 +6,19 @@
 #include "picocoin-config.h"
 
 #include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include <openssl/ec.h>
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
 #include <openssl/ripemd.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 #include <ccoin/key.h>
+#include <ccoin/ecc.h>
+#include <ccoin/buffer.h>
+
+#ifndef __SIZEOF_INT128__
 
 /* Generate a private key from just the secret parameter */
 static int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
@@ -49,6 +57,81 @@ err:
 	return(ok);
 }
 
+static bool EC_KEY_check_pair(const EC_KEY *eckey)
+{
+	return EC_KEY_check_key(eckey) == 1;
+}
+
+#else /* __SIZEOF_INT128__ */
+
+/* Set secret and public key, the latter computed in-tree (lib/ecc.c) */
+static bool EC_KEY_set_ecc(EC_KEY *eckey, const unsigned char *seckey,
+			   const struct ecc_pubkey *pub)
+{
+	const EC_GROUP *group = EC_KEY_get0_group(eckey);
+	unsigned char buf[ECC_PUBKEY_UNCOMPRESSED];
+	BIGNUM *bn = BN_bin2bn(seckey, 32, NULL);
+	EC_POINT *pub_key = EC_POINT_new(group);
+	bool rc = false;
+
+	if (!bn || !pub_key)
+		goto out;
+
+	ecc_pubkey_serialize(buf, pub, false);
+	if (!EC_POINT_oct2point(group, pub_key, buf, sizeof(buf), NULL))
+		goto out;
+
+	if (!EC_KEY_set_private_key(eckey, bn) ||
+	    !EC_KEY_set_public_key(eckey, pub_key))
+		goto out;
+
+	EC_KEY_set_conv_form(eckey, POINT_CONVERSION_COMPRESSED);
+	rc = true;
+
+out:
+	if (pub_key)
+		EC_POINT_free(pub_key);
+	BN_clear_free(bn);
+	return rc;
+}
+
+/*
+ * As EC_KEY_check_key: the public key is on the curve and, given a
+ * secret, matches it.  Without a generic point multiplication, which
+ * made loading and storing large wallets slow.
+ */
+static bool EC_KEY_check_pair(const EC_KEY *eckey)
+{
+	unsigned char buf[ECC_PUBKEY_UNCOMPRESSED], seckey[32];
+	struct ecc_pubkey pub, pub2;
+
+	const EC_POINT *pt = EC_KEY_get0_public_key(eckey);
+	if (!pt ||
+	    EC_POINT_point2oct(EC_KEY_get0_group(eckey), pt,
+			       POINT_CONVERSION_UNCOMPRESSED,
+			       buf, sizeof(buf), NULL) != sizeof(buf) ||
+	    !ecc_pubkey_parse(&pub, buf, sizeof(buf)))
+		return false;
+
+	const BIGNUM *bn = EC_KEY_get0_private_key(eckey);
+	if (!bn)
+		return true;
+	int n = BN_num_bytes(bn);
+	if (n > (int) sizeof(seckey))
+		return false;
+
+	memset(seckey, 0, sizeof(seckey));
+	BN_bn2bin(bn, seckey + sizeof(seckey) - n);
+
+	bool rc = ecc_pubkey_create(&pub2, seckey) &&
+	     !memcmp(&pub, &pub2, sizeof(pub));
+
+	OPENSSL_cleanse(seckey, sizeof(seckey));
+	return rc;
+}
+
+#endif /* __SIZEOF_INT128__ */
+
 bool bp_key_init(struct bp_key *key)
 {
 	memset(key, 0, sizeof(*key));
@@ -68,6 +151,60 @@ void bp_key_free(struct bp_key *key)
 	}
 }
 
+#ifdef __SIZEOF_INT128__
+
+bool bp_key_generate(struct bp_key *key)
+{
+	return bp_key_generate_batch(key, 1);
+}
+
+bool bp_key_generate_batch(struct bp_key *keys, unsigned int n)
+{
+	if (!n)
+		return true;
+
+	unsigned char *secs = malloc((size_t) n * 32);
+	struct ecc_pubkey *pubs = malloc(n * sizeof(*pubs));
+	bool *ok = malloc(n * sizeof(*ok));
+	bool rc = false;
+	unsigned int i;
+
+	if (!secs || !pubs || !ok)
+		goto out;
+	for (i = 0; i < n; i++)
+		if (!keys[i].k)
+			goto out;
+
+	if (RAND_bytes(secs, n * 32) != 1)
+		goto out;
+
+	/* a secret is out of range with negligible probability; redraw */
+	ecc_pubkey_create_batch(pubs, secs, n, ok);
+	for (i = 0; i < n; i++)
+		while (!ok[i]) {
+			if (RAND_bytes(secs + i * 32, 32) != 1)
+				goto out;
+			ok[i] = ecc_pubkey_create(&pubs[i], secs + i * 32);
+		}
+
+	for (i = 0; i < n; i++)
+		if (!EC_KEY_set_ecc(keys[i].k, secs + i * 32, &pubs[i]))
+			goto out;
+
+	rc = true;
+
+out:
+	if (secs) {
+		OPENSSL_cleanse(secs, (size_t) n * 32);
+		free(secs);
+	}
+	free(pubs);
+	free(ok);
+	return rc;
+}
+
+#else /* __SIZEOF_INT128__ */
+
 bool bp_key_generate(struct bp_key *key)
 {
 	if (!key->k)
@@ -83,12 +220,25 @@ bool bp_key_generate(struct bp_key *key)
 	return true;
 }
 
+bool bp_key_generate_batch(struct bp_key *keys, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (!bp_key_generate(&keys[i]))
+			return false;
+
+	return true;
+}
+
+#endif /* __SIZEOF_INT128__ */
+
 bool bp_privkey_set(struct bp_key *key, const void *privkey_, size_t pk_len)
 {
 	const unsigned char *privkey = privkey_;
 	if (!d2i_ECPrivateKey(&key->k, &privkey, pk_len))
 		return false;
-	if (!EC_KEY_check_key(key->k))
+	if (!EC_KEY_check_pair(key->k))
 		return false;
 
 	EC_KEY_set_conv_form(key->k, POINT_CONVERSION_COMPRESSED);
@@ -121,13 +271,20 @@ bool bp_key_secret_set(struct bp_key *key, const void *privkey_, size_t pk_len)
 	key->k = EC_KEY_new_by_curve_name(NID_secp256k1);
 	if (!key->k)
 		goto err_out;
-	
+
+#ifdef __SIZEOF_INT128__
+	struct ecc_pubkey pub;
+	if (!ecc_pubkey_create(&pub, privkey) ||
+	    !EC_KEY_set_ecc(key->k, privkey, &pub))
+		goto err_out;
+#else
 	if (!EC_KEY_regenerate_key(key->k, bn))
 		goto err_out;
 	if (!EC_KEY_check_key(key->k))
-		return false;
+		goto err_out;
 
 	EC_KEY_set_conv_form(key->k, POINT_CONVERSION_COMPRESSED);
+#endif
 
 	BN_clear_free(bn);
 	return true;
@@ -140,7 +297,7 @@ err_out:
 
 bool bp_privkey_get(struct bp_key *key, void **privkey, size_t *pk_len)
 {
-	if (!EC_KEY_check_key(key->k))
+	if (!EC_KEY_check_pair(key->k))
 		return false;
 
 	size_t sz = i2d_ECPrivateKey(key->k, 0);
@@ -156,7 +313,7 @@ bool bp_privkey_get(struct bp_key *key, void **privkey, size_t *pk_len)
 
 bool bp_pubkey_get(struct bp_key *key, void **pubkey, size_t *pk_len)
 {
-	if (!EC_KEY_check_key(key->k))
+	if (!EC_KEY_check_pair(key->k))
 		return false;
 
 	size_t sz = i2o_ECPublicKey(key->k, 0);
@@ -192,28 +349,472 @@ bool bp_key_secret_get(void *p, size_t len, const struct bp_key *key)
 	return true;
 }
 
+#ifdef __SIZEOF_INT128__
+
+/*
+ * RFC 6979 deterministic nonces: HMAC-DRBG over SHA-256, seeded with
+ * the secret and the message.  HMAC by hand, on the stack.
+ */
+struct rfc6979 {
+	unsigned char	k[32];
+	unsigned char	v[32];
+};
+
+/* out = HMAC(key, v [|| sep] [|| x || h1]); out may alias key or v */
+static void hmac_sha256(unsigned char *out, const unsigned char *key,
+			const unsigned char *v, int sep,
+			const unsigned char *x, const unsigned char *h1)
+{
+	unsigned char pad[64], md[SHA256_DIGEST_LENGTH];
+	SHA256_CTX ctx;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] = (i < 32 ? key[i] : 0) ^ 0x36;
+
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, pad, sizeof(pad));
+	SHA256_Update(&ctx, v, 32);
+	if (sep >= 0) {
+		unsigned char b = sep;
+		SHA256_Update(&ctx, &b, 1);
+	}
+	if (x) {
+		SHA256_Update(&ctx, x, 32);
+		SHA256_Update(&ctx, h1, 32);
+	}
+	SHA256_Final(md, &ctx);
+
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, pad, sizeof(pad));
+	SHA256_Update(&ctx, md, sizeof(md));
+	SHA256_Final(out, &ctx);
+
+	OPENSSL_cleanse(pad, sizeof(pad));
+	OPENSSL_cleanse(&ctx, sizeof(ctx));
+}
+
+static void rfc6979_init(struct rfc6979 *rng, const unsigned char *x,
+			 const unsigned char *h1)
+{
+	memset(rng->v, 0x01, sizeof(rng->v));
+	memset(rng->k, 0x00, sizeof(rng->k));
+
+	hmac_sha256(rng->k, rng->k, rng->v, 0x00, x, h1);
+	hmac_sha256(rng->v, rng->k, rng->v, -1, NULL, NULL);
+	hmac_sha256(rng->k, rng->k, rng->v, 0x01, x, h1);
+	hmac_sha256(rng->v, rng->k, rng->v, -1, NULL, NULL);
+}
+
+/* next candidate nonce; retry if the previous one was unusable */
+static void rfc6979_next(struct rfc6979 *rng, unsigned char *nonce,
+			 bool retry)
+{
+	if (retry) {
+		hmac_sha256(rng->k, rng->k, rng->v, 0x00, NULL, NULL);
+		hmac_sha256(rng->v, rng->k, rng->v, -1, NULL, NULL);
+	}
+
+	hmac_sha256(rng->v, rng->k, rng->v, -1, NULL, NULL);
+	memcpy(nonce, rng->v, 32);
+}
+
+bool bp_signer_init(struct bp_signer *signer, const struct bp_key *key)
+{
+	memset(signer, 0, sizeof(*signer));
+	signer->key = key;
+
+	return bp_key_secret_get(signer->seckey, sizeof(signer->seckey), key);
+}
+
+bool bp_signer_sign(struct bp_signer *signer, const void *data,
+		    size_t data_len, unsigned char *sig, size_t *sig_len)
+{
+	unsigned char h1[32], nonce[32];
+	struct rfc6979 rng;
+	bool rc = false;
+	unsigned int i;
+
+	ecc_msg_get_b32(h1, data, data_len);
+	rfc6979_init(&rng, signer->seckey, h1);
+
+	/* a nonce is unusable with negligible probability; take the next */
+	for (i = 0; i < 8 && !rc; i++) {
+		rfc6979_next(&rng, nonce, i > 0);
+		rc = ecc_sign(sig, sig_len, signer->seckey, data, data_len,
+			      nonce);
+	}
+
+	OPENSSL_cleanse(&rng, sizeof(rng));
+	OPENSSL_cleanse(nonce, sizeof(nonce));
+	return rc;
+}
+
+bool bp_verify(struct bp_key *key, const void *data, size_t data_len,
+	       const void *sig, size_t sig_len)
+{
+	unsigned char pub[ECC_PUBKEY_UNCOMPRESSED];
+	struct ecc_pubkey epub;
+
+	const EC_POINT *pt = EC_KEY_get0_public_key(key->k);
+	if (!pt ||
+	    EC_POINT_point2oct(EC_KEY_get0_group(key->k), pt,
+			       POINT_CONVERSION_UNCOMPRESSED,
+			       pub, sizeof(pub), NULL) != sizeof(pub))
+		return false;
+	if (!ecc_pubkey_parse(&epub, pub, sizeof(pub)))
+		return false;
+
+	return ecc_verify(&epub, data, data_len, sig, sig_len);
+}
+
+#else /* __SIZEOF_INT128__ */
+
+bool bp_signer_init(struct bp_signer *signer, const struct bp_key *key)
+{
+	memset(signer, 0, sizeof(*signer));
+	signer->key = key;
+
+	return key->k && ECDSA_size(key->k) <= BP_SIG_MAX;
+}
+
+/* OpenSSL's nonces: random, not RFC 6979 */
+bool bp_signer_sign(struct bp_signer *signer, const void *data,
+		    size_t data_len, unsigned char *sig, size_t *sig_len)
+{
+	unsigned int sig_sz_out = BP_SIG_MAX;
+
+	if (ECDSA_sign(0, data, data_len, sig, &sig_sz_out,
+		       signer->key->k) != 1)
+		return false;
+
+	*sig_len = sig_sz_out;
+	return true;
+}
+
+bool bp_verify(struct bp_key *key, const void *data, size_t data_len,
+	       const void *sig, size_t sig_len)
+{
+	return ECDSA_verify(0, data, data_len, sig, sig_len, key->k) == 1;
+}
+
+#endif /* __SIZEOF_INT128__ */
+
+/* the public key as serialized for the key's form, cached */
+bool bp_signer_pubkey(struct bp_signer *signer, const void **pubkey,
+		      size_t *pk_len)
+{
+	if (!signer->pub_len) {
+		unsigned char *p = signer->pub;
+		int len = i2o_ECPublicKey(signer->key->k, NULL);
+
+		if (len <= 0 || len > (int) sizeof(signer->pub) ||
+		    i2o_ECPublicKey(signer->key->k, &p) != len)
+			return false;
+		signer->pub_len = len;
+	}
+
+	*pubkey = signer->pub;
+	*pk_len = signer->pub_len;
+	return true;
+}
+
+void bp_signer_free(struct bp_signer *signer)
+{
+	OPENSSL_cleanse(signer, sizeof(*signer));
+}
+
 bool bp_sign(struct bp_key *key, const void *data, size_t data_len,
 	     void **sig_, size_t *sig_len_)
 {
-	size_t sig_sz = ECDSA_size(key->k);
-	void *sig = calloc(1, sig_sz);
-	unsigned int sig_sz_out = sig_sz;
+	struct bp_signer signer;
+	unsigned char *sig = NULL;
+	size_t sig_len;
+	bool rc = false;
+
+	if (!bp_signer_init(&signer, key))
+		goto out;
+
+	sig = malloc(BP_SIG_MAX);
+	if (sig)
+		rc = bp_signer_sign(&signer, data, data_len, sig, &sig_len);
+
+out:
+	bp_signer_free(&signer);
 
-	int src = ECDSA_sign(0, data, data_len, sig, &sig_sz_out, key->k);
-	if (src != 1) {
+	if (!rc) {
 		free(sig);
 		return false;
 	}
 
 	*sig_ = sig;
-	*sig_len_ = sig_sz_out;
+	*sig_len_ = sig_len;
 
 	return true;
 }
 
-bool bp_verify(struct bp_key *key, const void *data, size_t data_len,
-	       const void *sig, size_t sig_len)
+/*
+ * Cache of decoded public keys, for signature verification.  Decoding
+ * a key (point decompression, for compressed keys) costs a good part
+ * of a verification, and keys are reused heavily.
+ *
+ * Bounded, with the least recently used key evicted first.  Entries
+ * are refcounted, so a key may be evicted while another thread is
+ * verifying with it; a cached key is only ever read.
+ */
+struct pubkey_ent {
+	struct buffer		pub;		/* serialized key, in bytes[] */
+#ifdef __SIZEOF_INT128__
+	struct ecc_pubkey	key;
+#else
+	struct bp_key		key;
+#endif
+	unsigned int		refs;
+	struct pubkey_ent	*prev;		/* LRU list, newest first */
+	struct pubkey_ent	*next;
+	unsigned char		bytes[];
+};
+
+static pthread_mutex_t pubkey_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *pubkey_cache;
+static struct pubkey_ent *pubkey_lru_head, *pubkey_lru_tail;
+
+static void pubkey_ent_free(struct pubkey_ent *ent)
 {
-	return ECDSA_verify(0, data, data_len, sig, sig_len, key->k) == 1;
+#ifndef __SIZEOF_INT128__
+	bp_key_free(&ent->key);
+#endif
+	free(ent);
+}
+
+static bool pubkey_ent_decode(struct pubkey_ent *ent)
+{
+#ifdef __SIZEOF_INT128__
+	return ecc_pubkey_parse(&ent->key, ent->pub.p, ent->pub.len);
+#else
+	return bp_key_init(&ent->key) &&
+	       bp_pubkey_set(&ent->key, ent->pub.p, ent->pub.len);
+#endif
+}
+
+static void pubkey_lru_unlink(struct pubkey_ent *ent)
+{
+	if (ent->prev)
+		ent->prev->next = ent->next;
+	else
+		pubkey_lru_head = ent->next;
+	if (ent->next)
+		ent->next->prev = ent->prev;
+	else
+		pubkey_lru_tail = ent->prev;
+
+	ent->prev = ent->next = NULL;
+}
+
+static void pubkey_lru_push(struct pubkey_ent *ent)
+{
+	ent->prev = NULL;
+	ent->next = pubkey_lru_head;
+	if (pubkey_lru_head)
+		pubkey_lru_head->prev = ent;
+	else
+		pubkey_lru_tail = ent;
+	pubkey_lru_head = ent;
+}
+
+static void pubkey_ent_put(struct pubkey_ent *ent)
+{
+	pthread_mutex_lock(&pubkey_cache_lock);
+	bool last = (--ent->refs == 0);
+	pthread_mutex_unlock(&pubkey_cache_lock);
+
+	if (last)
+		pubkey_ent_free(ent);
+}
+
+static struct pubkey_ent *pubkey_cache_get(const void *pubkey, size_t pk_len)
+{
+	struct buffer lookup = { (void *) pubkey, pk_len };
+	struct pubkey_ent *ent;
+
+	pthread_mutex_lock(&pubkey_cache_lock);
+
+	if (!pubkey_cache)
+		pubkey_cache = g_hash_table_new(buffer_hash, buffer_equal);
+
+	ent = g_hash_table_lookup(pubkey_cache, &lookup);
+	if (ent) {
+		ent->refs++;
+		pubkey_lru_unlink(ent);
+		pubkey_lru_push(ent);
+	}
+
+	pthread_mutex_unlock(&pubkey_cache_lock);
+
+	if (ent)
+		return ent;
+
+	/* decode outside the lock; invalid keys are not cached */
+	struct pubkey_ent *new_ent = calloc(1, sizeof(*new_ent) + pk_len);
+	if (!new_ent)
+		return NULL;
+	memcpy(new_ent->bytes, pubkey, pk_len);
+	new_ent->pub.p = new_ent->bytes;
+	new_ent->pub.len = pk_len;
+	new_ent->refs = 1;
+
+	if (!pubkey_ent_decode(new_ent)) {
+		pubkey_ent_free(new_ent);
+		return NULL;
+	}
+
+	struct pubkey_ent *old = NULL;
+
+	pthread_mutex_lock(&pubkey_cache_lock);
+
+	/* lost a race to decode it? */
+	ent = g_hash_table_lookup(pubkey_cache, &lookup);
+	if (ent)
+		ent->refs++;
+	else {
+		ent = new_ent;
+		new_ent = NULL;
+
+		if (g_hash_table_size(pubkey_cache) >= BP_PUBKEY_CACHE_MAX) {
+			old = pubkey_lru_tail;
+			pubkey_lru_unlink(old);
+			g_hash_table_remove(pubkey_cache, &old->pub);
+			if (--old->refs)
+				old = NULL;
+		}
+
+		g_hash_table_insert(pubkey_cache, &ent->pub, ent);
+		pubkey_lru_push(ent);
+		ent->refs++;			/* the cache's reference */
+	}
+
+	pthread_mutex_unlock(&pubkey_cache_lock);
+
+	if (new_ent)
+		pubkey_ent_free(new_ent);
+	if (old)
+		pubkey_ent_free(old);
+	return ent;
 }
 
+bool bp_pubkey_verify(const void *pubkey, size_t pk_len,
+		      const void *data, size_t data_len,
+		      const void *sig, size_t sig_len)
+{
+	if (!pubkey || !pk_len)
+		return false;
+
+	struct pubkey_ent *ent = pubkey_cache_get(pubkey, pk_len);
+	if (!ent)
+		return false;
+
+#ifdef __SIZEOF_INT128__
+	bool rc = ecc_verify(&ent->key, data, data_len, sig, sig_len);
+#else
+	bool rc = bp_verify(&ent->key, data, data_len, sig, sig_len);
+#endif
+
+	pubkey_ent_put(ent);
+	return rc;
+}
+
+bool bp_pubkey_verify_batch(const struct bp_verify_item *items,
+			    unsigned int n, bool *results)
+{
+	unsigned int i, n_ok = 0;
+
+#ifdef __SIZEOF_INT128__
+	struct pubkey_ent **ents = calloc(n, sizeof(*ents));
+	struct ecc_verify_item *eitems = calloc(n, sizeof(*eitems));
+	unsigned int *eidx = calloc(n, sizeof(*eidx));
+	bool *eresults = calloc(n, sizeof(*eresults));
+	unsigned int n_eitems = 0;
+
+	if (!n || !ents || !eitems || !eidx || !eresults)
+		goto one_by_one;
+
+	/* keys via the cache: one ecc_pubkey per distinct key */
+	for (i = 0; i < n; i++) {
+		const struct bp_verify_item *item = &items[i];
+
+		if (results)
+			results[i] = false;
+		if (!item->pubkey || !item->pk_len)
+			continue;
+		ents[i] = pubkey_cache_get(item->pubkey, item->pk_len);
+		if (!ents[i])
+			continue;
+
+		struct ecc_verify_item *ei = &eitems[n_eitems];
+		ei->pub = &ents[i]->key;
+		ei->data = item->data;
+		ei->data_len = item->data_len;
+		ei->sig = item->sig;
+		ei->sig_len = item->sig_len;
+		eidx[n_eitems++] = i;
+	}
+
+	ecc_verify_batch(eitems, n_eitems, eresults);
+
+	for (i = 0; i < n_eitems; i++) {
+		if (results)
+			results[eidx[i]] = eresults[i];
+		n_ok += eresults[i];
+	}
+
+	for (i = 0; i < n; i++)
+		if (ents[i])
+			pubkey_ent_put(ents[i]);
+
+	goto out;
+
+one_by_one:
+#endif
+	for (i = 0; i < n; i++) {
+		const struct bp_verify_item *item = &items[i];
+		bool ok = bp_pubkey_verify(item->pubkey, item->pk_len,
+					   item->data, item->data_len,
+					   item->sig, item->sig_len);
+		if (results)
+			results[i] = ok;
+		n_ok += ok;
+	}
+
+#ifdef __SIZEOF_INT128__
+out:
+	free(ents);
+	free(eitems);
+	free(eidx);
+	free(eresults);
+#endif
+	return n_ok == n;
+}
+
+void bp_pubkey_cache_clear(void)
+{
+	pthread_mutex_lock(&pubkey_cache_lock);
+
+	struct pubkey_ent *ent = pubkey_lru_head, *next;
+	pubkey_lru_head = pubkey_lru_tail = NULL;
+	if (pubkey_cache)
+		g_hash_table_remove_all(pubkey_cache);
+
+	for (; ent; ent = next) {
+		next = ent->next;
+		ent->prev = ent->next = NULL;
+		if (--ent->refs)
+			ent = NULL;		/* still in use */
+		else
+			pubkey_ent_free(ent);
+	}
+
+	pthread_mutex_unlock(&pubkey_cache_lock);
+}
@@ -11,6 +11,93 @@
 #include <ccoin/buffer.h>
 #include <ccoin/util.h>
 
+enum {
+	BPKS_FILTER_MIN_BLOCKS	= 64,
+	BPKS_FILTER_MIN_SHIFT	= 64 - 6,
+	BPKS_FILTER_LOAD	= 4,		/* items per block, at most */
+};
+
+static uint64_t bpks_filter_hash(const void *data, size_t data_len)
+{
+	uint64_t v = 0;
+
+	/* keys and key hashes end in uniformly random bytes */
+	if (data_len >= sizeof(v))
+		memcpy(&v, (const unsigned char *) data + data_len - sizeof(v),
+		       sizeof(v));
+	else
+		memcpy(&v, data, data_len);
+
+	return v * 0x9e3779b97f4a7c15ULL;
+}
+
+/* four bits within the block; the block index is the top bits */
+static uint64_t bpks_filter_bits(uint64_t h)
+{
+	return (1ULL << (h & 63)) | (1ULL << ((h >> 6) & 63)) |
+	       (1ULL << ((h >> 12) & 63)) | (1ULL << ((h >> 18) & 63));
+}
+
+static void bpks_filter_add(struct bp_keyset *ks, const void *data,
+			    size_t data_len)
+{
+	uint64_t h = bpks_filter_hash(data, data_len);
+
+	ks->filter[h >> ks->filter_shift] |= bpks_filter_bits(h);
+	ks->filter_n++;
+}
+
+static bool bpks_filter_contains(const struct bp_keyset *ks,
+				 const void *data, size_t data_len)
+{
+	if (!ks->filter)
+		return false;
+
+	uint64_t h = bpks_filter_hash(data, data_len);
+	uint64_t bits = bpks_filter_bits(h);
+
+	return (ks->filter[h >> ks->filter_shift] & bits) == bits;
+}
+
+static void bpks_filter_add_buf(gpointer key, gpointer value, gpointer data)
+{
+	struct buffer *buf = key;
+
+	bpks_filter_add(data, buf->p, buf->len);
+}
+
+/* make room for n_new more items, rebuilding at twice the size */
+static bool bpks_filter_reserve(struct bp_keyset *ks, unsigned int n_new)
+{
+	unsigned int want = ks->filter_n + n_new;
+
+	if (ks->filter && want <= ks->filter_blocks * BPKS_FILTER_LOAD)
+		return true;
+
+	unsigned int blocks = BPKS_FILTER_MIN_BLOCKS;
+	unsigned int shift = BPKS_FILTER_MIN_SHIFT;
+	while (blocks * (BPKS_FILTER_LOAD / 2) < want) {
+		blocks <<= 1;
+		shift--;
+	}
+
+	/* an overfull filter still has no false negatives */
+	uint64_t *filter = calloc(blocks, sizeof(*filter));
+	if (!filter)
+		return ks->filter != NULL;
+
+	free(ks->filter);
+	ks->filter = filter;
+	ks->filter_blocks = blocks;
+	ks->filter_shift = shift;
+	ks->filter_n = 0;
+
+	g_hash_table_foreach(ks->pub, bpks_filter_add_buf, ks);
+	g_hash_table_foreach(ks->pubhash, bpks_filter_add_buf, ks);
+
+	return true;
+}
+
 void bpks_init(struct bp_keyset *ks)
 {
 	memset(ks, 0, sizeof(*ks));
@@ -26,6 +113,8 @@ bool bpks_add(struct bp_keyset *ks, struct bp_key *key)
 	void *pubkey = NULL;
 	size_t pk_len = 0;
 
+	if (!bpks_filter_reserve(ks, 2))
+		return false;
 	if (!bp_pubkey_get(key, &pubkey, &pk_len))
 		return false;
 
@@ -41,6 +130,9 @@ bool bpks_add(struct bp_keyset *ks, struct bp_key *key)
 	g_hash_table_replace(ks->pub, buf_pk, buf_pk);
 	g_hash_table_replace(ks->pubhash, buf_pkhash, buf_pkhash);
 
+	bpks_filter_add(ks, pubkey, pk_len);
+	bpks_filter_add(ks, md160, sizeof(md160));
+
 	return true;
 }
 
@@ -50,6 +142,9 @@ bool bpks_lookup(const struct bp_keyset *ks, const void *data, size_t data_len,
 	struct const_buffer buf = { data, data_len };
 	GHashTable *ht;
 
+	if (!bpks_filter_contains(ks, data, data_len))
+		return false;
+
 	if (is_pubkeyhash)
 		ht = ks->pubhash;
 	else
@@ -62,5 +157,7 @@ void bpks_free(struct bp_keyset *ks)
 {
 	g_hash_table_unref(ks->pub);
 	g_hash_table_unref(ks->pubhash);
+	free(ks->filter);
+	ks->filter = NULL;
 }
 
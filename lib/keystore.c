@@ -56,8 +56,9 @@ bool bkeys_add(struct bp_keystore *ks, struct bp_key *key)
 	return true;
 }
 
-bool bkeys_key_get(struct bp_keystore *ks, const bu160_t *key_id,
-		   struct bp_key *key_out)
+/* key_out is a reference to the stored key: do not bp_key_free() it */
+bool bkeys_privkey_get(struct bp_keystore *ks, const bu160_t *key_id,
+		       struct bp_key *key_out)
 {
 	struct bp_key *tmp = g_hash_table_lookup(ks->keys, key_id);
 	if (!tmp)
@@ -71,9 +72,8 @@ bool bkeys_pubkey_append(struct bp_keystore *ks, const bu160_t *key_id,
 			 GString *scriptSig)
 {
 	struct bp_key key;
-	bp_key_init(&key);
 
-	if (!bkeys_key_get(ks, key_id, &key))
+	if (!bkeys_privkey_get(ks, key_id, &key))
 		return false;
 
 	void *pubkey = NULL;
@@ -86,7 +86,7 @@ bool bkeys_pubkey_append(struct bp_keystore *ks, const bu160_t *key_id,
 
 	free(pubkey);
 	
-	/* no bp_key_free(&key), as bkeys_key_get() returns a ref */
+	/* no bp_key_free(&key), as bkeys_privkey_get() returns a ref */
 	return true;
 }
 
@@ -0,0 +1,392 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <ccoin/mempool.h>
+#include <ccoin/script.h>
+#include <ccoin/serialize.h>
+#include <ccoin/util.h>
+
+static guint outpt_hash(gconstpointer key_)
+{
+	const struct bp_outpt *key = key_;
+
+	return (guint) key->hash.dword[4] ^ key->n;
+}
+
+static gboolean outpt_equal(gconstpointer a, gconstpointer b)
+{
+	return bp_outpt_equal(a, b);
+}
+
+static void mempool_ent_free(gpointer data)
+{
+	struct mempool_ent *ent = data;
+
+	bp_tx_free(&ent->tx);
+	free(ent);
+}
+
+/*
+ * fee-rate index: binary min-heap, cheapest transaction at the root.
+ * Among equal fee rates, the newest is evicted first.
+ */
+
+static bool heap_less(const struct mempool_ent *a,
+		      const struct mempool_ent *b)
+{
+	if (a->fee_rate != b->fee_rate)
+		return a->fee_rate < b->fee_rate;
+	return a->nTime > b->nTime;
+}
+
+static void heap_set(GPtrArray *h, unsigned int idx, struct mempool_ent *ent)
+{
+	h->pdata[idx] = ent;
+	ent->heap_idx = idx;
+}
+
+static void heap_sift_up(GPtrArray *h, unsigned int idx)
+{
+	struct mempool_ent *ent = g_ptr_array_index(h, idx);
+
+	while (idx > 0) {
+		unsigned int parent = (idx - 1) / 2;
+		struct mempool_ent *p = g_ptr_array_index(h, parent);
+		if (!heap_less(ent, p))
+			break;
+
+		heap_set(h, idx, p);
+		idx = parent;
+	}
+
+	heap_set(h, idx, ent);
+}
+
+static void heap_sift_down(GPtrArray *h, unsigned int idx)
+{
+	struct mempool_ent *ent = g_ptr_array_index(h, idx);
+
+	while (true) {
+		unsigned int child = (idx * 2) + 1;
+		if (child >= h->len)
+			break;
+
+		struct mempool_ent *c = g_ptr_array_index(h, child);
+		if (child + 1 < h->len) {
+			struct mempool_ent *c2 = g_ptr_array_index(h, child + 1);
+			if (heap_less(c2, c)) {
+				child++;
+				c = c2;
+			}
+		}
+		if (!heap_less(c, ent))
+			break;
+
+		heap_set(h, idx, c);
+		idx = child;
+	}
+
+	heap_set(h, idx, ent);
+}
+
+static void heap_push(GPtrArray *h, struct mempool_ent *ent)
+{
+	g_ptr_array_add(h, ent);
+	heap_sift_up(h, h->len - 1);
+}
+
+static void heap_remove(GPtrArray *h, struct mempool_ent *ent)
+{
+	unsigned int idx = ent->heap_idx;
+	struct mempool_ent *last = g_ptr_array_index(h, h->len - 1);
+
+	g_ptr_array_set_size(h, h->len - 1);
+	if (last == ent)
+		return;
+
+	heap_set(h, idx, last);
+	heap_sift_up(h, idx);
+	heap_sift_down(h, last->heap_idx);
+}
+
+void mempool_init(struct mempool *mp, struct bp_utxo_set *uset,
+		  unsigned int height, size_t max_bytes)
+{
+	memset(mp, 0, sizeof(*mp));
+
+	mp->uset = uset;
+	mp->flags = SCRIPT_VERIFY_P2SH;
+	mp->height = height;
+	mp->max_bytes = max_bytes;
+
+	mp->map_tx = g_hash_table_new_full(g_bu256_hash, g_bu256_equal,
+					   NULL, mempool_ent_free);
+	mp->map_spent = g_hash_table_new(outpt_hash, outpt_equal);
+	mp->by_fee = g_ptr_array_new();
+}
+
+void mempool_free(struct mempool *mp)
+{
+	if (!mp)
+		return;
+
+	if (mp->by_fee) {
+		g_ptr_array_free(mp->by_fee, TRUE);
+		mp->by_fee = NULL;
+	}
+	if (mp->map_spent) {
+		g_hash_table_unref(mp->map_spent);
+		mp->map_spent = NULL;
+	}
+	if (mp->map_tx) {
+		g_hash_table_unref(mp->map_tx);
+		mp->map_tx = NULL;
+	}
+}
+
+/* find the coins an input spends: an unconfirmed parent, or the UTXO set */
+static bool mempool_prevout(struct mempool *mp, const struct bp_outpt *outpt,
+			    struct bp_utxo *tmp, const struct bp_utxo **coin)
+{
+	struct mempool_ent *parent = mempool_lookup(mp, &outpt->hash);
+
+	if (parent) {
+		if (outpt->n >= parent->tx.vout->len)
+			return false;
+
+		/* shallow view of parent outputs; not to be freed */
+		bp_utxo_init(tmp);
+		bu256_copy(&tmp->hash, &parent->tx.sha256);
+		tmp->version = parent->tx.nVersion;
+		tmp->vout = parent->tx.vout;
+
+		*coin = tmp;
+		return true;
+	}
+
+	if (!mp->uset || bp_utxo_is_spent(mp->uset, outpt))
+		return false;
+
+	*coin = bp_utxo_lookup(mp->uset, &outpt->hash);
+	return true;
+}
+
+static bool mempool_check_inputs(struct mempool *mp, struct mempool_ent *ent)
+{
+	struct bp_tx *tx = &ent->tx;
+	int64_t value_in = 0, value_out = 0;
+	unsigned int i;
+
+	/* candidates for the next block, at the tip height plus one */
+	unsigned int spend_height = mp->height + 1;
+
+	/* resolve inputs, and reject conflicts, before any
+	 * signature checking
+	 */
+	for (i = 0; i < tx->vin->len; i++) {
+		struct bp_txin *txin = g_ptr_array_index(tx->vin, i);
+		const struct bp_utxo *coin;
+		struct bp_utxo tmp;
+
+		if (mempool_spender(mp, &txin->prevout))
+			return false;	/* double spend */
+
+		if (!mempool_prevout(mp, &txin->prevout, &tmp, &coin))
+			return false;
+
+		/* coinbase outputs are spendable only once buried */
+		if (coin->is_coinbase &&
+		    (spend_height < coin->height + COINBASE_MATURITY))
+			return false;
+
+		struct bp_txout *txout = g_ptr_array_index(coin->vout,
+							   txin->prevout.n);
+		value_in += txout->nValue;
+		if (!bp_valid_value(txout->nValue) ||
+		    !bp_valid_value(value_in))
+			return false;
+	}
+
+	for (i = 0; i < tx->vout->len; i++) {
+		struct bp_txout *txout = g_ptr_array_index(tx->vout, i);
+
+		value_out += txout->nValue;
+	}
+
+	if (value_in < value_out)
+		return false;
+
+	for (i = 0; i < tx->vin->len; i++) {
+		struct bp_txin *txin = g_ptr_array_index(tx->vin, i);
+		const struct bp_utxo *coin;
+		struct bp_utxo tmp;
+
+		mempool_prevout(mp, &txin->prevout, &tmp, &coin);
+		if (!bp_verify_sig(coin, tx, i, mp->flags, 0))
+			return false;
+	}
+
+	ent->fee = value_in - value_out;
+	return true;
+}
+
+static void mempool_link(struct mempool *mp, struct mempool_ent *ent)
+{
+	g_hash_table_insert(mp->map_tx, &ent->tx.sha256, ent);
+
+	unsigned int i;
+	for (i = 0; i < ent->tx.vin->len; i++) {
+		struct bp_txin *txin = g_ptr_array_index(ent->tx.vin, i);
+
+		g_hash_table_insert(mp->map_spent, &txin->prevout, ent);
+	}
+
+	heap_push(mp->by_fee, ent);
+	mp->mem_bytes += ent->mem;
+}
+
+void mempool_remove(struct mempool *mp, const bu256_t *hash_in,
+		    bool descendants)
+{
+	bu256_t hash;
+	bu256_copy(&hash, hash_in);	/* may point into the entry */
+
+	struct mempool_ent *ent = mempool_lookup(mp, &hash);
+	if (!ent)
+		return;
+
+	unsigned int i;
+
+	/* children cannot be valid without their parent */
+	if (descendants) {
+		for (i = 0; i < ent->tx.vout->len; i++) {
+			struct bp_outpt outpt = { .n = i };
+			bu256_copy(&outpt.hash, &hash);
+
+			struct mempool_ent *child = mempool_spender(mp, &outpt);
+			if (child)
+				mempool_remove(mp, &child->tx.sha256, true);
+		}
+	}
+
+	for (i = 0; i < ent->tx.vin->len; i++) {
+		struct bp_txin *txin = g_ptr_array_index(ent->tx.vin, i);
+
+		g_hash_table_remove(mp->map_spent, &txin->prevout);
+	}
+
+	heap_remove(mp->by_fee, ent);
+	mp->mem_bytes -= ent->mem;
+
+	g_hash_table_remove(mp->map_tx, &hash);
+}
+
+/*
+ * Validate a transaction against the UTXO set and the pool, then add a
+ * copy of it.  When the pool exceeds its memory cap, the lowest fee-rate
+ * transactions are evicted, along with their descendants; this may
+ * include the new transaction itself, in which case it is refused.
+ */
+bool mempool_add(struct mempool *mp, const struct bp_tx *tx)
+{
+	if (!bp_tx_valid(tx) || bp_tx_coinbase(tx))
+		return false;
+
+	/* must be minable in the next block */
+	if (!bp_tx_final(tx, mp->height + 1, time(NULL)))
+		return false;
+
+	GString *s = g_string_sized_new(bp_tx_ser_size(tx));
+	ser_bp_tx(s, tx);
+
+	bu256_t hash;
+	bu_Hash((unsigned char *) &hash, s->str, s->len);
+
+	struct mempool_ent *ent = NULL;
+	bool rc = false;
+
+	if (mempool_lookup(mp, &hash))
+		goto out;
+
+	/* private copy of the transaction, with its hash */
+	ent = calloc(1, sizeof(*ent));
+	bp_tx_init(&ent->tx);
+
+	struct const_buffer buf = { s->str, s->len };
+	if (!deser_bp_tx(&ent->tx, &buf))
+		goto out;
+
+	bu256_copy(&ent->tx.sha256, &hash);
+	ent->tx.sha256_valid = true;
+
+	if (!mempool_check_inputs(mp, ent))
+		goto out;
+
+	ent->size = s->len;
+	ent->fee_rate = (uint64_t) ent->fee * 1000 / ent->size;
+	ent->nTime = time(NULL);
+
+	/* rough in-memory footprint: parsed tx is several times its
+	 * serialized size, plus index overhead
+	 */
+	ent->mem = sizeof(*ent) + (ent->size * 3) +
+		   (ent->tx.vin->len * sizeof(struct bp_txin)) +
+		   (ent->tx.vout->len * sizeof(struct bp_txout));
+
+	mempool_link(mp, ent);
+	ent = NULL;
+
+	while (mp->mem_bytes > mp->max_bytes && mp->by_fee->len) {
+		struct mempool_ent *worst = g_ptr_array_index(mp->by_fee, 0);
+
+		mempool_remove(mp, &worst->tx.sha256, true);
+	}
+
+	rc = (mempool_lookup(mp, &hash) != NULL);
+
+out:
+	if (ent)
+		mempool_ent_free(ent);
+	g_string_free(s, TRUE);
+	return rc;
+}
+
+/*
+ * Drop transactions confirmed by a newly connected block, and any that
+ * conflict with it, and advance the tip to the block's height.  The
+ * caller updates the UTXO set; descendants of confirmed transactions
+ * remain valid, and are kept.
+ */
+void mempool_block_connected(struct mempool *mp, const struct bp_block *block,
+			     unsigned int height)
+{
+	mp->height = height;
+
+	if (!block->vtx)
+		return;
+
+	unsigned int i, j;
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bp_tx *tx = g_ptr_array_index(block->vtx, i);
+
+		if (!tx->sha256_valid)
+			bp_tx_calc_sha256(tx);
+
+		mempool_remove(mp, &tx->sha256, false);
+
+		for (j = 0; j < tx->vin->len; j++) {
+			struct bp_txin *txin = g_ptr_array_index(tx->vin, j);
+			struct mempool_ent *conflict;
+
+			conflict = mempool_spender(mp, &txin->prevout);
+			if (conflict)
+				mempool_remove(mp, &conflict->tx.sha256, true);
+		}
+	}
+}
@@ -13,6 +13,51 @@
 #include <ccoin/util.h>
 #include <ccoin/compat.h>		/* for g_ptr_array_new_full */
 
+/* command strings, NUL-padded to the full 12-byte header field */
+static const char msg_cmds[MSG_CMD_COUNT][12] = {
+	[MSG_CMD_UNKNOWN]	= "",
+	[MSG_CMD_VERSION]	= "version",
+	[MSG_CMD_VERACK]	= "verack",
+	[MSG_CMD_ADDR]		= "addr",
+	[MSG_CMD_GETADDR]	= "getaddr",
+	[MSG_CMD_INV]		= "inv",
+	[MSG_CMD_GETDATA]	= "getdata",
+	[MSG_CMD_NOTFOUND]	= "notfound",
+	[MSG_CMD_GETBLOCKS]	= "getblocks",
+	[MSG_CMD_GETHEADERS]	= "getheaders",
+	[MSG_CMD_HEADERS]	= "headers",
+	[MSG_CMD_BLOCK]		= "block",
+	[MSG_CMD_TX]		= "tx",
+	[MSG_CMD_MEMPOOL]	= "mempool",
+	[MSG_CMD_PING]		= "ping",
+	[MSG_CMD_PONG]		= "pong",
+	[MSG_CMD_ALERT]		= "alert",
+};
+
+/*
+ * Map the raw 12-byte command field of a message header to its id.
+ * Each candidate is a single fixed-size compare of the whole field, so
+ * garbage after the NUL terminator never matches.
+ */
+enum msg_cmd message_cmd_id(const char *command)
+{
+	unsigned int i;
+
+	for (i = MSG_CMD_UNKNOWN + 1; i < MSG_CMD_COUNT; i++)
+		if (command[0] == msg_cmds[i][0] &&
+		    !memcmp(command, msg_cmds[i], 12))
+			return i;
+
+	return MSG_CMD_UNKNOWN;
+}
+
+const char *message_cmd_str(enum msg_cmd id)
+{
+	if (id >= MSG_CMD_COUNT)
+		id = MSG_CMD_UNKNOWN;
+	return msg_cmds[id];
+}
+
 void parse_message_hdr(struct p2p_message_hdr *hdr, const unsigned char *data)
 {
 	memcpy(hdr, data, P2P_HDR_SZ);
@@ -32,35 +77,52 @@ bool message_valid(const struct p2p_message *msg)
 	return memcmp(msg->hdr.hash, md32, sizeof(md32)) == 0;
 }
 
-GString *message_str(const unsigned char netmagic[4],
-		     const char *command_,
-		     const void *data, uint32_t data_len)
+GString *message_new(size_t data_len_hint)
+{
+	GString *s = g_string_sized_new(P2P_HDR_SZ + data_len_hint);
+
+	/* reserve header space; filled in by message_finish() */
+	g_string_set_size(s, P2P_HDR_SZ);
+	memset(s->str, 0, P2P_HDR_SZ);
+
+	return s;
+}
+
+void message_finish(GString *s, const unsigned char netmagic[4],
+		    const char *command_)
 {
-	GString *s = g_string_sized_new(P2P_HDR_SZ + data_len);
+	unsigned char *hdr = (unsigned char *) s->str;
+	const void *data = s->str + P2P_HDR_SZ;
+	uint32_t data_len = s->len - P2P_HDR_SZ;
 
 	/* network identifier (magic number) */
-	g_string_append_len(s, (gchar *) netmagic, 4);
+	memcpy(hdr, netmagic, 4);
 
 	/* command string */
 	char command[12] = {};
 	strncpy(command, command_, 12);
-	g_string_append_len(s, command, 12);
+	memcpy(hdr + 4, command, 12);
 
 	/* data length */
 	uint32_t data_len_le = GUINT32_TO_LE(data_len);
-	g_string_append_len(s, (gchar *) &data_len_le, 4);
+	memcpy(hdr + 16, &data_len_le, 4);
 
 	/* data checksum */
-	unsigned char md32[4];
-
-	bu_Hash4(md32, data, data_len);
+	bu_Hash4(hdr + 20, data, data_len);
+}
 
-	g_string_append_len(s, (gchar *) &md32[0], 4);
+GString *message_str(const unsigned char netmagic[4],
+		     const char *command_,
+		     const void *data, uint32_t data_len)
+{
+	GString *s = message_new(data_len);
 
 	/* data payload */
 	if (data_len > 0)
 		g_string_append_len(s, data, data_len);
 
+	message_finish(s, netmagic, command_);
+
 	return s;
 }
 
@@ -73,10 +135,11 @@ bool deser_msg_version(struct msg_version *mv, struct const_buffer *buf)
 		mv->nVersion = 300;
 	if (!deser_u64(&mv->nServices, buf)) return false;
 	if (!deser_s64(&mv->nTime, buf)) return false;
-	if (!deser_bp_addr(mv->nVersion, &mv->addrTo, buf)) return false;
+	/* version message addresses never carry nTime */
+	if (!deser_bp_addr(0, &mv->addrTo, buf)) return false;
 
 	if (mv->nVersion >= 106) {
-		if (!deser_bp_addr(mv->nVersion, &mv->addrFrom, buf)) return false;
+		if (!deser_bp_addr(0, &mv->addrFrom, buf)) return false;
 		if (!deser_u64(&mv->nonce, buf)) return false;
 		if (!deser_str(mv->strSubVer, buf, sizeof(mv->strSubVer)))
 			return false;
@@ -87,22 +150,37 @@ bool deser_msg_version(struct msg_version *mv, struct const_buffer *buf)
 	return true;
 }
 
-GString *ser_msg_version(const struct msg_version *mv)
+void ser_msg_version(GString *s, const struct msg_version *mv)
 {
-	GString *s = g_string_sized_new(256);
-
 	ser_u32(s, mv->nVersion);
 	ser_u64(s, mv->nServices);
 	ser_s64(s, mv->nTime);
 
-	ser_bp_addr(s, mv->nVersion, &mv->addrTo);
-	ser_bp_addr(s, mv->nVersion, &mv->addrFrom);
+	ser_bp_addr(s, 0, &mv->addrTo);
+	ser_bp_addr(s, 0, &mv->addrFrom);
 
 	ser_u64(s, mv->nonce);
 	ser_str(s, mv->strSubVer, sizeof(mv->strSubVer));
 	ser_u32(s, mv->nStartingHeight);
+}
 
-	return s;
+bool deser_msg_ping(unsigned int protover, struct msg_ping *mp,
+		    struct const_buffer *buf)
+{
+	memset(mp, 0, sizeof(*mp));
+
+	/* before BIP 31, ping carried no payload */
+	if (protover <= BIP0031_VERSION)
+		return true;
+
+	return deser_u64(&mp->nonce, buf);
+}
+
+void ser_msg_ping(unsigned int protover, GString *s,
+		  const struct msg_ping *mp)
+{
+	if (protover > BIP0031_VERSION)
+		ser_u64(s, mp->nonce);
 }
 
 bool deser_msg_addr(unsigned int protover, struct msg_addr *ma,
@@ -166,3 +244,77 @@ void msg_addr_free(struct msg_addr *ma)
 	}
 }
 
+void msg_vinv_push(struct msg_vinv *mv, uint32_t type, const bu256_t *hash)
+{
+	if (!mv->invs)
+		mv->invs = g_ptr_array_new_full(8, g_free);
+
+	struct bp_inv *inv = malloc(sizeof(*inv));
+	inv->type = type;
+	bu256_copy(&inv->hash, hash);
+
+	g_ptr_array_add(mv->invs, inv);
+}
+
+bool deser_msg_vinv(struct msg_vinv *mv, struct const_buffer *buf)
+{
+	msg_vinv_free(mv);
+
+	uint32_t vlen;
+	if (!deser_varlen(&vlen, buf)) return false;
+
+	/* reject oversized lists before allocating for them */
+	if (vlen > MAX_INV_SZ)
+		return false;
+
+	mv->invs = g_ptr_array_new_full(vlen, g_free);
+
+	unsigned int i;
+	for (i = 0; i < vlen; i++) {
+		struct bp_inv *inv;
+
+		inv = calloc(1, sizeof(*inv));
+		if (!deser_bp_inv(inv, buf)) {
+			free(inv);
+			goto err_out;
+		}
+
+		g_ptr_array_add(mv->invs, inv);
+	}
+
+	return true;
+
+err_out:
+	msg_vinv_free(mv);
+	return false;
+}
+
+void ser_msg_vinv(GString *s, const struct msg_vinv *mv)
+{
+	if (!mv || !mv->invs) {
+		ser_varlen(s, 0);
+		return;
+	}
+
+	ser_varlen(s, mv->invs->len);
+
+	unsigned int i;
+	for (i = 0; i < mv->invs->len; i++) {
+		struct bp_inv *inv;
+
+		inv = g_ptr_array_index(mv->invs, i);
+
+		ser_bp_inv(s, inv);
+	}
+}
+
+void msg_vinv_free(struct msg_vinv *mv)
+{
+	if (!mv)
+		return;
+
+	if (mv->invs) {
+		g_ptr_array_free(mv->invs, TRUE);
+		mv->invs = NULL;
+	}
+}
@@ -176,40 +176,164 @@ enum txnouttype bsp_classify(GPtrArray *ops)
 	return TX_NONSTANDARD;
 }
 
+/* a push at the start of 's': its size, with its data in 'data'; or 0 */
+static size_t bsp_push_at(struct const_buffer *data,
+			  const unsigned char *s, size_t len)
+{
+	size_t hdr, data_len;
+
+	if (len == 0 || !is_bsp_pushdata(s[0]))
+		return 0;
+
+	if (s[0] < OP_PUSHDATA1) {
+		hdr = 1;
+		data_len = s[0];
+	} else if (s[0] == OP_PUSHDATA1) {
+		if (len < 2)
+			return 0;
+		hdr = 2;
+		data_len = s[1];
+	} else if (s[0] == OP_PUSHDATA2) {
+		if (len < 3)
+			return 0;
+		hdr = 3;
+		data_len = s[1] | (s[2] << 8);
+	} else {
+		if (len < 5)
+			return 0;
+		hdr = 5;
+		data_len = s[1] | (s[2] << 8) | (s[3] << 16) |
+			   ((uint32_t) s[4] << 24);
+	}
+
+	if (data_len > len - hdr)
+		return 0;
+
+	data->p = s + hdr;
+	data->len = data_len;
+	return hdr + data_len;
+}
+
+static inline bool is_bsp_pubkey_len(size_t len)
+{
+	return (len >= 33 && len <= 120);
+}
+
+static inline bool is_bsp_smallint(unsigned char op)
+{
+	return (op >= OP_1 && op <= OP_16);
+}
+
+/*
+ * Match a script against the standard templates, directly on its
+ * bytes.  Keys and hashes are returned as slices of the script; nothing
+ * is allocated.
+ */
+enum txnouttype bsp_classify_script(struct bscript_tmpl *tmpl,
+				    const void *data, size_t data_len)
+{
+	const unsigned char *s = data;
+	size_t len = data_len;
+	struct const_buffer buf = { data, data_len };
+	struct const_buffer push;
+	size_t n;
+
+	memset(tmpl, 0, sizeof(*tmpl));
+	tmpl->txtype = TX_NONSTANDARD;
+
+	if (is_bsp_p2sh(&buf)) {
+		tmpl->hash.p = s + 2;
+		tmpl->hash.len = 20;
+		tmpl->txtype = TX_SCRIPTHASH;
+	}
+
+	/* OP_DUP OP_HASH160 <20 bytes> OP_EQUALVERIFY OP_CHECKSIG */
+	else if (len >= 25 && s[0] == OP_DUP && s[1] == OP_HASH160 &&
+		 (n = bsp_push_at(&push, s + 2, len - 2)) &&
+		 push.len == 20 && len == n + 4 &&
+		 s[len - 2] == OP_EQUALVERIFY && s[len - 1] == OP_CHECKSIG) {
+		tmpl->hash = push;
+		tmpl->txtype = TX_PUBKEYHASH;
+	}
+
+	/* <pubkey> OP_CHECKSIG */
+	else if (len >= 35 && s[len - 1] == OP_CHECKSIG &&
+		 bsp_push_at(&push, s, len - 1) == len - 1 &&
+		 is_bsp_pubkey_len(push.len)) {
+		tmpl->keys[0] = push;
+		tmpl->n_keys = 1;
+		tmpl->txtype = TX_PUBKEY;
+	}
+
+	/* OP_m <pubkey>... OP_n OP_CHECKMULTISIG */
+	else if (len >= 37 && s[len - 1] == OP_CHECKMULTISIG &&
+		 is_bsp_smallint(s[0]) && is_bsp_smallint(s[len - 2])) {
+		unsigned int n_req = s[0] - (OP_1 - 1);
+		unsigned int n_keys = s[len - 2] - (OP_1 - 1);
+		size_t pos = 1, end = len - 2;
+
+		while (pos < end && tmpl->n_keys < n_keys) {
+			n = bsp_push_at(&push, s + pos, end - pos);
+			if (!n || !is_bsp_pubkey_len(push.len))
+				break;
+			tmpl->keys[tmpl->n_keys++] = push;
+			pos += n;
+		}
+
+		if (pos == end && tmpl->n_keys == n_keys && n_req <= n_keys) {
+			tmpl->n_req = n_req;
+			tmpl->txtype = TX_MULTISIG;
+		} else
+			tmpl->n_keys = 0;
+	}
+
+	return tmpl->txtype;
+}
+
 bool bsp_addr_parse(struct bscript_addr *addr,
 		    const void *data, size_t data_len)
 {
 	memset(addr, 0, sizeof(*addr));
 
-	GPtrArray *ops = bsp_parse_all(data, data_len);
-	if (!ops)
-		return false;
+	struct bscript_tmpl tmpl;
+	addr->txtype = bsp_classify_script(&tmpl, data, data_len);
 
-	enum txnouttype txtype = bsp_classify(ops);
-	switch (txtype) {
+	unsigned int i;
+	switch (addr->txtype) {
 
-	case TX_PUBKEY: {
-		struct bscript_op *op = g_ptr_array_index(ops, 0);
-		struct buffer *buf = buffer_copy(op->data.p, op->data.len);
-		addr->pub = g_list_append(addr->pub, buf);
+	case TX_PUBKEY:
+	case TX_MULTISIG:
+		for (i = 0; i < tmpl.n_keys; i++) {
+			struct buffer *buf = buffer_copy(tmpl.keys[i].p,
+							 tmpl.keys[i].len);
+			addr->pub = g_list_append(addr->pub, buf);
+		}
 		break;
-	}
 
 	case TX_PUBKEYHASH: {
-		struct bscript_op *op = g_ptr_array_index(ops, 2);
-		struct buffer *buf = buffer_copy(op->data.p, op->data.len);
-		addr->pubhash = g_list_append(addr->pub, buf);
+		struct buffer *buf = buffer_copy(tmpl.hash.p, tmpl.hash.len);
+		addr->pubhash = g_list_append(addr->pubhash, buf);
 		break;
 	}
 	
-	default:
-		/* do nothing */
+	case TX_SCRIPTHASH:
 		break;
-	}
 
-	addr->txtype = txtype;
+	default: {
+		/* no addresses, but the script must at least parse */
+		struct const_buffer buf = { data, data_len };
+		struct bscript_parser bp;
+		struct bscript_op op;
+
+		bsp_start(&bp, &buf);
+		while (bsp_getop(&op, &bp))
+			;
+		if (bp.error)
+			return false;
+		break;
+	}
+	}
 
-	g_ptr_array_free(ops, TRUE);
 	return true;
 }
 
@@ -263,67 +387,83 @@ void bsp_push_data(GString *s, const void *data, size_t data_len)
 	g_string_append_len(s, data, data_len);
 }
 
-void bsp_push_int64(GString *s, int64_t n)
+/*
+ * script numbers: little endian magnitude, minimally encoded, with the
+ * sign in the high bit of the last byte; zero is the empty string
+ */
+static unsigned int scriptnum_ser(unsigned char *out, uint64_t absv, bool neg)
 {
-	if (n == -1 || (n >= 1 && n <= 16)) {
-		unsigned char c = (unsigned char) (n + (OP_1 - 1));
-		g_string_append_len(s, (gchar *) &c, 1);
-		return;
-	}
+	unsigned int len = 0;
 
-	bool neg = false;
-	if (n < 0) {
-		neg = true;
-		n = -n;
+	while (absv) {
+		out[len++] = absv & 0xff;
+		absv >>= 8;
 	}
 
-	BIGNUM bn, bn_lo, bn_hi;
-	BN_init(&bn);
-	BN_init(&bn_hi);
-	BN_init(&bn_lo);
+	if (len && (out[len - 1] & 0x80))
+		out[len++] = neg ? 0x80 : 0;
+	else if (neg)
+		out[len - 1] |= 0x80;
+
+	return len;
+}
 
-	BN_set_word(&bn_hi, (n >> 32));
-	BN_lshift(&bn_hi, &bn_hi, 32);
-	BN_set_word(&bn_lo, (n & 0xffffffffU));
-	BN_add(&bn, &bn_hi, &bn_lo);
-	if (neg)
-		BN_set_negative(&bn, 1);
+unsigned int bsp_scriptnum_enc(unsigned char *out, int64_t v)
+{
+	bool neg = (v < 0);
+	uint64_t absv = neg ? -((uint64_t) v) : (uint64_t) v;
 
-	GString *vch = bn_getvch(&bn);
+	return scriptnum_ser(out, absv, neg);
+}
 
-	bsp_push_data(s, vch->str, vch->len);
+bool bsp_scriptnum_dec(int64_t *vo, const void *data, size_t data_len,
+		       size_t max_len)
+{
+	const unsigned char *vch = data;
 
-	g_string_free(vch, TRUE);
-	BN_clear_free(&bn);
-	BN_clear_free(&bn_hi);
-	BN_clear_free(&bn_lo);
+	if (data_len > max_len || data_len > 8)
+		return false;
+
+	uint64_t v = 0;
+	unsigned int i;
+	for (i = 0; i < data_len; i++)
+		v |= ((uint64_t) vch[i]) << (8 * i);
+
+	/* negative, including negative zero */
+	if (data_len && (vch[data_len - 1] & 0x80)) {
+		v &= ~(((uint64_t) 0x80) << (8 * (data_len - 1)));
+		*vo = -((int64_t) v);
+	} else
+		*vo = (int64_t) v;
+
+	return true;
 }
 
-void bsp_push_uint64(GString *s, uint64_t n)
+void bsp_push_int64(GString *s, int64_t n)
 {
-	if (n >= 1 && n <= 16) {
+	if (n == -1 || (n >= 1 && n <= 16)) {
 		unsigned char c = (unsigned char) (n + (OP_1 - 1));
 		g_string_append_len(s, (gchar *) &c, 1);
 		return;
 	}
 
-	BIGNUM bn, bn_lo, bn_hi;
-	BN_init(&bn);
-	BN_init(&bn_hi);
-	BN_init(&bn_lo);
+	unsigned char vch[BSP_SCRIPTNUM_MAX];
+	unsigned int len = bsp_scriptnum_enc(vch, n);
 
-	BN_set_word(&bn_hi, (n >> 32));
-	BN_lshift(&bn_hi, &bn_hi, 32);
-	BN_set_word(&bn_lo, (n & 0xffffffffU));
-	BN_add(&bn, &bn_hi, &bn_lo);
+	bsp_push_data(s, vch, len);
+}
 
-	GString *vch = bn_getvch(&bn);
+void bsp_push_uint64(GString *s, uint64_t n)
+{
+	if (n >= 1 && n <= 16) {
+		unsigned char c = (unsigned char) (n + (OP_1 - 1));
+		g_string_append_len(s, (gchar *) &c, 1);
+		return;
+	}
 
-	bsp_push_data(s, vch->str, vch->len);
+	unsigned char vch[BSP_SCRIPTNUM_MAX];
+	unsigned int len = scriptnum_ser(vch, n, false);
 
-	g_string_free(vch, TRUE);
-	BN_clear_free(&bn);
-	BN_clear_free(&bn_hi);
-	BN_clear_free(&bn_lo);
+	bsp_push_data(s, vch, len);
 }
 
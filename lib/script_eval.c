@@ -4,6 +4,7 @@
 #define _GNU_SOURCE			/* for memmem */
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <openssl/sha.h>
 #include <openssl/ripemd.h>
 #include <ccoin/script.h>
@@ -14,16 +15,107 @@
 
 static const size_t nMaxNumSize = 4;
 
-static void string_find_del(GString *s, const struct buffer *buf)
+enum {
+	MAX_SCRIPT_ELEMENT_SIZE	= 520,
+	MAX_OPS_PER_SCRIPT	= 201,
+	MAX_STACK_SIZE		= 1000,
+
+	STACK_ELEM_INLINE	= 32,	/* bytes held within a stack element */
+	STACK_INIT_ELEMS	= 16,
+	SCRIPT_ARENA_ELEMS	= 96,	/* local arena size, in elements */
+};
+
+/*
+ * Evaluation stack.  An element either references bytes that outlive
+ * the evaluation (pushdata, within the script being run), or holds a
+ * small computed value (number, boolean, hash) inline.  Elements are
+ * immutable, so DUP, PICK and friends copy only the element itself.
+ */
+struct stack_elem {
+	const unsigned char	*p;		/* NULL: data is inline */
+	unsigned int		len;
+	unsigned char		data[STACK_ELEM_INLINE];
+};
+
+/*
+ * Per-verification arena, from which element arrays are carved.
+ * Nothing is freed until the verification ends; only unusually deep
+ * stacks spill to the heap.
+ */
+struct script_arena {
+	size_t			used;
+	GList			*spill;
+	union {
+		struct stack_elem	elem[SCRIPT_ARENA_ELEMS];
+		unsigned char		bytes[1];
+	} u;
+};
+
+struct script_stack {
+	struct script_arena	*arena;
+	struct stack_elem	*v;
+	unsigned int		len;
+	unsigned int		cap;
+};
+
+static void arena_init(struct script_arena *arena)
+{
+	arena->used = 0;
+	arena->spill = NULL;
+}
+
+static void arena_free(struct script_arena *arena)
+{
+	g_list_free_full(arena->spill, g_free);
+	arena->spill = NULL;
+}
+
+static void *arena_alloc(struct script_arena *arena, size_t sz)
 {
-	/* wrap buffer in a script */
-	GString *script = g_string_sized_new(buf->len + 8);
-	bsp_push_data(script, buf->p, buf->len);
+	sz = (sz + 15) & ~((size_t) 15);
 
-	/* search for script, as a substring of 's' */
+	if (sz <= sizeof(arena->u) - arena->used) {
+		void *p = &arena->u.bytes[arena->used];
+		arena->used += sz;
+		return p;
+	}
+
+	void *p = g_malloc(sz);
+	arena->spill = g_list_prepend(arena->spill, p);
+	return p;
+}
+
+static inline const unsigned char *elem_p(const struct stack_elem *e)
+{
+	return e->p ? e->p : e->data;
+}
+
+/* serialize a push of 'len' bytes, as bsp_push_data() would */
+static unsigned int ser_push(unsigned char *out, const unsigned char *p,
+			     unsigned int len)
+{
+	unsigned int n = 0;
+
+	if (len < OP_PUSHDATA1)
+		out[n++] = len;
+	else if (len <= 0xff) {
+		out[n++] = OP_PUSHDATA1;
+		out[n++] = len;
+	} else {
+		out[n++] = OP_PUSHDATA2;
+		out[n++] = len & 0xff;
+		out[n++] = len >> 8;
+	}
+
+	memcpy(out + n, p, len);
+	return n + len;
+}
+
+static void string_find_del(GString *s, const void *sub, unsigned int sublen)
+{
+	/* search for sub, as a substring of 's' */
 	void *p;
-	unsigned int sublen = script->len;
-	while ((p = memmem(s->str, s->len, script->str, sublen)) != NULL) {
+	while ((p = memmem(s->str, s->len, sub, sublen)) != NULL) {
 		void *begin = s->str;
 		void *end = begin + s->len;
 		void *tail = p + sublen;
@@ -33,8 +125,85 @@ static void string_find_del(GString *s, const struct buffer *buf)
 		memmove(p, tail, tail_len);
 		g_string_set_size(s, new_len);
 	}
+}
+
+/*
+ * Script code for signature hashing: the script from the most recent
+ * OP_CODESEPARATOR, less any pushes of the signature(s) being checked.
+ * The script bytes are borrowed, and copied only if there is
+ * something to delete.
+ */
+struct script_code {
+	GString			view;
+	GString			*copy;
+};
+
+static void script_code_init(struct script_code *sc,
+			     const struct const_buffer *code)
+{
+	sc->view.str = (gchar *) code->p;
+	sc->view.len = code->len;
+	sc->view.allocated_len = 0;
+	sc->copy = NULL;
+}
+
+static void script_code_del(struct script_code *sc,
+			    const struct stack_elem *vchSig)
+{
+	unsigned char sub[MAX_SCRIPT_ELEMENT_SIZE + 3];
+
+	if (vchSig->len > MAX_SCRIPT_ELEMENT_SIZE)
+		return;
+	unsigned int sublen = ser_push(sub, elem_p(vchSig), vchSig->len);
+
+	if (!sc->copy) {
+		if (!memmem(sc->view.str, sc->view.len, sub, sublen))
+			return;
+		sc->copy = g_string_new_len(sc->view.str, sc->view.len);
+	}
 
-	g_string_free(script, TRUE);
+	string_find_del(sc->copy, sub, sublen);
+}
+
+static const GString *script_code_get(const struct script_code *sc)
+{
+	return sc->copy ? sc->copy : &sc->view;
+}
+
+static void script_code_free(struct script_code *sc)
+{
+	if (sc->copy) {
+		g_string_free(sc->copy, TRUE);
+		sc->copy = NULL;
+	}
+}
+
+/*
+ * OP_CODESEPARATORs are not signed: a copy of scriptCode without them,
+ * or NULL if there are none.  As with the reference FindAndDelete,
+ * only whole ops are removed, and a parse error ends the search.
+ */
+static GString *script_code_strip_sep(const GString *scriptCode)
+{
+	if (!memchr(scriptCode->str, OP_CODESEPARATOR, scriptCode->len))
+		return NULL;
+
+	struct const_buffer buf = { scriptCode->str, scriptCode->len };
+	struct bscript_parser bp;
+	struct bscript_op op;
+	GString *s = g_string_sized_new(scriptCode->len);
+	const char *pos = scriptCode->str;
+
+	bsp_start(&bp, &buf);
+	while (bsp_getop(&op, &bp)) {
+		const char *end = buf.p;
+		if (op.op != OP_CODESEPARATOR)
+			g_string_append_len(s, pos, end - pos);
+		pos = end;
+	}
+	g_string_append_len(s, pos, scriptCode->str + scriptCode->len - pos);
+
+	return s;
 }
 
 static void bp_tx_calc_sighash(bu256_t *hash, const struct bp_tx *tx,
@@ -57,15 +226,17 @@ void bp_tx_sighash(bu256_t *hash, const GString *scriptCode,
 {
 	if (nIn >= txTo->vin->len) {
 		bu256_set_u64(hash, 1);
-		goto out;
+		return;
 	}
-	
+
+	GString *stripped = script_code_strip_sep(scriptCode);
+	if (stripped)
+		scriptCode = stripped;
+
 	struct bp_tx txTmp;
 	bp_tx_init(&txTmp);
 	bp_tx_copy(&txTmp, txTo);
 
-	/* TODO: find-and-delete OP_CODESEPARATOR from scriptCode */
-
 	/* Blank out other inputs' signatures */
 	unsigned int i;
 	struct bp_txin *txin;
@@ -130,6 +301,117 @@ void bp_tx_sighash(bu256_t *hash, const GString *scriptCode,
 
 out:
 	bp_tx_free(&txTmp);
+	if (stripped)
+		g_string_free(stripped, TRUE);
+}
+
+enum {
+	TXIN_BLANK_SZ		= 32 + 4 + 1 + 4,	/* scriptSig empty */
+};
+
+void bp_sighash_ctx_init(struct bp_sighash_ctx *ctx, const struct bp_tx *tx)
+{
+	unsigned int i, n_vin = tx->vin ? tx->vin->len : 0;
+	unsigned int n_vout = tx->vout ? tx->vout->len : 0;
+
+	ctx->tx = tx;
+
+	ctx->head = g_string_sized_new(4 + 5);
+	ser_u32(ctx->head, tx->nVersion);
+	ser_varlen(ctx->head, n_vin);
+
+	ctx->vin = g_string_sized_new(n_vin * TXIN_BLANK_SZ);
+	for (i = 0; i < n_vin; i++) {
+		struct bp_txin *txin = g_ptr_array_index(tx->vin, i);
+
+		ser_bp_outpt(ctx->vin, &txin->prevout);
+		ser_varlen(ctx->vin, 0);
+		ser_u32(ctx->vin, txin->nSequence);
+	}
+
+	ctx->tail = g_string_sized_new(512);
+	ser_varlen(ctx->tail, n_vout);
+	for (i = 0; i < n_vout; i++)
+		ser_bp_txout(ctx->tail, g_ptr_array_index(tx->vout, i));
+	ser_u32(ctx->tail, tx->nLockTime);
+}
+
+void bp_sighash_ctx_free(struct bp_sighash_ctx *ctx)
+{
+	if (!ctx || !ctx->tx)
+		return;
+
+	g_string_free(ctx->head, TRUE);
+	g_string_free(ctx->vin, TRUE);
+	g_string_free(ctx->tail, TRUE);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void bp_sighash_ctx_hash(bu256_t *hash, const struct bp_sighash_ctx *ctx,
+			 const GString *scriptCode, unsigned int nIn,
+			 int nHashType)
+{
+	const struct bp_tx *tx = ctx->tx;
+
+	if (!tx->vin || nIn >= tx->vin->len ||
+	    (nHashType & 0x1f) == SIGHASH_NONE ||
+	    (nHashType & 0x1f) == SIGHASH_SINGLE ||
+	    (nHashType & SIGHASH_ANYONECANPAY)) {
+		bp_tx_sighash(hash, scriptCode, tx, nIn, nHashType);
+		return;
+	}
+
+	GString *stripped = script_code_strip_sep(scriptCode);
+	if (stripped)
+		scriptCode = stripped;
+
+	const unsigned char *txin =
+		(unsigned char *) ctx->vin->str + nIn * TXIN_BLANK_SZ;
+	unsigned char vl[5], ht[4], md[SHA256_DIGEST_LENGTH];
+	unsigned int vl_len, len = scriptCode->len;
+
+	if (len < 253) {
+		vl[0] = len;
+		vl_len = 1;
+	} else if (len <= 0xffff) {
+		vl[0] = 253;
+		vl[1] = len;
+		vl[2] = len >> 8;
+		vl_len = 3;
+	} else {
+		vl[0] = 254;
+		vl[1] = len;
+		vl[2] = len >> 8;
+		vl[3] = len >> 16;
+		vl[4] = len >> 24;
+		vl_len = 5;
+	}
+
+	uint32_t ht_u = nHashType;
+	ht[0] = ht_u;
+	ht[1] = ht_u >> 8;
+	ht[2] = ht_u >> 16;
+	ht[3] = ht_u >> 24;
+
+	/* as ser_bp_tx() of the blanked copy, then ser_s32(nHashType) */
+	SHA256_CTX c;
+	SHA256_Init(&c);
+	SHA256_Update(&c, ctx->head->str, ctx->head->len);
+	SHA256_Update(&c, ctx->vin->str, nIn * TXIN_BLANK_SZ);
+	SHA256_Update(&c, txin, 36);				/* prevout */
+	SHA256_Update(&c, vl, vl_len);
+	SHA256_Update(&c, scriptCode->str, len);
+	SHA256_Update(&c, txin + 37, 4);			/* nSequence */
+	SHA256_Update(&c, txin + TXIN_BLANK_SZ,
+		      ctx->vin->len - (nIn + 1) * TXIN_BLANK_SZ);
+	SHA256_Update(&c, ctx->tail->str, ctx->tail->len);
+	SHA256_Update(&c, ht, sizeof(ht));
+	SHA256_Final(md, &c);
+
+	SHA256(md, sizeof(md), (unsigned char *) hash);
+
+	if (stripped)
+		g_string_free(stripped, TRUE);
 }
 
 static const unsigned char disabled_op[256] = {
@@ -150,35 +432,19 @@ static const unsigned char disabled_op[256] = {
 	[OP_RSHIFT] = 1,
 };
 
-static bool CastToBigNum(BIGNUM *vo, const struct buffer *buf)
+static bool CastToInt64(int64_t *vo, const struct stack_elem *e)
 {
-	if (buf->len > nMaxNumSize)
-		return false;
-	
-	// Get rid of extra leading zeros:
-	// buf -> bn -> buf -> bn
-
-	BIGNUM bn;
-	BN_init(&bn);
-
-	bn_setvch(&bn, buf->p, buf->len);
-	GString *bn_s = bn_getvch(&bn);
-
-	bn_setvch(vo, bn_s->str, bn_s->len);
-
-	g_string_free(bn_s, TRUE);
-	BN_clear_free(&bn);
-	return true;
+	return bsp_scriptnum_dec(vo, elem_p(e), e->len, nMaxNumSize);
 }
 
-static bool CastToBool(const struct buffer *buf)
+static bool CastToBool(const struct stack_elem *e)
 {
 	unsigned int i;
-	const unsigned char *vch = buf->p;
-	for (i = 0; i < buf->len; i++) {
+	const unsigned char *vch = elem_p(e);
+	for (i = 0; i < e->len; i++) {
 		if (vch[i] != 0) {
 			// Can be negative zero
-			if (i == (buf->len - 1) && vch[i] == 0x80)
+			if (i == (e->len - 1) && vch[i] == 0x80)
 				return false;
 			return true;
 		}
@@ -187,116 +453,148 @@ static bool CastToBool(const struct buffer *buf)
 	return false;
 }
 
-static void stack_insert(GPtrArray *stack, const struct buffer *buf, int index_)
+static void stack_init(struct script_stack *stack, struct script_arena *arena)
 {
-	int index = stack->len + index_;
-	g_ptr_array_add(stack, NULL);
-	memmove(&stack->pdata[index + 1], &stack->pdata[index],
-		sizeof(gpointer) * (stack->len - index - 1));
-	stack->pdata[index] = buffer_copy(buf->p, buf->len);
+	stack->arena = arena;
+	stack->v = NULL;
+	stack->len = 0;
+	stack->cap = 0;
 }
 
-static void stack_push(GPtrArray *stack, const struct buffer *buf)
+static void stack_reserve(struct script_stack *stack, unsigned int n)
 {
-	g_ptr_array_add(stack, buffer_copy(buf->p, buf->len));
+	if (stack->len + n <= stack->cap)
+		return;
+
+	unsigned int cap = MAX(stack->cap * 2, STACK_INIT_ELEMS);
+	while (cap < stack->len + n)
+		cap *= 2;
+
+	/* the old array stays in the arena, so outstanding
+	 * element pointers remain readable
+	 */
+	struct stack_elem *v = arena_alloc(stack->arena, cap * sizeof(*v));
+	if (stack->len)
+		memcpy(v, stack->v, stack->len * sizeof(*v));
+
+	stack->v = v;
+	stack->cap = cap;
 }
 
-static void stack_push_nocopy(GPtrArray *stack, struct buffer *buf)
+static void stack_push(struct script_stack *stack, const struct stack_elem *e)
 {
-	g_ptr_array_add(stack, buf);
+	struct stack_elem tmp = *e;
+
+	stack_reserve(stack, 1);
+	stack->v[stack->len++] = tmp;
 }
 
-static void stack_push_char(GPtrArray *stack, unsigned char ch)
+/* reference bytes that outlive the evaluation, without copying */
+static void stack_push_ref(struct script_stack *stack, const void *p,
+			   unsigned int len)
 {
-	g_ptr_array_add(stack, buffer_copy(&ch, 1));
+	stack_reserve(stack, 1);
+
+	struct stack_elem *e = &stack->v[stack->len++];
+	e->p = p;
+	e->len = len;
 }
 
-static void stack_push_str(GPtrArray *stack, GString *s)
+static void stack_push_data(struct script_stack *stack, const void *p,
+			    unsigned int len)
 {
-	g_ptr_array_add(stack, buffer_copy(s->str, s->len));
-	g_string_free(s, TRUE);
+	stack_reserve(stack, 1);
+
+	struct stack_elem *e = &stack->v[stack->len++];
+	e->len = len;
+	if (len <= STACK_ELEM_INLINE) {
+		e->p = NULL;
+		memcpy(e->data, p, len);
+	} else {
+		void *data = arena_alloc(stack->arena, len);
+		memcpy(data, p, len);
+		e->p = data;
+	}
 }
 
-static void stack_copy(GPtrArray *dest, const GPtrArray *src)
+static void stack_push_char(struct script_stack *stack, unsigned char ch)
 {
-	unsigned int i;
-	for (i = 0; i < src->len; i++)
-		stack_push(dest, g_ptr_array_index(src, i));
+	stack_push_data(stack, &ch, 1);
 }
 
-static struct buffer *stacktop(GPtrArray *stack, int index)
+static void stack_push_int(struct script_stack *stack, int64_t v)
 {
-	return stack->pdata[stack->len + index];
+	unsigned char vch[BSP_SCRIPTNUM_MAX];
+	unsigned int len = bsp_scriptnum_enc(vch, v);
+
+	stack_push_data(stack, vch, len);
 }
 
-static int stackint(GPtrArray *stack, int index)
+static void stack_insert(struct script_stack *stack,
+			 const struct stack_elem *e, int index_)
 {
-	struct buffer *buf = stacktop(stack, index);
-	BIGNUM bn;
-	BN_init(&bn);
+	struct stack_elem tmp = *e;
 
-	int ret = -1;
+	stack_reserve(stack, 1);
 
-	if (!CastToBigNum(&bn, buf))
-		goto out;
-
-	if (!BN_is_negative(&bn))
-		ret = BN_get_word(&bn);
-	else {
-		BN_set_negative(&bn, 0);
-		ret = BN_get_word(&bn);
-		ret = -ret;
-	}
-
-out:
-	BN_clear_free(&bn);
-	return ret;
+	int index = stack->len + index_;
+	memmove(&stack->v[index + 1], &stack->v[index],
+		sizeof(tmp) * (stack->len - index));
+	stack->v[index] = tmp;
+	stack->len++;
 }
 
-static struct buffer *stack_take(GPtrArray *stack, int index)
+static void stack_remove(struct script_stack *stack, int index_,
+			 unsigned int n)
 {
-	struct buffer *ret = stack->pdata[stack->len + index];
-	stack->pdata[stack->len + index] = NULL;
-	return ret;
+	int index = stack->len + index_;
+	memmove(&stack->v[index], &stack->v[index + n],
+		sizeof(struct stack_elem) * (stack->len - index - n));
+	stack->len -= n;
 }
 
-static void popstack(GPtrArray *stack)
+static void stack_copy(struct script_stack *dest,
+		       const struct script_stack *src)
 {
-	assert(stack->len > 0);
-	g_ptr_array_remove_index(stack, stack->len - 1);
+	if (!src->len)
+		return;
+
+	stack_reserve(dest, src->len);
+	memcpy(&dest->v[dest->len], src->v, src->len * sizeof(*src->v));
+	dest->len += src->len;
 }
 
-static void stack_swap(GPtrArray *stack, int idx1, int idx2)
+static struct stack_elem *stacktop(struct script_stack *stack, int index)
 {
-	int len = stack->len;
-	struct buffer *tmp = stack->pdata[len + idx1];
-	stack->pdata[len + idx1] = stack->pdata[len + idx2];
-	stack->pdata[len + idx2] = tmp;
+	return &stack->v[stack->len + index];
 }
 
-static unsigned int count_false(GByteArray *vfExec)
+static int stackint(struct script_stack *stack, int index)
 {
-	unsigned int i, count = 0;
+	int64_t v;
 
-	for (i = 0; i < vfExec->len; i++)
-		if (vfExec->data[i] == 0)
-			count++;
+	if (!CastToInt64(&v, stacktop(stack, index)))
+		return -1;
 
-	return count;
+	return (int) v;
 }
 
-static void bn_set_int(BIGNUM *n, int val)
+static void popstack(struct script_stack *stack)
 {
-	if (val >= 0)
-		BN_set_word(n, val);
-	else {
-		BN_set_word(n, -val);
-		BN_set_negative(n, 1);
-	}
+	assert(stack->len > 0);
+	stack->len--;
+}
+
+static void stack_swap(struct script_stack *stack, int idx1, int idx2)
+{
+	int len = stack->len;
+	struct stack_elem tmp = stack->v[len + idx1];
+	stack->v[len + idx1] = stack->v[len + idx2];
+	stack->v[len + idx2] = tmp;
 }
 
-static bool bp_checksig(const struct buffer *vchSigHT,
-			const struct buffer *vchPubKey,
+static bool bp_checksig(const struct stack_elem *vchSigHT,
+			const struct stack_elem *vchPubKey,
 			const GString *scriptCode,
 			const struct bp_tx *txTo, unsigned int nIn,
 			int nHashType)
@@ -306,87 +604,347 @@ static bool bp_checksig(const struct buffer *vchSigHT,
 		return false;
 
 	/* examine hashtype at end of string, then remove it */
-	unsigned char *vch_back = vchSigHT->p + (vchSigHT->len - 1);
+	const unsigned char *sig = elem_p(vchSigHT);
+	unsigned char vch_back = sig[vchSigHT->len - 1];
 	if (nHashType == 0)
-		nHashType = *vch_back;
-	else if (nHashType != *vch_back)
+		nHashType = vch_back;
+	else if (nHashType != vch_back)
 		return false;
-	struct buffer vchSig = { vchSigHT->p, vchSigHT->len - 1 };
+	struct const_buffer vchSig = { sig, vchSigHT->len - 1 };
 
 	/* calculate signature hash of transaction */
 	bu256_t sighash;
 	bp_tx_sighash(&sighash, scriptCode, txTo, nIn, nHashType);
 
 	/* verify signature hash */
-	struct bp_key key;
-	bp_key_init(&key);
-
-	bool rc = false;
-	if (!bp_pubkey_set(&key, vchPubKey->p, vchPubKey->len))
-		goto out;
-	if (!bp_verify(&key, &sighash, sizeof(sighash), vchSig.p, vchSig.len))
-		goto out;
-
-	rc = true;
-
-out:
-	bp_key_free(&key);
-	return rc;
+	return bp_pubkey_verify(elem_p(vchPubKey), vchPubKey->len,
+				&sighash, sizeof(sighash),
+				vchSig.p, vchSig.len);
 }
 
-static bool IsCanonicalSignature(const struct buffer *vch)
+static bool IsCanonicalSignature(const struct stack_elem *vch)
 {
 	// TODO
 	return true;
 }
 
-static bool IsCanonicalPubKey(const struct buffer *vch)
+static bool IsCanonicalPubKey(const struct stack_elem *vch)
 {
 	// TODO
 	return true;
 }
 
-static bool bp_script_eval(GPtrArray *stack, const GString *script,
-			   const struct bp_tx *txTo, unsigned int nIn,
-			   unsigned int flags, int nHashType)
+static bool script_checksig(const struct stack_elem *vchSig,
+			    const struct stack_elem *vchPubKey,
+			    const struct const_buffer *code,
+			    const struct bp_tx *txTo, unsigned int nIn,
+			    unsigned int flags, int nHashType)
 {
-	struct const_buffer pc = { script->str, script->len };
-	struct const_buffer pend = { script->str + script->len, 0 };
-	struct const_buffer pbegincodehash = { script->str, script->len };
-	struct bscript_op op;
-	bool rc = false;
-	GByteArray *vfExec = g_byte_array_new();
-	GPtrArray *altstack = g_ptr_array_new_with_free_func(
-						(GDestroyNotify) buffer_free);
-	BIGNUM bn;
-	BN_init(&bn);
+	if ((flags & SCRIPT_VERIFY_STRICTENC) &&
+	    (!IsCanonicalSignature(vchSig) || !IsCanonicalPubKey(vchPubKey)))
+		return false;
+
+	// Subset of script starting at the most recent codeseparator
+	struct script_code scriptCode;
+	script_code_init(&scriptCode, code);
+
+	// Drop the signature, since there's no way for
+	// a signature to sign itself
+	script_code_del(&scriptCode, vchSig);
+
+	bool rc = bp_checksig(vchSig, vchPubKey, script_code_get(&scriptCode),
+			      txTo, nIn, nHashType);
+
+	script_code_free(&scriptCode);
+	return rc;
+}
+
+/*
+ * OP_CHECKMULTISIG signature checks.  Signatures and keys are listed in
+ * the order they are tried: each key is tried once, against the first
+ * signature not yet matched.
+ */
+static bool script_checkmultisig(const struct stack_elem **sigs,
+				 int nSigsCount,
+				 const struct stack_elem **keys,
+				 int nKeysCount,
+				 const struct const_buffer *code,
+				 const struct bp_tx *txTo, unsigned int nIn,
+				 unsigned int flags, int nHashType)
+{
+	// Subset of script starting at the most recent codeseparator
+	struct script_code scriptCode;
+	script_code_init(&scriptCode, code);
+
+	// Drop the signatures, since there's no way for
+	// a signature to sign itself
+	int k;
+	for (k = 0; k < nSigsCount; k++)
+		script_code_del(&scriptCode, sigs[k]);
+
+	int isig = 0, ikey = 0;
+	bool fSuccess = true;
+	while (fSuccess && nSigsCount > 0)
+	{
+		const struct stack_elem *vchSig = sigs[isig];
+		const struct stack_elem *vchPubKey = keys[ikey];
+
+		// Check signature
+		bool fOk =
+			(!(flags & SCRIPT_VERIFY_STRICTENC) ||
+			 (IsCanonicalSignature(vchSig) &&
+			  IsCanonicalPubKey(vchPubKey)));
+		if (fOk)
+			fOk = bp_checksig(vchSig, vchPubKey,
+					  script_code_get(&scriptCode),
+					  txTo, nIn, nHashType);
+
+		if (fOk) {
+			isig++;
+			nSigsCount--;
+		}
+		ikey++;
+		nKeysCount--;
+
+		// If there are more signatures left than keys left,
+		// then too many signatures have failed
+		if (nSigsCount > nKeysCount)
+			fSuccess = false;
+	}
+
+	script_code_free(&scriptCode);
+	return fSuccess;
+}
+
+/*
+ * Compiled script: the parsed ops, with pushdata resolved to slices of
+ * the script, and each IF, NOTIF and ELSE linked to the ELSE or ENDIF
+ * that ends its branch.  Offsets are relative to the script bytes, so
+ * a compiled script applies to any copy of them.
+ */
+struct script_op {
+	unsigned char		op;
+	uint16_t		n_counted;	/* counted ops, up to here */
+	uint16_t		data_off;
+	uint16_t		data_len;
+	uint16_t		end;		/* offset past this op */
+	uint16_t		next;		/* index of ELSE or ENDIF */
+};
+
+struct script_prog {
+	unsigned int		refs;
+	bool			valid;		/* false: fails, always */
+	unsigned int		n_counted;
+	unsigned int		n_ops;
+	struct buffer		key;		/* script bytes, if cached */
+	struct script_op	ops[];
+};
+
+/*
+ * Compile a script: onto the heap, keeping a copy of the script bytes
+ * as its key, for the cache; otherwise into the verification's arena,
+ * released with it.
+ */
+static struct script_prog *script_compile(const struct const_buffer *script,
+					  struct script_arena *arena)
+{
+	/* ops never outnumber script bytes */
+	size_t max_ops = (script->len <= 10000) ? script->len : 0;
+	bool keep_key = (arena == NULL);
+	size_t key_len = keep_key ? script->len : 0;
+	size_t sz = sizeof(struct script_prog) +
+		    (max_ops * sizeof(struct script_op)) + key_len;
+	struct script_prog *prog = arena ? arena_alloc(arena, sz) :
+					   g_malloc(sz);
+
+	prog->refs = 1;
+	prog->valid = false;
+	prog->n_counted = 0;
+	prog->n_ops = 0;
+	prog->key.p = NULL;
+	prog->key.len = 0;
+	if (keep_key) {
+		prog->key.p = &prog->ops[max_ops];
+		prog->key.len = key_len;
+		memcpy(prog->key.p, script->p, key_len);
+	}
 
 	if (script->len > 10000)
-		goto out;
-	
-	bool fStrictEncodings = flags & SCRIPT_VERIFY_STRICTENC;
-	unsigned int nOpCount = 0;
+		return prog;
+
+	/* each OP_IF counts against the opcode limit, bounding nesting */
+	unsigned int ctrl[MAX_OPS_PER_SCRIPT];
+	unsigned int n_ctrl = 0;
 
+	struct const_buffer pc = *script;
 	struct bscript_parser bp;
+	struct bscript_op op;
 	bsp_start(&bp, &pc);
 
-	while (pc.p < pend.p) {
-		bool fExec = !count_false(vfExec);
-
-		if (!bsp_getop(&op, &bp))
-			goto out;
+	while (bsp_getop(&op, &bp)) {
 		enum opcodetype opcode = op.op;
+		unsigned int idx = prog->n_ops++;
+		struct script_op *sop = &prog->ops[idx];
 
-		if (op.data.len > 520)
-			goto out;
-		if (opcode > OP_16 && ++nOpCount > 201)
-			goto out;
+		if (op.data.len > MAX_SCRIPT_ELEMENT_SIZE)
+			return prog;
+		if (opcode > OP_16 && ++prog->n_counted > MAX_OPS_PER_SCRIPT)
+			return prog;
 		if (disabled_op[opcode])
-			goto out;
+			return prog;
+
+		sop->op = opcode;
+		sop->n_counted = prog->n_counted;
+		sop->data_off = op.data.p ?
+			(const unsigned char *) op.data.p -
+			(const unsigned char *) script->p : 0;
+		sop->data_len = op.data.len;
+		sop->end = (const unsigned char *) pc.p -
+			   (const unsigned char *) script->p;
+		sop->next = 0;
 
-		if (fExec && is_bsp_pushdata(opcode))
-			stack_push(stack, (struct buffer *) &op.data);
-		else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
+		switch (opcode) {
+		case OP_IF:
+		case OP_NOTIF:
+			ctrl[n_ctrl++] = idx;
+			break;
+
+		case OP_ELSE:
+			if (n_ctrl == 0)
+				return prog;
+			prog->ops[ctrl[n_ctrl - 1]].next = idx;
+			ctrl[n_ctrl - 1] = idx;
+			break;
+
+		case OP_ENDIF:
+			if (n_ctrl == 0)
+				return prog;
+			prog->ops[ctrl[--n_ctrl]].next = idx;
+			break;
+
+		case OP_VERIF:
+		case OP_VERNOTIF:
+			/* invalid even where not executed */
+			return prog;
+
+		default:
+			break;
+		}
+	}
+
+	prog->valid = (!bp.error && n_ctrl == 0);
+	return prog;
+}
+
+/*
+ * Cache of compiled scripts, keyed by script bytes, for the scripts
+ * seen over and over: output scripts and P2SH redeem scripts.  The
+ * oldest entry is evicted once the cache is full.
+ */
+enum {
+	SCRIPT_CACHE_MAX	= 4096,
+};
+
+static pthread_mutex_t script_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *script_cache;
+static struct script_prog *script_cache_ring[SCRIPT_CACHE_MAX];
+static unsigned int script_cache_pos;
+
+static void script_prog_put(struct script_prog *prog)
+{
+	pthread_mutex_lock(&script_cache_lock);
+	bool last = (--prog->refs == 0);
+	pthread_mutex_unlock(&script_cache_lock);
+
+	if (last)
+		g_free(prog);
+}
+
+static struct script_prog *script_cache_get(const struct const_buffer *script)
+{
+	struct buffer key = { (void *) script->p, script->len };
+	struct script_prog *prog;
+
+	pthread_mutex_lock(&script_cache_lock);
+
+	if (!script_cache)
+		script_cache = g_hash_table_new(buffer_hash, buffer_equal);
+
+	prog = g_hash_table_lookup(script_cache, &key);
+	if (prog)
+		prog->refs++;
+
+	pthread_mutex_unlock(&script_cache_lock);
+
+	if (prog)
+		return prog;
+
+	struct script_prog *new_prog = script_compile(script, NULL);
+	struct script_prog *old = NULL;
+
+	pthread_mutex_lock(&script_cache_lock);
+
+	/* lost a race to compile it? */
+	prog = g_hash_table_lookup(script_cache, &key);
+	if (prog)
+		prog->refs++;
+	else {
+		prog = new_prog;
+		new_prog = NULL;
+
+		old = script_cache_ring[script_cache_pos];
+		if (old) {
+			g_hash_table_remove(script_cache, &old->key);
+			if (--old->refs)
+				old = NULL;
+		}
+
+		script_cache_ring[script_cache_pos] = prog;
+		script_cache_pos = (script_cache_pos + 1) % SCRIPT_CACHE_MAX;
+		g_hash_table_insert(script_cache, &prog->key, prog);
+		prog->refs++;			/* the cache's reference */
+	}
+
+	pthread_mutex_unlock(&script_cache_lock);
+
+	g_free(new_prog);
+	g_free(old);
+	return prog;
+}
+
+/*
+ * Run a compiled script.  Only executed ops are visited: a branch not
+ * taken is jumped over, straight to its ELSE or ENDIF.  The static
+ * checks, which the reference interpreter applies to skipped ops as
+ * well, were made by script_compile().
+ */
+static bool script_run(struct script_stack *stack,
+		       const struct script_prog *prog,
+		       const struct const_buffer *script,
+		       const struct bp_tx *txTo, unsigned int nIn,
+		       unsigned int flags, int nHashType)
+{
+	struct const_buffer pbegincodehash = *script;
+	bool rc = false;
+
+	struct script_stack altstack;
+	stack_init(&altstack, stack->arena);
+
+	if (!prog->valid)
+		goto out;
+
+	/* opcodes counted by OP_CHECKMULTISIG, beyond the static count */
+	unsigned int nOpCountExtra = 0;
+
+	unsigned int pc = 0;
+	while (pc < prog->n_ops) {
+		const struct script_op *sop = &prog->ops[pc++];
+		enum opcodetype opcode = sop->op;
+
+		if (is_bsp_pushdata(opcode))
+			stack_push_ref(stack, script->p + sop->data_off,
+				       sop->data_len);
+		else
 		switch (opcode) {
 
 		//
@@ -409,8 +967,7 @@ static bool bp_script_eval(GPtrArray *stack, const GString *script,
 		case OP_14:
 		case OP_15:
 		case OP_16:
-			bn_set_int(&bn, (int)opcode - (int)(OP_1 - 1));
-			stack_push_str(stack, bn_getvch(&bn));
+			stack_push_int(stack, (int)opcode - (int)(OP_1 - 1));
 			break;
 
 		//
@@ -426,33 +983,25 @@ OP_NOP10:
 		case OP_IF:
 		case OP_NOTIF: {
 			// <expression> if [statements] [else [statements]] endif
-			bool fValue = false;
-			if (fExec) {
-				if (stack->len < 1)
-					goto out;
-				struct buffer *vch = stacktop(stack, -1);
-				fValue = CastToBool(vch);
-				if (opcode == OP_NOTIF)
-					fValue = !fValue;
-				popstack(stack);
-			}
-			guint8 vc = (guint8) fValue;
-			g_byte_array_append(vfExec, &vc, 1);
+			if (stack->len < 1)
+				goto out;
+			struct stack_elem *vch = stacktop(stack, -1);
+			bool fValue = CastToBool(vch);
+			if (opcode == OP_NOTIF)
+				fValue = !fValue;
+			popstack(stack);
+			if (!fValue)
+				pc = sop->next + 1;
 			break;
 		}
 
-		case OP_ELSE: {
-			if (vfExec->len == 0)
-				goto out;
-			guint8 *v = &vfExec->data[vfExec->len - 1];
-			*v = !(*v);
+		case OP_ELSE:
+			// reached by executing a branch: skip the next one;
+			// an ELSE jumped to starts executing after itself
+			pc = sop->next + 1;
 			break;
-		}
 
 		case OP_ENDIF:
-			if (vfExec->len == 0)
-				goto out;
-			g_byte_array_remove_index(vfExec, vfExec->len - 1);
 			break;
 
 		case OP_VERIFY: {
@@ -475,15 +1024,15 @@ OP_NOP10:
 		case OP_TOALTSTACK:
 			if (stack->len < 1)
 				goto out;
-			stack_push(altstack, stacktop(stack, -1));
+			stack_push(&altstack, stacktop(stack, -1));
 			popstack(stack);
 			break;
 
 		case OP_FROMALTSTACK:
-			if (altstack->len < 1)
+			if (altstack.len < 1)
 				goto out;
-			stack_push(stack, stacktop(altstack, -1));
-			popstack(altstack);
+			stack_push(stack, stacktop(&altstack, -1));
+			popstack(&altstack);
 			break;
 
 		case OP_2DROP:
@@ -498,10 +1047,8 @@ OP_NOP10:
 			// (x1 x2 -- x1 x2 x1 x2)
 			if (stack->len < 2)
 				goto out;
-			struct buffer *vch1 = stacktop(stack, -2);
-			struct buffer *vch2 = stacktop(stack, -1);
-			stack_push(stack, vch1);
-			stack_push(stack, vch2);
+			stack_push(stack, stacktop(stack, -2));
+			stack_push(stack, stacktop(stack, -2));
 			break;
 		}
 
@@ -509,12 +1056,9 @@ OP_NOP10:
 			// (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
 			if (stack->len < 3)
 				goto out;
-			struct buffer *vch1 = stacktop(stack, -3);
-			struct buffer *vch2 = stacktop(stack, -2);
-			struct buffer *vch3 = stacktop(stack, -1);
-			stack_push(stack, vch1);
-			stack_push(stack, vch2);
-			stack_push(stack, vch3);
+			stack_push(stack, stacktop(stack, -3));
+			stack_push(stack, stacktop(stack, -3));
+			stack_push(stack, stacktop(stack, -3));
 			break;
 		}
 
@@ -522,10 +1066,8 @@ OP_NOP10:
 			// (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
 			if (stack->len < 4)
 				goto out;
-			struct buffer *vch1 = stacktop(stack, -4);
-			struct buffer *vch2 = stacktop(stack, -3);
-			stack_push(stack, vch1);
-			stack_push(stack, vch2);
+			stack_push(stack, stacktop(stack, -4));
+			stack_push(stack, stacktop(stack, -4));
 			break;
 		}
 
@@ -533,11 +1075,11 @@ OP_NOP10:
 			// (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
 			if (stack->len < 6)
 				goto out;
-			struct buffer *vch1 = stack_take(stack, -6);
-			struct buffer *vch2 = stack_take(stack, -5);
-			g_ptr_array_remove_range(stack, stack->len - 6, 2);
-			stack_push(stack, vch1);
-			stack_push(stack, vch2);
+			struct stack_elem vch1 = *stacktop(stack, -6);
+			struct stack_elem vch2 = *stacktop(stack, -5);
+			stack_remove(stack, -6, 2);
+			stack_push(stack, &vch1);
+			stack_push(stack, &vch2);
 			break;
 		}
 
@@ -553,7 +1095,7 @@ OP_NOP10:
 			// (x - 0 | x x)
 			if (stack->len < 1)
 				goto out;
-			struct buffer *vch = stacktop(stack, -1);
+			struct stack_elem *vch = stacktop(stack, -1);
 			if (CastToBool(vch))
 				stack_push(stack, vch);
 			break;
@@ -561,8 +1103,7 @@ OP_NOP10:
 
 		case OP_DEPTH:
 			// -- stacksize
-			BN_set_word(&bn, stack->len);
-			stack_push_str(stack, bn_getvch(&bn));
+			stack_push_int(stack, stack->len);
 			break;
 
 		case OP_DROP:
@@ -576,8 +1117,7 @@ OP_NOP10:
 			// (x -- x x)
 			if (stack->len < 1)
 				goto out;
-			struct buffer *vch = stacktop(stack, -1);
-			stack_push(stack, vch);
+			stack_push(stack, stacktop(stack, -1));
 			break;
 		}
 
@@ -585,15 +1125,14 @@ OP_NOP10:
 			// (x1 x2 -- x2)
 			if (stack->len < 2)
 				goto out;
-			g_ptr_array_remove_index(stack, stack->len - 2);
+			stack_remove(stack, -2, 1);
 			break;
 
 		case OP_OVER: {
 			// (x1 x2 -- x1 x2 x1)
 			if (stack->len < 2)
 				goto out;
-			struct buffer *vch = stacktop(stack, -2);
-			stack_push(stack, vch);
+			stack_push(stack, stacktop(stack, -2));
 			break;
 		}
 
@@ -607,14 +1146,10 @@ OP_NOP10:
 			popstack(stack);
 			if (n < 0 || n >= (int)stack->len)
 				goto out;
-			struct buffer *vch = stacktop(stack, -n-1);
-			if (opcode == OP_ROLL) {
-				vch = buffer_copy(vch->p, vch->len);
-				g_ptr_array_remove_index(stack,
-							 stack->len - n - 1);
-				stack_push_nocopy(stack, vch);
-			} else
-				stack_push(stack, vch);
+			struct stack_elem vch = *stacktop(stack, -n-1);
+			if (opcode == OP_ROLL)
+				stack_remove(stack, -n-1, 1);
+			stack_push(stack, &vch);
 			break;
 		}
 
@@ -641,8 +1176,7 @@ OP_NOP10:
 			// (x1 x2 -- x2 x1 x2)
 			if (stack->len < 2)
 				goto out;
-			struct buffer *vch = stacktop(stack, -1);
-			stack_insert(stack, vch, -2);
+			stack_insert(stack, stacktop(stack, -1), -2);
 			break;
 		}
 
@@ -650,9 +1184,7 @@ OP_NOP10:
 			// (in -- in size)
 			if (stack->len < 1)
 				goto out;
-			struct buffer *vch = stacktop(stack, -1);
-			BN_set_word(&bn, vch->len);
-			stack_push_str(stack, bn_getvch(&bn));
+			stack_push_int(stack, stacktop(stack, -1)->len);
 			break;
 		}
 
@@ -662,10 +1194,11 @@ OP_NOP10:
 			// (x1 x2 - bool)
 			if (stack->len < 2)
 				goto out;
-			struct buffer *vch1 = stacktop(stack, -2);
-			struct buffer *vch2 = stacktop(stack, -1);
+			struct stack_elem *vch1 = stacktop(stack, -2);
+			struct stack_elem *vch2 = stacktop(stack, -1);
 			bool fEqual = ((vch1->len == vch2->len) &&
-				      memcmp(vch1->p, vch2->p, vch1->len) == 0);
+				      memcmp(elem_p(vch1), elem_p(vch2),
+					     vch1->len) == 0);
 			// OP_NOTEQUAL is disabled because it would be too easy to say
 			// something like n != 1 and have some wiseguy pass in 1 with extra
 			// zero bytes after it (numerically, 0x01 == 0x0001 == 0x000001)
@@ -695,35 +1228,36 @@ OP_NOP10:
 			// (in -- out)
 			if (stack->len < 1)
 				goto out;
-			if (!CastToBigNum(&bn, stacktop(stack, -1)))
+			int64_t bn;
+			if (!CastToInt64(&bn, stacktop(stack, -1)))
 				goto out;
 			switch (opcode)
 			{
 			case OP_1ADD:
-				BN_add_word(&bn, 1);
+				bn += 1;
 				break;
 			case OP_1SUB:
-				BN_sub_word(&bn, 1);
+				bn -= 1;
 				break;
 			case OP_NEGATE:
-				BN_set_negative(&bn, !BN_is_negative(&bn));
+				bn = -bn;
 				break;
 			case OP_ABS:
-				if (BN_is_negative(&bn))
-					BN_set_negative(&bn, 0);
+				if (bn < 0)
+					bn = -bn;
 				break;
 			case OP_NOT:
-				BN_set_word(&bn, BN_is_zero(&bn) ? 1 : 0);
+				bn = (bn == 0);
 				break;
 			case OP_0NOTEQUAL:
-				BN_set_word(&bn, BN_is_zero(&bn) ? 0 : 1);
+				bn = (bn != 0);
 				break;
 			default:
 				// impossible
 				goto out;
 			}
 			popstack(stack);
-			stack_push_str(stack, bn_getvch(&bn));
+			stack_push_int(stack, bn);
 			break;
 		}
 
@@ -744,70 +1278,49 @@ OP_NOP10:
 			if (stack->len < 2)
 				goto out;
 
-			BIGNUM bn1, bn2;
-			BN_init(&bn1);
-			BN_init(&bn2);
-			if (!CastToBigNum(&bn1, stacktop(stack, -2)) ||
-			    !CastToBigNum(&bn2, stacktop(stack, -1))) {
-				BN_clear_free(&bn1);
-				BN_clear_free(&bn2);
+			int64_t bn1, bn2, bn = 0;
+			if (!CastToInt64(&bn1, stacktop(stack, -2)) ||
+			    !CastToInt64(&bn2, stacktop(stack, -1)))
 				goto out;
-			}
 
 			switch (opcode)
 			{
 			case OP_ADD:
-				BN_add(&bn, &bn1, &bn2);
+				bn = bn1 + bn2;
 				break;
 			case OP_SUB:
-				BN_sub(&bn, &bn1, &bn2);
+				bn = bn1 - bn2;
 				break;
 			case OP_BOOLAND:
-				BN_set_word(&bn,
-				    (!BN_is_zero(&bn1) && !BN_is_zero(&bn2)) ?
-				    1 : 0);
+				bn = (bn1 != 0 && bn2 != 0);
 				break;
 			case OP_BOOLOR:
-				BN_set_word(&bn,
-				    (!BN_is_zero(&bn1) || !BN_is_zero(&bn2)) ?
-				    1 : 0);
+				bn = (bn1 != 0 || bn2 != 0);
 				break;
 			case OP_NUMEQUAL:
 			case OP_NUMEQUALVERIFY:
-				BN_set_word(&bn,
-				    (BN_cmp(&bn1, &bn2) == 0) ?  1 : 0);
+				bn = (bn1 == bn2);
 				break;
 			case OP_NUMNOTEQUAL:
-				BN_set_word(&bn,
-				    (BN_cmp(&bn1, &bn2) != 0) ?  1 : 0);
+				bn = (bn1 != bn2);
 				break;
 			case OP_LESSTHAN:
-				BN_set_word(&bn,
-				    (BN_cmp(&bn1, &bn2) < 0) ?  1 : 0);
+				bn = (bn1 < bn2);
 				break;
 			case OP_GREATERTHAN:
-				BN_set_word(&bn,
-				    (BN_cmp(&bn1, &bn2) > 0) ?  1 : 0);
+				bn = (bn1 > bn2);
 				break;
 			case OP_LESSTHANOREQUAL:
-				BN_set_word(&bn,
-				    (BN_cmp(&bn1, &bn2) <= 0) ?  1 : 0);
+				bn = (bn1 <= bn2);
 				break;
 			case OP_GREATERTHANOREQUAL:
-				BN_set_word(&bn,
-				    (BN_cmp(&bn1, &bn2) >= 0) ?  1 : 0);
+				bn = (bn1 >= bn2);
 				break;
 			case OP_MIN:
-				if (BN_cmp(&bn1, &bn2) < 0)
-					BN_copy(&bn, &bn1);
-				else
-					BN_copy(&bn, &bn2);
+				bn = (bn1 < bn2 ? bn1 : bn2);
 				break;
 			case OP_MAX:
-				if (BN_cmp(&bn1, &bn2) > 0)
-					BN_copy(&bn, &bn1);
-				else
-					BN_copy(&bn, &bn2);
+				bn = (bn1 > bn2 ? bn1 : bn2);
 				break;
 			default:
 				// impossible
@@ -815,9 +1328,7 @@ OP_NOP10:
 			}
 			popstack(stack);
 			popstack(stack);
-			stack_push_str(stack, bn_getvch(&bn));
-			BN_clear_free(&bn1);
-			BN_clear_free(&bn2);
+			stack_push_int(stack, bn);
 
 			if (opcode == OP_NUMEQUALVERIFY)
 			{
@@ -833,22 +1344,15 @@ OP_NOP10:
 			// (x min max -- out)
 			if (stack->len < 3)
 				goto out;
-			BIGNUM bn1, bn2, bn3;
-			BN_init(&bn1);
-			BN_init(&bn2);
-			BN_init(&bn3);
-			bool rc1 = CastToBigNum(&bn1, stacktop(stack, -3));
-			bool rc2 = CastToBigNum(&bn2, stacktop(stack, -2));
-			bool rc3 = CastToBigNum(&bn3, stacktop(stack, -1));
-			bool fValue = (BN_cmp(&bn2, &bn1) <= 0 &&
-				       BN_cmp(&bn1, &bn3) < 0);
+			int64_t bn1 = 0, bn2 = 0, bn3 = 0;
+			bool rc1 = CastToInt64(&bn1, stacktop(stack, -3));
+			bool rc2 = CastToInt64(&bn2, stacktop(stack, -2));
+			bool rc3 = CastToInt64(&bn3, stacktop(stack, -1));
+			bool fValue = (bn2 <= bn1 && bn1 < bn3);
 			popstack(stack);
 			popstack(stack);
 			popstack(stack);
 			stack_push_char(stack, fValue ? 1 : 0);
-			BN_clear_free(&bn1);
-			BN_clear_free(&bn2);
-			BN_clear_free(&bn3);
 			if (!rc1 || !rc2 || !rc3)
 				goto out;
 			break;
@@ -865,30 +1369,31 @@ OP_NOP10:
 			// (in -- hash)
 			if (stack->len < 1)
 				goto out;
-			struct buffer *vch = stacktop(stack, -1);
+			struct stack_elem *vch = stacktop(stack, -1);
+			const unsigned char *p = elem_p(vch);
 			unsigned int hashlen;
 			unsigned char md[32];
 
 			switch (opcode) {
 			case OP_RIPEMD160:
 				hashlen = 20;
-				RIPEMD160(vch->p, vch->len, md);
+				RIPEMD160(p, vch->len, md);
 				break;
 			case OP_SHA1:
 				hashlen = 20;
-				SHA1(vch->p, vch->len, md);
+				SHA1(p, vch->len, md);
 				break;
 			case OP_SHA256:
 				hashlen = 32;
-				SHA256(vch->p, vch->len, md);
+				SHA256(p, vch->len, md);
 				break;
 			case OP_HASH160:
 				hashlen = 20;
-				bu_Hash160(md, vch->p, vch->len);
+				bu_Hash160(md, p, vch->len);
 				break;
 			case OP_HASH256:
 				hashlen = 32;
-				bu_Hash(md, vch->p, vch->len);
+				bu_Hash(md, p, vch->len);
 				break;
 			default:
 				// impossible
@@ -896,14 +1401,14 @@ OP_NOP10:
 			}
 
 			popstack(stack);
-			struct buffer buf = { md, hashlen };
-			stack_push(stack, &buf);
+			stack_push_data(stack, md, hashlen);
 			break;
 		}
 
 		case OP_CODESEPARATOR:
 			// Hash starts after the code separator
-			memcpy(&pbegincodehash, &pc, sizeof(pc));
+			pbegincodehash.p = script->p + sop->end;
+			pbegincodehash.len = script->len - sop->end;
 			break;
 
 		case OP_CHECKSIG:
@@ -912,33 +1417,17 @@ OP_NOP10:
 			if (stack->len < 2)
 				goto out;
 
-			struct buffer *vchSig	= stacktop(stack, -2);
-			struct buffer *vchPubKey = stacktop(stack, -1);
+			struct stack_elem *vchSig	= stacktop(stack, -2);
+			struct stack_elem *vchPubKey = stacktop(stack, -1);
 
 			////// debug print
 			//PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
 			//PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
 
-			// Subset of script starting at the most recent codeseparator
-			GString *scriptCode = g_string_sized_new(pbegincodehash.len);
-			g_string_append_len(scriptCode,
-					    pbegincodehash.p,
-					    pbegincodehash.len);
-
-			// Drop the signature, since there's no way for
-			// a signature to sign itself
-			string_find_del(scriptCode, vchSig);
-
-			bool fSuccess =
-				(!fStrictEncodings ||
-				 (IsCanonicalSignature(vchSig) &&
-				  IsCanonicalPubKey(vchPubKey)));
-			if (fSuccess)
-				fSuccess = bp_checksig(vchSig, vchPubKey,
-						       scriptCode,
-						       txTo, nIn, nHashType);
-
-			g_string_free(scriptCode, TRUE);
+			bool fSuccess = script_checksig(vchSig, vchPubKey,
+							&pbegincodehash,
+							txTo, nIn, flags,
+							nHashType);
 
 			popstack(stack);
 			popstack(stack);
@@ -964,8 +1453,8 @@ OP_NOP10:
 			int nKeysCount = stackint(stack, -i);
 			if (nKeysCount < 0 || nKeysCount > 20)
 				goto out;
-			nOpCount += nKeysCount;
-			if (nOpCount > 201)
+			nOpCountExtra += nKeysCount;
+			if (sop->n_counted + nOpCountExtra > MAX_OPS_PER_SCRIPT)
 				goto out;
 			int ikey = ++i;
 			i += nKeysCount;
@@ -980,51 +1469,17 @@ OP_NOP10:
 			if ((int)stack->len < i)
 				goto out;
 
-			// Subset of script starting at the most recent codeseparator
-			GString *scriptCode = g_string_sized_new(pbegincodehash.len);
-			g_string_append_len(scriptCode,
-					    pbegincodehash.p,
-					    pbegincodehash.len);
-
-			// Drop the signatures, since there's no way for
-			// a signature to sign itself
+			const struct stack_elem *sigs[20], *keys[20];
 			int k;
 			for (k = 0; k < nSigsCount; k++)
-			{
-				struct buffer *vchSig =stacktop(stack, -isig-k);
-				string_find_del(scriptCode, vchSig);
-			}
+				sigs[k] = stacktop(stack, -isig-k);
+			for (k = 0; k < nKeysCount; k++)
+				keys[k] = stacktop(stack, -ikey-k);
 
-			bool fSuccess = true;
-			while (fSuccess && nSigsCount > 0)
-			{
-				struct buffer *vchSig	= stacktop(stack, -isig);
-				struct buffer *vchPubKey = stacktop(stack, -ikey);
-
-				// Check signature
-				bool fOk =
-					(!fStrictEncodings ||
-					 (IsCanonicalSignature(vchSig) &&
-					  IsCanonicalPubKey(vchPubKey)));
-				if (fOk)
-					fOk = bp_checksig(vchSig, vchPubKey,
-							  scriptCode, txTo, nIn,
-							  nHashType);
-
-				if (fOk) {
-					isig++;
-					nSigsCount--;
-				}
-				ikey++;
-				nKeysCount--;
-
-				// If there are more signatures left than keys left,
-				// then too many signatures have failed
-				if (nSigsCount > nKeysCount)
-					fSuccess = false;
-			}
-
-			g_string_free(scriptCode, TRUE);
+			bool fSuccess = script_checkmultisig(sigs, nSigsCount,
+						keys, nKeysCount,
+						&pbegincodehash, txTo, nIn,
+						flags, nHashType);
 
 			while (i-- > 0)
 				popstack(stack);
@@ -1044,16 +1499,249 @@ OP_NOP10:
 			goto out;
 		}
 
-		if (stack->len + altstack->len > 1000)
+		if (stack->len + altstack.len > MAX_STACK_SIZE)
 			goto out;
 	}
 
-	rc = (vfExec->len == 0 && bp.error == false);
+	/* the opcode limit also covers any ops after the last
+	 * OP_CHECKMULTISIG, executed or not
+	 */
+	rc = (prog->n_counted + nOpCountExtra <= MAX_OPS_PER_SCRIPT);
 
 out:
-	BN_clear_free(&bn);
-	g_ptr_array_free(altstack, TRUE);
-	g_byte_array_unref(vfExec);
+	return rc;
+}
+
+/*
+ * Fast paths for the standard templates, skipping the interpreter.
+ * Each leaves the same stack, and returns the same result, as running
+ * the script would.
+ */
+enum script_fast {
+	SCRIPT_FAST_NONE,
+	SCRIPT_FAST_PUBKEY,
+	SCRIPT_FAST_PUBKEYHASH,
+	SCRIPT_FAST_SCRIPTHASH,
+	SCRIPT_FAST_MULTISIG,
+};
+
+/* OP_m <pubkey> ... OP_n OP_CHECKMULTISIG, with m <= n */
+static bool is_fast_multisig(const unsigned char *s, size_t len)
+{
+	if (len < 4 || s[len - 1] != OP_CHECKMULTISIG ||
+	    s[0] < OP_1 || s[0] > OP_16 ||
+	    s[len - 2] < OP_1 || s[len - 2] > OP_16 || s[0] > s[len - 2])
+		return false;
+
+	unsigned int n_keys = s[len - 2] - OP_1 + 1;
+	size_t pos = 1;
+	unsigned int i;
+	for (i = 0; i < n_keys; i++) {
+		if (pos >= len - 2 || s[pos] < 1 || s[pos] >= OP_PUSHDATA1)
+			return false;
+		pos += 1 + s[pos];
+	}
+
+	return (pos == len - 2);
+}
+
+static enum script_fast script_fast_type(const struct const_buffer *script)
+{
+	const unsigned char *s = script->p;
+	size_t len = script->len;
+
+	/* OP_DUP OP_HASH160 <20 bytes> OP_EQUALVERIFY OP_CHECKSIG */
+	if (len == 25 && s[0] == OP_DUP && s[1] == OP_HASH160 &&
+	    s[2] == 20 && s[23] == OP_EQUALVERIFY && s[24] == OP_CHECKSIG)
+		return SCRIPT_FAST_PUBKEYHASH;
+
+	/* <pubkey> OP_CHECKSIG */
+	if (len >= 2 && s[0] >= 1 && s[0] < OP_PUSHDATA1 &&
+	    len == (size_t) s[0] + 2 && s[len - 1] == OP_CHECKSIG)
+		return SCRIPT_FAST_PUBKEY;
+
+	/* OP_HASH160 <20 bytes> OP_EQUAL */
+	if (len == 23 && s[0] == OP_HASH160 && s[1] == 20 &&
+	    s[22] == OP_EQUAL)
+		return SCRIPT_FAST_SCRIPTHASH;
+
+	if (is_fast_multisig(s, len))
+		return SCRIPT_FAST_MULTISIG;
+
+	return SCRIPT_FAST_NONE;
+}
+
+static bool script_eval_pubkeyhash(struct script_stack *stack,
+				   const struct const_buffer *script,
+				   const struct bp_tx *txTo, unsigned int nIn,
+				   unsigned int flags, int nHashType)
+{
+	const unsigned char *hash = (const unsigned char *) script->p + 3;
+
+	/* DUP and the hash push peak at two more elements */
+	if (stack->len < 2 || stack->len + 2 > MAX_STACK_SIZE)
+		return false;
+
+	struct stack_elem *vchPubKey = stacktop(stack, -1);
+	unsigned char md[20];
+	bu_Hash160(md, elem_p(vchPubKey), vchPubKey->len);
+	if (memcmp(md, hash, sizeof(md)))
+		return false;
+
+	bool fSuccess = script_checksig(stacktop(stack, -2), vchPubKey,
+					script, txTo, nIn, flags, nHashType);
+
+	popstack(stack);
+	popstack(stack);
+	stack_push_char(stack, fSuccess ? 1 : 0);
+	return true;
+}
+
+static bool script_eval_pubkey(struct script_stack *stack,
+			       const struct const_buffer *script,
+			       const struct bp_tx *txTo, unsigned int nIn,
+			       unsigned int flags, int nHashType)
+{
+	if (stack->len < 1 || stack->len + 1 > MAX_STACK_SIZE)
+		return false;
+
+	struct stack_elem vchPubKey = {
+		.p	= (const unsigned char *) script->p + 1,
+		.len	= script->len - 2,
+	};
+
+	bool fSuccess = script_checksig(stacktop(stack, -1), &vchPubKey,
+					script, txTo, nIn, flags, nHashType);
+
+	popstack(stack);
+	stack_push_char(stack, fSuccess ? 1 : 0);
+	return true;
+}
+
+static bool script_eval_scripthash(struct script_stack *stack,
+				   const struct const_buffer *script)
+{
+	const unsigned char *hash = (const unsigned char *) script->p + 2;
+
+	if (stack->len < 1 || stack->len + 1 > MAX_STACK_SIZE)
+		return false;
+
+	struct stack_elem *vch = stacktop(stack, -1);
+	unsigned char md[20];
+	bu_Hash160(md, elem_p(vch), vch->len);
+
+	popstack(stack);
+	stack_push_char(stack, memcmp(md, hash, sizeof(md)) ? 0 : 1);
+	return true;
+}
+
+static bool script_eval_multisig(struct script_stack *stack,
+				 const struct const_buffer *script,
+				 const struct bp_tx *txTo, unsigned int nIn,
+				 unsigned int flags, int nHashType)
+{
+	const unsigned char *s = script->p;
+	int nSigsCount = s[0] - OP_1 + 1;
+	int nKeysCount = s[script->len - 2] - OP_1 + 1;
+
+	/* the signatures, under them the element CHECKMULTISIG also
+	 * pops, and room for the counts and keys pushed on top
+	 */
+	if ((int) stack->len < nSigsCount + 1 ||
+	    stack->len + nKeysCount + 2 > MAX_STACK_SIZE)
+		return false;
+
+	struct stack_elem key_elems[16];
+	const struct stack_elem *sigs[16], *keys[16];
+	size_t pos = 1;
+	int k;
+	for (k = 0; k < nKeysCount; k++) {
+		key_elems[k].p = s + pos + 1;
+		key_elems[k].len = s[pos];
+		pos += 1 + s[pos];
+	}
+
+	/* tried from the last key, and the topmost signature, down */
+	for (k = 0; k < nKeysCount; k++)
+		keys[k] = &key_elems[nKeysCount - 1 - k];
+	for (k = 0; k < nSigsCount; k++)
+		sigs[k] = stacktop(stack, -1 - k);
+
+	bool fSuccess = script_checkmultisig(sigs, nSigsCount,
+					     keys, nKeysCount, script,
+					     txTo, nIn, flags, nHashType);
+
+	for (k = 0; k <= nSigsCount; k++)
+		popstack(stack);
+	stack_push_char(stack, fSuccess ? 1 : 0);
+	return true;
+}
+
+/* push-only scripts, such as nearly every scriptSig */
+static bool script_eval_pushonly(struct script_stack *stack,
+				 const struct const_buffer *script)
+{
+	if (script->len > 10000)
+		return false;
+
+	struct const_buffer pc = *script;
+	struct bscript_parser bp;
+	struct bscript_op op;
+	bsp_start(&bp, &pc);
+
+	while (bsp_getop(&op, &bp)) {
+		if (op.data.len > MAX_SCRIPT_ELEMENT_SIZE)
+			return false;
+
+		stack_push_ref(stack, op.data.p, op.data.len);
+		if (stack->len > MAX_STACK_SIZE)
+			return false;
+	}
+
+	return !bp.error;
+}
+
+/*
+ * Evaluate a script: by template, where it matches one, or else by
+ * running its compiled form.  Scripts that recur (output and redeem
+ * scripts) are worth caching; scriptSigs, unique to each input, are not.
+ */
+static bool bp_script_eval(struct script_stack *stack,
+			   const struct const_buffer *script,
+			   const struct bp_tx *txTo, unsigned int nIn,
+			   unsigned int flags, int nHashType, bool cache)
+{
+	switch (script_fast_type(script)) {
+	case SCRIPT_FAST_PUBKEYHASH:
+		return script_eval_pubkeyhash(stack, script, txTo, nIn,
+					      flags, nHashType);
+	case SCRIPT_FAST_PUBKEY:
+		return script_eval_pubkey(stack, script, txTo, nIn,
+					  flags, nHashType);
+	case SCRIPT_FAST_SCRIPTHASH:
+		return script_eval_scripthash(stack, script);
+	case SCRIPT_FAST_MULTISIG:
+		return script_eval_multisig(stack, script, txTo, nIn,
+					    flags, nHashType);
+	case SCRIPT_FAST_NONE:
+		break;
+	}
+
+	struct const_buffer tmp = *script;
+	if (is_bsp_pushonly(&tmp))
+		return script_eval_pushonly(stack, script);
+
+	if (!cache) {
+		struct script_prog *prog = script_compile(script, stack->arena);
+		return script_run(stack, prog, script, txTo, nIn, flags,
+				  nHashType);
+	}
+
+	struct script_prog *prog = script_cache_get(script);
+
+	bool rc = script_run(stack, prog, script, txTo, nIn, flags, nHashType);
+
+	script_prog_put(prog);
 	return rc;
 }
 
@@ -1062,63 +1750,60 @@ bool bp_script_verify(const GString *scriptSig, const GString *scriptPubKey,
 		      unsigned int flags, int nHashType)
 {
 	bool rc = false;
-	GPtrArray *stack = g_ptr_array_new_with_free_func(
-						(GDestroyNotify) buffer_free);
-	GString *pubkey2 = NULL;
-	GPtrArray *stackCopy = NULL;
+	struct script_arena arena;
+	struct script_stack stack, stackCopy;
+	struct const_buffer sigbuf = { scriptSig->str, scriptSig->len };
+	struct const_buffer pubbuf = { scriptPubKey->str, scriptPubKey->len };
+
+	arena_init(&arena);
+	stack_init(&stack, &arena);
+	stack_init(&stackCopy, &arena);
 
-	if (!bp_script_eval(stack, scriptSig, txTo, nIn, flags, nHashType))
+	if (!bp_script_eval(&stack, &sigbuf, txTo, nIn, flags, nHashType,
+			    false))
 		goto out;
 
-	if (flags & SCRIPT_VERIFY_P2SH) {
-		stackCopy = g_ptr_array_new_full(stack->len,
-						(GDestroyNotify) buffer_free);
-		stack_copy(stackCopy, stack);
-	}
+	if (flags & SCRIPT_VERIFY_P2SH)
+		stack_copy(&stackCopy, &stack);
 
-	if (!bp_script_eval(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+	if (!bp_script_eval(&stack, &pubbuf, txTo, nIn, flags, nHashType,
+			    true))
 		goto out;
-	if (stack->len == 0)
+	if (stack.len == 0)
 		goto out;
 
-	if (CastToBool(stacktop(stack, -1)) == false)
+	if (CastToBool(stacktop(&stack, -1)) == false)
 		goto out;
 
 	if ((flags & SCRIPT_VERIFY_P2SH) && is_bsp_p2sh_str(scriptPubKey)) {
-		struct const_buffer sigbuf = { scriptSig->str, scriptSig->len };
 		if (!is_bsp_pushonly(&sigbuf))
 			goto out;
-		if (stackCopy->len < 1)
+		if (stackCopy.len < 1)
 			goto out;
 
-		struct buffer *pubkey2_buf = stack_take(stackCopy, -1);
-		popstack(stackCopy);
-
-		GString *pubkey2 = g_string_sized_new(pubkey2_buf->len);
-		g_string_append_len(pubkey2, pubkey2_buf->p, pubkey2_buf->len);
+		/* the serialized script is the top element; keep it
+		 * out of the stack, where evaluation may overwrite it
+		 */
+		struct stack_elem pubkey2_elem = *stacktop(&stackCopy, -1);
+		popstack(&stackCopy);
 
-		buffer_free(pubkey2_buf);
-
-		bool rc2 = bp_script_eval(stackCopy, pubkey2, txTo, nIn,
-					  flags, nHashType);
-		g_string_free(pubkey2, TRUE);
+		struct const_buffer pubkey2 = {
+			elem_p(&pubkey2_elem), pubkey2_elem.len
+		};
 
-		if (!rc2)
+		if (!bp_script_eval(&stackCopy, &pubkey2, txTo, nIn,
+				    flags, nHashType, true))
 			goto out;
-		if (stackCopy->len == 0)
+		if (stackCopy.len == 0)
 			goto out;
-		if (CastToBool(stacktop(stackCopy, -1)) == false)
+		if (CastToBool(stacktop(&stackCopy, -1)) == false)
 			goto out;
 	}
 
 	rc = true;
 
 out:
-	g_ptr_array_free(stack, TRUE);
-	if (pubkey2)
-		g_string_free(pubkey2, TRUE);
-	if (stackCopy)
-		g_ptr_array_free(stackCopy, TRUE);
+	arena_free(&arena);
 	return rc;
 }
 
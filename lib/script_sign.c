@@ -10,54 +10,51 @@
 
 static bool sign1(const bu160_t *key_id, struct bp_keystore *ks,
 		  const bu256_t *hash, int nHashType,
-		  GString *scriptSig)
+		  GString *scriptSig, bool append_pubkey)
 {
-	struct bp_key key;
+	struct bp_key key;		/* a reference; not ours to free */
+	struct bp_signer signer;
+	unsigned char sig[BP_SIG_MAX + 1];
+	size_t siglen = 0;
 	bool rc = false;
 
-	bp_key_init(&key);
-
 	/* find private key in keystore */
 	if (!bkeys_privkey_get(ks, key_id, &key))
+		return false;
+	if (!bp_signer_init(&signer, &key))
 		goto out;
 
-	void *sig = NULL;
-	size_t siglen = 0;
-
 	/* sign hash with private key */
-	if (!bp_sign(&key, hash, sizeof(*hash), &sig, &siglen))
+	if (!bp_signer_sign(&signer, hash, sizeof(*hash), sig, &siglen))
 		goto out;
 
 	/* append nHashType to signature */
-	unsigned char ch = (unsigned char) nHashType;
-	sig = realloc(sig, siglen + 1);
-	memcpy(sig + siglen, &ch, 1);
-	siglen++;
+	sig[siglen++] = (unsigned char) nHashType;
 
 	/* append signature to scriptSig */
 	bsp_push_data(scriptSig, sig, siglen);
-	free(sig);
+
+	if (append_pubkey) {
+		const void *pubkey;
+		size_t pk_len;
+
+		if (!bp_signer_pubkey(&signer, &pubkey, &pk_len))
+			goto out;
+		bsp_push_data(scriptSig, pubkey, pk_len);
+	}
 
 	rc = true;
 
 out:
-	bp_key_free(&key);
+	bp_signer_free(&signer);
 	return rc;
 }
 
-bool bp_script_sign(struct bp_keystore *ks, const GString *fromPubKey,
-		    const struct bp_tx *txTo, unsigned int nIn,
-		    int nHashType)
+static bool script_sign_hash(struct bp_keystore *ks,
+			     const GString *fromPubKey,
+			     struct bp_txin *txin, const bu256_t *hash,
+			     int nHashType)
 {
-	if (!txTo || !txTo->vin || nIn >= txTo->vin->len)
-		return false;
-
-	struct bp_txin *txin = g_ptr_array_index(txTo->vin, nIn);
-
-	/* get signature hash */
-	bu256_t hash;
-	bp_tx_sighash(&hash, fromPubKey, txTo, nIn, nHashType);
-
 	/* match fromPubKey against templates, to find what pubkey[hashes]
 	 * are required for signing
 	 */
@@ -76,7 +73,7 @@ bool bp_script_sign(struct bp_keystore *ks, const GString *fromPubKey,
 		kbuf = addrs.pub->data;
 		bu_Hash160((unsigned char *)&key_id, kbuf->p, kbuf->len);
 
-		if (!sign1(&key_id, ks, &hash, nHashType, scriptSig))
+		if (!sign1(&key_id, ks, hash, nHashType, scriptSig, false))
 			goto out;
 		break;
 
@@ -84,9 +81,7 @@ bool bp_script_sign(struct bp_keystore *ks, const GString *fromPubKey,
 		kbuf = addrs.pubhash->data;
 		memcpy(&key_id, kbuf->p, kbuf->len);
 
-		if (!sign1(&key_id, ks, &hash, nHashType, scriptSig))
-			goto out;
-		if (!bkeys_pubkey_append(ks, &key_id, scriptSig))
+		if (!sign1(&key_id, ks, hash, nHashType, scriptSig, true))
 			goto out;
 		break;
 
@@ -111,6 +106,54 @@ out:
 	return rc;
 }
 
+bool bp_script_sign(struct bp_keystore *ks, const GString *fromPubKey,
+		    const struct bp_tx *txTo, unsigned int nIn,
+		    int nHashType)
+{
+	if (!txTo || !txTo->vin || nIn >= txTo->vin->len)
+		return false;
+
+	struct bp_txin *txin = g_ptr_array_index(txTo->vin, nIn);
+
+	/* get signature hash */
+	bu256_t hash;
+	bp_tx_sighash(&hash, fromPubKey, txTo, nIn, nHashType);
+
+	return script_sign_hash(ks, fromPubKey, txin, &hash, nHashType);
+}
+
+bool bp_script_sign_all(struct bp_keystore *ks, GString * const *fromPubKeys,
+			struct bp_tx *txTo, int nHashType)
+{
+	if (!ks || !fromPubKeys || !txTo || !txTo->vin)
+		return false;
+
+	struct bp_sighash_ctx ctx;
+	bool rc = true;
+	unsigned int i;
+
+	/* scriptSigs are blanked for hashing, so signing as we go is safe */
+	bp_sighash_ctx_init(&ctx, txTo);
+
+	for (i = 0; i < txTo->vin->len; i++) {
+		struct bp_txin *txin = g_ptr_array_index(txTo->vin, i);
+		bu256_t hash;
+
+		if (!fromPubKeys[i]) {
+			rc = false;
+			continue;
+		}
+
+		bp_sighash_ctx_hash(&hash, &ctx, fromPubKeys[i], i, nHashType);
+		if (!script_sign_hash(ks, fromPubKeys[i], txin, &hash,
+				      nHashType))
+			rc = false;
+	}
+
+	bp_sighash_ctx_free(&ctx);
+	return rc;
+}
+
 bool bp_sign_sig(struct bp_keystore *ks, const struct bp_utxo *txFrom,
 		 struct bp_tx *txTo, unsigned int nIn,
 		 unsigned int flags, int nHashType)
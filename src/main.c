@@ -239,7 +239,9 @@ static void print_help()
 	const char *settings[] = {
 		"config","Pathname to the configuration file.",
 		"wallet","Pathname to the wallet file.",
-		"chain","One of 'bitcoin' or 'testnet3', use with chain-set command."
+		"chain","One of 'bitcoin' or 'testnet3', use with chain-set command.",
+		"count","Number of addresses, use with new-addresses command.",
+		"netstats","If set, netsync logs received messages per command on exit."
 	};
 
 	const char *commands[] = {
@@ -247,6 +249,7 @@ static void print_help()
 		"dns-seeds","Query and display bitcoin DNS seeds.",
 		"list-settings","Display settings map.",
 		"new-address","Generate a new address and output it. Store pair in wallet.",
+		"new-addresses","Generate count=N new addresses at once, as new-address.",
 		"new-wallet","Initialize a new wallet. Refuses to initialize if the file exists.",
 		"netsync","\tSynchronize with the network, sending and receiving payments.",
 		"wallet-addr","List all address in the wallet.",
@@ -272,6 +275,7 @@ static bool is_command(const char *s)
 		!strcmp(s, "help") ||
 		!strcmp(s, "list-settings") ||
 		!strcmp(s, "new-address") ||
+		!strcmp(s, "new-addresses") ||
 		!strcmp(s, "new-wallet") ||
 		!strcmp(s, "netsync") ||
 		!strcmp(s, "version") ||
@@ -298,6 +302,9 @@ static bool do_command(const char *s)
 	else if (!strcmp(s, "new-address"))
 		wallet_new_address();
 
+	else if (!strcmp(s, "new-addresses"))
+		wallet_new_addresses();
+
 	else if (!strcmp(s, "new-wallet"))
 		wallet_create();
 
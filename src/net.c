@@ -24,12 +24,14 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 #include <glib.h>
 #include <event2/event.h>
 #include <ccoin/util.h>
 #include <ccoin/mbr.h>
 #include <ccoin/core.h>
 #include <ccoin/message.h>
+#include <ccoin/bloom.h>
 #include "picocoin.h"
 #include "peerman.h"
 #include <ccoin/blkdb.h>
@@ -51,6 +53,49 @@ enum netcmds {
 	NC_STOP,
 };
 
+enum {
+	NC_MAX_CONN		= 8,		/* outbound connections */
+	NC_MAX_INBOUND		= 64,		/* inbound connections */
+	NC_MAX_INBOUND_SUBNET	= 4,		/* inbound, per /16 or /32 */
+	NC_ACCEPT_BATCH		= 16,		/* accept(2)s per event */
+	NC_ACCEPT_BACKOFF_MS	= 1000,		/* pause, when out of fds */
+	NC_LISTEN_BACKLOG	= 32,
+	NC_MAX_IOV		= 16,		/* buffers per writev(2) */
+	NC_SENDQ_INIT		= 16,		/* initial send ring slots */
+	NC_RDBUF_SZ		= 16 * 1024,	/* bytes per read(2) */
+
+	/* send queue backpressure, in bytes.  Above HIGH, stop reading
+	 * from the peer until its queue drains below LOW; above MAX,
+	 * give up on the peer entirely.
+	 */
+	NC_SENDQ_LOW		= 1 * 1024 * 1024,
+	NC_SENDQ_HIGH		= 4 * 1024 * 1024,
+	NC_SENDQ_MAX		= 16 * 1024 * 1024,
+
+	/* inventory relay */
+	NC_TRICKLE_MS		= 500,		/* inv announcement batching */
+	NC_KNOWN_INV_GEN	= 5000,		/* entries per known-inv gen. */
+	NC_RELAY_EXPIRE		= 15 * 60,	/* seconds tx is served */
+	NC_RELAY_MAX_BYTES	= 32 * 1024 * 1024,
+	NC_INV_REQ_EXPIRE	= 2 * 60,	/* seconds, getdata in flight */
+
+	NC_MAINT_MS		= 1000,		/* housekeeping interval */
+	NC_STALL_MS		= 30 * 1000,	/* getdata unanswered */
+	NC_RATE_MIN_MS		= 10 * 1000,	/* min session, for rx_bps */
+
+	NC_HANDSHAKE_MS		= 60 * 1000,	/* connect, to verack */
+	NC_PING_MS		= 2 * 60 * 1000, /* keepalive interval */
+	NC_PING_TIMEOUT_MS	= 5 * 60 * 1000, /* pong overdue */
+	NC_INACTIVE_MS		= 20 * 60 * 1000, /* nothing received */
+
+	NC_PEERS_SAVE_MS	= 15 * 60 * 1000, /* peers file, if changed */
+};
+
+struct nc_cmd_stats {
+	uint64_t		count;
+	uint64_t		bytes;		/* including header */
+};
+
 struct net_child_info {
 	int			read_fd;
 	int			write_fd;
@@ -60,19 +105,68 @@ struct net_child_info {
 
 	GPtrArray		*conns;
 	struct event_base	*eb;
+	bool			edge_triggered;	/* EV_ET conn events? */
+
+	int			listen_fd;
+	struct event		*listen_ev;
+	struct event		*listen_backoff_ev;
+	unsigned int		n_inbound;
+
+	struct nc_cmd_stats	cmd_stats[MSG_CMD_COUNT];	/* received */
+
+	GHashTable		*relay;		/* hash -> nc_relay_item */
+	GQueue			relay_q;	/* of nc_relay_item, by age */
+	size_t			relay_bytes;
+	GHashTable		*inv_req;	/* hash -> getdata expiry */
+	struct event		*trickle_ev;
+
+	struct event		*maint_ev;
+	int64_t			t_peers_save;	/* ms */
+
+	struct event		*seed_ev;	/* DNS seed results ready */
+};
+
+/* recently seen transaction, served to peers in answer to getdata */
+struct nc_relay_item {
+	bu256_t			hash;		/* hash table key */
+	time_t			expire;
+	struct buffer		data;		/* serialized tx */
+};
+
+/*
+ * Rolling set of inventory a peer is known to have: two bloom filter
+ * generations, the older one cleared and reused whenever the current
+ * one fills.  An entry is remembered for at least one generation.
+ */
+struct nc_known_inv {
+	struct bloom		gen[2];
+	unsigned int		cur;		/* generation taking inserts */
+	unsigned int		n_cur;		/* inserts into current gen. */
+};
+
+/* ring of outgoing wire messages; each slot owns one malloc'd buffer */
+struct nc_sendq {
+	struct buffer		*ring;
+	unsigned int		size;		/* slot count; power of 2 */
+	unsigned int		head;		/* slot of oldest message */
+	unsigned int		count;		/* slots in use */
+	unsigned int		partial;	/* bytes of head already sent */
+	size_t			bytes;		/* bytes queued, not yet sent */
 };
 
 struct nc_conn {
 	int			fd;
 	struct bp_address	addr;
 	bool			ipv4;
+	bool			inbound;	/* accepted, not connected */
 	bool			connected;
 	struct event		*ev;
 	struct net_child_info	*nci;
 
 	struct event		*write_ev;
-	GList			*write_q;	/* of struct buffer */
-	unsigned int		write_partial;
+	struct nc_sendq		sendq;
+	bool			reading;	/* read event armed? */
+	bool			writing;	/* write event armed? */
 
 	struct p2p_message	msg;
 
@@ -80,18 +174,42 @@ struct nc_conn {
 	unsigned int		expected;
 	bool			reading_hdr;
 	unsigned char		hdrbuf[P2P_HDR_SZ];
+	unsigned char		rdbuf[NC_RDBUF_SZ];
 
 	bool			seen_version;
 	bool			seen_verack;
 	uint32_t		protover;
+
+	struct nc_known_inv	known;
+	GArray			*inv_q;		/* of bp_inv, to announce */
+
+	/* outbound: peer database record, returned when conn ends */
+	struct peer		*peer;
+	int64_t			t_start;	/* ms; connect(2) or accept(2) */
+	int64_t			t_established;	/* ms */
+	uint64_t		bytes_rx;
+	unsigned int		getdata_pending;
+	int64_t			t_getdata;	/* ms; oldest request pending */
+	bool			stalled;
+
+	/* keepalive */
+	int64_t			t_last_rx;	/* ms */
+	int64_t			t_ping;		/* ms; last ping sent */
+	uint64_t		ping_nonce;	/* awaiting pong, if non-zero */
+	uint32_t		rtt_ms;		/* ping round trip, EWMA */
 };
 
+static int64_t nc_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
 
-enum {
-	NC_MAX_CONN		= 8,
-};
 
 static void nc_conn_free(struct nc_conn *conn);
+static bool nc_conn_send_version(struct nc_conn *conn);
 static bool nc_conn_read_enable(struct nc_conn *conn);
 static bool nc_conn_read_disable(struct nc_conn *conn);
 static bool nc_conn_write_enable(struct nc_conn *conn);
@@ -142,144 +260,192 @@ static enum netcmds readcmd(int fd, int timeout_secs)
 	return v;
 }
 
-static void nc_conn_build_iov(GList *write_q, unsigned int partial,
-			      struct iovec **iov_, unsigned int *iov_len_)
+static bool nc_sendq_push(struct nc_sendq *q, void *p, size_t len)
 {
-	*iov_ = NULL;
-	*iov_len_ = 0;
+	/* ring full (or not yet allocated); double it, unwrapping */
+	if (q->count == q->size) {
+		unsigned int i, new_size = q->size ? q->size * 2 : NC_SENDQ_INIT;
+		struct buffer *ring = malloc(new_size * sizeof(struct buffer));
+		if (!ring)
+			return false;
+
+		for (i = 0; i < q->count; i++)
+			ring[i] = q->ring[(q->head + i) & (q->size - 1)];
+
+		free(q->ring);
+		q->ring = ring;
+		q->size = new_size;
+		q->head = 0;
+	}
+
+	struct buffer *buf = &q->ring[(q->head + q->count) & (q->size - 1)];
+	buf->p = p;
+	buf->len = len;
+
+	q->count++;
+	q->bytes += len;
+
+	return true;
+}
 
-	unsigned int i, iov_len = g_list_length(write_q);
-	struct iovec *iov = calloc(iov_len, sizeof(struct iovec));
+static unsigned int nc_sendq_iov(const struct nc_sendq *q,
+				 struct iovec *iov, unsigned int iov_max)
+{
+	unsigned int i, iov_len = MIN(q->count, iov_max);
 
-	GList *tmp = write_q;
+	for (i = 0; i < iov_len; i++) {
+		const struct buffer *buf;
 
-	i = 0;
-	while (tmp) {
-		struct buffer *buf = tmp->data;
+		buf = &q->ring[(q->head + i) & (q->size - 1)];
 
 		iov[i].iov_base = buf->p;
 		iov[i].iov_len = buf->len;
+	}
 
-		if (i == 0) {
-			iov[0].iov_base += partial;
-			iov[0].iov_len -= partial;
-		}
-
-		tmp = tmp->next;
-		i++;
+	if (iov_len > 0) {
+		iov[0].iov_base += q->partial;
+		iov[0].iov_len -= q->partial;
 	}
 
-	*iov_ = iov;
-	*iov_len_ = iov_len;
+	return iov_len;
 }
 
-static void nc_conn_written(struct nc_conn *conn, size_t bytes)
+static void nc_sendq_written(struct nc_sendq *q, size_t bytes)
 {
+	q->bytes -= bytes;
+
 	while (bytes > 0) {
-		GList *tmp;
-		struct buffer *buf;
-		unsigned int left;
+		struct buffer *buf = &q->ring[q->head];
+		size_t left = buf->len - q->partial;
 
-		tmp = conn->write_q;
-		buf = tmp->data;
-		left = buf->len - conn->write_partial;
+		/* buffer partially written; store state */
+		if (bytes < left) {
+			q->partial += bytes;
+			break;
+		}
 
 		/* buffer fully written; free */
-		if (bytes >= left) {
-			free(buf->p);
-			free(buf);
-			conn->write_partial = 0;
-			conn->write_q = g_list_delete_link(tmp, tmp);
+		free(buf->p);
+		buf->p = NULL;
 
-			bytes -= left;
-		}
+		q->head = (q->head + 1) & (q->size - 1);
+		q->count--;
+		q->partial = 0;
 
-		/* buffer partially written; store state */
-		else {
-			conn->write_partial += bytes;
-			break;
-		}
+		bytes -= left;
+	}
+}
+
+static void nc_sendq_free(struct nc_sendq *q)
+{
+	while (q->count > 0) {
+		free(q->ring[q->head].p);
+
+		q->head = (q->head + 1) & (q->size - 1);
+		q->count--;
 	}
+
+	free(q->ring);
+	memset(q, 0, sizeof(*q));
 }
 
 static void nc_conn_write_evt(int fd, short events, void *priv)
 {
 	struct nc_conn *conn = priv;
-	struct iovec *iov = NULL;
-	unsigned int iov_len = 0;
+	struct iovec iov[NC_MAX_IOV];
+	unsigned int iov_len;
 
-	/* build list of outgoing data buffers */
-	nc_conn_build_iov(conn->write_q, conn->write_partial, &iov, &iov_len);
+	do {
+		/* build list of outgoing data buffers */
+		iov_len = nc_sendq_iov(&conn->sendq, iov, NC_MAX_IOV);
 
-	/* send data to network */
-	ssize_t wrc = writev(conn->fd, iov, iov_len);
+		/* send data to network */
+		ssize_t wrc = writev(conn->fd, iov, iov_len);
 
-	free(iov);
+		if (wrc < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				nc_conn_free(conn);
+				return;
+			}
+			break;
+		}
 
-	if (wrc < 0) {
-		if (errno != EAGAIN && errno != EWOULDBLOCK)
-			nc_conn_free(conn);
-		return;
-	}
+		/* handle partially and fully completed buffers */
+		nc_sendq_written(&conn->sendq, wrc);
 
-	/* handle partially and fully completed buffers */
-	nc_conn_written(conn, wrc);
+	/* edge-triggered: keep writing until the socket is full */
+	} while (conn->nci->edge_triggered && conn->sendq.count);
 
-	/* thaw read, if write fully drained */
-	if (!conn->write_q) {
+	/* stop polling for writable, once write queue fully drained */
+	if (!conn->sendq.count)
 		nc_conn_write_disable(conn);
-		nc_conn_read_enable(conn);
-	}
+
+	/* thaw read, once peer has caught up with our output */
+	if (!conn->reading && conn->sendq.bytes < NC_SENDQ_LOW &&
+	    !nc_conn_read_enable(conn))
+		nc_conn_free(conn);
 }
 
-static bool nc_conn_send(struct nc_conn *conn, const char *command,
-			 const void *data, size_t data_len)
+/*
+ * Send a wire message started with message_new(), whose payload has been
+ * serialized directly after the reserved header.  Takes ownership of msg.
+ */
+static bool nc_conn_send_msg(struct nc_conn *conn, const char *command,
+			     GString *msg)
 {
-	/* build wire message */
-	GString *msg = message_str(chain->netmagic, command, data, data_len);
-	if (!msg)
-		return false;
+	message_finish(msg, chain->netmagic, command);
 
 	/* buffer now owns message data */
-	struct buffer *buf = calloc(1, sizeof(struct buffer));
-	buf->p = msg->str;
-	buf->len = msg->len;
+	size_t msg_len = msg->len;
+	void *msg_p = g_string_free(msg, FALSE);
 
-	g_string_free(msg, FALSE);
+	/* peer is not reading what we send; give up */
+	if (conn->sendq.bytes + msg_len > NC_SENDQ_MAX) {
+		free(msg_p);
+		return false;
+	}
 
 	/* if write q exists, write_evt will handle output */
-	if (conn->write_q) {
-		conn->write_q = g_list_append(conn->write_q, buf);
-		return true;
+	if (conn->sendq.count) {
+		if (!nc_sendq_push(&conn->sendq, msg_p, msg_len)) {
+			free(msg_p);
+			return false;
+		}
+		goto out_backpressure;
 	}
 
 	/* attempt optimistic write */
-	ssize_t wrc = write(conn->fd, buf->p, buf->len);
+	ssize_t wrc = write(conn->fd, msg_p, msg_len);
 	if (wrc < 0) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
-			free(buf->p);
-			free(buf);
+			free(msg_p);
 			return false;
 		}
 
-		conn->write_q = g_list_append(conn->write_q, buf);
-		goto out_wrstart;
+		wrc = 0;
 	}
 
 	/* message fully sent */
-	if (wrc == buf->len) {
-		free(buf->p);
-		free(buf);
+	if (wrc == msg_len) {
+		free(msg_p);
 		return true;
 	}
 
-	/* message partially sent; pause read; poll for writable */
-	conn->write_q = g_list_append(conn->write_q, buf);
-	conn->write_partial = wrc;
+	/* message partially sent; poll for writable */
+	if (!nc_sendq_push(&conn->sendq, msg_p, msg_len)) {
+		free(msg_p);
+		return false;
+	}
+	nc_sendq_written(&conn->sendq, wrc);
+
+	if (!nc_conn_write_enable(conn))
+		return false;
+
+out_backpressure:
+	/* pause read, while too much output is outstanding */
+	if (conn->sendq.bytes > NC_SENDQ_HIGH)
+		return nc_conn_read_disable(conn);
 
-out_wrstart:
-	nc_conn_read_disable(conn);
-	nc_conn_write_enable(conn);
 	return true;
 }
 
@@ -298,15 +464,21 @@ static bool nc_msg_version(struct nc_conn *conn)
 	if (!deser_msg_version(&mv, &buf))
 		goto out;
 
-	if (!(mv.nServices & NODE_NETWORK))	/* require NODE_NETWORK */
+	/* require NODE_NETWORK of the peers we choose */
+	if (!conn->inbound && !(mv.nServices & NODE_NETWORK))
 		goto out;
 	if (mv.nonce == instance_nonce)		/* connected to ourselves? */
 		goto out;
 
 	conn->protover = MIN(mv.nVersion, PROTO_VERSION);
 
+	/* inbound peer spoke first; reply with our own version */
+	if (conn->inbound && !nc_conn_send_version(conn))
+		goto out;
+
 	/* acknowledge version receipt */
-	if (!nc_conn_send(conn, "verack", NULL, 0))
+	GString *msg = message_new(0);
+	if (!msg || !nc_conn_send_msg(conn, "verack", msg))
 		goto out;
 
 	rc = true;
@@ -353,318 +525,913 @@ static bool nc_msg_verack(struct nc_conn *conn)
 	conn->seen_verack = true;
 
 	/*
-	 * When a connection attempt is made, the peer is deleted
-	 * from the peer list.  When we successfully connect,
-	 * the peer is re-added.  Thus, peers are immediately
-	 * forgotten if they fail, on the first try.
+	 * An outbound peer is held outside the peer database for the
+	 * life of the connection, and returned with updated metrics
+	 * when it ends.  Inbound peers connect from an ephemeral port,
+	 * and are not remembered.
 	 */
-	peerman_add(conn->nci->peers, &conn->addr, true);
+	if (conn->peer)
+		conn->peer->m.last_success = (uint32_t) time(NULL);
 
 	/* request peer addresses */
-	if ((conn->protover >= CADDR_TIME_VERSION) &&
-	    (!nc_conn_send(conn, "getaddr", NULL, 0)))
-		return false;
+	if (conn->protover >= CADDR_TIME_VERSION) {
+		GString *msg = message_new(0);
+		if (!msg || !nc_conn_send_msg(conn, "getaddr", msg))
+			return false;
+	}
 
 	return true;
 }
 
-static bool nc_conn_message(struct nc_conn *conn)
+static bool nc_known_init(struct nc_known_inv *k)
 {
-	/* verify correct network */
-	if (memcmp(conn->msg.hdr.netmagic, chain->netmagic, 4))
-		return false;
-
-	char *command = conn->msg.hdr.command;
-
-	/* incoming message: version */
-	if (!strncmp(command, "version", 12))
-		return nc_msg_version(conn);
+	memset(k, 0, sizeof(*k));
 
-	/* "version" must be first message */
-	if (!conn->seen_version)
-		return false;
-
-	/* incoming message: verack */
-	if (!strncmp(command, "verack", 12))
-		return nc_msg_verack(conn);
-
-	/* "verack" must be second message */
-	if (!conn->seen_verack)
-		return false;
+	return bloom_init(&k->gen[0], NC_KNOWN_INV_GEN, 0.0001) &&
+	       bloom_init(&k->gen[1], NC_KNOWN_INV_GEN, 0.0001);
+}
 
-	/* incoming message: addr */
-	if (!strncmp(command, "addr", 12))
-		return nc_msg_addr(conn);
+static void nc_known_free(struct nc_known_inv *k)
+{
+	bloom_free(&k->gen[0]);
+	bloom_free(&k->gen[1]);
+}
 
-	/* ignore unknown messages */
-	return true;
+static bool nc_known_has(struct nc_known_inv *k, const bu256_t *hash)
+{
+	return bloom_contains(&k->gen[k->cur], hash, sizeof(*hash)) ||
+	       bloom_contains(&k->gen[k->cur ^ 1], hash, sizeof(*hash));
 }
 
-static bool nc_conn_ip_active(struct net_child_info *nci,
-			      const unsigned char *ip)
+static void nc_known_add(struct nc_known_inv *k, const bu256_t *hash)
 {
-	unsigned int i;
-	for (i = 0; i < nci->conns->len; i++) {
-		struct nc_conn *conn;
+	/* current generation full; recycle the older one */
+	if (k->n_cur >= NC_KNOWN_INV_GEN) {
+		k->cur ^= 1;
+		k->n_cur = 0;
 
-		conn = g_ptr_array_index(nci->conns, i);
-		if (!memcmp(conn->addr.ip, ip, 16))
-			return true;
+		bloom_clear(&k->gen[k->cur]);
 	}
 
-	return false;
+	bloom_insert(&k->gen[k->cur], hash, sizeof(*hash));
+	k->n_cur++;
 }
 
-static struct nc_conn *nc_conn_new(const struct bp_address *addr_in)
+static void nc_relay_item_free(gpointer data)
 {
-	struct nc_conn *conn;
+	struct nc_relay_item *item = data;
 
-	conn = calloc(1, sizeof(*conn));
-	if (!conn)
-		return NULL;
+	free(item->data.p);
+	free(item);
+}
 
-	conn->fd = -1;
+static void nc_relay_expire(struct net_child_info *nci, time_t now)
+{
+	struct nc_relay_item *item;
 
-	if (addr_in)
-		memcpy(&conn->addr, addr_in, sizeof(*addr_in));
+	while ((item = g_queue_peek_head(&nci->relay_q)) &&
+	       ((item->expire <= now) ||
+		(nci->relay_bytes > NC_RELAY_MAX_BYTES))) {
+		g_queue_pop_head(&nci->relay_q);
+		nci->relay_bytes -= item->data.len;
 
-	return conn;
+		/* hash table owns, and frees, the item */
+		g_hash_table_remove(nci->relay, &item->hash);
+	}
 }
 
-static void nc_conn_free(struct nc_conn *conn)
+/* queue an announcement to every established peer, except the source */
+static void nc_relay_announce(struct net_child_info *nci,
+			      struct nc_conn *src, const struct bp_inv *inv)
 {
-	if (!conn)
-		return;
-
-	if (conn->write_q) {
-		GList *tmp = conn->write_q;
+	unsigned int i;
+	for (i = 0; i < nci->conns->len; i++) {
+		struct nc_conn *conn = g_ptr_array_index(nci->conns, i);
 
-		while (tmp) {
-			struct buffer *buf;
+		if (conn == src || !conn->seen_verack)
+			continue;
 
-			buf = tmp->data;
-			tmp = tmp->next;
+		g_array_append_val(conn->inv_q, *inv);
+	}
+}
 
-			free(buf->p);
-			free(buf);
-		}
+static bool nc_relay_add(struct net_child_info *nci, struct nc_conn *src,
+			 const bu256_t *hash, const void *data, size_t len)
+{
+	if (g_hash_table_lookup(nci->relay, hash))
+		return true;		/* already relayed */
 
-		g_list_free(conn->write_q);
-	}
+	struct nc_relay_item *item = calloc(1, sizeof(*item));
+	if (!item)
+		return false;
 
-	if (conn->ev) {
-		event_del(conn->ev);
-		event_free(conn->ev);
-	}
-	if (conn->write_ev) {
-		event_del(conn->write_ev);
-		event_free(conn->write_ev);
+	item->data.p = malloc(len);
+	if (!item->data.p) {
+		free(item);
+		return false;
 	}
+	memcpy(item->data.p, data, len);
+	item->data.len = len;
+	bu256_copy(&item->hash, hash);
+	item->expire = time(NULL) + NC_RELAY_EXPIRE;
 
-	if (conn->fd >= 0)
-		close(conn->fd);
+	g_hash_table_insert(nci->relay, &item->hash, item);
+	g_queue_push_tail(&nci->relay_q, item);
+	nci->relay_bytes += len;
 
-	free(conn->msg.data);
+	struct bp_inv inv = { MSG_TX, };
+	bu256_copy(&inv.hash, hash);
+	nc_relay_announce(nci, src, &inv);
 
-	free(conn);
+	return true;
 }
 
-static bool nc_conn_start(struct nc_conn *conn)
+static bool nc_conn_send_vinv(struct nc_conn *conn, const char *command,
+			      const struct msg_vinv *mv)
 {
-	/* create socket */
-	conn->ipv4 = is_ipv4_mapped(conn->addr.ip);
-	conn->fd = socket(conn->ipv4 ? AF_INET : AF_INET6,
-			  SOCK_STREAM, IPPROTO_TCP);
-	if (conn->fd < 0)
+	GString *msg = message_new(mv->invs->len * sizeof(struct bp_inv));
+	if (!msg)
 		return false;
 
-	/* set non-blocking */
-	int flags = fcntl(conn->fd, F_GETFL, 0);
-	if ((flags < 0) ||
-	    (fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) < 0))
-		return false;
+	ser_msg_vinv(msg, mv);
 
-	struct sockaddr *saddr;
-	struct sockaddr_in6 saddr6;
-	struct sockaddr_in saddr4;
-	socklen_t saddr_len;
+	return nc_conn_send_msg(conn, command, msg);
+}
 
-	/* fill out connect(2) address */
-	if (conn->ipv4) {
-		memset(&saddr4, 0, sizeof(saddr4));
-		saddr4.sin_family = AF_INET;
-		memcpy(&saddr4.sin_addr.s_addr,
-		       &conn->addr.ip[12], 4);
-		saddr4.sin_port = htons(conn->addr.port);
+/* announce queued inventory the peer does not already know about */
+static bool nc_conn_trickle(struct nc_conn *conn)
+{
+	struct msg_vinv mv;
+	bool rc = true;
+	unsigned int i;
 
-		saddr = (struct sockaddr *) &saddr4;
-		saddr_len = sizeof(saddr4);
-	} else {
-		memset(&saddr6, 0, sizeof(saddr6));
-		saddr6.sin6_family = AF_INET6;
-		memcpy(&saddr6.sin6_addr.s6_addr,
-		       &conn->addr.ip[0], 16);
-		saddr6.sin6_port = htons(conn->addr.port);
+	msg_vinv_init(&mv);
 
-		saddr = (struct sockaddr *) &saddr6;
-		saddr_len = sizeof(saddr6);
+	for (i = 0; i < conn->inv_q->len; i++) {
+		struct bp_inv *inv = &g_array_index(conn->inv_q,
+						    struct bp_inv, i);
+
+		if (nc_known_has(&conn->known, &inv->hash))
+			continue;
+		nc_known_add(&conn->known, &inv->hash);
+
+		msg_vinv_push(&mv, inv->type, &inv->hash);
+
+		if (mv.invs->len == MAX_INV_SZ) {
+			rc = nc_conn_send_vinv(conn, "inv", &mv);
+			msg_vinv_free(&mv);
+			if (!rc)
+				goto out;
+		}
 	}
 
-	/* initiate TCP connection */
-	if (connect(conn->fd, saddr, saddr_len) < 0)
-		return false;
+	if (mv.invs && mv.invs->len)
+		rc = nc_conn_send_vinv(conn, "inv", &mv);
 
-	return true;
+out:
+	g_array_set_size(conn->inv_q, 0);
+	msg_vinv_free(&mv);
+	return rc;
 }
 
-static void nc_conn_got_header(struct nc_conn *conn)
+static gboolean nc_inv_req_expired(gpointer key, gpointer value,
+				   gpointer priv)
 {
-	parse_message_hdr(&conn->msg.hdr, conn->hdrbuf);
+	const time_t *now = priv;
 
-	unsigned int data_len = conn->msg.hdr.data_len;
-	if (data_len > (16 * 1024 * 1024))
-		goto err_out;
+	return (time_t) GPOINTER_TO_UINT(value) <= *now;
+}
 
-	conn->msg.data = malloc(data_len);
+static void nc_trickle_evt(int fd, short events, void *priv)
+{
+	struct net_child_info *nci = priv;
+	time_t now = time(NULL);
 
-	/* switch to read-body state */
-	conn->msg_p = conn->msg.data;
-	conn->expected = data_len;
-	conn->reading_hdr = false;
+	nc_relay_expire(nci, now);
+	g_hash_table_foreach_remove(nci->inv_req, nc_inv_req_expired, &now);
 
-	return;
+	/* walk backwards; a failed conn is removed from the array */
+	unsigned int i = nci->conns->len;
+	while (i-- > 0) {
+		struct nc_conn *conn = g_ptr_array_index(nci->conns, i);
 
-err_out:
-	nc_conn_free(conn);
+		if (conn->inv_q && conn->inv_q->len &&
+		    !nc_conn_trickle(conn))
+			nc_conn_free(conn);
+	}
 }
 
-static void nc_conn_got_msg(struct nc_conn *conn)
+static bool nc_msg_inv(struct nc_conn *conn)
 {
-	if (!message_valid(&conn->msg))
-		goto err_out;
+	struct net_child_info *nci = conn->nci;
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_vinv mv, mv_req;
+	bool rc = false;
 
-	if (!nc_conn_message(conn))
-		goto err_out;
+	msg_vinv_init(&mv);
+	msg_vinv_init(&mv_req);
 
-	free(conn->msg.data);
-	conn->msg.data = NULL;
+	if (!deser_msg_vinv(&mv, &buf))
+		goto out;
 
-	/* switch to read-header state */
-	conn->msg_p = conn->hdrbuf;
-	conn->expected = P2P_HDR_SZ;
-	conn->reading_hdr = true;
+	time_t expire = time(NULL) + NC_INV_REQ_EXPIRE;
 
-	return;
+	unsigned int i;
+	for (i = 0; i < mv.invs->len; i++) {
+		struct bp_inv *inv = g_ptr_array_index(mv.invs, i);
 
-err_out:
-	nc_conn_free(conn);
-}
+		/* blocks are not fetched by this client */
+		if (inv->type != MSG_TX)
+			continue;
 
-static void nc_conn_read_evt(int fd, short events, void *priv)
-{
-	struct nc_conn *conn = priv;
+		nc_known_add(&conn->known, &inv->hash);
 
-	ssize_t rrc = read(fd, conn->msg_p, conn->expected);
-	if (rrc <= 0) {
-		nc_conn_free(conn);
-		return;
+		/* already have it, or asked another peer for it? */
+		if (g_hash_table_lookup(nci->relay, &inv->hash) ||
+		    g_hash_table_lookup(nci->inv_req, &inv->hash))
+			continue;
+
+		g_hash_table_insert(nci->inv_req,
+				    g_memdup(&inv->hash, sizeof(bu256_t)),
+				    GUINT_TO_POINTER((guint) expire));
+
+		msg_vinv_push(&mv_req, inv->type, &inv->hash);
 	}
 
-	conn->msg_p += rrc;
-	conn->expected -= rrc;
+	if (mv_req.invs) {
+		if (!nc_conn_send_vinv(conn, "getdata", &mv_req))
+			goto out;
 
-	if (conn->expected == 0) {
-		if (conn->reading_hdr)
-			nc_conn_got_header(conn);
-		else
-			nc_conn_got_msg(conn);
+		if (!conn->getdata_pending)
+			conn->t_getdata = nc_now_ms();
+		conn->getdata_pending += mv_req.invs->len;
 	}
+
+	rc = true;
+
+out:
+	msg_vinv_free(&mv);
+	msg_vinv_free(&mv_req);
+	return rc;
 }
 
-static GString *nc_version_build(struct nc_conn *conn)
+static bool nc_msg_getdata(struct nc_conn *conn)
 {
-	struct msg_version mv;
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_vinv mv, mv_nf;
+	bool rc = false;
 
-	msg_version_init(&mv);
+	msg_vinv_init(&mv);
+	msg_vinv_init(&mv_nf);
 
-	mv.nVersion = PROTO_VERSION;
-	mv.nTime = (int64_t) time(NULL);
-	mv.nonce = instance_nonce;
-	sprintf(mv.strSubVer, "/picocoin:%s/", VERSION);
-	mv.nStartingHeight = conn->nci->db->nBestHeight;
+	if (!deser_msg_vinv(&mv, &buf))
+		goto out;
 
-	GString *rs = ser_msg_version(&mv);
+	unsigned int i;
+	for (i = 0; i < mv.invs->len; i++) {
+		struct bp_inv *inv = g_ptr_array_index(mv.invs, i);
+		struct nc_relay_item *item = NULL;
+
+		if (inv->type == MSG_TX)
+			item = g_hash_table_lookup(conn->nci->relay,
+						   &inv->hash);
+		if (!item) {
+			msg_vinv_push(&mv_nf, inv->type, &inv->hash);
+			continue;
+		}
 
-	msg_version_free(&mv);
+		nc_known_add(&conn->known, &inv->hash);
 
-	return rs;
-}
+		GString *msg = message_new(item->data.len);
+		if (!msg)
+			goto out;
 
-static bool nc_conn_read_enable(struct nc_conn *conn)
-{
-	if (conn->ev)
-		return true;
+		g_string_append_len(msg, item->data.p, item->data.len);
 
-	conn->ev = event_new(conn->nci->eb, conn->fd, EV_READ | EV_PERSIST,
-			     nc_conn_read_evt, conn);
+		if (!nc_conn_send_msg(conn, "tx", msg))
+			goto out;
+	}
+
+	if (mv_nf.invs && !nc_conn_send_vinv(conn, "notfound", &mv_nf))
+		goto out;
+
+	rc = true;
+
+out:
+	msg_vinv_free(&mv);
+	msg_vinv_free(&mv_nf);
+	return rc;
+}
+
+/* requested inventory arrived, or was declared not found */
+static void nc_conn_getdata_done(struct nc_conn *conn, unsigned int count)
+{
+	if (!conn->getdata_pending)
+		return;
+
+	int64_t now = nc_now_ms();
+
+	if (conn->peer)
+		peer_metric_sample(&conn->peer->m.getdata_ms,
+				   (uint32_t) (now - conn->t_getdata));
+
+	conn->getdata_pending -= MIN(count, conn->getdata_pending);
+	conn->t_getdata = now;
+}
+
+static bool nc_msg_notfound(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_vinv mv;
+	bool rc = false;
+
+	msg_vinv_init(&mv);
+
+	if (!deser_msg_vinv(&mv, &buf))
+		goto out;
+
+	/* let another peer be asked */
+	unsigned int i, n_req = 0;
+	for (i = 0; i < mv.invs->len; i++) {
+		struct bp_inv *inv = g_ptr_array_index(mv.invs, i);
+
+		if (g_hash_table_remove(conn->nci->inv_req, &inv->hash))
+			n_req++;
+	}
+
+	nc_conn_getdata_done(conn, n_req);
+
+	rc = true;
+
+out:
+	msg_vinv_free(&mv);
+	return rc;
+}
+
+static bool nc_msg_tx(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct bp_tx tx;
+	bool rc = false;
+
+	bp_tx_init(&tx);
+
+	/* the entire message must be a single transaction, so its
+	 * hash may be taken over the raw message data
+	 */
+	if (!deser_bp_tx(&tx, &buf) || buf.len)
+		goto out;
+
+	bu256_t hash;
+	bu_Hash((unsigned char *) &hash, conn->msg.data,
+		conn->msg.hdr.data_len);
+
+	if (g_hash_table_remove(conn->nci->inv_req, &hash))
+		nc_conn_getdata_done(conn, 1);
+	nc_known_add(&conn->known, &hash);
+
+	/* drop, but do not penalize, transactions failing basic checks */
+	if (!bp_tx_valid(&tx))
+		goto out_ok;
+
+	if (!nc_relay_add(conn->nci, conn, &hash, conn->msg.data,
+			  conn->msg.hdr.data_len))
+		goto out;
+
+out_ok:
+	rc = true;
+
+out:
+	bp_tx_free(&tx);
+	return rc;
+}
+
+/* handshake progress, in order; each handler names the minimum required */
+enum nc_hs_state {
+	NC_HS_NONE,			/* "version" must be first message */
+	NC_HS_VERSION,			/* "verack" must be second message */
+	NC_HS_DONE,
+};
+
+struct nc_msg_handler {
+	bool			(*fn)(struct nc_conn *conn);
+	enum nc_hs_state	need;
+};
+
+static bool nc_msg_ping(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_ping mp;
+
+	msg_ping_init(&mp);
+
+	if (!deser_msg_ping(conn->protover, &mp, &buf))
+		return false;
+
+	/* older peers expect no reply */
+	if (conn->protover <= BIP0031_VERSION)
+		return true;
+
+	GString *msg = message_new(sizeof(mp.nonce));
+	if (!msg)
+		return false;
+
+	ser_msg_ping(conn->protover, msg, &mp);
+
+	msg_ping_free(&mp);
+	return nc_conn_send_msg(conn, "pong", msg);
+}
+
+static bool nc_msg_pong(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_ping mp;
+
+	msg_ping_init(&mp);
+
+	if (!deser_msg_ping(conn->protover, &mp, &buf))
+		return false;
+
+	/* unsolicited, or answering an older ping: ignore */
+	if (!conn->ping_nonce || mp.nonce != conn->ping_nonce)
+		return true;
+
+	uint32_t rtt = (uint32_t) (nc_now_ms() - conn->t_ping);
+
+	peer_metric_sample(&conn->rtt_ms, rtt);
+	if (conn->peer)
+		peer_metric_sample(&conn->peer->m.rtt_ms, rtt);
+
+	conn->ping_nonce = 0;
+
+	msg_ping_free(&mp);
+	return true;
+}
+
+static bool nc_conn_send_ping(struct nc_conn *conn, int64_t now)
+{
+	struct msg_ping mp;
+
+	msg_ping_init(&mp);
+
+	/* pre-BIP 31 peers get an empty ping, and send no pong; it
+	 * keeps the connection alive, but measures nothing
+	 */
+	if (conn->protover > BIP0031_VERSION) {
+		while (!mp.nonce)
+			mp.nonce = ((uint64_t) g_random_int() << 32) |
+				   g_random_int();
+		conn->ping_nonce = mp.nonce;
+	}
+	conn->t_ping = now;
+
+	GString *msg = message_new(sizeof(mp.nonce));
+	if (!msg)
+		return false;
+
+	ser_msg_ping(conn->protover, msg, &mp);
+
+	msg_ping_free(&mp);
+	return nc_conn_send_msg(conn, "ping", msg);
+}
+
+static const struct nc_msg_handler nc_msg_handlers[MSG_CMD_COUNT] = {
+	[MSG_CMD_UNKNOWN]	= { NULL, NC_HS_DONE },	/* ignored */
+	[MSG_CMD_VERSION]	= { nc_msg_version, NC_HS_NONE },
+	[MSG_CMD_VERACK]	= { nc_msg_verack, NC_HS_VERSION },
+	[MSG_CMD_ADDR]		= { nc_msg_addr, NC_HS_DONE },
+	[MSG_CMD_INV]		= { nc_msg_inv, NC_HS_DONE },
+	[MSG_CMD_GETDATA]	= { nc_msg_getdata, NC_HS_DONE },
+	[MSG_CMD_TX]		= { nc_msg_tx, NC_HS_DONE },
+	[MSG_CMD_NOTFOUND]	= { nc_msg_notfound, NC_HS_DONE },
+	[MSG_CMD_PING]		= { nc_msg_ping, NC_HS_VERSION },
+	[MSG_CMD_PONG]		= { nc_msg_pong, NC_HS_VERSION },
+};
+
+static enum nc_hs_state nc_conn_hs_state(const struct nc_conn *conn)
+{
+	if (!conn->seen_version)
+		return NC_HS_NONE;
+	if (!conn->seen_verack)
+		return NC_HS_VERSION;
+	return NC_HS_DONE;
+}
+
+static bool nc_conn_message(struct nc_conn *conn)
+{
+	/* verify correct network */
+	if (memcmp(conn->msg.hdr.netmagic, chain->netmagic, 4))
+		return false;
+
+	enum msg_cmd cmd = message_cmd_id(conn->msg.hdr.command);
+	const struct nc_msg_handler *h = &nc_msg_handlers[cmd];
+
+	struct nc_cmd_stats *st = &conn->nci->cmd_stats[cmd];
+	st->count++;
+	st->bytes += P2P_HDR_SZ + conn->msg.hdr.data_len;
+
+	/* enforce version/verack ordering; duplicates of either are
+	 * rejected by their handlers
+	 */
+	if (nc_conn_hs_state(conn) < h->need)
+		return false;
+
+	/* ignore known-but-unhandled and unknown messages */
+	if (!h->fn)
+		return true;
+
+	return h->fn(conn);
+}
+
+/* summarize received traffic, per command, to stderr */
+static void nc_cmd_stats_log(const struct net_child_info *nci)
+{
+	enum msg_cmd cmd;
+
+	for (cmd = 0; cmd < MSG_CMD_COUNT; cmd++) {
+		const struct nc_cmd_stats *st = &nci->cmd_stats[cmd];
+		if (!st->count)
+			continue;
+
+		fprintf(stderr, "net: received %-12s %10llu msgs %14llu bytes\n",
+			(cmd == MSG_CMD_UNKNOWN) ? "(unknown)" :
+				message_cmd_str(cmd),
+			(unsigned long long) st->count,
+			(unsigned long long) st->bytes);
+	}
+}
+
+static bool nc_conn_ip_active(struct net_child_info *nci,
+			      const unsigned char *ip)
+{
+	unsigned int i;
+	for (i = 0; i < nci->conns->len; i++) {
+		struct nc_conn *conn;
+
+		conn = g_ptr_array_index(nci->conns, i);
+		if (!memcmp(conn->addr.ip, ip, 16))
+			return true;
+	}
+
+	return false;
+}
+
+static struct nc_conn *nc_conn_new(const struct bp_address *addr_in)
+{
+	struct nc_conn *conn;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+
+	conn->fd = -1;
+
+	if (addr_in)
+		memcpy(&conn->addr, addr_in, sizeof(*addr_in));
+
+	return conn;
+}
+
+/* session over; fold its metrics into the peer record, and return it */
+static void nc_conn_peer_put(struct nc_conn *conn)
+{
+	struct peer_metrics *m = &conn->peer->m;
+
+	if (conn->seen_verack && !conn->stalled) {
+		m->n_success++;
+
+		int64_t duration = nc_now_ms() - conn->t_established;
+		if (duration >= NC_RATE_MIN_MS)
+			peer_metric_sample(&m->rx_bps,
+				(uint32_t) ((conn->bytes_rx * 1000) / duration));
+	} else
+		m->n_fail++;
+
+	peerman_put(conn->nci->peers, conn->peer);
+	conn->peer = NULL;
+}
+
+static void nc_conn_free(struct nc_conn *conn)
+{
+	if (!conn)
+		return;
+
+	/* unlink from active connection list, if present */
+	if (conn->nci && g_ptr_array_remove_fast(conn->nci->conns, conn) &&
+	    conn->inbound)
+		conn->nci->n_inbound--;
+
+	if (conn->peer)
+		nc_conn_peer_put(conn);
+
+	nc_sendq_free(&conn->sendq);
+
+	if (conn->ev) {
+		event_del(conn->ev);
+		event_free(conn->ev);
+	}
+	if (conn->write_ev) {
+		event_del(conn->write_ev);
+		event_free(conn->write_ev);
+	}
+
+	if (conn->fd >= 0)
+		close(conn->fd);
+
+	free(conn->msg.data);
+
+	nc_known_free(&conn->known);
+	if (conn->inv_q)
+		g_array_free(conn->inv_q, TRUE);
+
+	free(conn);
+}
+
+static bool nc_conn_start(struct nc_conn *conn)
+{
+	/* create socket */
+	conn->ipv4 = is_ipv4_mapped(conn->addr.ip);
+	conn->fd = socket(conn->ipv4 ? AF_INET : AF_INET6,
+			  SOCK_STREAM, IPPROTO_TCP);
+	if (conn->fd < 0)
+		return false;
+
+	/* set non-blocking */
+	int flags = fcntl(conn->fd, F_GETFL, 0);
+	if ((flags < 0) ||
+	    (fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) < 0))
+		return false;
+
+	struct sockaddr *saddr;
+	struct sockaddr_in6 saddr6;
+	struct sockaddr_in saddr4;
+	socklen_t saddr_len;
+
+	/* fill out connect(2) address */
+	if (conn->ipv4) {
+		memset(&saddr4, 0, sizeof(saddr4));
+		saddr4.sin_family = AF_INET;
+		memcpy(&saddr4.sin_addr.s_addr,
+		       &conn->addr.ip[12], 4);
+		saddr4.sin_port = htons(conn->addr.port);
+
+		saddr = (struct sockaddr *) &saddr4;
+		saddr_len = sizeof(saddr4);
+	} else {
+		memset(&saddr6, 0, sizeof(saddr6));
+		saddr6.sin6_family = AF_INET6;
+		memcpy(&saddr6.sin6_addr.s6_addr,
+		       &conn->addr.ip[0], 16);
+		saddr6.sin6_port = htons(conn->addr.port);
+
+		saddr = (struct sockaddr *) &saddr6;
+		saddr_len = sizeof(saddr6);
+	}
+
+	/* initiate TCP connection */
+	if ((connect(conn->fd, saddr, saddr_len) < 0) &&
+	    (errno != EINPROGRESS))
+		return false;
+
+	return true;
+}
+
+static bool nc_conn_got_header(struct nc_conn *conn)
+{
+	parse_message_hdr(&conn->msg.hdr, conn->hdrbuf);
+
+	unsigned int data_len = conn->msg.hdr.data_len;
+	if (data_len > (16 * 1024 * 1024))
+		return false;
+
+	conn->msg.data = malloc(data_len);
+
+	/* switch to read-body state */
+	conn->msg_p = conn->msg.data;
+	conn->expected = data_len;
+	conn->reading_hdr = false;
+
+	return true;
+}
+
+static bool nc_conn_got_msg(struct nc_conn *conn)
+{
+	if (!message_valid(&conn->msg))
+		return false;
+
+	if (!nc_conn_message(conn))
+		return false;
+
+	free(conn->msg.data);
+	conn->msg.data = NULL;
+
+	/* switch to read-header state */
+	conn->msg_p = conn->hdrbuf;
+	conn->expected = P2P_HDR_SZ;
+	conn->reading_hdr = true;
+
+	return true;
+}
+
+/* feed received bytes through the header/body state machine */
+static bool nc_conn_input(struct nc_conn *conn, const unsigned char *p,
+			  size_t len)
+{
+	while (len > 0) {
+		size_t n = MIN(len, conn->expected);
+
+		memcpy(conn->msg_p, p, n);
+		conn->msg_p += n;
+		conn->expected -= n;
+		p += n;
+		len -= n;
+
+		if (conn->expected > 0)
+			continue;
+
+		if (conn->reading_hdr) {
+			if (!nc_conn_got_header(conn))
+				return false;
+
+			/* zero-length body; message already complete */
+			if (conn->expected == 0 && !nc_conn_got_msg(conn))
+				return false;
+		} else if (!nc_conn_got_msg(conn))
+			return false;
+	}
+
+	return true;
+}
+
+static void nc_conn_read_evt(int fd, short events, void *priv)
+{
+	struct nc_conn *conn = priv;
+
+	while (true) {
+		ssize_t rrc;
+
+		/* large message bodies are read directly in place */
+		if (!conn->reading_hdr && conn->expected >= NC_RDBUF_SZ) {
+			rrc = read(fd, conn->msg_p, conn->expected);
+			if (rrc > 0) {
+				conn->msg_p += rrc;
+				conn->expected -= rrc;
+				if (conn->expected == 0 &&
+				    !nc_conn_got_msg(conn))
+					goto err_out;
+			}
+		}
+
+		/* otherwise, read as much as is available, and parse
+		 * every message contained therein
+		 */
+		else {
+			rrc = read(fd, conn->rdbuf, NC_RDBUF_SZ);
+			if (rrc > 0 && !nc_conn_input(conn, conn->rdbuf, rrc))
+				goto err_out;
+		}
+
+		if (rrc > 0) {
+			conn->bytes_rx += rrc;
+			conn->t_last_rx = nc_now_ms();
+		}
+		if (rrc == 0)
+			goto err_out;
+		if (rrc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			goto err_out;
+		}
+
+		/* level-triggered: we will be called again, if more
+		 * data is pending.  edge-triggered: drain the socket,
+		 * unless backpressure paused reading.
+		 */
+		if (!conn->nci->edge_triggered || !conn->reading)
+			break;
+	}
+
+	return;
+
+err_out:
+	nc_conn_free(conn);
+}
+
+static bool nc_conn_events_new(struct nc_conn *conn)
+{
+	/* read and write interest are armed independently, on events
+	 * that persist for the life of the connection
+	 */
+	short et = conn->nci->edge_triggered ? EV_ET : 0;
+
+	conn->ev = event_new(conn->nci->eb, conn->fd, EV_READ | EV_PERSIST | et,
+			     nc_conn_read_evt, conn);
 	if (!conn->ev)
 		return false;
 
-	if (event_add(conn->ev, NULL) != 0) {
-		event_free(conn->ev);
-		conn->ev = NULL;
+	conn->write_ev = event_new(conn->nci->eb, conn->fd,
+				   EV_WRITE | EV_PERSIST | et,
+				   nc_conn_write_evt, conn);
+	if (!conn->write_ev)
+		return false;
+
+	return true;
+}
+
+static bool nc_conn_read_enable(struct nc_conn *conn)
+{
+	if (conn->reading)
+		return true;
+
+	if (event_add(conn->ev, NULL) != 0)
 		return false;
-	}
 
+	conn->reading = true;
 	return true;
 }
 
 static bool nc_conn_read_disable(struct nc_conn *conn)
 {
-	if (!conn->ev)
+	if (!conn->reading)
 		return true;
 
 	event_del(conn->ev);
-	event_free(conn->ev);
-
-	conn->ev = NULL;
 
+	conn->reading = false;
 	return true;
 }
 
 static bool nc_conn_write_enable(struct nc_conn *conn)
 {
-	if (conn->write_ev)
+	if (conn->writing)
 		return true;
 
-	conn->write_ev = event_new(conn->nci->eb, conn->fd,
-				   EV_WRITE | EV_PERSIST,
-				   nc_conn_write_evt, conn);
-	if (!conn->write_ev)
-		return false;
-
-	if (event_add(conn->write_ev, NULL) != 0) {
-		event_free(conn->write_ev);
-		conn->write_ev = NULL;
+	if (event_add(conn->write_ev, NULL) != 0)
 		return false;
-	}
 
+	conn->writing = true;
 	return true;
 }
 
 static bool nc_conn_write_disable(struct nc_conn *conn)
 {
-	if (!conn->write_ev)
+	if (!conn->writing)
 		return true;
 
 	event_del(conn->write_ev);
-	event_free(conn->write_ev);
-
-	conn->write_ev = NULL;
 
+	conn->writing = false;
 	return true;
 }
 
+static bool nc_conn_send_version(struct nc_conn *conn)
+{
+	struct msg_version mv;
+
+	msg_version_init(&mv);
+
+	mv.nVersion = PROTO_VERSION;
+	mv.nTime = (int64_t) time(NULL);
+	mv.nonce = instance_nonce;
+	sprintf(mv.strSubVer, "/picocoin:%s/", VERSION);
+	mv.nStartingHeight = conn->nci->db->nBestHeight;
+
+	/* build and send "version" message */
+	GString *msg = message_new(128);
+	if (!msg)
+		return false;
+
+	ser_msg_version(msg, &mv);
+
+	msg_version_free(&mv);
+	return nc_conn_send_msg(conn, "version", msg);
+}
+
+/* TCP session is up, in either direction; begin exchanging messages */
+static bool nc_conn_established(struct nc_conn *conn)
+{
+	conn->connected = true;
+	conn->t_established = nc_now_ms();
+
+	if (conn->peer)
+		peer_metric_sample(&conn->peer->m.connect_ms,
+			(uint32_t) (conn->t_established - conn->t_start));
+
+	if (!nc_conn_events_new(conn))
+		return false;
+
+	conn->inv_q = g_array_new(FALSE, FALSE, sizeof(struct bp_inv));
+	if (!nc_known_init(&conn->known))
+		return false;
+
+	/* switch to read-header state */
+	conn->msg_p = conn->hdrbuf;
+	conn->expected = P2P_HDR_SZ;
+	conn->reading_hdr = true;
+
+	return nc_conn_read_enable(conn);
+}
+
 static void nc_conn_evt_connected(int fd, short events, void *priv)
 {
 	struct nc_conn *conn = priv;
@@ -677,31 +1444,14 @@ static void nc_conn_evt_connected(int fd, short events, void *priv)
 	    (err != 0))
 		goto err_out;
 
-	conn->connected = true;
-
 	event_free(conn->ev);
 	conn->ev = NULL;
 
-	/* build and send "version" message */
-	GString *msg_data = nc_version_build(conn);
-	GString *msg = message_str(chain->netmagic, "version",
-				   msg_data->str, msg_data->len);
-	g_string_free(msg_data, TRUE);
-
-	unsigned int msg_len = msg->len;
-	ssize_t wrc = write(conn->fd, msg->str, msg_len);
-
-	g_string_free(msg, TRUE);
-
-	if (wrc != msg_len)
+	if (!nc_conn_established(conn))
 		goto err_out;
 
-	/* switch to read-header state */
-	conn->msg_p = conn->hdrbuf;
-	conn->expected = P2P_HDR_SZ;
-	conn->reading_hdr = true;
-
-	if (!nc_conn_read_enable(conn))
+	/* outbound: we speak first */
+	if (!nc_conn_send_version(conn))
 		goto err_out;
 
 	return;
@@ -712,21 +1462,29 @@ err_out:
 
 static void nc_conns_open(struct net_child_info *nci)
 {
+	GList *skipped = NULL;
+
 	while ((g_hash_table_size(nci->peers->map_addr) > 0) &&
-	       (nci->conns->len < NC_MAX_CONN)) {
+	       ((nci->conns->len - nci->n_inbound) < NC_MAX_CONN)) {
 
-		/* delete peer from front of address list.  it will be
-		 * re-added before writing peer file, if successful
+		/* take the best of a sample of peers, out of the peer
+		 * database.  it is returned when the connection ends.
 		 */
-		struct bp_address *addr = peerman_pop(nci->peers);
+		struct peer *peer = peerman_pop(nci->peers);
 
-		struct nc_conn *conn = nc_conn_new(addr);
-		conn->nci = nci;
-		free(addr);
+		/* are we already connected to this IP?  set it aside,
+		 * to be returned once we stop popping
+		 */
+		if (nc_conn_ip_active(nci, peer->addr.ip)) {
+			skipped = g_list_prepend(skipped, peer);
+			continue;
+		}
 
-		/* are we already connected to this IP? */
-		if (nc_conn_ip_active(nci, conn->addr.ip))
-			goto err_loop;
+		struct nc_conn *conn = nc_conn_new(&peer->addr);
+		conn->nci = nci;
+		conn->peer = peer;
+		conn->t_start = nc_now_ms();
+		peer->m.last_try = (uint32_t) time(NULL);
 
 		/* initiate non-blocking connect(2) */
 		if (!nc_conn_start(conn))
@@ -750,6 +1508,301 @@ static void nc_conns_open(struct net_child_info *nci)
 err_loop:
 		nc_conn_free(conn);
 	}
+
+	GList *tmp;
+	for (tmp = skipped; tmp; tmp = tmp->next)
+		peerman_put(nci->peers, tmp->data);
+	g_list_free(skipped);
+}
+
+static bool nc_inbound_allowed(struct net_child_info *nci,
+			       const unsigned char *ip)
+{
+	if (nci->n_inbound >= NC_MAX_INBOUND)
+		return false;
+
+	/* group by /16 for IPv4, /32 for IPv6 */
+	size_t pfx_len = is_ipv4_mapped(ip) ? (12 + 2) : 4;
+
+	unsigned int i, n_subnet = 0;
+	for (i = 0; i < nci->conns->len; i++) {
+		struct nc_conn *conn = g_ptr_array_index(nci->conns, i);
+
+		if (conn->inbound && !memcmp(conn->addr.ip, ip, pfx_len))
+			n_subnet++;
+	}
+
+	return (n_subnet < NC_MAX_INBOUND_SUBNET);
+}
+
+static bool nc_sockaddr_parse(struct bp_address *addr,
+			      const struct sockaddr_storage *ss)
+{
+	bp_addr_init(addr);
+	addr->nTime = (uint32_t) time(NULL);
+
+	if (ss->ss_family == AF_INET) {
+		const struct sockaddr_in *sin = (const void *) ss;
+
+		memcpy(addr->ip, ipv4_mapped_pfx, 12);
+		memcpy(&addr->ip[12], &sin->sin_addr.s_addr, 4);
+		addr->port = ntohs(sin->sin_port);
+	} else if (ss->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const void *) ss;
+
+		memcpy(addr->ip, &sin6->sin6_addr.s6_addr, 16);
+		addr->port = ntohs(sin6->sin6_port);
+	} else
+		return false;
+
+	return true;
+}
+
+static void nc_conn_accept(struct net_child_info *nci, int fd,
+			   const struct sockaddr_storage *ss)
+{
+	struct nc_conn *conn = nc_conn_new(NULL);
+	if (!conn) {
+		close(fd);
+		return;
+	}
+
+	conn->fd = fd;
+	conn->t_start = nc_now_ms();
+
+	/* inbound limits: global, and per-subnet */
+	if (!nc_sockaddr_parse(&conn->addr, ss) ||
+	    !nc_inbound_allowed(nci, conn->addr.ip))
+		goto err_out;
+
+	conn->ipv4 = is_ipv4_mapped(conn->addr.ip);
+
+	/* set non-blocking */
+	int flags = fcntl(fd, F_GETFL, 0);
+	if ((flags < 0) ||
+	    (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+		goto err_out;
+
+	/* add to our list of active connections */
+	conn->nci = nci;
+	conn->inbound = true;
+	g_ptr_array_add(nci->conns, conn);
+	nci->n_inbound++;
+
+	/* remote peer speaks first; await its "version" */
+	if (!nc_conn_established(conn))
+		goto err_out;
+
+	return;
+
+err_out:
+	nc_conn_free(conn);
+}
+
+static void nc_listen_evt(int fd, short events, void *priv)
+{
+	struct net_child_info *nci = priv;
+	unsigned int i;
+
+	/* accept a bounded batch of pending connections per wakeup */
+	for (i = 0; i < NC_ACCEPT_BATCH; i++) {
+		struct sockaddr_storage ss;
+		socklen_t ss_len = sizeof(ss);
+
+		int cfd = accept(fd, (struct sockaddr *) &ss, &ss_len);
+		if (cfd >= 0) {
+			nc_conn_accept(nci, cfd, &ss);
+			continue;
+		}
+
+		/* out of descriptors or memory: the connection stays
+		 * pending, and the level-triggered listen event would
+		 * fire again at once.  Stop listening for a while.
+		 */
+		if ((errno == EMFILE) || (errno == ENFILE) ||
+		    (errno == ENOBUFS) || (errno == ENOMEM)) {
+			struct timeval tv = {
+				NC_ACCEPT_BACKOFF_MS / 1000,
+				(NC_ACCEPT_BACKOFF_MS % 1000) * 1000,
+			};
+
+			event_del(nci->listen_ev);
+			event_add(nci->listen_backoff_ev, &tv);
+		}
+
+		break;		/* EAGAIN, or aborted connection */
+	}
+}
+
+/* accept(2) backoff expired; listen again */
+static void nc_listen_resume_evt(int fd, short events, void *priv)
+{
+	struct net_child_info *nci = priv;
+
+	event_add(nci->listen_ev, NULL);
+}
+
+/*
+ * Listen for inbound P2P connections on the port given by the "listen"
+ * setting, on all local addresses.  IPv6 sockets accept IPv4 as well,
+ * where the system permits; otherwise, fall back to IPv4 only.
+ */
+static bool nc_listen_start(struct net_child_info *nci)
+{
+	nci->listen_fd = -1;
+
+	char *port_str = setting("listen");
+	if (!port_str)
+		return true;		/* not listening; not an error */
+
+	int port = atoi(port_str);
+	if ((port <= 0) || (port > 0xffff))
+		return false;
+
+	struct sockaddr_in6 saddr6;
+	struct sockaddr_in saddr4;
+	struct sockaddr *saddr;
+	socklen_t saddr_len;
+
+	int fd = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if (fd >= 0) {
+		int v6only = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+			   &v6only, sizeof(v6only));
+
+		memset(&saddr6, 0, sizeof(saddr6));
+		saddr6.sin6_family = AF_INET6;
+		saddr6.sin6_addr = in6addr_any;
+		saddr6.sin6_port = htons(port);
+
+		saddr = (struct sockaddr *) &saddr6;
+		saddr_len = sizeof(saddr6);
+	} else {
+		fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (fd < 0)
+			return false;
+
+		memset(&saddr4, 0, sizeof(saddr4));
+		saddr4.sin_family = AF_INET;
+		saddr4.sin_addr.s_addr = htonl(INADDR_ANY);
+		saddr4.sin_port = htons(port);
+
+		saddr = (struct sockaddr *) &saddr4;
+		saddr_len = sizeof(saddr4);
+	}
+
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	/* set non-blocking */
+	int flags = fcntl(fd, F_GETFL, 0);
+	if ((flags < 0) ||
+	    (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+		goto err_out;
+
+	if ((bind(fd, saddr, saddr_len) < 0) ||
+	    (listen(fd, NC_LISTEN_BACKLOG) < 0))
+		goto err_out;
+
+	/* level-triggered: a batch may leave connections pending */
+	nci->listen_ev = event_new(nci->eb, fd, EV_READ | EV_PERSIST,
+				   nc_listen_evt, nci);
+	if (!nci->listen_ev || (event_add(nci->listen_ev, NULL) != 0))
+		goto err_out;
+
+	nci->listen_backoff_ev = event_new(nci->eb, -1, 0,
+					   nc_listen_resume_evt, nci);
+	if (!nci->listen_backoff_ev)
+		goto err_out;
+
+	nci->listen_fd = fd;
+	return true;
+
+err_out:
+	if (nci->listen_ev) {
+		event_free(nci->listen_ev);
+		nci->listen_ev = NULL;
+	}
+	close(fd);
+	return false;
+}
+
+/* import DNS seed results, as they arrive, and put them to use */
+static void nc_seed_poll(struct net_child_info *nci)
+{
+	if (!nci->peers->seeder)
+		return;
+
+	if (!peerman_seed_collect(nci->peers) && nci->seed_ev) {
+		event_free(nci->seed_ev);
+		nci->seed_ev = NULL;
+	}
+
+	nc_conns_open(nci);
+}
+
+static void nc_seed_evt(int fd, short events, void *priv)
+{
+	nc_seed_poll(priv);
+}
+
+/*
+ * Is this connection still worth its slot?  Send keepalive pings as
+ * they come due; false if the connection should be dropped.
+ */
+static bool nc_conn_alive(struct nc_conn *conn, int64_t now)
+{
+	/* handshake must complete promptly */
+	if (!conn->seen_verack)
+		return (now - conn->t_start) <= NC_HANDSHAKE_MS;
+
+	if ((now - conn->t_last_rx) > NC_INACTIVE_MS)
+		return false;
+
+	if (conn->ping_nonce) {
+		if ((now - conn->t_ping) > NC_PING_TIMEOUT_MS)
+			return false;
+	} else if ((now - conn->t_ping) >= NC_PING_MS) {
+		if (!nc_conn_send_ping(conn, now))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * periodic housekeeping: keepalive, evict stalled and unresponsive
+ * peers, refill outbound slots
+ */
+static void nc_maint_evt(int fd, short events, void *priv)
+{
+	struct net_child_info *nci = priv;
+	int64_t now = nc_now_ms();
+
+	/* walk backwards; a freed conn is removed from the array */
+	unsigned int i = nci->conns->len;
+	while (i-- > 0) {
+		struct nc_conn *conn = g_ptr_array_index(nci->conns, i);
+
+		/* only a stalled getdata counts against the peer;
+		 * quiet or timed-out sessions end without blame
+		 */
+		if (conn->getdata_pending &&
+		    (now - conn->t_getdata) > NC_STALL_MS) {
+			conn->stalled = true;
+			nc_conn_free(conn);
+		} else if (!nc_conn_alive(conn, now))
+			nc_conn_free(conn);
+	}
+
+	nc_seed_poll(nci);		/* seeding timeout */
+	nc_conns_open(nci);
+
+	/* a no-op, unless something worth saving changed */
+	if ((now - nci->t_peers_save) >= NC_PEERS_SAVE_MS) {
+		peerman_write(nci->peers);
+		nci->t_peers_save = now;
+	}
 }
 
 static void nc_pipe_evt(int fd, short events, void *priv)
@@ -773,6 +1826,55 @@ static void nc_pipe_evt(int fd, short events, void *priv)
 	}
 }
 
+/*
+ * Create the event base, honoring the "netbackend" setting: one of the
+ * libevent methods supported on this system ("epoll", "poll", "select",
+ * ...).  Connection events are edge-triggered, when the selected backend
+ * supports it.
+ */
+static struct event_base *nc_event_base_new(bool *edge_triggered)
+{
+	*edge_triggered = false;
+
+	char *backend = setting("netbackend");
+	if (!backend || !*backend)
+		return event_base_new();
+
+	struct event_config *cfg = event_config_new();
+	if (!cfg)
+		return NULL;
+
+	/* avoid every method, except the one requested */
+	const char **methods = event_get_supported_methods();
+	bool found = false;
+	unsigned int i;
+	for (i = 0; methods && methods[i]; i++) {
+		if (!strcmp(methods[i], backend))
+			found = true;
+		else
+			event_config_avoid_method(cfg, methods[i]);
+	}
+
+	struct event_base *eb = NULL;
+
+	if (!found) {
+		fprintf(stderr, "net: unsupported netbackend '%s'\n", backend);
+		goto out;
+	}
+
+	if (!strcmp(backend, "epoll"))
+		event_config_require_features(cfg,
+					EV_FEATURE_ET | EV_FEATURE_O1);
+
+	eb = event_base_new_with_config(cfg);
+	if (eb && (event_base_get_features(eb) & EV_FEATURE_ET))
+		*edge_triggered = true;
+
+out:
+	event_config_free(cfg);
+	return eb;
+}
+
 static void network_child(int read_fd, int write_fd)
 {
 	/*
@@ -781,10 +1883,10 @@ static void network_child(int read_fd, int write_fd)
 	struct peer_manager *peers;
 
 	peers = peerman_read();
-	if (!peers) {
-		peers = peerman_seed();
-		peerman_write(peers);
-	}
+	if (!peers)
+		peers = peerman_seed();	/* resolved in the background */
+	if (!peers)
+		exit(1);
 
 	/*
 	 * read block database
@@ -815,18 +1917,57 @@ static void network_child(int read_fd, int write_fd)
 
 	struct event *pipe_evt;
 
-	nci.eb = event_base_new();
+	nci.eb = nc_event_base_new(&nci.edge_triggered);
+	if (!nci.eb)
+		exit(1);
 	pipe_evt = event_new(nci.eb, read_fd, EV_READ | EV_PERSIST,
 			     nc_pipe_evt, &nci);
 	event_add(pipe_evt, NULL);
 
+	/* inventory relay: tx cache, and batched announcements */
+	nci.relay = g_hash_table_new_full(g_bu256_hash, g_bu256_equal,
+					  NULL, nc_relay_item_free);
+	g_queue_init(&nci.relay_q);
+	nci.inv_req = g_hash_table_new_full(g_bu256_hash, g_bu256_equal,
+					    g_free, NULL);
+
+	struct timeval trickle_tv = { 0, NC_TRICKLE_MS * 1000 };
+	nci.trickle_ev = event_new(nci.eb, -1, EV_PERSIST,
+				   nc_trickle_evt, &nci);
+	event_add(nci.trickle_ev, &trickle_tv);
+
+	struct timeval maint_tv = { NC_MAINT_MS / 1000,
+				    (NC_MAINT_MS % 1000) * 1000 };
+	nci.t_peers_save = nc_now_ms();
+	nci.maint_ev = event_new(nci.eb, -1, EV_PERSIST, nc_maint_evt, &nci);
+	event_add(nci.maint_ev, &maint_tv);
+
+	if (!nc_listen_start(&nci)) {	/* accept inbound P2P connections */
+		fprintf(stderr, "net: cannot listen on port %s\n",
+			setting("listen"));
+		exit(1);
+	}
+
+	if (peers->seeder) {
+		nci.seed_ev = event_new(nci.eb, dns_seeder_fd(peers->seeder),
+					EV_READ | EV_PERSIST, nc_seed_evt, &nci);
+		event_add(nci.seed_ev, NULL);
+	}
+
 	nc_conns_open(&nci);		/* start opening P2P connections */
 
 	/* main loop */
 	event_base_dispatch(nci.eb);
 
-	/* cleanup: just the minimum for file I/O correctness */
+	/* cleanup: just the minimum for file I/O correctness.
+	 * Closing connections returns their peers to the database.
+	 */
+	while (nci.conns->len > 0)
+		nc_conn_free(g_ptr_array_index(nci.conns, nci.conns->len - 1));
 	peerman_write(peers);
+
+	if (setting("netstats"))
+		nc_cmd_stats_log(&nci);
 	blkdb_free(&db);
 	exit(0);
 }
@@ -4,12 +4,19 @@
  */
 #include "picocoin-config.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
 #include "peerman.h"
 #include <ccoin/mbr.h>
 #include <ccoin/util.h>
 #include <ccoin/coredefs.h>
 #include <ccoin/compat.h>
+#include <ccoin/serialize.h>
 #include "picocoin.h"
 
 static guint addr_hash(gconstpointer key)
@@ -22,6 +29,63 @@ static gboolean addr_equal(gconstpointer a, gconstpointer b)
 	return memcmp(a, b, 16) == 0 ? TRUE : FALSE;
 }
 
+enum {
+	PEERMAN_BUCKET_SZ	= 64,		/* peers per bucket */
+
+	/* serialized bp_address and peer_metrics, in the peers file */
+	PEERMAN_ADDR_SZ		= 4 + 8 + 16 + 2,
+	PEERMAN_METRICS_SZ	= 8 * 4,
+
+	/* compact peers file: header, fixed-size records, checksum */
+	PEERMAN_FILE_VER	= 1,
+	PEERMAN_FILE_HDR_SZ	= 8 + 4 + 4 + 4 + 4,
+	PEERMAN_REC_SZ		= PEERMAN_ADDR_SZ + PEERMAN_METRICS_SZ + 1,
+	PEERMAN_NTIME_SLOP	= 20 * 60,	/* nTime updates worth saving */
+
+	PEERMAN_SAMPLE		= 8,		/* candidates per pop */
+	PEERMAN_RETRY_SECS	= 10 * 60,	/* recently tried: deprioritize */
+	PEERMAN_MAX_FAIL	= 8,		/* net failures, then forget */
+};
+
+static const unsigned int peerman_n_buckets[PEER_N_TABLES] = {
+	[PEER_NEW]	= 1024,
+	[PEER_TRIED]	= 256,
+};
+
+static const unsigned char peerman_file_magic[8] = "picopeer";
+
+/* legacy peers file record types, one per table */
+static const char *peerman_rec_cmd[PEER_N_TABLES] = {
+	[PEER_NEW]	= "CAddress",
+	[PEER_TRIED]	= "CAddrTried",
+};
+
+static bool deser_peer_metrics(struct peer_metrics *m,
+			       struct const_buffer *buf)
+{
+	if (!deser_u32(&m->connect_ms, buf)) return false;
+	if (!deser_u32(&m->rtt_ms, buf)) return false;
+	if (!deser_u32(&m->rx_bps, buf)) return false;
+	if (!deser_u32(&m->getdata_ms, buf)) return false;
+	if (!deser_u32(&m->n_success, buf)) return false;
+	if (!deser_u32(&m->n_fail, buf)) return false;
+	if (!deser_u32(&m->last_try, buf)) return false;
+	if (!deser_u32(&m->last_success, buf)) return false;
+	return true;
+}
+
+static void ser_peer_metrics(GString *s, const struct peer_metrics *m)
+{
+	ser_u32(s, m->connect_ms);
+	ser_u32(s, m->rtt_ms);
+	ser_u32(s, m->rx_bps);
+	ser_u32(s, m->getdata_ms);
+	ser_u32(s, m->n_success);
+	ser_u32(s, m->n_fail);
+	ser_u32(s, m->last_try);
+	ser_u32(s, m->last_success);
+}
+
 static struct peer_manager *peerman_new(void)
 {
 	struct peer_manager *peers;
@@ -31,6 +95,15 @@ static struct peer_manager *peerman_new(void)
 		return NULL;
 	
 	peers->map_addr = g_hash_table_new(addr_hash, addr_equal);
+	peers->active = g_hash_table_new(addr_hash, addr_equal);
+	peers->key = g_random_int();
+
+	unsigned int t;
+	for (t = 0; t < PEER_N_TABLES; t++) {
+		peers->table[t] = g_ptr_array_new();
+		peers->buckets[t] = calloc(peerman_n_buckets[t],
+					   sizeof(GPtrArray *));
+	}
 
 	return peers;
 }
@@ -40,59 +113,264 @@ void peerman_free(struct peer_manager *peers)
 	if (!peers)
 		return;
 
+	dns_seeder_free(peers->seeder);
+
 	if (peers->map_addr)
 		g_hash_table_unref(peers->map_addr);
+	if (peers->active)			/* owned by their callers */
+		g_hash_table_unref(peers->active);
+
+	unsigned int t, i;
+	for (t = 0; t < PEER_N_TABLES; t++) {
+		if (peers->table[t]) {
+			for (i = 0; i < peers->table[t]->len; i++)
+				free(g_ptr_array_index(peers->table[t], i));
+			g_ptr_array_free(peers->table[t], TRUE);
+		}
 
-	g_list_free_full(peers->addrlist, g_free);
+		if (peers->buckets[t]) {
+			for (i = 0; i < peerman_n_buckets[t]; i++)
+				if (peers->buckets[t][i])
+					g_ptr_array_free(peers->buckets[t][i],
+							 TRUE);
+			free(peers->buckets[t]);
+		}
+	}
 
 	memset(peers, 0, sizeof(*peers));
 	free(peers);
 }
 
-static void __peerman_add(struct peer_manager *peers, struct bp_address *addr,
-			  bool prepend_front)
+/* bucket for an address: keyed hash of its network group */
+static unsigned int peer_bucket(const struct peer_manager *peers,
+				enum peer_table table, const unsigned char *ip)
 {
-	if (prepend_front)
-		peers->addrlist = g_list_prepend(peers->addrlist, addr);
+	unsigned long h = peers->key ^ (table + 1);
+
+	if (is_ipv4_mapped(ip))
+		h = djb2_hash(h, &ip[12], 2);		/* /16 */
 	else
-		peers->addrlist = g_list_append(peers->addrlist, addr);
+		h = djb2_hash(h, ip, 4);		/* /32 */
+
+	return h % peerman_n_buckets[table];
+}
+
+static void peer_unlink(struct peer_manager *peers, struct peer *peer)
+{
+	GPtrArray *b = peers->buckets[peer->table][peer->bucket];
+	GPtrArray *t = peers->table[peer->table];
+	struct peer *last;
+
+	/* swap-remove from bucket */
+	last = g_ptr_array_index(b, b->len - 1);
+	b->pdata[peer->bucket_idx] = last;
+	last->bucket_idx = peer->bucket_idx;
+	g_ptr_array_set_size(b, b->len - 1);
+
+	/* swap-remove from dense table array */
+	last = g_ptr_array_index(t, t->len - 1);
+	t->pdata[peer->table_idx] = last;
+	last->table_idx = peer->table_idx;
+	g_ptr_array_set_size(t, t->len - 1);
+
+	g_hash_table_remove(peers->map_addr, peer->addr.ip);
+	peers->dirty = true;
+}
+
+static void peer_link(struct peer_manager *peers, struct peer *peer,
+		      enum peer_table table)
+{
+	unsigned int bucket = peer_bucket(peers, table, peer->addr.ip);
+	GPtrArray **bp = &peers->buckets[table][bucket];
+
+	if (!*bp)
+		*bp = g_ptr_array_sized_new(PEERMAN_BUCKET_SZ);
+
+	/* bucket full: make room, by evicting a random occupant.
+	 * Tried peers are demoted to new, rather than forgotten.
+	 */
+	if ((*bp)->len >= PEERMAN_BUCKET_SZ) {
+		struct peer *victim;
+
+		victim = g_ptr_array_index(*bp,
+				g_random_int_range(0, (*bp)->len));
+		peer_unlink(peers, victim);
+
+		if (table == PEER_TRIED)
+			peer_link(peers, victim, PEER_NEW);
+		else
+			free(victim);
+	}
+
+	peer->table = table;
+	peer->bucket = bucket;
+	peer->bucket_idx = (*bp)->len;
+	g_ptr_array_add(*bp, peer);
+
+	peer->table_idx = peers->table[table]->len;
+	g_ptr_array_add(peers->table[table], peer);
 
 	/* when using GHashTable as a set, key=value enables some
 	 * unspecified GLib optimizations
 	 */
-	g_hash_table_insert(peers->map_addr, addr->ip, addr->ip);
+	g_hash_table_insert(peers->map_addr, peer->addr.ip, peer);
+	peers->dirty = true;
 }
 
-static bool peerman_has_addr(struct peer_manager *peers,const unsigned char *ip)
+static struct peer *peerman_lookup(struct peer_manager *peers,
+				   const unsigned char *ip)
 {
-	return g_hash_table_lookup_extended(peers->map_addr, ip, NULL, NULL);
+	return g_hash_table_lookup(peers->map_addr, ip);
+}
+
+static void __peerman_add(struct peer_manager *peers,
+			  const struct bp_address *addr, enum peer_table table)
+{
+	struct peer *peer = peerman_lookup(peers, addr->ip);
+	if (!peer)
+		peer = g_hash_table_lookup(peers->active, addr->ip);
+
+	if (peer) {
+		if (addr->nTime > peer->addr.nTime) {
+			if (addr->nTime - peer->addr.nTime > PEERMAN_NTIME_SLOP)
+				peers->dirty = true;
+			peer->addr.nTime = addr->nTime;
+		}
+
+		/* in use; table is chosen when returned */
+		if (g_hash_table_lookup(peers->active, addr->ip))
+			return;
+
+		/* promote to tried */
+		if (table == PEER_TRIED && peer->table == PEER_NEW) {
+			peer_unlink(peers, peer);
+			peer_link(peers, peer, PEER_TRIED);
+		}
+		return;
+	}
+
+	peer = calloc(1, sizeof(*peer));
+	if (!peer)
+		return;
+
+	memcpy(&peer->addr, addr, sizeof(*addr));
+	peer_link(peers, peer, table);
 }
 
 static bool peerman_read_rec(struct peer_manager *peers,
 			     const struct p2p_message *msg)
 {
-	if (strncmp(msg->hdr.command, "CAddress", sizeof(msg->hdr.command)) ||
-	    (msg->hdr.data_len != sizeof(struct bp_address)))
+	enum peer_table table;
+
+	for (table = 0; table < PEER_N_TABLES; table++)
+		if (!strncmp(msg->hdr.command, peerman_rec_cmd[table],
+			     sizeof(msg->hdr.command)))
+			break;
+
+	/* metrics are absent from older files */
+	if ((table == PEER_N_TABLES) ||
+	    ((msg->hdr.data_len != PEERMAN_ADDR_SZ) &&
+	     (msg->hdr.data_len != PEERMAN_ADDR_SZ + PEERMAN_METRICS_SZ)))
 		return false;
 
 	struct const_buffer buf = { msg->data, msg->hdr.data_len };
-	struct bp_address *addr;
-
-	addr = calloc(1, sizeof(*addr));
+	struct peer *peer = calloc(1, sizeof(*peer));
 
-	if (!deser_bp_addr(CADDR_TIME_VERSION, addr, &buf))
-		goto err_out;
+	if (!deser_bp_addr(CADDR_TIME_VERSION, &peer->addr, &buf) ||
+	    (buf.len && !deser_peer_metrics(&peer->m, &buf))) {
+		free(peer);
+		return false;
+	}
 
-	if (!peerman_has_addr(peers, addr->ip))
-		__peerman_add(peers, addr, false);
+	if (peerman_lookup(peers, peer->addr.ip))
+		free(peer);
 	else
-		free(addr);
+		peer_link(peers, peer, table);
 
 	return true;
+}
 
-err_out:
-	free(addr);
-	return false;
+/* older peers files: a sequence of p2p-framed records */
+static bool peerman_read_legacy(struct peer_manager *peers,
+				struct const_buffer *buf)
+{
+	struct mbuf_reader mbr;
+
+	mbr_init(&mbr, buf);
+
+	while (mbr_read(&mbr)) {
+		if (!peerman_read_rec(peers, &mbr.msg)) {
+			mbr.error = true;
+			break;
+		}
+	}
+
+	bool rc = !mbr.error;
+
+	mbr_free(&mbr);
+	return rc;
+}
+
+/*
+ * Compact peers file:
+ *	magic[8], version, netmagic[4], record size, record count
+ *	records: address, metrics, table
+ *	double-SHA256 of all the above
+ * Records may grow in later versions; unknown trailing bytes are skipped.
+ */
+static bool peerman_read_compact(struct peer_manager *peers,
+				 struct const_buffer *buf)
+{
+	if (buf->len < PEERMAN_FILE_HDR_SZ + sizeof(bu256_t))
+		return false;
+
+	size_t body_len = buf->len - sizeof(bu256_t);
+	bu256_t hash;
+
+	bu_Hash((unsigned char *) &hash, buf->p, body_len);
+	if (memcmp(&hash, buf->p + body_len, sizeof(hash)))
+		return false;
+
+	struct const_buffer hdr = { buf->p + sizeof(peerman_file_magic),
+				    PEERMAN_FILE_HDR_SZ -
+				    sizeof(peerman_file_magic) };
+	uint32_t ver, rec_sz, count;
+	unsigned char netmagic[4];
+
+	if (!deser_u32(&ver, &hdr) ||
+	    !deser_bytes(netmagic, &hdr, sizeof(netmagic)) ||
+	    !deser_u32(&rec_sz, &hdr) ||
+	    !deser_u32(&count, &hdr))
+		return false;
+
+	if ((ver < PEERMAN_FILE_VER) || (rec_sz < PEERMAN_REC_SZ) ||
+	    memcmp(netmagic, chain->netmagic, sizeof(netmagic)) ||
+	    ((uint64_t) count * rec_sz != body_len - PEERMAN_FILE_HDR_SZ))
+		return false;
+
+	const unsigned char *p = buf->p + PEERMAN_FILE_HDR_SZ;
+	unsigned int i;
+
+	for (i = 0; i < count; i++, p += rec_sz) {
+		struct const_buffer rec = { p, rec_sz };
+		struct peer *peer = calloc(1, sizeof(*peer));
+		uint8_t table;
+
+		if (!deser_bp_addr(CADDR_TIME_VERSION, &peer->addr, &rec) ||
+		    !deser_peer_metrics(&peer->m, &rec) ||
+		    !deser_bytes(&table, &rec, 1) ||
+		    (table >= PEER_N_TABLES)) {
+			free(peer);
+			return false;
+		}
+
+		if (peerman_lookup(peers, peer->addr.ip))
+			free(peer);
+		else
+			peer_link(peers, peer, table);
+	}
+
+	return true;
 }
 
 struct peer_manager *peerman_read(void)
@@ -112,123 +390,258 @@ struct peer_manager *peerman_read(void)
 	peers = peerman_new();
 
 	struct const_buffer buf = { data, data_len };
-	struct mbuf_reader mbr;
-
-	mbr_init(&mbr, &buf);
+	bool legacy, rc;
 
-	while (mbr_read(&mbr)) {
-		if (!peerman_read_rec(peers, &mbr.msg)) {
-			mbr.error = true;
-			break;
-		}
-	}
+	legacy = (data_len < sizeof(peerman_file_magic)) ||
+		 memcmp(data, peerman_file_magic, sizeof(peerman_file_magic));
+	if (legacy)
+		rc = peerman_read_legacy(peers, &buf);
+	else
+		rc = peerman_read_compact(peers, &buf);
 
-	if (mbr.error) {
+	if (!rc) {
 		peerman_free(peers);
 		peers = NULL;
-	}
+	} else
+		peers->dirty = legacy;	/* rewrite legacy files as compact */
 
-	mbr_free(&mbr);
 	free(data);
 
 	return peers;
 }
 
+/* "dnstimeout" setting: whole seconds, positive, as milliseconds */
+static bool peerman_parse_timeout(const char *s, unsigned int *timeout_ms)
+{
+	char *end;
+
+	errno = 0;
+	long secs = strtol(s, &end, 10);
+	if (errno || (end == s) || *end ||
+	    (secs <= 0) || (secs > UINT_MAX / 1000))
+		return false;
+
+	*timeout_ms = (unsigned int) secs * 1000;
+	return true;
+}
+
+/*
+ * New, empty peer manager, with DNS seed queries started in the
+ * background.  Poll peerman_seed_collect() for their results.
+ */
 struct peer_manager *peerman_seed(void)
 {
 	struct peer_manager *peers;
 
+	/* seed list and timeout may be overridden by settings */
+	char *seeds_str = setting("dnsseeds");
+	char *timeout_str = setting("dnstimeout");
+	gchar **seeds = NULL;
+	unsigned int timeout_ms = DNS_SEED_TIMEOUT_MS;
+
+	if (timeout_str && !peerman_parse_timeout(timeout_str, &timeout_ms)) {
+		fprintf(stderr, "peerman: invalid dnstimeout '%s'\n",
+			timeout_str);
+		return NULL;
+	}
+
 	peers = peerman_new();
 	if (!peers)
 		return NULL;
 
-	/* make DNS query for seed data */
-	GList *tmp, *seedlist = bu_dns_seed_addrs();
+	if (seeds_str)
+		seeds = g_strsplit(seeds_str, ",", 0);
 
-	/* import seed data into peerman */
-	tmp = seedlist;
-	while (tmp) {
-		__peerman_add(peers, tmp->data, true);
-		tmp = tmp->next;
-	}
-	g_list_free(seedlist);
+	peers->seeder = dns_seeder_new(seeds ? (const char **) seeds :
+						dns_seeds_default,
+				       timeout_ms, dns_resolve_getaddrinfo,
+				       NULL);
+
+	g_strfreev(seeds);
 
 	return peers;
 }
 
-static GString *ser_peerman(struct peer_manager *peers)
+/*
+ * Import DNS seed results that arrived since the last call.  Returns
+ * true while seeding is still in progress.
+ */
+bool peerman_seed_collect(struct peer_manager *peers)
 {
-	unsigned int peer_count = g_hash_table_size(peers->map_addr);
-	GString *s = g_string_sized_new(
-		peer_count * (24 + sizeof(struct bp_address)));
+	if (!peers->seeder)
+		return false;
 
-	GList *tmp = peers->addrlist;
+	GList *tmp, *seedlist = dns_seeder_take(peers->seeder);
 
-	while (tmp) {
-		struct bp_address *addr;
+	for (tmp = seedlist; tmp; tmp = tmp->next)
+		__peerman_add(peers, tmp->data, PEER_NEW);
+	g_list_free_full(seedlist, g_free);
 
-		addr = tmp->data;
-		tmp = tmp->next;
+	if (!dns_seeder_done(peers->seeder))
+		return true;
 
-		GString *msg_data = g_string_sized_new(sizeof(struct bp_address));
-		ser_bp_addr(msg_data, CADDR_TIME_VERSION, addr);
+	dns_seeder_free(peers->seeder);
+	peers->seeder = NULL;
 
-		GString *rec = message_str(chain->netmagic, "CAddress",
-					   msg_data->str, msg_data->len);
+	return false;
+}
 
-		g_string_append_len(s, rec->str, rec->len);
+static void ser_peer_rec(GString *s, const struct peer *peer)
+{
+	ser_bp_addr(s, CADDR_TIME_VERSION, &peer->addr);
+	ser_peer_metrics(s, &peer->m);
+	g_string_append_c(s, (char) peer->table);
+}
 
-		g_string_free(rec, TRUE);
-		g_string_free(msg_data, TRUE);
-	}
+static GString *ser_peerman(struct peer_manager *peers)
+{
+	unsigned int count = g_hash_table_size(peers->map_addr) +
+			     g_hash_table_size(peers->active);
+	GString *s = g_string_sized_new(PEERMAN_FILE_HDR_SZ +
+					(count * PEERMAN_REC_SZ) +
+					sizeof(bu256_t));
+
+	g_string_append_len(s, (const char *) peerman_file_magic,
+			    sizeof(peerman_file_magic));
+	ser_u32(s, PEERMAN_FILE_VER);
+	ser_bytes(s, chain->netmagic, 4);
+	ser_u32(s, PEERMAN_REC_SZ);
+	ser_u32(s, count);
+
+	unsigned int t, i;
+	for (t = 0; t < PEER_N_TABLES; t++)
+		for (i = 0; i < peers->table[t]->len; i++)
+			ser_peer_rec(s, g_ptr_array_index(peers->table[t], i));
+
+	/* peers in use are saved as of their last return */
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&iter, peers->active);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		ser_peer_rec(s, value);
+
+	bu256_t hash;
+	bu_Hash((unsigned char *) &hash, s->str, s->len);
+	ser_u256(s, &hash);
 
 	return s;
 }
 
+/* write peers file, if changed since last read or written */
 bool peerman_write(struct peer_manager *peers)
 {
 	char *filename = setting("peers");
 	if (!filename)
 		return false;
 
+	if (!peers->dirty)
+		return true;
+
 	GString *data = ser_peerman(peers);
 
 	bool rc = bu_write_file(filename, data->str, data->len);
+	if (rc)
+		peers->dirty = false;
 
 	g_string_free(data, TRUE);
 
 	return rc;
 }
 
-struct bp_address *peerman_pop(struct peer_manager *peers)
+/*
+ * Desirability of a peer, from its history: reliability, scaled by
+ * latency, with a bonus for throughput.  Untried peers score as an
+ * average peer would, so that they continue to be explored.
+ */
+static double peer_score(const struct peer *peer, uint32_t now)
 {
-	struct bp_address *addr;
-	GList *tmp;
+	const struct peer_metrics *m = &peer->m;
 
-	tmp = peers->addrlist;
-	if (!tmp)
-		return NULL;
+	double reliability = (m->n_success + 1.0) /
+			     (m->n_success + (2.0 * m->n_fail) + 1.0);
 
-	addr = tmp->data;
+	uint32_t latency_ms = m->rtt_ms ? m->rtt_ms :
+			      m->connect_ms ? m->connect_ms : 250;
+	double speed = 1000.0 / (latency_ms + 100.0);
 
-	peers->addrlist = g_list_delete_link(tmp, tmp);
+	double throughput = 1.0 + log1p(m->rx_bps / 10000.0);
 
-	g_hash_table_remove(peers->map_addr, addr->ip);
+	/* don't hammer a peer we just tried */
+	double backoff = 1.0;
+	if (m->last_try && (now - m->last_try) < PEERMAN_RETRY_SECS)
+		backoff = 0.01;
 
-	return addr;
+	return reliability * speed * throughput * backoff;
 }
 
-void peerman_add(struct peer_manager *peers,
-		 const struct bp_address *addr_in, bool known_working)
+/*
+ * Detach and return a peer to connect to.  Tried and new tables are
+ * equally likely; within the table, the best-scoring of a small random
+ * sample is chosen.  The caller owns the result, and returns it with
+ * peerman_put() once the connection ends.
+ */
+struct peer *peerman_pop(struct peer_manager *peers)
 {
-	struct bp_address *addr;
+	GPtrArray *t_new = peers->table[PEER_NEW];
+	GPtrArray *t_tried = peers->table[PEER_TRIED];
+	GPtrArray *t;
 
-	if (peerman_has_addr(peers, addr_in->ip))
-		return;
+	if (!t_new->len && !t_tried->len)
+		return NULL;
+
+	if (!t_new->len)
+		t = t_tried;
+	else if (!t_tried->len)
+		t = t_new;
+	else
+		t = (g_random_int() & 1) ? t_tried : t_new;
+
+	struct peer *best = NULL;
+	double best_score = 0.0;
+	uint32_t now = (uint32_t) time(NULL);
+	unsigned int i;
+
+	for (i = 0; i < PEERMAN_SAMPLE; i++) {
+		struct peer *peer;
+		double score;
+
+		peer = g_ptr_array_index(t, g_random_int_range(0, t->len));
+		score = peer_score(peer, now);
+		if (!best || score > best_score) {
+			best = peer;
+			best_score = score;
+		}
+	}
+
+	peer_unlink(peers, best);
+	g_hash_table_insert(peers->active, best->addr.ip, best);
+
+	return best;
+}
+
+/*
+ * Return a peer detached by peerman_pop(), with updated metrics.  Peers
+ * with a history of failure are demoted, and eventually forgotten.
+ */
+void peerman_put(struct peer_manager *peers, struct peer *peer)
+{
+	const struct peer_metrics *m = &peer->m;
+
+	g_hash_table_remove(peers->active, peer->addr.ip);
 
-	addr = malloc(sizeof(*addr));
-	memcpy(addr, addr_in, sizeof(*addr));
+	if ((m->n_fail > m->n_success + PEERMAN_MAX_FAIL) ||
+	    peerman_lookup(peers, peer->addr.ip)) {
+		free(peer);
+		return;
+	}
 
-	__peerman_add(peers, addr, !known_working);
+	peer_link(peers, peer,
+		  (m->n_success > m->n_fail) ? PEER_TRIED : PEER_NEW);
 }
 
+void peerman_add(struct peer_manager *peers,
+		 const struct bp_address *addr_in, bool known_working)
+{
+	__peerman_add(peers, addr_in, known_working ? PEER_TRIED : PEER_NEW);
+}
@@ -5,20 +5,77 @@
  * file COPYING or http://www.opensource.org/licenses/mit-license.php.
  */
 
+#include <stdint.h>
 #include <stdbool.h>
 #include <glib.h>
 #include <ccoin/core.h>
+#include <ccoin/dns.h>
 
+enum peer_table {
+	PEER_NEW,			/* heard about; never connected */
+	PEER_TRIED,			/* connected successfully, at least once */
+
+	PEER_N_TABLES
+};
+
+/* observed behavior of a peer, kept across sessions in the peers file */
+struct peer_metrics {
+	uint32_t	connect_ms;	/* TCP connect latency */
+	uint32_t	rtt_ms;		/* ping round trip */
+	uint32_t	rx_bps;		/* bytes/sec received */
+	uint32_t	getdata_ms;	/* getdata response latency */
+	uint32_t	n_success;	/* sessions completing handshake */
+	uint32_t	n_fail;		/* failed or stalled sessions */
+	uint32_t	last_try;	/* time of last connection attempt */
+	uint32_t	last_success;
+};
+
+/* fold a new sample into a smoothed metric (EWMA, alpha = 1/4) */
+static inline void peer_metric_sample(uint32_t *metric, uint32_t sample)
+{
+	if (!*metric)
+		*metric = sample;
+	else
+		*metric = (uint32_t) ((((uint64_t) *metric * 3) + sample) / 4);
+}
+
+struct peer {
+	struct bp_address addr;
+	struct peer_metrics m;
+
+	enum peer_table	table;
+	unsigned int	bucket;
+	unsigned int	bucket_idx;	/* position in bucket array */
+	unsigned int	table_idx;	/* position in table's dense array */
+};
+
+/*
+ * Addresses are kept in two tables, new and tried.  Each table is a set
+ * of fixed-capacity buckets, chosen by a keyed hash of the address group
+ * (/16 IPv4, /32 IPv6), which bounds how much of the table any one
+ * network can occupy.  A dense array per table permits O(1) uniform
+ * random selection; removal from either array is O(1) swap-remove.
+ */
 struct peer_manager {
-	GHashTable	*map_addr;
-	GList		*addrlist;	/* of struct bp_address */
+	GHashTable	*map_addr;	/* ip -> struct peer */
+
+	GPtrArray	*table[PEER_N_TABLES];	/* of struct peer */
+	GPtrArray	**buckets[PEER_N_TABLES];
+	guint32		key;		/* bucket placement secret */
+
+	GHashTable	*active;	/* ip -> struct peer, popped */
+	bool		dirty;		/* changed since read/written */
+
+	struct dns_seeder *seeder;	/* DNS seeding in progress */
 };
 
 extern void peerman_free(struct peer_manager *peers);
 extern struct peer_manager *peerman_read(void);
 extern struct peer_manager *peerman_seed(void);
+extern bool peerman_seed_collect(struct peer_manager *peers);
 extern bool peerman_write(struct peer_manager *peers);
-extern struct bp_address *peerman_pop(struct peer_manager *peers);
+extern struct peer *peerman_pop(struct peer_manager *peers);
+extern void peerman_put(struct peer_manager *peers, struct peer *peer);
 extern void peerman_add(struct peer_manager *peers,
 		 const struct bp_address *addr_in, bool known_working);
 
@@ -292,6 +292,85 @@ void wallet_new_address(void)
 	g_string_free(btc_addr, TRUE);
 }
 
+/* address pools: count=N new-addresses, one wallet write for all */
+void wallet_new_addresses(void)
+{
+	char *count_str = setting("count");
+	int n = count_str ? atoi(count_str) : 0;
+	if (n <= 0) {
+		fprintf(stderr, "wallet: new-addresses requires count=N\n");
+		return;
+	}
+	unsigned int count = n;
+
+	if (!cur_wallet_load())
+		return;
+	struct wallet *wlt = cur_wallet;
+
+	struct bp_key *keys = calloc(count, sizeof(*keys));
+	struct bp_key **owned = NULL;
+	unsigned int i, n_init = 0;
+
+	if (!keys) {
+		fprintf(stderr, "wallet: out of memory\n");
+		return;
+	}
+
+	for (n_init = 0; n_init < count; n_init++)
+		if (!bp_key_init(&keys[n_init])) {
+			fprintf(stderr, "wallet: key init failed\n");
+			goto err_out;
+		}
+
+	if (!bp_key_generate_batch(keys, count)) {
+		fprintf(stderr, "wallet: key gen failed\n");
+		goto err_out;
+	}
+
+	/* the wallet owns individually allocated keys; allocate them
+	 * all before handing any over
+	 */
+	owned = calloc(count, sizeof(*owned));
+	if (!owned)
+		goto err_oom;
+	for (i = 0; i < count; i++) {
+		owned[i] = malloc(sizeof(struct bp_key));
+		if (!owned[i])
+			goto err_oom;
+	}
+
+	for (i = 0; i < count; i++) {
+		*owned[i] = keys[i];
+		g_ptr_array_add(wlt->keys, owned[i]);
+	}
+	free(owned);
+	free(keys);
+
+	store_wallet(wlt);
+
+	for (i = wlt->keys->len - count; i < wlt->keys->len; i++) {
+		struct bp_key *key = g_ptr_array_index(wlt->keys, i);
+		GString *btc_addr = bp_pubkey_get_address(key,
+							  chain->addr_pubkey);
+
+		printf("%s\n", btc_addr->str);
+
+		g_string_free(btc_addr, TRUE);
+	}
+	return;
+
+err_oom:
+	fprintf(stderr, "wallet: out of memory\n");
+	if (owned)
+		for (i = 0; i < count; i++)
+			free(owned[i]);		/* calloc'd: NULL past failure */
+	free(owned);
+err_out:
+	for (i = 0; i < n_init; i++)
+		bp_key_free(&keys[i]);
+	free(keys);
+}
+
 void cur_wallet_free(void)
 {
 	if (!cur_wallet)
@@ -17,6 +17,7 @@ struct wallet {
 };
 
 extern void wallet_new_address(void);
+extern void wallet_new_addresses(void);
 extern void wallet_create(void);
 extern void wallet_info(void);
 extern void wallet_dump(void);
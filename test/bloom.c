@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <openssl/sha.h>
 #include <ccoin/bloom.h>
+#include <ccoin/util.h>
 #include "libtest.h"
 
 static const char *data1 = "foo";
@@ -49,14 +50,123 @@ static void runtest (void)
 
 	bloom_free(&bloom2);
 
+	/* lookups never grow or modify the filter */
+	GString *snap = g_string_new_len(bloom.vData->str, bloom.vData->len);
+	unsigned int i;
+	for (i = 0; i < 1000; i++) {
+		unsigned char md[SHA256_DIGEST_LENGTH];
+		SHA256((unsigned char *) &i, sizeof(i), md);
+		bloom_contains(&bloom, md, sizeof(md));
+	}
+	assert(bloom.vData->len == snap->len);
+	assert(memcmp(bloom.vData->str, snap->str, snap->len) == 0);
+	g_string_free(snap, TRUE);
+
+	bloom_clear(&bloom);
+	assert(bloom_contains(&bloom, md1, sizeof(md1)) == false);
+
+	bloom_free(&bloom);
+
+	/* degenerate: a single hash function; an empty filter */
+	assert(bloom_init(&bloom, 1, 0.5) == true);
+	assert(bloom.nHashFuncs >= 1);
+	bloom_insert(&bloom, md1, sizeof(md1));
+	assert(bloom_contains(&bloom, md1, sizeof(md1)) == true);
+	bloom_free(&bloom);
+
+	__bloom_init(&bloom);
+	bloom_insert(&bloom, md1, sizeof(md1));
+	assert(bloom_contains(&bloom, md1, sizeof(md1)) == false);
 	bloom_free(&bloom);
 
 	g_string_free(ser, TRUE);
 }
 
+/* MurmurHash3 x86_32 reference values */
+static const struct {
+	const char	*data;
+	uint32_t	seed;
+	uint32_t	hash;
+} murmur3_vectors[] = {
+	{ "", 0, 0 },
+	{ "", 1, 0x514e28b7 },
+	{ "", 0xffffffff, 0x81f16f39 },
+	{ "\x21\x43\x65\x87", 0, 0xf55b516b },
+	{ "\x21\x43\x65\x87", 0x5082edee, 0x2362f9de },
+	{ "\x21\x43\x65", 0, 0x7e4a8634 },
+	{ "\x21\x43", 0, 0xa0f7b07a },
+	{ "\x21", 0, 0x72661cf4 },
+	{ "aaaa", 0x9747b28c, 0x5a97808a },
+	{ "Hello, world!", 0x9747b28c, 0x24884cba },
+	{ "The quick brown fox jumps over the lazy dog",
+	  0x9747b28c, 0x2fa826cd },
+};
+
+static void test_murmur3(void)
+{
+	unsigned int n = ARRAY_SIZE(murmur3_vectors);
+	unsigned int i, j;
+
+	for (i = 0; i < n; i++) {
+		const char *data = murmur3_vectors[i].data;
+		uint32_t h;
+
+		murmur3_multi(&h, &murmur3_vectors[i].seed, 1,
+			      data, strlen(data));
+		assert(h == murmur3_vectors[i].hash);
+	}
+
+	/* many seeds at once, spanning several SIMD vectors, must agree
+	 * with one seed at a time
+	 */
+	uint32_t seeds[60], out[60];
+	const char *data = "The quick brown fox jumps over the lazy dog";
+
+	for (i = 0; i < ARRAY_SIZE(seeds); i++)
+		seeds[i] = i * 0x0519ff93U;
+	for (j = 1; j <= ARRAY_SIZE(seeds); j++) {
+		memset(out, 0, sizeof(out));
+		murmur3_multi(out, seeds, j, data, strlen(data));
+
+		for (i = 0; i < ARRAY_SIZE(seeds); i++) {
+			uint32_t h;
+			murmur3_multi(&h, &seeds[i], 1, data, strlen(data));
+			assert((i < j) ? (out[i] == h) : (out[i] == 0));
+		}
+	}
+}
+
+static void test_batch(void)
+{
+	struct bloom bloom;
+	unsigned char md[100][SHA256_DIGEST_LENGTH];
+	struct const_buffer keys[100];
+	bool match[100];
+	unsigned int i;
+
+	assert(bloom_init(&bloom, 100, 0.000001) == true);
+
+	for (i = 0; i < 100; i++) {
+		SHA256((unsigned char *) &i, sizeof(i), md[i]);
+		keys[i].p = md[i];
+		keys[i].len = sizeof(md[i]);
+
+		if (i & 1)
+			bloom_insert(&bloom, md[i], sizeof(md[i]));
+	}
+
+	assert(bloom_contains_batch(&bloom, keys, 100, match) == 50);
+	for (i = 0; i < 100; i++)
+		assert(match[i] == (i & 1));
+
+	bloom_free(&bloom);
+}
+
 int main (int argc, char *argv[])
 {
 	runtest();
+	test_murmur3();
+	test_batch();
 
 	return 0;
 }
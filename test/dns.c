@@ -0,0 +1,211 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <assert.h>
+#include <ccoin/core.h>
+#include <ccoin/util.h>
+#include <ccoin/dns.h>
+
+/*
+ * stub resolver: "<gate>.<n-addrs>.test" blocks until the test opens
+ * that gate, then answers with n addresses, whose last byte is the gate
+ */
+static struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned int	open;		/* bitmask of open gates */
+	unsigned int	n_waiting;	/* queries blocked on a gate */
+	unsigned int	n_answered;
+} stub = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static GList *stub_resolve(const char *name, void *priv)
+{
+	unsigned int gate = 0, n_addrs = 0;
+	GList *l = NULL;
+
+	if ((sscanf(name, "%u.%u.test", &gate, &n_addrs) != 2) ||
+	    (gate >= 32))
+		return NULL;
+
+	pthread_mutex_lock(&stub.lock);
+	stub.n_waiting++;
+	pthread_cond_broadcast(&stub.cond);
+	while (!(stub.open & (1U << gate)))
+		pthread_cond_wait(&stub.cond, &stub.lock);
+	stub.n_waiting--;
+	pthread_mutex_unlock(&stub.lock);
+
+	unsigned int i;
+	for (i = 0; i < n_addrs; i++) {
+		struct bp_address *addr = calloc(1, sizeof(*addr));
+
+		memcpy(addr->ip, ipv4_mapped_pfx, 12);
+		addr->ip[13] = i;
+		addr->ip[15] = gate;
+		addr->port = 8333;
+
+		l = g_list_append(l, addr);
+	}
+
+	pthread_mutex_lock(&stub.lock);
+	stub.n_answered++;
+	pthread_cond_broadcast(&stub.cond);
+	pthread_mutex_unlock(&stub.lock);
+
+	return l;
+}
+
+static void stub_reset(void)
+{
+	pthread_mutex_lock(&stub.lock);
+	stub.open = 0;
+	stub.n_answered = 0;
+	pthread_mutex_unlock(&stub.lock);
+}
+
+static void stub_open(unsigned int gate)
+{
+	pthread_mutex_lock(&stub.lock);
+	stub.open |= (1U << gate);
+	pthread_cond_broadcast(&stub.cond);
+	pthread_mutex_unlock(&stub.lock);
+}
+
+/* wait for a stub counter to reach n; a generous limit turns a hang
+ * into a failure
+ */
+static void stub_wait(const unsigned int *counter, unsigned int n)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 60;
+
+	pthread_mutex_lock(&stub.lock);
+	while (*counter < n)
+		assert(pthread_cond_timedwait(&stub.cond, &stub.lock,
+					      &ts) == 0);
+	pthread_mutex_unlock(&stub.lock);
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* wait for the first batch of results */
+static GList *take_first(struct dns_seeder *ds)
+{
+	GList *l = NULL;
+
+	while (!l && !dns_seeder_done(ds)) {
+		dns_seeder_wait(ds);
+		l = dns_seeder_take(ds);
+	}
+
+	return l;
+}
+
+static void test_concurrent(void)
+{
+	const char *seeds[] = {
+		"0.3.test", "1.2.test", "2.1.test",
+		"bogus", "3.0.test", NULL
+	};
+
+	stub_reset();
+
+	struct dns_seeder *ds = dns_seeder_new(seeds, 60 * 1000,
+					       stub_resolve, NULL);
+	assert(ds != NULL);
+	assert(dns_seeder_fd(ds) >= 0);
+
+	/* every query is in flight at once */
+	stub_wait(&stub.n_waiting, 4);
+	assert(dns_seeder_done(ds) == false);
+
+	/* a seed answers as soon as it can, without waiting on others */
+	stub_open(1);
+	GList *l = take_first(ds);
+	assert(g_list_length(l) == 2);
+	assert(((struct bp_address *) l->data)->ip[15] == 1);
+	assert(dns_seeder_done(ds) == false);
+
+	stub_open(0);
+	stub_open(2);
+	stub_open(3);
+	while (!dns_seeder_done(ds)) {
+		dns_seeder_wait(ds);
+		l = g_list_concat(l, dns_seeder_take(ds));
+	}
+	l = g_list_concat(l, dns_seeder_take(ds));
+
+	assert(g_list_length(l) == 2 + 3 + 1);
+
+	g_list_free_full(l, g_free);
+	dns_seeder_free(ds);
+}
+
+static void test_timeout(void)
+{
+	const char *seeds[] = { "0.1.test", "1.4.test", NULL };
+	int64_t t0 = now_ms();
+
+	stub_reset();
+	stub_open(0);
+
+	struct dns_seeder *ds = dns_seeder_new(seeds, 300, stub_resolve,
+					       NULL);
+	assert(ds != NULL);
+
+	GList *l = take_first(ds);
+	assert(g_list_length(l) == 1);
+
+	while (!dns_seeder_done(ds))
+		dns_seeder_wait(ds);
+	l = g_list_concat(l, dns_seeder_take(ds));
+
+	/* gave up on the slow seed, at the deadline */
+	assert(now_ms() - t0 >= 300);
+	assert(g_list_length(l) == 1);
+
+	g_list_free_full(l, g_free);
+
+	/* the slow query is still running; it must clean up after us */
+	dns_seeder_free(ds);
+	stub_open(1);
+	stub_wait(&stub.n_answered, 2);
+	usleep(100 * 1000);		/* let its thread finish */
+}
+
+static void test_empty(void)
+{
+	const char *seeds[] = { NULL };
+
+	struct dns_seeder *ds = dns_seeder_new(seeds, 1000, stub_resolve,
+					       NULL);
+	assert(ds != NULL);
+	assert(dns_seeder_done(ds) == true);
+	assert(dns_seeder_take(ds) == NULL);
+	dns_seeder_free(ds);
+}
+
+int main (int argc, char *argv[])
+{
+	test_concurrent();
+	test_timeout();
+	test_empty();
+
+	return 0;
+}
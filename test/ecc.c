@@ -0,0 +1,357 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+#include <ccoin/ecc.h>
+#include <ccoin/util.h>
+
+/*
+ * cross-check the in-tree secp256k1 code against OpenSSL
+ */
+
+#ifdef __SIZEOF_INT128__
+
+enum {
+	N_KEYS		= 64,
+	N_PARSE		= 1000,
+	N_BATCH_KEYS	= 5,
+	N_BATCH		= 40,
+	N_CREATE	= 300,		/* spans three inversion chunks */
+};
+
+static const unsigned char order[32] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe,
+	0xba, 0xae, 0xdc, 0xe6, 0xaf, 0x48, 0xa0, 0x3b,
+	0xbf, 0xd2, 0x5e, 0x8c, 0xd0, 0x36, 0x41, 0x41,
+};
+
+static EC_KEY *ossl_key(const unsigned char *seckey)
+{
+	EC_KEY *k = EC_KEY_new_by_curve_name(NID_secp256k1);
+	const EC_GROUP *group = EC_KEY_get0_group(k);
+	BIGNUM *bn = BN_bin2bn(seckey, 32, NULL);
+	EC_POINT *pt = EC_POINT_new(group);
+
+	assert(EC_POINT_mul(group, pt, bn, NULL, NULL, NULL) == 1);
+	assert(EC_KEY_set_private_key(k, bn) == 1);
+	assert(EC_KEY_set_public_key(k, pt) == 1);
+
+	EC_POINT_free(pt);
+	BN_free(bn);
+	return k;
+}
+
+static size_t ossl_pubkey(unsigned char *out, EC_KEY *k, bool compressed)
+{
+	return EC_POINT_point2oct(EC_KEY_get0_group(k),
+				  EC_KEY_get0_public_key(k),
+				  compressed ? POINT_CONVERSION_COMPRESSED :
+					       POINT_CONVERSION_UNCOMPRESSED,
+				  out, ECC_PUBKEY_UNCOMPRESSED, NULL);
+}
+
+static bool ossl_parse(const unsigned char *data, size_t len)
+{
+	EC_KEY *k = EC_KEY_new_by_curve_name(NID_secp256k1);
+	const unsigned char *p = data;
+	bool rc = (o2i_ECPublicKey(&k, &p, len) != NULL);
+
+	EC_KEY_free(k);
+	return rc;
+}
+
+static void check_key(const unsigned char *seckey)
+{
+	struct ecc_pubkey pub, pub2;
+	unsigned char ser[ECC_PUBKEY_UNCOMPRESSED], oser[ECC_PUBKEY_UNCOMPRESSED];
+	unsigned char msg[64], sig[ECC_SIG_MAX], nonce[32];
+	size_t sig_len;
+
+	EC_KEY *k = ossl_key(seckey);
+
+	/* public key derivation and encodings */
+	assert(ecc_pubkey_create(&pub, seckey) == true);
+
+	assert(ecc_pubkey_serialize(ser, &pub, true) == ECC_PUBKEY_COMPRESSED);
+	assert(ossl_pubkey(oser, k, true) == ECC_PUBKEY_COMPRESSED);
+	assert(memcmp(ser, oser, ECC_PUBKEY_COMPRESSED) == 0);
+	assert(ecc_pubkey_parse(&pub2, ser, ECC_PUBKEY_COMPRESSED) == true);
+	assert(memcmp(&pub, &pub2, sizeof(pub)) == 0);
+
+	assert(ecc_pubkey_serialize(ser, &pub, false) == ECC_PUBKEY_UNCOMPRESSED);
+	assert(ossl_pubkey(oser, k, false) == ECC_PUBKEY_UNCOMPRESSED);
+	assert(memcmp(ser, oser, ECC_PUBKEY_UNCOMPRESSED) == 0);
+	assert(ecc_pubkey_parse(&pub2, ser, ECC_PUBKEY_UNCOMPRESSED) == true);
+	assert(memcmp(&pub, &pub2, sizeof(pub)) == 0);
+
+	/* hybrid encoding: parity in the prefix must match */
+	ser[0] = 0x06 | (ser[64] & 1);
+	assert(ecc_pubkey_parse(&pub2, ser, ECC_PUBKEY_UNCOMPRESSED) == true);
+	assert(ossl_parse(ser, ECC_PUBKEY_UNCOMPRESSED) == true);
+	ser[0] ^= 1;
+	assert(ecc_pubkey_parse(&pub2, ser, ECC_PUBKEY_UNCOMPRESSED) == false);
+	assert(ossl_parse(ser, ECC_PUBKEY_UNCOMPRESSED) == false);
+
+	/* not on the curve */
+	ser[0] = 0x04;
+	ser[64] ^= 1;
+	assert(ecc_pubkey_parse(&pub2, ser, ECC_PUBKEY_UNCOMPRESSED) == false);
+
+	RAND_bytes(msg, sizeof(msg));
+
+	/* OpenSSL signs, we verify */
+	unsigned int osig_len = ECDSA_size(k);
+	unsigned char *osig = malloc(osig_len);
+	assert(ECDSA_sign(0, msg, 32, osig, &osig_len, k) == 1);
+	assert(ecc_verify(&pub, msg, 32, osig, osig_len) == true);
+
+	msg[0] ^= 1;
+	assert(ecc_verify(&pub, msg, 32, osig, osig_len) == false);
+	msg[0] ^= 1;
+
+	osig[osig_len - 1] ^= 1;
+	assert(ecc_verify(&pub, msg, 32, osig, osig_len) == false);
+	assert(ECDSA_verify(0, msg, 32, osig, osig_len, k) != 1);
+	free(osig);
+
+	/* we sign, OpenSSL verifies */
+	RAND_bytes(nonce, sizeof(nonce));
+	assert(ecc_sign(sig, &sig_len, seckey, msg, 32, nonce));
+	assert(sig_len <= ECC_SIG_MAX);
+	assert(ECDSA_verify(0, msg, 32, sig, sig_len, k) == 1);
+	assert(ecc_verify(&pub, msg, 32, sig, sig_len) == true);
+
+	/* digests of other lengths are truncated, or padded, alike */
+	assert(ecc_sign(sig, &sig_len, seckey, msg, 20, nonce));
+	assert(ECDSA_verify(0, msg, 20, sig, sig_len, k) == 1);
+	assert(ecc_sign(sig, &sig_len, seckey, msg, 48, nonce) == true);
+	assert(ECDSA_verify(0, msg, 48, sig, sig_len, k) == 1);
+	assert(ecc_verify(&pub, msg, 32, sig, sig_len) == true);
+
+	EC_KEY_free(k);
+}
+
+static void test_keys(void)
+{
+	unsigned char seckey[32];
+	struct ecc_pubkey pub;
+	unsigned int i;
+
+	for (i = 0; i < N_KEYS; i++) {
+		RAND_bytes(seckey, sizeof(seckey));
+		check_key(seckey);
+	}
+
+	/* edges of the scalar range */
+	memset(seckey, 0, sizeof(seckey));
+	assert(ecc_pubkey_create(&pub, seckey) == false);
+	seckey[31] = 1;
+	check_key(seckey);
+	seckey[31] = 2;
+	check_key(seckey);
+
+	memcpy(seckey, order, sizeof(seckey));
+	assert(ecc_pubkey_create(&pub, seckey) == false);
+	seckey[31]--;
+	check_key(seckey);
+	seckey[31]--;
+	check_key(seckey);
+
+	memset(seckey, 0xff, sizeof(seckey));
+	assert(ecc_pubkey_create(&pub, seckey) == false);
+}
+
+/* random encodings: valid exactly when OpenSSL says so */
+static void test_parse(void)
+{
+	unsigned char buf[ECC_PUBKEY_UNCOMPRESSED];
+	struct ecc_pubkey pub;
+	unsigned int i, valid = 0;
+
+	for (i = 0; i < N_PARSE; i++) {
+		RAND_bytes(buf, sizeof(buf));
+		buf[0] = 0x02 | (buf[0] & 1);
+		if (i & 1)
+			memset(buf + 1, 0xff, 4);	/* near or above p */
+
+		bool rc = ecc_pubkey_parse(&pub, buf, ECC_PUBKEY_COMPRESSED);
+		assert(rc == ossl_parse(buf, ECC_PUBKEY_COMPRESSED));
+		valid += rc;
+
+		buf[0] = 0x04;
+		assert(ecc_pubkey_parse(&pub, buf, ECC_PUBKEY_UNCOMPRESSED) ==
+		       false);
+	}
+
+	/* about half of all x are on the curve */
+	assert(valid > N_PARSE / 4);
+	assert(valid < (N_PARSE * 3) / 4);
+
+	memset(buf, 0, sizeof(buf));
+	assert(ecc_pubkey_parse(&pub, buf, 1) == false);
+	buf[0] = 0x02;
+	assert(ecc_pubkey_parse(&pub, buf, ECC_PUBKEY_UNCOMPRESSED) == false);
+	buf[0] = 0x05;
+	assert(ecc_pubkey_parse(&pub, buf, ECC_PUBKEY_COMPRESSED) == false);
+}
+
+/* encodings strict DER would refuse, but the chain holds */
+static void test_lax_der(void)
+{
+	unsigned char seckey[32], nonce[32], msg[32];
+	unsigned char sig[ECC_SIG_MAX], lax[ECC_SIG_MAX + 16];
+	struct ecc_pubkey pub;
+	size_t sig_len;
+
+	RAND_bytes(seckey, sizeof(seckey));
+	RAND_bytes(nonce, sizeof(nonce));
+	RAND_bytes(msg, sizeof(msg));
+	assert(ecc_pubkey_create(&pub, seckey) == true);
+	assert(ecc_sign(sig, &sig_len, seckey, msg, sizeof(msg), nonce));
+
+	const unsigned char *r = sig + 2, *s = r + 2 + r[1];
+	size_t n = 0;
+
+	/* long-form lengths, zero-padded integers, trailing garbage */
+	lax[n++] = 0x30;
+	lax[n++] = 0x81;
+	lax[n++] = sig[1] + 2;
+	lax[n++] = 0x02;
+	lax[n++] = 0x82;
+	lax[n++] = 0x00;
+	lax[n++] = r[1] + 1;
+	lax[n++] = 0x00;
+	memcpy(lax + n, r + 2, r[1]);
+	n += r[1];
+	lax[n++] = 0x02;
+	lax[n++] = s[1];
+	memcpy(lax + n, s + 2, s[1]);
+	n += s[1];
+	lax[n++] = 0x01;
+
+	assert(ecc_verify(&pub, msg, sizeof(msg), lax, n) == true);
+
+	/* truncated */
+	assert(ecc_verify(&pub, msg, sizeof(msg), lax, n - 2) == false);
+	assert(ecc_verify(&pub, msg, sizeof(msg), sig, 6) == false);
+	assert(ecc_verify(&pub, msg, sizeof(msg), sig, 0) == false);
+
+	/* zero r */
+	unsigned char zero[] = { 0x30, 0x06, 0x02, 0x01, 0x00,
+				 0x02, 0x01, 0x01 };
+	assert(ecc_verify(&pub, msg, sizeof(msg), zero, sizeof(zero)) ==
+	       false);
+}
+
+/* batches agree with one-at-a-time verification, item by item */
+static void test_batch(void)
+{
+	struct ecc_pubkey pubs[N_BATCH_KEYS];
+	unsigned char seckeys[N_BATCH_KEYS][32];
+	unsigned char msgs[N_BATCH][32], sigs[N_BATCH][ECC_SIG_MAX];
+	struct ecc_verify_item items[N_BATCH];
+	bool results[N_BATCH];
+	unsigned int i;
+
+	for (i = 0; i < N_BATCH_KEYS; i++) {
+		RAND_bytes(seckeys[i], 32);
+		assert(ecc_pubkey_create(&pubs[i], seckeys[i]) == true);
+	}
+
+	for (i = 0; i < N_BATCH; i++) {
+		unsigned int k = (i * 7) % N_BATCH_KEYS;
+		unsigned char nonce[32];
+
+		RAND_bytes(msgs[i], 32);
+		RAND_bytes(nonce, sizeof(nonce));
+
+		items[i].pub = &pubs[k];
+		items[i].data = msgs[i];
+		items[i].data_len = 32;
+		items[i].sig = sigs[i];
+		assert(ecc_sign(sigs[i], &items[i].sig_len, seckeys[k],
+				msgs[i], 32, nonce) == true);
+	}
+
+	assert(ecc_verify_batch(items, N_BATCH, results) == true);
+	for (i = 0; i < N_BATCH; i++)
+		assert(results[i] == true);
+	assert(ecc_verify_batch(items, N_BATCH, NULL) == true);
+	assert(ecc_verify_batch(items, 0, NULL) == true);
+
+	/* wrong key, wrong message, bad signature, bad encoding */
+	items[3].pub = &pubs[(3 * 7 + 1) % N_BATCH_KEYS];
+	msgs[10][5] ^= 0x10;
+	sigs[21][10] ^= 0x01;
+	sigs[38][0] = 0x31;
+
+	assert(ecc_verify_batch(items, N_BATCH, results) == false);
+	for (i = 0; i < N_BATCH; i++) {
+		bool ok = ecc_verify(items[i].pub, items[i].data,
+				     items[i].data_len, items[i].sig,
+				     items[i].sig_len);
+		assert(results[i] == ok);
+		assert(ok == (i != 3 && i != 10 && i != 21 && i != 38));
+	}
+}
+
+/* batch key creation, across several shared inversions */
+static void test_create_batch(void)
+{
+	unsigned char seckeys[N_CREATE][32];
+	struct ecc_pubkey pubs[N_CREATE], pub;
+	bool results[N_CREATE];
+	unsigned int i;
+
+	RAND_bytes(&seckeys[0][0], sizeof(seckeys));
+	assert(ecc_pubkey_create_batch(pubs, &seckeys[0][0], N_CREATE,
+				       results) == true);
+	for (i = 0; i < N_CREATE; i++) {
+		assert(results[i] == true);
+		assert(ecc_pubkey_create(&pub, seckeys[i]) == true);
+		assert(memcmp(&pub, &pubs[i], sizeof(pub)) == 0);
+	}
+
+	/* out-of-range secrets fail alone */
+	memset(seckeys[5], 0, 32);
+	memcpy(seckeys[200], order, 32);
+	memset(&pubs[0], 0, sizeof(pubs));
+	assert(ecc_pubkey_create_batch(pubs, &seckeys[0][0], N_CREATE,
+				       results) == false);
+	for (i = 0; i < N_CREATE; i++) {
+		assert(results[i] == (i != 5 && i != 200));
+		if (!results[i])
+			continue;
+		assert(ecc_pubkey_create(&pub, seckeys[i]) == true);
+		assert(memcmp(&pub, &pubs[i], sizeof(pub)) == 0);
+	}
+
+	assert(ecc_pubkey_create_batch(pubs, NULL, 0, NULL) == true);
+}
+
+#endif /* __SIZEOF_INT128__ */
+
+int main (int argc, char *argv[])
+{
+#ifdef __SIZEOF_INT128__
+	test_keys();
+	test_parse();
+	test_lax_der();
+	test_batch();
+	test_create_batch();
+
+	return 0;
+#else
+	return 77;		/* skipped */
+#endif
+}
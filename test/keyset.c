@@ -7,8 +7,10 @@
 #include <string.h>
 #include <assert.h>
 #include <openssl/ripemd.h>
+#include <openssl/sha.h>
 #include <ccoin/key.h>
 #include <ccoin/util.h>
+#include <ccoin/hexcode.h>
 #include "libtest.h"
 
 static void runtest(void)
@@ -78,9 +80,285 @@ static void runtest(void)
 	}
 }
 
+static void sign_one(struct bp_key *key, const bu256_t *hash,
+		     void **sig, size_t *sig_len, void **pub, size_t *pub_len)
+{
+	assert(bp_sign(key, hash, sizeof(*hash), sig, sig_len) == true);
+	assert(bp_pubkey_get(key, pub, pub_len) == true);
+}
+
+static void test_pubkey_cache(void)
+{
+	struct bp_key key;
+	bu256_t hash, other;
+	void *sig, *pub;
+	size_t sig_len, pub_len;
+
+	memset(&hash, 0x42, sizeof(hash));
+	memset(&other, 0x43, sizeof(other));
+
+	assert(bp_key_init(&key) == true);
+	assert(bp_key_generate(&key) == true);
+	sign_one(&key, &hash, &sig, &sig_len, &pub, &pub_len);
+
+	/* miss, then hit */
+	unsigned int i;
+	for (i = 0; i < 2; i++) {
+		assert(bp_pubkey_verify(pub, pub_len, &hash, sizeof(hash),
+					sig, sig_len) == true);
+		assert(bp_pubkey_verify(pub, pub_len, &other, sizeof(other),
+					sig, sig_len) == false);
+	}
+
+	/* undecodable keys fail, and are not cached */
+	unsigned char bad_pub[33];
+	memset(bad_pub, 0xff, sizeof(bad_pub));
+	for (i = 0; i < 2; i++)
+		assert(bp_pubkey_verify(bad_pub, sizeof(bad_pub),
+					&hash, sizeof(hash),
+					sig, sig_len) == false);
+
+	/* push the first key out of the cache, then back in */
+	for (i = 0; i < BP_PUBKEY_CACHE_MAX + 1; i++) {
+		struct bp_key tmp;
+		void *tsig, *tpub;
+		size_t tsig_len, tpub_len;
+
+		assert(bp_key_init(&tmp) == true);
+		assert(bp_key_generate(&tmp) == true);
+		assert(bp_pubkey_get(&tmp, &tpub, &tpub_len) == true);
+
+		/* a signature by another key */
+		assert(bp_pubkey_verify(tpub, tpub_len, &hash, sizeof(hash),
+					sig, sig_len) == false);
+
+		if (i == 0) {
+			assert(bp_sign(&tmp, &hash, sizeof(hash),
+				       &tsig, &tsig_len) == true);
+			assert(bp_pubkey_verify(tpub, tpub_len,
+						&hash, sizeof(hash),
+						tsig, tsig_len) == true);
+			free(tsig);
+		}
+
+		free(tpub);
+		bp_key_free(&tmp);
+	}
+
+	assert(bp_pubkey_verify(pub, pub_len, &hash, sizeof(hash),
+				sig, sig_len) == true);
+
+	bp_pubkey_cache_clear();
+	assert(bp_pubkey_verify(pub, pub_len, &hash, sizeof(hash),
+				sig, sig_len) == true);
+	bp_pubkey_cache_clear();
+
+	/* batches: one bad key, one bad signature */
+	struct bp_verify_item items[4];
+	bool results[ARRAY_SIZE(items)];
+	for (i = 0; i < ARRAY_SIZE(items); i++) {
+		items[i].pubkey = pub;
+		items[i].pk_len = pub_len;
+		items[i].data = &hash;
+		items[i].data_len = sizeof(hash);
+		items[i].sig = sig;
+		items[i].sig_len = sig_len;
+	}
+	assert(bp_pubkey_verify_batch(items, ARRAY_SIZE(items),
+				      results) == true);
+
+	items[1].pubkey = bad_pub;
+	items[1].pk_len = sizeof(bad_pub);
+	items[2].data = &other;
+	assert(bp_pubkey_verify_batch(items, ARRAY_SIZE(items),
+				      results) == false);
+	assert(results[0] == true && results[1] == false &&
+	       results[2] == false && results[3] == true);
+	bp_pubkey_cache_clear();
+
+	free(sig);
+	free(pub);
+	bp_key_free(&key);
+}
+
+/* batch generation: keys agree with OpenSSL, and sign */
+static void test_generate_batch(void)
+{
+	struct bp_key keys[10], key2;
+	unsigned char secret[32];
+	bu256_t hash;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++)
+		assert(bp_key_init(&keys[i]) == true);
+	assert(bp_key_generate_batch(keys, ARRAY_SIZE(keys)) == true);
+	assert(bp_key_generate_batch(keys, 0) == true);
+
+	memset(&hash, 0x5a, sizeof(hash));
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		void *sig, *pub, *pub2;
+		size_t sig_len, pub_len, pub2_len;
+
+		/* bp_pubkey_get checks the pair, by in-tree derivation */
+		sign_one(&keys[i], &hash, &sig, &sig_len, &pub, &pub_len);
+		assert(pub_len == 33);
+		assert(bp_pubkey_verify(pub, pub_len, &hash, sizeof(hash),
+					sig, sig_len) == true);
+
+		/* and the same pair, from the secret alone */
+		assert(bp_key_secret_get(secret, sizeof(secret),
+					 &keys[i]) == true);
+		assert(bp_key_init(&key2) == true);
+		assert(bp_key_secret_set(&key2, secret, sizeof(secret)) == true);
+		assert(bp_pubkey_get(&key2, &pub2, &pub2_len) == true);
+		assert(pub2_len == pub_len && !memcmp(pub, pub2, pub_len));
+
+		/* stored pairs are checked on load */
+		void *priv;
+		size_t priv_len;
+		assert(bp_privkey_get(&keys[i], &priv, &priv_len) == true);
+		assert(bp_privkey_set(&key2, priv, priv_len) == true);
+		((unsigned char *) priv)[priv_len - 1] ^= 0x01;
+		assert(bp_privkey_set(&key2, priv, priv_len) == false);
+		free(priv);
+
+		free(sig);
+		free(pub);
+		free(pub2);
+		bp_key_free(&key2);
+		bp_key_free(&keys[i]);
+	}
+	bp_pubkey_cache_clear();
+}
+
+/* the prefilter, across rebuilds: no false negatives */
+static void test_keyset_filter(void)
+{
+	struct bp_key keys[2000];
+	struct bp_keyset ks;
+	unsigned int i;
+
+	bpks_init(&ks);
+	for (i = 0; i < ARRAY_SIZE(keys); i++)
+		assert(bp_key_init(&keys[i]) == true);
+	assert(bp_key_generate_batch(keys, ARRAY_SIZE(keys)) == true);
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++)
+		assert(bpks_add(&ks, &keys[i]) == true);
+	assert(ks.filter_n <= ks.filter_blocks * 4);
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		unsigned char md160[RIPEMD160_DIGEST_LENGTH];
+		void *pubkey;
+		size_t pklen;
+
+		assert(bp_pubkey_get(&keys[i], &pubkey, &pklen) == true);
+		bu_Hash160(md160, pubkey, pklen);
+
+		assert(bpks_lookup(&ks, pubkey, pklen, false) == true);
+		assert(bpks_lookup(&ks, md160, sizeof(md160), true) == true);
+
+		/* near misses, through the filter and beyond */
+		md160[0] ^= 0x01;
+		assert(bpks_lookup(&ks, md160, sizeof(md160), true) == false);
+		md160[19] ^= 0x01;
+		assert(bpks_lookup(&ks, md160, sizeof(md160), true) == false);
+
+		free(pubkey);
+	}
+
+	/* unrelated hashes */
+	for (i = 0; i < 10000; i++) {
+		unsigned char md160[RIPEMD160_DIGEST_LENGTH];
+
+		bu_Hash160(md160, &i, sizeof(i));
+		assert(bpks_lookup(&ks, md160, sizeof(md160), true) == false);
+	}
+
+	bpks_free(&ks);
+	for (i = 0; i < ARRAY_SIZE(keys); i++)
+		bp_key_free(&keys[i]);
+}
+
+#ifdef __SIZEOF_INT128__
+
+/* RFC 6979 nonces; signatures of SHA256(msg) */
+static const struct {
+	const char	*secret;
+	const char	*msg;
+	const char	*sig;
+} rfc6979_vectors[] = {
+	{ "0000000000000000000000000000000000000000000000000000000000000001",
+	  "Satoshi Nakamoto",
+	  "3046022100934b1ea10a4b3c1757e2b0c017d0b6143ce3c9a7e6a4a49860d7a6ab"
+	  "210ee3d8022100dbbd3162d46e9f9bef7feb87c16dc13b4f6568a87f4e83f728e2"
+	  "443ba586675c" },
+	{ "fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364140",
+	  "Satoshi Nakamoto",
+	  "3046022100fd567d121db66e382991534ada77a6bd3106f0a1098c231e47993447"
+	  "cd6af2d002210094c632f14e4379fc1ea610a3df5a375152549736425ee17cebe1"
+	  "0abbc2a2826c" },
+	{ "f8b8af8ce3c7cca5e300d33939540c10d45ce001b8f252bfbc57ba0342904181",
+	  "Alan Turing",
+	  "304502207063ae83e7f62bbb171798131b4a0564b956930092b33b07b395615d9e"
+	  "c7e15c022100a72033e1ff5ca1ea8d0c99001cb45f0272d3be7525d3049c0d9e98"
+	  "dc7582b857" },
+};
+
+static void test_rfc6979(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(rfc6979_vectors); i++) {
+		unsigned char secret[32], md[SHA256_DIGEST_LENGTH];
+		unsigned char sig2[BP_SIG_MAX];
+		size_t len, sig_len, sig2_len;
+		struct bp_key key;
+		struct bp_signer signer;
+		void *sig;
+
+		assert(decode_hex(secret, sizeof(secret),
+				  rfc6979_vectors[i].secret, &len) == true);
+		assert(len == sizeof(secret));
+		GString *expect = hex2str(rfc6979_vectors[i].sig);
+		SHA256((const unsigned char *) rfc6979_vectors[i].msg,
+		       strlen(rfc6979_vectors[i].msg), md);
+
+		assert(bp_key_init(&key) == true);
+		assert(bp_key_secret_set(&key, secret, sizeof(secret)) == true);
+
+		assert(bp_sign(&key, md, sizeof(md), &sig, &sig_len) == true);
+		assert(sig_len == expect->len);
+		assert(memcmp(sig, expect->str, sig_len) == 0);
+
+		/* and again, through a reusable signer */
+		assert(bp_signer_init(&signer, &key) == true);
+		assert(bp_signer_sign(&signer, md, sizeof(md),
+				      sig2, &sig2_len) == true);
+		assert(sig2_len == sig_len && !memcmp(sig2, sig, sig_len));
+		assert(bp_signer_sign(&signer, md, sizeof(md),
+				      sig2, &sig2_len) == true);
+		assert(sig2_len == sig_len && !memcmp(sig2, sig, sig_len));
+		bp_signer_free(&signer);
+
+		free(sig);
+		g_string_free(expect, TRUE);
+		bp_key_free(&key);
+	}
+}
+
+#endif /* __SIZEOF_INT128__ */
+
 int main (int argc, char *argv[])
 {
 	runtest();
+	test_pubkey_cache();
+	test_generate_batch();
+	test_keyset_filter();
+#ifdef __SIZEOF_INT128__
+	test_rfc6979();
+#endif
 
 	return 0;
 }
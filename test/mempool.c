@@ -0,0 +1,430 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <ccoin/core.h>
+#include <ccoin/key.h>
+#include <ccoin/script.h>
+#include <ccoin/util.h>
+#include <ccoin/mempool.h>
+#include <ccoin/blktmpl.h>
+#include <ccoin/compat.h>		/* for g_ptr_array_new_full */
+#include "libtest.h"
+
+static struct bp_key key;
+static GString *script_pub;		/* P2PKH, paying to key */
+
+static void init_key(void)
+{
+	assert(bp_key_init(&key) == true);
+	assert(bp_key_generate(&key) == true);
+
+	void *pub;
+	size_t pub_len;
+	assert(bp_pubkey_get(&key, &pub, &pub_len) == true);
+
+	unsigned char md160[20];
+	bu_Hash160(md160, pub, pub_len);
+	free(pub);
+
+	script_pub = g_string_new(NULL);
+	bsp_push_op(script_pub, OP_DUP);
+	bsp_push_op(script_pub, OP_HASH160);
+	bsp_push_data(script_pub, md160, sizeof(md160));
+	bsp_push_op(script_pub, OP_EQUALVERIFY);
+	bsp_push_op(script_pub, OP_CHECKSIG);
+}
+
+static void tx_add_input(struct bp_tx *tx, const bu256_t *hash, uint32_t n)
+{
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	bu256_copy(&txin->prevout.hash, hash);
+	txin->prevout.n = n;
+	txin->scriptSig = g_string_new(NULL);
+	txin->nSequence = 0xffffffffU;
+
+	g_ptr_array_add(tx->vin, txin);
+}
+
+static void tx_add_output(struct bp_tx *tx, int64_t value)
+{
+	struct bp_txout *txout = calloc(1, sizeof(*txout));
+	bp_txout_init(txout);
+	txout->nValue = value;
+	txout->scriptPubKey = g_string_new_len(script_pub->str,
+					       script_pub->len);
+
+	g_ptr_array_add(tx->vout, txout);
+}
+
+static void tx_new(struct bp_tx *tx)
+{
+	bp_tx_init(tx);
+	tx->nVersion = 1;
+	tx->vin = g_ptr_array_new_full(1, g_free);
+	tx->vout = g_ptr_array_new_full(1, g_free);
+}
+
+static void tx_sign(struct bp_tx *tx)
+{
+	unsigned int i;
+	for (i = 0; i < tx->vin->len; i++) {
+		struct bp_txin *txin = g_ptr_array_index(tx->vin, i);
+
+		bu256_t hash;
+		bp_tx_sighash(&hash, script_pub, tx, i, SIGHASH_ALL);
+
+		void *sig, *pub;
+		size_t sig_len, pub_len;
+		assert(bp_sign(&key, &hash, sizeof(hash), &sig, &sig_len));
+		assert(bp_pubkey_get(&key, &pub, &pub_len));
+
+		GString *sigbuf = g_string_new_len(sig, sig_len);
+		g_string_append_c(sigbuf, SIGHASH_ALL);
+
+		g_string_set_size(txin->scriptSig, 0);
+		bsp_push_data(txin->scriptSig, sigbuf->str, sigbuf->len);
+		bsp_push_data(txin->scriptSig, pub, pub_len);
+
+		g_string_free(sigbuf, TRUE);
+		free(sig);
+		free(pub);
+	}
+
+	tx->sha256_valid = false;
+	bp_tx_calc_sha256(tx);
+}
+
+/* one-input, one-output spend of the given outpoint */
+static void tx_spend(struct bp_tx *tx, const bu256_t *hash, uint32_t n,
+		     int64_t value)
+{
+	tx_new(tx);
+	tx_add_input(tx, hash, n);
+	tx_add_output(tx, value);
+	tx_sign(tx);
+}
+
+/* spend of a confirmed coin, by a tx with the given lock */
+static void tx_spend_locked(struct bp_tx *tx, const bu256_t *hash,
+			    uint32_t n, int64_t value, uint32_t nLockTime,
+			    uint32_t nSequence)
+{
+	tx_new(tx);
+	tx_add_input(tx, hash, n);
+	tx_add_output(tx, value);
+	tx->nLockTime = nLockTime;
+
+	struct bp_txin *txin = g_ptr_array_index(tx->vin, 0);
+	txin->nSequence = nSequence;
+
+	tx_sign(tx);
+}
+
+/* coinbase maturity, and nLockTime finality, at the pool's tip */
+static void test_final_mature(void)
+{
+	const unsigned int tip = 200;
+
+	/* a coinbase confirmed at the tip, and an ordinary coin */
+	struct bp_tx cb, fund;
+	bu256_t prev;
+
+	tx_new(&cb);
+	memset(&prev, 0, sizeof(prev));
+	tx_add_input(&cb, &prev, 0xffffffffU);
+	struct bp_txin *txin = g_ptr_array_index(cb.vin, 0);
+	bsp_push_int64(txin->scriptSig, tip);
+	tx_add_output(&cb, 25LL * COIN);
+	bp_tx_calc_sha256(&cb);
+	assert(bp_tx_coinbase(&cb));
+
+	memset(&prev, 0x43, sizeof(prev));
+	tx_new(&fund);
+	tx_add_input(&fund, &prev, 0);
+	tx_add_output(&fund, COIN);
+	tx_add_output(&fund, COIN);
+	tx_add_output(&fund, COIN);
+	bp_tx_calc_sha256(&fund);
+
+	struct bp_utxo_set uset;
+	bp_utxo_set_init(&uset);
+
+	struct bp_utxo *coin = calloc(1, sizeof(*coin));
+	bp_utxo_init(coin);
+	assert(bp_utxo_from_tx(coin, &cb, true, tip) == true);
+	bp_utxo_set_add(&uset, coin);
+
+	coin = calloc(1, sizeof(*coin));
+	bp_utxo_init(coin);
+	assert(bp_utxo_from_tx(coin, &fund, false, tip) == true);
+	bp_utxo_set_add(&uset, coin);
+
+	struct mempool mp;
+	mempool_init(&mp, &uset, tip, 1024 * 1024);
+
+	/* immature coinbase spend: refused until the block at
+	 * tip + COINBASE_MATURITY may include it
+	 */
+	struct bp_tx tx_cb;
+	tx_spend(&tx_cb, &cb.sha256, 0, 25LL * COIN - 10000);
+	assert(mempool_add(&mp, &tx_cb) == false);
+
+	struct bp_block empty;
+	bp_block_init(&empty);
+	mempool_block_connected(&mp, &empty,
+				tip + COINBASE_MATURITY - 2);
+	assert(mempool_add(&mp, &tx_cb) == false);
+	mempool_block_connected(&mp, &empty,
+				tip + COINBASE_MATURITY - 1);
+	assert(mp.height == tip + COINBASE_MATURITY - 1);
+	assert(mempool_add(&mp, &tx_cb) == true);
+
+	unsigned int next = mp.height + 1;
+
+	/* height lock: final only below the next block's height */
+	struct bp_tx tx_lock;
+	tx_spend_locked(&tx_lock, &fund.sha256, 0, COIN - 10000, next, 0);
+	assert(bp_tx_final(&tx_lock, next, time(NULL)) == false);
+	assert(mempool_add(&mp, &tx_lock) == false);
+	bp_tx_free(&tx_lock);
+
+	tx_spend_locked(&tx_lock, &fund.sha256, 0, COIN - 10000, next - 1, 0);
+	assert(mempool_add(&mp, &tx_lock) == true);
+
+	/* time lock, in the future */
+	struct bp_tx tx_time;
+	uint32_t later = (uint32_t) time(NULL) + 3600;
+	tx_spend_locked(&tx_time, &fund.sha256, 1, COIN - 10000, later, 0);
+	assert(later >= LOCKTIME_THRESHOLD);
+	assert(mempool_add(&mp, &tx_time) == false);
+	bp_tx_free(&tx_time);
+
+	/* a final nSequence on every input overrides the lock */
+	tx_spend_locked(&tx_time, &fund.sha256, 1, COIN - 10000, later,
+			0xffffffffU);
+	assert(mempool_add(&mp, &tx_time) == true);
+
+	assert(mempool_count(&mp) == 3);
+	mempool_free(&mp);
+
+	bp_tx_free(&tx_time);
+	bp_tx_free(&tx_lock);
+	bp_tx_free(&tx_cb);
+	bp_tx_free(&fund);
+	bp_tx_free(&cb);
+	bp_utxo_set_free(&uset);
+}
+
+static unsigned int tx_index(const struct blktmpl *t, const struct bp_tx *tx)
+{
+	unsigned int i;
+	for (i = 0; i < t->block.vtx->len; i++) {
+		struct bp_tx *tmp = g_ptr_array_index(t->block.vtx, i);
+		if (bu256_equal(&tmp->sha256, &tx->sha256))
+			return i;
+	}
+
+	assert(!"tx not in template");
+	return 0;
+}
+
+static void check_template(struct blktmpl *t, int64_t fees)
+{
+	assert(t->fees == fees);
+
+	struct bp_tx *cb = g_ptr_array_index(t->block.vtx, 0);
+	assert(bp_tx_coinbase(cb));
+	struct bp_txout *txout = g_ptr_array_index(cb->vout, 0);
+	assert(txout->nValue == (25LL * COIN) + fees);
+
+	bu256_t root;
+	bp_block_merkle(&root, &t->block);
+	assert(bu256_equal(&root, &t->block.hashMerkleRoot));
+
+	assert(t->size >= bp_block_ser_size(&t->block));
+}
+
+static void runtest(void)
+{
+	init_key();
+
+	/* confirmed coin, with two 1-BTC outputs, to be spent */
+	struct bp_tx fund;
+	bu256_t fund_prev;
+	memset(&fund_prev, 0x42, sizeof(fund_prev));
+	tx_new(&fund);
+	tx_add_input(&fund, &fund_prev, 0);
+	tx_add_output(&fund, COIN);
+	tx_add_output(&fund, COIN);
+	bp_tx_calc_sha256(&fund);
+
+	struct bp_utxo_set uset;
+	bp_utxo_set_init(&uset);
+
+	struct bp_utxo *coin = calloc(1, sizeof(*coin));
+	bp_utxo_init(coin);
+	assert(bp_utxo_from_tx(coin, &fund, false, 1) == true);
+	bp_utxo_set_add(&uset, coin);
+
+	struct mempool mp;
+	mempool_init(&mp, &uset, 200, 1024 * 1024);
+
+	/* valid spend of a confirmed coin */
+	struct bp_tx tx1;
+	tx_spend(&tx1, &fund.sha256, 0, COIN - 10000);
+	assert(mempool_add(&mp, &tx1) == true);
+	assert(mempool_count(&mp) == 1);
+
+	struct mempool_ent *ent = mempool_lookup(&mp, &tx1.sha256);
+	assert(ent != NULL);
+	assert(ent->fee == 10000);
+	assert(ent->fee_rate == (10000ULL * 1000) / ent->size);
+
+	/* duplicate */
+	assert(mempool_add(&mp, &tx1) == false);
+
+	/* double spend of the same outpoint */
+	struct bp_tx tx1b;
+	tx_spend(&tx1b, &fund.sha256, 0, COIN - 20000);
+	assert(mempool_add(&mp, &tx1b) == false);
+
+	/* outputs exceed inputs */
+	struct bp_tx tx_over;
+	tx_spend(&tx_over, &fund.sha256, 1, COIN + 1);
+	assert(mempool_add(&mp, &tx_over) == false);
+
+	/* nonexistent, and bad signature */
+	struct bp_tx tx_bad;
+	tx_spend(&tx_bad, &fund.sha256, 1, COIN - 10000);
+	struct bp_txout *txout = g_ptr_array_index(tx_bad.vout, 0);
+	txout->nValue--;		/* invalidates signature */
+	assert(mempool_add(&mp, &tx_bad) == false);
+
+	struct bp_tx tx_missing;
+	tx_spend(&tx_missing, &fund.sha256, 2, 1000);
+	assert(mempool_add(&mp, &tx_missing) == false);
+	assert(mempool_count(&mp) == 1);
+
+	/* spend of an unconfirmed parent */
+	struct bp_tx tx2;
+	tx_spend(&tx2, &tx1.sha256, 0, COIN - 30000);
+	assert(mempool_add(&mp, &tx2) == true);
+	assert(mempool_count(&mp) == 2);
+
+	struct bp_outpt outpt = { .n = 0 };
+	bu256_copy(&outpt.hash, &tx1.sha256);
+	assert(mempool_spender(&mp, &outpt) == mempool_lookup(&mp, &tx2.sha256));
+
+	/* removing the parent takes its descendants along */
+	size_t mem_one = mempool_lookup(&mp, &tx1.sha256)->mem;
+	mempool_remove(&mp, &tx1.sha256, true);
+	assert(mempool_count(&mp) == 0);
+	assert(g_hash_table_size(mp.map_spent) == 0);
+	assert(mp.by_fee->len == 0);
+	assert(mp.mem_bytes == 0);
+
+	/* a confirmed parent leaves its children in the pool */
+	assert(mempool_add(&mp, &tx1) == true);
+	assert(mempool_add(&mp, &tx2) == true);
+
+	struct bp_block block;
+	bp_block_init(&block);
+	block.vtx = g_ptr_array_new();
+	g_ptr_array_add(block.vtx, &tx1);
+	mempool_block_connected(&mp, &block, 201);
+	g_ptr_array_free(block.vtx, TRUE);
+
+	assert(mempool_lookup(&mp, &tx1.sha256) == NULL);
+	assert(mempool_lookup(&mp, &tx2.sha256) != NULL);
+	mempool_free(&mp);
+
+	/* memory cap: room for two transactions; the cheapest goes */
+	mempool_init(&mp, &uset, 200, (mem_one * 2) + (mem_one / 2));
+
+	struct bp_tx tx_hi;
+	tx_spend(&tx_hi, &fund.sha256, 1, COIN - 50000);
+	assert(mempool_add(&mp, &tx1) == true);		/* fee 10000 */
+	assert(mempool_add(&mp, &tx_hi) == true);	/* fee 50000 */
+
+	struct bp_tx tx2_lo;
+	tx_spend(&tx2_lo, &tx1.sha256, 0, COIN - 10000 - 100);
+	assert(mempool_add(&mp, &tx2_lo) == false);	/* evicts itself */
+	assert(mempool_count(&mp) == 2);
+
+	struct bp_tx tx2_hi;
+	tx_spend(&tx2_hi, &tx1.sha256, 0, COIN - 10000 - 90000);
+	assert(mempool_add(&mp, &tx2_hi) == false);	/* parent evicted */
+	assert(mempool_lookup(&mp, &tx1.sha256) == NULL);
+	assert(mempool_lookup(&mp, &tx_hi.sha256) != NULL);
+	assert(mempool_count(&mp) == 1);
+
+	mempool_free(&mp);
+
+	/* block template: children follow parents; merkle root and
+	 * coinbase value track incremental additions
+	 */
+	mempool_init(&mp, &uset, 200, 1024 * 1024);
+
+	bu256_t prev;
+	memset(&prev, 0x11, sizeof(prev));
+
+	struct blktmpl tmpl;
+	assert(blktmpl_init(&tmpl, &mp, &prev, 210001, 0x1d00ffff,
+			    script_pub) == true);
+	assert(tmpl.block.vtx->len == 1);
+
+	assert(mempool_add(&mp, &tx1) == true);
+	assert(mempool_add(&mp, &tx2_hi) == true);	/* child of tx1 */
+	assert(mempool_add(&mp, &tx_hi) == true);
+	assert(blktmpl_build(&tmpl) == true);
+
+	check_template(&tmpl, 10000 + 90000 + 50000);
+	assert(tmpl.block.vtx->len == 4);
+	assert(tx_index(&tmpl, &tx1) < tx_index(&tmpl, &tx2_hi));
+	assert(tx_index(&tmpl, &tx_hi) < tx_index(&tmpl, &tx1));
+
+	/* incremental */
+	mempool_remove(&mp, &tx_hi.sha256, true);
+	assert(blktmpl_tx_removed(&tmpl, &tx_hi.sha256) == true);
+	check_template(&tmpl, 10000 + 90000);
+	assert(tmpl.block.vtx->len == 3);
+
+	assert(mempool_add(&mp, &tx_hi) == true);
+	assert(blktmpl_tx_added(&tmpl, &tx_hi.sha256) == true);
+	check_template(&tmpl, 10000 + 90000 + 50000);
+	assert(tx_index(&tmpl, &tx_hi) == 3);
+
+	blktmpl_free(&tmpl);
+	mempool_free(&mp);
+
+	bp_tx_free(&tx2_hi);
+	bp_tx_free(&tx2_lo);
+	bp_tx_free(&tx_hi);
+	bp_tx_free(&tx2);
+	bp_tx_free(&tx_missing);
+	bp_tx_free(&tx_bad);
+	bp_tx_free(&tx_over);
+	bp_tx_free(&tx1b);
+	bp_tx_free(&tx1);
+	bp_tx_free(&fund);
+	bp_utxo_set_free(&uset);
+
+	test_final_mature();
+
+	g_string_free(script_pub, TRUE);
+	bp_key_free(&key);
+}
+
+int main (int argc, char *argv[])
+{
+	runtest();
+
+	return 0;
+}
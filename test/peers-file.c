@@ -0,0 +1,222 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <glib.h>
+#include <ccoin/core.h>
+#include <ccoin/util.h>
+#include <ccoin/message.h>
+#include <ccoin/serialize.h>
+#include <ccoin/coredefs.h>
+#include "peerman.h"
+#include "picocoin.h"
+
+/* picocoin globals used by peerman.c */
+GHashTable *settings;
+const struct chain_info *chain;
+
+enum {
+	N_PEERS		= 60,
+	N_TRIED		= 10,		/* of which, in the tried table */
+};
+
+static void make_addr(struct bp_address *addr, unsigned int i)
+{
+	bp_addr_init(addr);
+	addr->nTime = 1350000000 + i;
+	addr->nServices = NODE_NETWORK;
+	memcpy(addr->ip, ipv4_mapped_pfx, 12);
+	addr->ip[12] = 10;
+	addr->ip[13] = i;		/* one /16 group per peer */
+	addr->ip[15] = 1;
+	addr->port = 8333;
+}
+
+/* peers file as written before the compact format: p2p-framed records */
+static void write_legacy(const char *filename)
+{
+	GString *s = g_string_new(NULL);
+	unsigned int i;
+
+	for (i = 0; i < N_PEERS; i++) {
+		struct bp_address addr;
+		make_addr(&addr, i);
+
+		GString *data = g_string_new(NULL);
+		ser_bp_addr(data, CADDR_TIME_VERSION, &addr);
+
+		GString *rec = message_str(chain->netmagic,
+					   (i < N_TRIED) ? "CAddrTried" :
+							   "CAddress",
+					   data->str, data->len);
+		g_string_append_len(s, rec->str, rec->len);
+
+		g_string_free(rec, TRUE);
+		g_string_free(data, TRUE);
+	}
+
+	assert(bu_write_file(filename, s->str, s->len) == true);
+	g_string_free(s, TRUE);
+}
+
+static void check_peers(struct peer_manager *peers)
+{
+	assert(g_hash_table_size(peers->map_addr) == N_PEERS);
+	assert(peers->table[PEER_TRIED]->len == N_TRIED);
+	assert(peers->table[PEER_NEW]->len == N_PEERS - N_TRIED);
+
+	unsigned int i;
+	for (i = 0; i < N_PEERS; i++) {
+		struct bp_address addr;
+		make_addr(&addr, i);
+
+		struct peer *peer = g_hash_table_lookup(peers->map_addr,
+							addr.ip);
+		assert(peer != NULL);
+		assert(peer->table == ((i < N_TRIED) ? PEER_TRIED : PEER_NEW));
+		assert(peer->addr.nTime == addr.nTime);
+		assert(peer->addr.nServices == addr.nServices);
+		assert(peer->addr.port == addr.port);
+	}
+}
+
+static bool file_is_compact(const char *filename)
+{
+	void *data;
+	size_t data_len;
+
+	assert(bu_read_file(filename, &data, &data_len, 1024 * 1024) == true);
+	bool rc = (data_len > 8) && !memcmp(data, "picopeer", 8);
+	free(data);
+
+	return rc;
+}
+
+static void runtest(const char *filename)
+{
+	/* legacy file: read, and marked for rewrite in compact form */
+	write_legacy(filename);
+	assert(file_is_compact(filename) == false);
+
+	struct peer_manager *peers = peerman_read();
+	assert(peers != NULL);
+	check_peers(peers);
+	assert(peers->dirty == true);
+
+	assert(peerman_write(peers) == true);
+	assert(peers->dirty == false);
+	assert(file_is_compact(filename) == true);
+	peerman_free(peers);
+
+	/* compact round trip: addresses, tables, and metrics */
+	peers = peerman_read();
+	assert(peers != NULL);
+	check_peers(peers);
+	assert(peers->dirty == false);
+
+	struct peer *peer = peerman_pop(peers);
+	assert(peer != NULL);
+
+	unsigned char ip[16];
+	memcpy(ip, peer->addr.ip, sizeof(ip));
+	enum peer_table table = peer->table;
+	struct peer_metrics m = {
+		.connect_ms	= 120,
+		.rtt_ms		= 80,
+		.rx_bps		= 250000,
+		.getdata_ms	= 300,
+		.n_success	= (table == PEER_TRIED) ? 3 : 0,
+		.n_fail		= (table == PEER_TRIED) ? 1 : 0,
+		.last_try	= 1350001000,
+		.last_success	= 1350000900,
+	};
+	peer->m = m;
+	peerman_put(peers, peer);
+
+	/* still in use peers are saved too */
+	peer = peerman_pop(peers);
+	assert(peer != NULL);
+
+	assert(peerman_write(peers) == true);
+	peerman_put(peers, peer);
+	peerman_free(peers);
+
+	peers = peerman_read();
+	assert(peers != NULL);
+	check_peers(peers);
+
+	peer = g_hash_table_lookup(peers->map_addr, ip);
+	assert(peer != NULL);
+	assert(peer->table == table);
+	assert(!memcmp(&peer->m, &m, sizeof(m)));
+
+	/* unchanged: nothing to write */
+	assert(unlink(filename) == 0);
+	assert(peerman_write(peers) == true);
+	assert(access(filename, F_OK) != 0);
+
+	/* corrupt compact file is refused */
+	peers->dirty = true;
+	assert(peerman_write(peers) == true);
+	peerman_free(peers);
+
+	void *data;
+	size_t data_len;
+	assert(bu_read_file(filename, &data, &data_len, 1024 * 1024) == true);
+	((unsigned char *) data)[data_len / 2] ^= 0x01;
+	assert(bu_write_file(filename, data, data_len) == true);
+	free(data);
+
+	assert(peerman_read() == NULL);
+}
+
+/* DNS seeding settings: "dnstimeout" must be a positive second count */
+static void test_seed_settings(void)
+{
+	static const char *bad[] = {
+		"0", "-5", "", "10x", "abc", "99999999999999999999", "4294968",
+	};
+	unsigned int i;
+
+	g_hash_table_insert(settings, "dnsseeds", "");
+
+	for (i = 0; i < ARRAY_SIZE(bad); i++) {
+		g_hash_table_insert(settings, "dnstimeout", (char *) bad[i]);
+		assert(peerman_seed() == NULL);
+	}
+
+	g_hash_table_insert(settings, "dnstimeout", "30");
+	struct peer_manager *peers = peerman_seed();
+	assert(peers != NULL);
+	assert(peerman_seed_collect(peers) == false);	/* no seeds */
+	peerman_free(peers);
+
+	g_hash_table_remove(settings, "dnstimeout");
+	g_hash_table_remove(settings, "dnsseeds");
+}
+
+int main (int argc, char *argv[])
+{
+	char filename[] = "/tmp/picocoin-peers.XXXXXX";
+	int fd = mkstemp(filename);
+	assert(fd >= 0);
+	close(fd);
+
+	chain = &chain_metadata[CHAIN_BITCOIN];
+	settings = g_hash_table_new(g_str_hash, g_str_equal);
+	g_hash_table_insert(settings, "peers", filename);
+
+	runtest(filename);
+	test_seed_settings();
+
+	unlink(filename);
+	g_hash_table_unref(settings);
+	return 0;
+}
@@ -68,6 +68,98 @@ static void test_txout(const struct bp_txout *txout)
 	assert(g_string_equal(s, txout->scriptPubKey));
 
 	g_string_free(s, TRUE);
+
+	/* byte-pattern classifier agrees with the op-based one */
+	GPtrArray *ops_arr = bsp_parse_all(txout->scriptPubKey->str,
+					   txout->scriptPubKey->len);
+	assert(ops_arr != NULL);
+
+	struct bscript_tmpl tmpl;
+	enum txnouttype txtype = bsp_classify(ops_arr);
+	assert(bsp_classify_script(&tmpl, txout->scriptPubKey->str,
+				   txout->scriptPubKey->len) == txtype);
+
+	struct bscript_op *top;
+	switch (txtype) {
+	case TX_PUBKEY:
+		top = g_ptr_array_index(ops_arr, 0);
+		assert(tmpl.n_keys == 1);
+		assert(tmpl.keys[0].p == top->data.p);
+		assert(tmpl.keys[0].len == top->data.len);
+		break;
+	case TX_PUBKEYHASH:
+		top = g_ptr_array_index(ops_arr, 2);
+		assert(tmpl.hash.p == top->data.p);
+		assert(tmpl.hash.len == 20);
+		break;
+	default:
+		break;
+	}
+
+	g_ptr_array_free(ops_arr, TRUE);
+}
+
+static void test_classify(void)
+{
+	unsigned char key1[33], key2[65], hash[20];
+	memset(key1, 0x02, sizeof(key1));
+	memset(key2, 0x04, sizeof(key2));
+	memset(hash, 0x11, sizeof(hash));
+
+	struct bscript_tmpl tmpl;
+	GString *s = g_string_new(NULL);
+
+	bsp_push_op(s, OP_HASH160);
+	bsp_push_data(s, hash, sizeof(hash));
+	bsp_push_op(s, OP_EQUAL);
+	assert(bsp_classify_script(&tmpl, s->str, s->len) == TX_SCRIPTHASH);
+	assert(tmpl.hash.p == s->str + 2);
+
+	/* 1-of-2 bare multisig */
+	g_string_set_size(s, 0);
+	bsp_push_op(s, OP_1);
+	bsp_push_data(s, key1, sizeof(key1));
+	bsp_push_data(s, key2, sizeof(key2));
+	bsp_push_op(s, OP_2);
+	bsp_push_op(s, OP_CHECKMULTISIG);
+	assert(bsp_classify_script(&tmpl, s->str, s->len) == TX_MULTISIG);
+	assert(tmpl.n_req == 1);
+	assert(tmpl.n_keys == 2);
+	assert(tmpl.keys[0].len == sizeof(key1));
+	assert(tmpl.keys[1].p == s->str + 1 + 1 + sizeof(key1) + 1);
+	assert(tmpl.keys[1].len == sizeof(key2));
+
+	/* key count mismatch */
+	s->str[s->len - 2] = OP_3;
+	assert(bsp_classify_script(&tmpl, s->str, s->len) == TX_NONSTANDARD);
+
+	/* more signatures required than keys */
+	s->str[0] = OP_3;
+	s->str[s->len - 2] = OP_2;
+	assert(bsp_classify_script(&tmpl, s->str, s->len) == TX_NONSTANDARD);
+
+	/* truncated pubkey push */
+	g_string_set_size(s, 0);
+	bsp_push_data(s, key1, sizeof(key1));
+	bsp_push_op(s, OP_CHECKSIG);
+	assert(bsp_classify_script(&tmpl, s->str, s->len) == TX_PUBKEY);
+	assert(bsp_classify_script(&tmpl, s->str + 1, s->len - 1) ==
+	       TX_NONSTANDARD);
+	s->str[0]++;
+	assert(bsp_classify_script(&tmpl, s->str, s->len) == TX_NONSTANDARD);
+
+	/* nonstandard scripts parse, with no addresses; malformed do not */
+	struct bscript_addr addrs;
+	assert(bsp_addr_parse(&addrs, s->str, s->len) == true);
+	assert(addrs.txtype == TX_NONSTANDARD);
+	assert(addrs.pub == NULL && addrs.pubhash == NULL);
+	bsp_addr_free(&addrs);
+
+	s->str[0] = 40;
+	assert(bsp_addr_parse(&addrs, s->str, s->len) == false);
+	bsp_addr_free(&addrs);
+
+	g_string_free(s, TRUE);
 }
 
 static void runtest(const char *ser_fn_base)
@@ -121,6 +213,7 @@ int main (int argc, char *argv[])
 	opn = GetOpName(OP_INVALIDOPCODE);
 	assert(!strcmp(opn, "<unknown>"));
 
+	test_classify();
 	runtest("blk120383.ser");
 
 	return 0;
@@ -0,0 +1,225 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "picocoin-config.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+#include <ccoin/script.h>
+#include <ccoin/core.h>
+#include <ccoin/key.h>
+#include <ccoin/util.h>
+#include <ccoin/compat.h>		/* for g_ptr_array_new_full */
+
+enum {
+	N_KEYS		= 3,
+	N_INPUTS	= 40,
+	N_OUTPUTS	= 3,
+};
+
+static const unsigned int test_flags =
+	SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+
+static GString *script_pubkey(struct bp_key *key, bool pubkeyhash)
+{
+	GString *s = g_string_new(NULL);
+	unsigned char md160[20];
+	void *pub;
+	size_t pub_len;
+
+	assert(bp_pubkey_get(key, &pub, &pub_len) == true);
+
+	if (pubkeyhash) {
+		bu_Hash160(md160, pub, pub_len);
+		bsp_push_op(s, OP_DUP);
+		bsp_push_op(s, OP_HASH160);
+		bsp_push_data(s, md160, sizeof(md160));
+		bsp_push_op(s, OP_EQUALVERIFY);
+		bsp_push_op(s, OP_CHECKSIG);
+	} else {
+		bsp_push_data(s, pub, pub_len);
+		bsp_push_op(s, OP_CHECKSIG);
+	}
+
+	free(pub);
+	return s;
+}
+
+static void build_tx(struct bp_tx *tx)
+{
+	unsigned int i;
+
+	bp_tx_init(tx);
+	tx->nVersion = 1;
+	tx->nLockTime = 0;
+	tx->vin = g_ptr_array_new_full(N_INPUTS, g_free);
+	tx->vout = g_ptr_array_new_full(N_OUTPUTS, g_free);
+
+	for (i = 0; i < N_INPUTS; i++) {
+		struct bp_txin *txin = calloc(1, sizeof(*txin));
+
+		bp_txin_init(txin);
+		memset(&txin->prevout.hash, i + 1, sizeof(txin->prevout.hash));
+		txin->prevout.n = i;
+		txin->scriptSig = g_string_new(NULL);
+		txin->nSequence = 0xffffffffU - (i & 1);
+		g_ptr_array_add(tx->vin, txin);
+	}
+
+	for (i = 0; i < N_OUTPUTS; i++) {
+		struct bp_txout *txout = calloc(1, sizeof(*txout));
+
+		bp_txout_init(txout);
+		txout->nValue = 1000000 * (i + 1);
+		txout->scriptPubKey = g_string_new(NULL);
+		bsp_push_op(txout->scriptPubKey, OP_TRUE);
+		g_ptr_array_add(tx->vout, txout);
+	}
+}
+
+/* streamed hashes match bp_tx_sighash(), for every hash type */
+static void test_sighash_ctx(struct bp_tx *tx, GString **fromPubKeys)
+{
+	static const int hash_types[] = {
+		SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE,
+		SIGHASH_ALL | SIGHASH_ANYONECANPAY,
+		SIGHASH_SINGLE | SIGHASH_ANYONECANPAY,
+	};
+	struct bp_sighash_ctx ctx;
+	bu256_t hash, hash2;
+	unsigned int i, j;
+
+	bp_sighash_ctx_init(&ctx, tx);
+
+	for (i = 0; i < N_INPUTS + 1; i++)
+		for (j = 0; j < ARRAY_SIZE(hash_types); j++) {
+			const GString *code = fromPubKeys[i % N_INPUTS];
+
+			bp_sighash_ctx_hash(&hash, &ctx, code, i,
+					    hash_types[j]);
+			bp_tx_sighash(&hash2, code, tx, i, hash_types[j]);
+			assert(bu256_equal(&hash, &hash2));
+		}
+
+	/* long scriptCode, for a multi-byte length prefix */
+	GString *code = g_string_new(NULL);
+	for (i = 0; i < 300; i++)
+		bsp_push_op(code, OP_NOP);
+	bp_sighash_ctx_hash(&hash, &ctx, code, 3, SIGHASH_ALL);
+	bp_tx_sighash(&hash2, code, tx, 3, SIGHASH_ALL);
+	assert(bu256_equal(&hash, &hash2));
+
+	/* OP_CODESEPARATORs are not hashed, but separator bytes in
+	 * push data are
+	 */
+	static const unsigned char data[] = {
+		OP_CODESEPARATOR, OP_DUP, OP_CODESEPARATOR,
+	};
+	GString *sep = g_string_new(NULL);
+	bsp_push_op(sep, OP_CODESEPARATOR);
+	bsp_push_op(sep, OP_DUP);
+	bsp_push_op(sep, OP_CODESEPARATOR);
+	bsp_push_data(sep, data, sizeof(data));
+	bsp_push_op(sep, OP_CODESEPARATOR);
+
+	g_string_truncate(code, 0);
+	bsp_push_op(code, OP_DUP);
+	bsp_push_data(code, data, sizeof(data));
+
+	bp_sighash_ctx_hash(&hash, &ctx, sep, 3, SIGHASH_ALL);
+	bp_tx_sighash(&hash2, code, tx, 3, SIGHASH_ALL);
+	assert(bu256_equal(&hash, &hash2));
+	bp_tx_sighash(&hash2, sep, tx, 3, SIGHASH_ALL);
+	assert(bu256_equal(&hash, &hash2));
+	bp_sighash_ctx_hash(&hash2, &ctx, code, 3, SIGHASH_ALL);
+	assert(bu256_equal(&hash, &hash2));
+
+	g_string_free(sep, TRUE);
+	g_string_free(code, TRUE);
+
+	bp_sighash_ctx_free(&ctx);
+}
+
+static void runtest(void)
+{
+	struct bp_keystore ks;
+	struct bp_key *keys[N_KEYS], stranger;
+	GString *fromPubKeys[N_INPUTS];
+	struct bp_tx tx, tx2;
+	unsigned int i;
+
+	bkeys_init(&ks);
+	for (i = 0; i < N_KEYS; i++) {
+		keys[i] = calloc(1, sizeof(struct bp_key));
+		assert(bp_key_init(keys[i]) == true);
+		assert(bp_key_generate(keys[i]) == true);
+		assert(bkeys_add(&ks, keys[i]) == true);
+	}
+
+	for (i = 0; i < N_INPUTS; i++)
+		fromPubKeys[i] = script_pubkey(keys[i % N_KEYS], i & 1);
+
+	build_tx(&tx);
+	build_tx(&tx2);
+
+	test_sighash_ctx(&tx, fromPubKeys);
+
+	/* all at once, or one by one: same, deterministic, signatures
+	 * (but for the OpenSSL fallback, with random nonces)
+	 */
+	assert(bp_script_sign_all(&ks, fromPubKeys, &tx, SIGHASH_ALL) == true);
+	for (i = 0; i < N_INPUTS; i++)
+		assert(bp_script_sign(&ks, fromPubKeys[i], &tx2, i,
+				      SIGHASH_ALL) == true);
+
+	for (i = 0; i < N_INPUTS; i++) {
+		struct bp_txin *txin = g_ptr_array_index(tx.vin, i);
+
+		assert(bp_script_verify(txin->scriptSig, fromPubKeys[i],
+					&tx, i, test_flags, 0) == true);
+#ifdef __SIZEOF_INT128__
+		struct bp_txin *txin2 = g_ptr_array_index(tx2.vin, i);
+		assert(g_string_equal(txin->scriptSig, txin2->scriptSig));
+#endif
+
+		/* not valid for another input */
+		assert(bp_script_verify(txin->scriptSig,
+					fromPubKeys[(i + 1) % N_INPUTS],
+					&tx, (i + 1) % N_INPUTS,
+					test_flags, 0) == false);
+	}
+
+	/* a key we do not hold: that input alone is left unsigned */
+	assert(bp_key_init(&stranger) == true);
+	assert(bp_key_generate(&stranger) == true);
+	g_string_free(fromPubKeys[5], TRUE);
+	fromPubKeys[5] = script_pubkey(&stranger, true);
+
+	bp_tx_free(&tx2);
+	build_tx(&tx2);
+	assert(bp_script_sign_all(&ks, fromPubKeys, &tx2, SIGHASH_ALL) == false);
+	for (i = 0; i < N_INPUTS; i++) {
+		struct bp_txin *txin = g_ptr_array_index(tx2.vin, i);
+
+		assert((txin->scriptSig->len == 0) == (i == 5));
+		assert(bp_script_verify(txin->scriptSig, fromPubKeys[i],
+					&tx2, i, test_flags, 0) == (i != 5));
+	}
+
+	bp_key_free(&stranger);
+	for (i = 0; i < N_INPUTS; i++)
+		g_string_free(fromPubKeys[i], TRUE);
+	bp_tx_free(&tx);
+	bp_tx_free(&tx2);
+	bkeys_free(&ks);
+}
+
+int main (int argc, char *argv[])
+{
+	runtest();
+	return 0;
+}
@@ -4,11 +4,15 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <jansson.h>
 #include <glib.h>
 #include <ccoin/script.h>
 #include <ccoin/core.h>
+#include <ccoin/util.h>
+#include <ccoin/key.h>
+#include <ccoin/compat.h>		/* for g_ptr_array_new_full */
 #include "libtest.h"
 
 static void test_script(bool is_valid,GString *scriptSig, GString *scriptPubKey,
@@ -70,8 +74,340 @@ static void runtest(bool is_valid, const char *basefn)
 	free(fn);
 }
 
+/* native script numbers must match the BIGNUM encoding */
+static void check_scriptnum(int64_t v)
+{
+	unsigned char vch[BSP_SCRIPTNUM_MAX];
+	unsigned int len = bsp_scriptnum_enc(vch, v);
+
+	BIGNUM bn;
+	BN_init(&bn);
+	BN_set_word(&bn, v < 0 ? -v : v);
+	BN_set_negative(&bn, v < 0);
+	GString *ref = bn_getvch(&bn);
+
+	assert(len == ref->len);
+	assert(memcmp(vch, ref->str, len) == 0);
+
+	int64_t v2;
+	assert(bsp_scriptnum_dec(&v2, vch, len, 8) == true);
+	assert(v2 == v);
+	assert(bsp_scriptnum_dec(&v2, vch, len, len - 1) == (len == 0));
+
+	g_string_free(ref, TRUE);
+	BN_clear_free(&bn);
+}
+
+static void test_scriptnum(void)
+{
+	static const int64_t vals[] = {
+		0, 1, -1, 16, 127, -127, 128, -128, 255, 256, -256,
+		32767, 32768, -32768, 0x7fffffffLL, -0x7fffffffLL,
+		0x80000000LL, -0x80000000LL, 0xffffffffLL, 0x100000000LL,
+		0x7fffffffffffffLL, -0x7fffffffffffffLL,
+	};
+	unsigned int i;
+	for (i = 0; i < ARRAY_SIZE(vals); i++)
+		check_scriptnum(vals[i]);
+
+	/* non-minimal encodings, and negative zero */
+	static const unsigned char one_padded[] = { 0x01, 0x00 };
+	static const unsigned char neg_zero[] = { 0x00, 0x80 };
+	int64_t v;
+	assert(bsp_scriptnum_dec(&v, one_padded, 2, 4) && v == 1);
+	assert(bsp_scriptnum_dec(&v, neg_zero, 2, 4) && v == 0);
+}
+
+/*
+ * Standard templates take a fast path around the interpreter.  Behind
+ * an OP_CODESEPARATOR, which leaves the signature hash as it was, the
+ * same script is interpreted instead; both must agree.
+ */
+enum {
+	FAST_KEYS	= 3,
+};
+
+static struct bp_key fast_keys[FAST_KEYS];
+static struct bp_tx fast_tx;
+
+static void fast_push_sig(GString *s, unsigned int k, const GString *code)
+{
+	bu256_t hash;
+	void *sig;
+	size_t sig_len;
+
+	bp_tx_sighash(&hash, code, &fast_tx, 0, SIGHASH_ALL);
+	assert(bp_sign(&fast_keys[k], &hash, sizeof(hash),
+		       &sig, &sig_len) == true);
+
+	GString *sigHT = g_string_new_len(sig, sig_len);
+	g_string_append_c(sigHT, SIGHASH_ALL);
+	bsp_push_data(s, sigHT->str, sigHT->len);
+
+	g_string_free(sigHT, TRUE);
+	free(sig);
+}
+
+static void fast_push_pubkey(GString *s, unsigned int k)
+{
+	void *pub;
+	size_t pub_len;
+
+	assert(bp_pubkey_get(&fast_keys[k], &pub, &pub_len) == true);
+	bsp_push_data(s, pub, pub_len);
+	free(pub);
+}
+
+static GString *fast_interpreted(const GString *script)
+{
+	GString *s = g_string_new(NULL);
+	bsp_push_op(s, OP_CODESEPARATOR);
+	g_string_append_len(s, script->str, script->len);
+	return s;
+}
+
+static void check_fast(const GString *scriptSig, const GString *scriptPubKey,
+		       bool expect)
+{
+	/* the hash check alone, for P2SH outputs */
+	unsigned int flags = SCRIPT_VERIFY_STRICTENC;
+	GString *slow = fast_interpreted(scriptPubKey);
+
+	assert(bp_script_verify(scriptSig, scriptPubKey, &fast_tx, 0,
+				flags, 0) == expect);
+	assert(bp_script_verify(scriptSig, slow, &fast_tx, 0,
+				flags, 0) == expect);
+
+	/* a scriptSig that is not push-only is interpreted, too */
+	GString *slowSig = g_string_new_len(scriptSig->str, scriptSig->len);
+	bsp_push_op(slowSig, OP_NOP);
+
+	assert(bp_script_verify(slowSig, scriptPubKey, &fast_tx, 0,
+				flags, 0) == expect);
+	assert(bp_script_verify(slowSig, slow, &fast_tx, 0,
+				flags, 0) == expect);
+
+	g_string_free(slowSig, TRUE);
+	g_string_free(slow, TRUE);
+}
+
+/* <sigs> for 'code', keys by index, -1 for OP_0 */
+static GString *fast_sigs(const GString *code, const int *ks, unsigned int n)
+{
+	GString *s = g_string_new(NULL);
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (ks[i] < 0)
+			bsp_push_op(s, OP_0);
+		else
+			fast_push_sig(s, ks[i], code);
+	}
+	return s;
+}
+
+static void check_fast_sigs(const GString *scriptPubKey, const int *ks,
+			    unsigned int n, bool expect)
+{
+	GString *scriptSig = fast_sigs(scriptPubKey, ks, n);
+	check_fast(scriptSig, scriptPubKey, expect);
+	g_string_free(scriptSig, TRUE);
+}
+
+static GString *fast_multisig(unsigned int m, unsigned int n)
+{
+	GString *s = g_string_new(NULL);
+	unsigned int i;
+
+	bsp_push_op(s, OP_1 + m - 1);
+	for (i = 0; i < n; i++)
+		fast_push_pubkey(s, i);
+	bsp_push_op(s, OP_1 + n - 1);
+	bsp_push_op(s, OP_CHECKMULTISIG);
+	return s;
+}
+
+static GString *fast_p2sh(const GString *redeem)
+{
+	GString *s = g_string_new(NULL);
+	unsigned char md160[20];
+
+	bu_Hash160(md160, redeem->str, redeem->len);
+	bsp_push_op(s, OP_HASH160);
+	bsp_push_data(s, md160, sizeof(md160));
+	bsp_push_op(s, OP_EQUAL);
+	return s;
+}
+
+/* P2SH-wrapped: the redeem script, fast or interpreted, is the same */
+static void check_fast_p2sh(const GString *redeem, const int *ks,
+			    unsigned int n, bool expect)
+{
+	unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+	GString *slow = fast_interpreted(redeem);
+	const GString *redeems[2] = { redeem, slow };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(redeems); i++) {
+		GString *scriptSig = fast_sigs(redeem, ks, n);
+		bsp_push_data(scriptSig, redeems[i]->str, redeems[i]->len);
+		GString *scriptPubKey = fast_p2sh(redeems[i]);
+
+		assert(bp_script_verify(scriptSig, scriptPubKey, &fast_tx, 0,
+					flags, 0) == expect);
+
+		g_string_free(scriptPubKey, TRUE);
+		g_string_free(scriptSig, TRUE);
+	}
+
+	g_string_free(slow, TRUE);
+}
+
+static void test_fast_paths(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < FAST_KEYS; i++) {
+		assert(bp_key_init(&fast_keys[i]) == true);
+		assert(bp_key_generate(&fast_keys[i]) == true);
+	}
+
+	bp_tx_init(&fast_tx);
+	fast_tx.nVersion = 1;
+	fast_tx.vin = g_ptr_array_new_full(1, g_free);
+	fast_tx.vout = g_ptr_array_new_full(1, g_free);
+
+	struct bp_txin *txin = calloc(1, sizeof(*txin));
+	bp_txin_init(txin);
+	memset(&txin->prevout.hash, 0x42, sizeof(txin->prevout.hash));
+	txin->scriptSig = g_string_new(NULL);
+	txin->nSequence = 0xffffffffU;
+	g_ptr_array_add(fast_tx.vin, txin);
+
+	struct bp_txout *txout = calloc(1, sizeof(*txout));
+	bp_txout_init(txout);
+	txout->nValue = 1000000;
+	txout->scriptPubKey = g_string_new(NULL);
+	bsp_push_op(txout->scriptPubKey, OP_TRUE);
+	g_ptr_array_add(fast_tx.vout, txout);
+
+	GString *empty = g_string_new(NULL);
+
+	/* P2PKH */
+	GString *pkh = g_string_new(NULL);
+	{
+		void *pub;
+		size_t pub_len;
+		unsigned char md160[20];
+
+		assert(bp_pubkey_get(&fast_keys[0], &pub, &pub_len) == true);
+		bu_Hash160(md160, pub, pub_len);
+		free(pub);
+
+		bsp_push_op(pkh, OP_DUP);
+		bsp_push_op(pkh, OP_HASH160);
+		bsp_push_data(pkh, md160, sizeof(md160));
+		bsp_push_op(pkh, OP_EQUALVERIFY);
+		bsp_push_op(pkh, OP_CHECKSIG);
+	}
+
+	GString *sig = g_string_new(NULL);
+	fast_push_sig(sig, 0, pkh);
+	fast_push_pubkey(sig, 0);
+	check_fast(sig, pkh, true);
+	g_string_truncate(sig, 0);
+
+	fast_push_sig(sig, 1, pkh);		/* wrong key's signature */
+	fast_push_pubkey(sig, 0);
+	check_fast(sig, pkh, false);
+	g_string_truncate(sig, 0);
+
+	fast_push_sig(sig, 1, pkh);		/* key not hashed */
+	fast_push_pubkey(sig, 1);
+	check_fast(sig, pkh, false);
+	g_string_truncate(sig, 0);
+
+	fast_push_pubkey(sig, 0);		/* no signature */
+	check_fast(sig, pkh, false);
+	check_fast(empty, pkh, false);
+	g_string_truncate(sig, 0);
+
+	/* P2PK */
+	GString *pk = g_string_new(NULL);
+	fast_push_pubkey(pk, 1);
+	bsp_push_op(pk, OP_CHECKSIG);
+
+	fast_push_sig(sig, 1, pk);
+	check_fast(sig, pk, true);
+	g_string_truncate(sig, 0);
+
+	fast_push_sig(sig, 2, pk);
+	check_fast(sig, pk, false);
+	g_string_truncate(sig, 0);
+
+	check_fast(empty, pk, false);
+
+	/* P2SH, as a hash check alone */
+	GString *p2sh = fast_p2sh(pk);
+	bsp_push_data(sig, pk->str, pk->len);
+	check_fast(sig, p2sh, true);
+	g_string_truncate(sig, 0);
+
+	bsp_push_data(sig, pkh->str, pkh->len);
+	check_fast(sig, p2sh, false);
+	g_string_truncate(sig, 0);
+
+	check_fast(empty, p2sh, false);
+
+	/* bare multisig; OP_CHECKMULTISIG pops one element too many */
+	GString *ms = fast_multisig(2, 3);
+	static const int ms_good[] = { -1, 0, 1 };
+	static const int ms_skip[] = { -1, 0, 2 };
+	static const int ms_extra[] = { 1, -1, 1, 2 };
+	static const int ms_order[] = { -1, 1, 0 };
+	static const int ms_dup[] = { -1, 0, 0 };
+	static const int ms_short[] = { -1, 0 };
+	static const int ms_nodummy[] = { 0, 1 };
+	check_fast_sigs(ms, ms_good, ARRAY_SIZE(ms_good), true);
+	check_fast_sigs(ms, ms_skip, ARRAY_SIZE(ms_skip), true);
+	check_fast_sigs(ms, ms_extra, ARRAY_SIZE(ms_extra), true);
+	check_fast_sigs(ms, ms_order, ARRAY_SIZE(ms_order), false);
+	check_fast_sigs(ms, ms_dup, ARRAY_SIZE(ms_dup), false);
+	check_fast_sigs(ms, ms_short, ARRAY_SIZE(ms_short), false);
+	check_fast_sigs(ms, ms_nodummy, ARRAY_SIZE(ms_nodummy), false);
+
+	GString *ms11 = fast_multisig(1, 1);
+	static const int ms11_good[] = { -1, 0 };
+	static const int ms11_bad[] = { -1, 1 };
+	check_fast_sigs(ms11, ms11_good, ARRAY_SIZE(ms11_good), true);
+	check_fast_sigs(ms11, ms11_bad, ARRAY_SIZE(ms11_bad), false);
+
+	/* multisig redeem scripts */
+	check_fast_p2sh(ms, ms_good, ARRAY_SIZE(ms_good), true);
+	check_fast_p2sh(ms, ms_order, ARRAY_SIZE(ms_order), false);
+	check_fast_p2sh(ms, ms_short, ARRAY_SIZE(ms_short), false);
+
+	g_string_free(ms11, TRUE);
+	g_string_free(ms, TRUE);
+	g_string_free(p2sh, TRUE);
+	g_string_free(pk, TRUE);
+	g_string_free(sig, TRUE);
+	g_string_free(pkh, TRUE);
+	g_string_free(empty, TRUE);
+	bp_tx_free(&fast_tx);
+	for (i = 0; i < FAST_KEYS; i++)
+		bp_key_free(&fast_keys[i]);
+}
+
 int main (int argc, char *argv[])
 {
+	test_scriptnum();
+	test_fast_paths();
+
+	runtest(true, "script_valid.json");
+	runtest(false, "script_invalid.json");
+
+	/* again, with output scripts now in the compiled script cache */
 	runtest(true, "script_valid.json");
 	runtest(false, "script_invalid.json");
 	return 0;
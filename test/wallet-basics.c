@@ -79,6 +79,18 @@ static void runtest(const char *json_base_fn, const char *ser_in_fn,
 	struct bp_block_match *match = g_ptr_array_index(matches, 0);
 	assert(match->n == 1);			/* match 2nd tx, index 1 */
 
+	/* the same, scanning the serialized block */
+	GPtrArray *raw_matches = bp_block_match_raw(data, data_len, &ks);
+	assert(raw_matches != NULL);
+	assert(raw_matches->len == 1);
+	struct bp_block_match *raw_match = g_ptr_array_index(raw_matches, 0);
+	assert(raw_match->n == match->n);
+	assert(BN_cmp(&raw_match->mask, &match->mask) == 0);
+	g_ptr_array_free(raw_matches, TRUE);
+
+	/* truncated blocks are rejected */
+	assert(bp_block_match_raw(data, data_len - 1, &ks) == NULL);
+
 	/* get matching transaction */
 	struct bp_tx *tx = g_ptr_array_index(block_in.vtx, match->n);
 	bp_tx_calc_sha256(tx);